@@ -0,0 +1,601 @@
+/**
+ *  allocator.hpp
+ *  Allocators for the containers: the default heap allocator, a bump-pointer arena that frees everything at once,
+ *  and a pool that hands out fixed-size objects from slabs.
+ *
+ *  The containers take any allocator with the standard interface. An allocator that also has
+ *  T* reallocate(T* p, size_t old_n, size_t new_n) lets Vector grow trivially relocatable elements in place.
+ *
+ *  @author Marquess Valdez
+ *  @version 1.0
+ */
+#ifndef MQS_ALLOCATOR_HPP
+#define MQS_ALLOCATOR_HPP
+
+#include <cstddef> //for std::size_t
+#include <cstdint> // for std::uintptr_t
+#include <cstring> // for std::memcpy
+#include <limits> // for std::numeric_limits<size_t>
+#include <memory> // for std::shared_ptr, std::unique_ptr
+#include <new> // for std::bad_alloc
+#include <type_traits>
+#include <utility> // for std::declval
+#include <vector>
+#include "memory.hpp"
+
+namespace mqs
+{
+
+  /**
+   *  The default allocator for the containers. Memory comes from malloc, or straight from the kernel for very large
+   *  buffers, so it can be resized in place with reallocate().
+   */
+  template <typename T>
+  struct heap_allocator
+  {
+    typedef T value_type;
+
+    heap_allocator() noexcept {}
+
+    template <typename U>
+    heap_allocator(const heap_allocator<U>&) noexcept {}
+
+    T* allocate(size_t n)
+    {
+      if(n > std::numeric_limits<size_t>::max()/sizeof(T)) {
+        throw std::bad_alloc();
+      }
+      return static_cast<T*>(detail::heap::allocate(n*sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) noexcept
+    {
+      detail::heap::deallocate(p, n*sizeof(T));
+    }
+
+    /**
+     *  Resizes p, which holds old_n elements, to hold new_n, keeping the bytes of the first min(old_n, new_n).
+     */
+    T* reallocate(T* p, size_t old_n, size_t new_n)
+    {
+      if(new_n > std::numeric_limits<size_t>::max()/sizeof(T)) {
+        throw std::bad_alloc();
+      }
+      return static_cast<T*>(detail::heap::reallocate(p, old_n*sizeof(T), new_n*sizeof(T)));
+    }
+  };
+
+  template <typename T, typename U>
+  bool operator==(const heap_allocator<T>&, const heap_allocator<U>&) noexcept
+  {
+    return true;
+  }
+
+  template <typename T, typename U>
+  bool operator!=(const heap_allocator<T>&, const heap_allocator<U>&) noexcept
+  {
+    return false;
+  }
+
+  /**
+   *  A bump-pointer arena. Allocating moves a pointer forward through a block, taking a new, larger block when the
+   *  current one runs out, and nothing is freed until release() or the arena's destruction, which hand every block
+   *  back at once. Made for memory whose lifetime is a request or a phase: per-object bookkeeping and frees
+   *  disappear. An arena is not thread safe, and can't be copied or moved since allocators point to it.
+   */
+  class arena
+  {
+  private:
+    struct block
+    {
+      block* next;
+      size_t size;
+    };
+
+    block* head;
+    char* cur;
+    char* end;
+    char* last; // The most recent allocation, which can still be extended or given back.
+    size_t next_block_size;
+    size_t initial_block_size;
+    size_t used;
+    size_t reserved;
+
+    static const size_t max_block_size = size_t(1) << 26;
+
+    static char* align_up(char* p, size_t align)
+    {
+      return reinterpret_cast<char*>((reinterpret_cast<std::uintptr_t>(p) + align - 1) & ~std::uintptr_t(align - 1));
+    }
+
+    // Starts a new block big enough for bytes at the given alignment. The rest of the old block is abandoned.
+    void refill(size_t bytes, size_t align)
+    {
+      size_t size = next_block_size;
+      if(size < sizeof(block) + align + bytes) {
+        if(bytes > std::numeric_limits<size_t>::max() - sizeof(block) - align) {
+          throw std::bad_alloc();
+        }
+        size = sizeof(block) + align + bytes;
+      }
+      block* b = static_cast<block*>(detail::heap::allocate(size));
+      b->next = head;
+      b->size = size;
+      head = b;
+      cur = reinterpret_cast<char*>(b + 1);
+      end = reinterpret_cast<char*>(b) + size;
+      reserved += size;
+      if(next_block_size < max_block_size) {
+        next_block_size *= 2;
+      }
+    }
+
+  public:
+    /**
+     *  Creates an empty arena. Nothing is allocated until the first request, which takes a block of block_size
+     *  bytes; each following block is twice the size of the one before it, up to 64 MiB.
+     */
+    explicit arena(size_t block_size = 4096) : head(nullptr), cur(nullptr), end(nullptr), last(nullptr),
+      next_block_size(block_size < 2*sizeof(block) ? 2*sizeof(block) : block_size),
+      initial_block_size(next_block_size), used(0), reserved(0) {}
+
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+
+    /**
+     *  Returns bytes of uninitialized memory aligned to align, which must be a power of two.
+     */
+    void* allocate(size_t bytes, size_t align = alignof(std::max_align_t))
+    {
+      char* p = align_up(cur, align);
+      if(!cur || bytes > static_cast<size_t>(end - cur) || p > end - bytes) {
+        refill(bytes, align);
+        p = align_up(cur, align);
+      }
+      cur = p + bytes;
+      last = p;
+      used += bytes;
+      return p;
+    }
+
+    /**
+     *  Gives memory back if it is the most recent allocation, so that short-lived scratch space is reused. Anything
+     *  else is left until release().
+     */
+    void deallocate(void* p, size_t bytes) noexcept
+    {
+      if(p && p == last && last + bytes == cur) {
+        cur = last;
+        used -= bytes;
+      }
+    }
+
+    /**
+     *  Resizes the most recent allocation in place, if it is p and the block has room.
+     *  @return true if p now holds new_bytes, false if nothing changed.
+     */
+    bool extend(void* p, size_t old_bytes, size_t new_bytes) noexcept
+    {
+      if(!p || p != last || last + old_bytes != cur || new_bytes > static_cast<size_t>(end - last)) {
+        return false;
+      }
+      cur = last + new_bytes;
+      used = used - old_bytes + new_bytes;
+      return true;
+    }
+
+    /**
+     *  Frees every block, invalidating everything allocated from the arena. Costs one free per block no matter how
+     *  many allocations were made.
+     */
+    void release() noexcept
+    {
+      while(head) {
+        block* next = head->next;
+        detail::heap::deallocate(head, head->size);
+        head = next;
+      }
+      cur = end = last = nullptr;
+      next_block_size = initial_block_size;
+      used = reserved = 0;
+    }
+
+    /**
+     *  @return the number of bytes handed out and not given back.
+     */
+    size_t bytes_used() const
+    {
+      return used;
+    }
+
+    /**
+     *  @return the number of bytes taken from the heap for blocks.
+     */
+    size_t bytes_reserved() const
+    {
+      return reserved;
+    }
+
+    ~arena()
+    {
+      release();
+    }
+  };
+
+  /**
+   *  An allocator that takes its memory from an arena. deallocate() does nothing unless it is the arena's most
+   *  recent allocation, so containers using it should be destroyed before the arena is released. Copies, including
+   *  copies rebound to other types, share the arena and compare equal.
+   */
+  template <typename T>
+  class arena_allocator
+  {
+  private:
+    template <typename U> friend class arena_allocator;
+    arena* source;
+
+  public:
+    typedef T value_type;
+
+    explicit arena_allocator(arena& a) noexcept : source(&a) {}
+
+    template <typename U>
+    arena_allocator(const arena_allocator<U>& a) noexcept : source(a.source) {}
+
+    T* allocate(size_t n)
+    {
+      if(n > std::numeric_limits<size_t>::max()/sizeof(T)) {
+        throw std::bad_alloc();
+      }
+      return static_cast<T*>(source->allocate(n*sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, size_t n) noexcept
+    {
+      source->deallocate(p, n*sizeof(T));
+    }
+
+    /**
+     *  Extends p in place if it is the arena's most recent allocation, and copies it to a new allocation otherwise.
+     *  A Vector growing by itself in an arena therefore never copies its elements.
+     */
+    T* reallocate(T* p, size_t old_n, size_t new_n)
+    {
+      if(new_n > std::numeric_limits<size_t>::max()/sizeof(T)) {
+        throw std::bad_alloc();
+      }
+      if(source->extend(p, old_n*sizeof(T), new_n*sizeof(T))) {
+        return p;
+      }
+      T* q = allocate(new_n);
+      if(p) {
+        std::memcpy(static_cast<void*>(q), static_cast<const void*>(p), (old_n < new_n ? old_n : new_n)*sizeof(T));
+      }
+      return q;
+    }
+
+    arena& resource() const noexcept
+    {
+      return *source;
+    }
+  };
+
+  template <typename T, typename U>
+  bool operator==(const arena_allocator<T>& a, const arena_allocator<U>& b) noexcept
+  {
+    return &a.resource() == &b.resource();
+  }
+
+  template <typename T, typename U>
+  bool operator!=(const arena_allocator<T>& a, const arena_allocator<U>& b) noexcept
+  {
+    return !(a == b);
+  }
+
+  /**
+   *  A pool of fixed-size objects. Objects are carved out of slabs in the order they are requested, so objects
+   *  allocated close together in time sit close together in memory, and freed objects go on a free list to be
+   *  handed out again first. Destroying the pool or calling release() frees it one slab at a time. Not thread safe.
+   */
+  class object_pool
+  {
+  private:
+    struct slab
+    {
+      slab* next;
+    };
+
+    struct free_object
+    {
+      free_object* next;
+    };
+
+    size_t size;
+    size_t align;
+    size_t per_slab;
+    size_t header;     // Bytes at the start of each slab, before the first object, that keep objects aligned.
+    slab* slabs;
+    char* cur;
+    char* end;
+    free_object* free_list;
+    size_t live;
+    size_t slab_count;
+
+    size_t slab_bytes() const
+    {
+      return header + per_slab*size;
+    }
+
+  public:
+    /**
+     *  Creates an empty pool of objects of object_size bytes aligned to object_align. Each slab holds
+     *  objects_per_slab objects, or as many as fit in 64 KiB if objects_per_slab is 0.
+     */
+    explicit object_pool(size_t object_size, size_t object_align = alignof(std::max_align_t),
+                         size_t objects_per_slab = 0) :
+      size(object_size < sizeof(free_object) ? sizeof(free_object) : object_size),
+      align(object_align < alignof(free_object) ? alignof(free_object) : object_align),
+      per_slab(objects_per_slab), header(0), slabs(nullptr), cur(nullptr), end(nullptr), free_list(nullptr), live(0),
+      slab_count(0)
+    {
+      size = (size + align - 1)/align*align;
+      header = (sizeof(slab) + align - 1)/align*align;
+      if(per_slab == 0) {
+        per_slab = (size < 65536/8 ? 65536/size : 8);
+      }
+    }
+
+    object_pool(const object_pool&) = delete;
+    object_pool& operator=(const object_pool&) = delete;
+
+    /**
+     *  Returns uninitialized memory for one object.
+     */
+    void* allocate()
+    {
+      live++;
+      if(free_list) {
+        free_object* p = free_list;
+        free_list = p->next;
+        return p;
+      }
+      if(cur == end) {
+        slab* s = static_cast<slab*>(detail::heap::allocate(slab_bytes()));
+        s->next = slabs;
+        slabs = s;
+        slab_count++;
+        cur = reinterpret_cast<char*>(s) + header;
+        end = cur + per_slab*size;
+      }
+      void* p = cur;
+      cur += size;
+      return p;
+    }
+
+    /**
+     *  Returns an object from allocate() to the pool, to be handed out by the next allocate().
+     */
+    void deallocate(void* p) noexcept
+    {
+      if(!p) {
+        return;
+      }
+      free_object* f = static_cast<free_object*>(p);
+      f->next = free_list;
+      free_list = f;
+      live--;
+    }
+
+    /**
+     *  Frees every slab, invalidating every object handed out.
+     */
+    void release() noexcept
+    {
+      while(slabs) {
+        slab* next = slabs->next;
+        detail::heap::deallocate(slabs, slab_bytes());
+        slabs = next;
+      }
+      cur = end = nullptr;
+      free_list = nullptr;
+      live = slab_count = 0;
+    }
+
+    size_t object_size() const
+    {
+      return size;
+    }
+
+    size_t object_alignment() const
+    {
+      return align;
+    }
+
+    /**
+     *  @return the number of objects handed out and not yet returned.
+     */
+    size_t objects_in_use() const
+    {
+      return live;
+    }
+
+    size_t slabs_allocated() const
+    {
+      return slab_count;
+    }
+
+    ~object_pool()
+    {
+      release();
+    }
+  };
+
+  namespace detail
+  {
+    // The pools behind a pool_allocator and every copy and rebinding of it, one per object size and alignment.
+    class pool_group
+    {
+    private:
+      struct entry
+      {
+        size_t size;
+        size_t align;
+        std::unique_ptr<object_pool> pool;
+      };
+      std::vector<entry> pools;
+
+    public:
+      object_pool& get(size_t size, size_t align)
+      {
+        for(entry& e : pools) {
+          if(e.size == size && e.align == align) {
+            return *e.pool;
+          }
+        }
+        pools.push_back(entry{size, align, std::unique_ptr<object_pool>(new object_pool(size, align))});
+        return *pools.back().pool;
+      }
+    };
+  }
+
+  /**
+   *  An allocator that serves single objects from an object_pool, which makes it a good fit for node-based
+   *  containers such as red_black_tree: insertions take a node off a free list or the end of a slab instead of
+   *  calling malloc, and the last copy of the allocator frees all the slabs at once. Requests for more than one
+   *  object go to the heap. Copies and rebindings share the same pools and compare equal.
+   */
+  template <typename T>
+  class pool_allocator
+  {
+  private:
+    template <typename U> friend class pool_allocator;
+    std::shared_ptr<detail::pool_group> group;
+    object_pool* pool;
+
+  public:
+    typedef T value_type;
+
+    pool_allocator() : group(std::make_shared<detail::pool_group>()), pool(&group->get(sizeof(T), alignof(T))) {}
+
+    template <typename U>
+    pool_allocator(const pool_allocator<U>& a) : group(a.group), pool(&group->get(sizeof(T), alignof(T))) {}
+
+    T* allocate(size_t n)
+    {
+      if(n == 1) {
+        return static_cast<T*>(pool->allocate());
+      }
+      return heap_allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p, size_t n) noexcept
+    {
+      if(n == 1) {
+        pool->deallocate(p);
+      } else {
+        heap_allocator<T>().deallocate(p, n);
+      }
+    }
+
+    object_pool& resource() const noexcept
+    {
+      return *pool;
+    }
+
+    template <typename U>
+    bool operator==(const pool_allocator<U>& a) const noexcept
+    {
+      return group == a.group;
+    }
+
+    template <typename U>
+    bool operator!=(const pool_allocator<U>& a) const noexcept
+    {
+      return group != a.group;
+    }
+  };
+
+  /**
+   *  True if memory from Allocator is given back all at once by its resource, so a container of trivially
+   *  destructible elements can be destroyed without visiting them to deallocate one by one. Specialize it for other
+   *  arena-style allocators.
+   */
+  template <typename Allocator>
+  struct releases_in_bulk : std::false_type {};
+
+  template <typename T>
+  struct releases_in_bulk<arena_allocator<T>> : std::true_type {};
+
+  namespace detail
+  {
+    // True if a container of T using Allocator can skip tearing down its nodes in its destructor: the memory goes
+    // back to the allocator's resource in one piece later anyway, and no element needs its destructor run. The
+    // containers' destructors check it before clear().
+    template <typename Allocator, typename T>
+    struct skips_teardown
+      : std::integral_constant<bool, releases_in_bulk<Allocator>::value && std::is_trivially_destructible<T>::value> {};
+
+    template <typename Allocator, typename = void>
+    struct has_reallocate : std::false_type {};
+
+    template <typename Allocator>
+    struct has_reallocate<Allocator, decltype(void(std::declval<Allocator&>().reallocate(
+      std::declval<typename Allocator::value_type*>(), size_t(), size_t())))> : std::true_type {};
+
+    template <typename Allocator>
+    typename Allocator::value_type* reallocate(Allocator& a, typename Allocator::value_type* p, size_t old_n,
+                                               size_t new_n, std::true_type)
+    {
+      return a.reallocate(p, old_n, new_n);
+    }
+
+    // Never called; containers check has_reallocate first. It only has to compile.
+    template <typename Allocator>
+    typename Allocator::value_type* reallocate(Allocator&, typename Allocator::value_type* p, size_t, size_t,
+                                               std::false_type)
+    {
+      return p;
+    }
+
+    // Holds a container's allocator, taking no space when the allocator is empty.
+    template <typename Allocator, bool Empty = std::is_empty<Allocator>::value>
+    class allocator_holder : private Allocator
+    {
+    protected:
+      explicit allocator_holder(const Allocator& a) : Allocator(a) {}
+
+      Allocator& allocator()
+      {
+        return *this;
+      }
+
+      const Allocator& allocator() const
+      {
+        return *this;
+      }
+    };
+
+    template <typename Allocator>
+    class allocator_holder<Allocator, false>
+    {
+    private:
+      Allocator alloc;
+
+    protected:
+      explicit allocator_holder(const Allocator& a) : alloc(a) {}
+
+      Allocator& allocator()
+      {
+        return alloc;
+      }
+
+      const Allocator& allocator() const
+      {
+        return alloc;
+      }
+    };
+  }
+
+}
+
+#endif
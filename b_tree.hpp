@@ -0,0 +1,983 @@
+/**
+ *  b_tree.hpp
+ *  An ordered set kept in a B+ tree.
+ *
+ *  @author Marquess Valdez
+ *  @version 1.0
+ */
+#ifndef B_TREE_HPP
+#define B_TREE_HPP
+
+#include <algorithm> // for std::move, std::move_backward, std::copy, std::copy_backward
+#include <cstddef> //for std::size_t
+#include <cstdint> // for std::uint16_t
+#include <iterator> // for std::reverse_iterator, std::bidirectional_iterator_tag
+#include <memory> // for std::allocator_traits
+#include <new> // for placement new
+#include <type_traits>
+#include <utility> // for std::pair
+#include <vector>  //for std::vector
+#include "allocator.hpp"
+#include "simd.hpp"
+
+namespace mqs {
+
+namespace detail {
+
+  // The header every B+ tree node starts with.
+  struct b_tree_node
+  {
+    std::uint16_t count; // Keys in the node.
+    bool leaf;
+  };
+
+  constexpr size_t b_tree_round_up(size_t n, size_t multiple)
+  {
+    return (n + multiple - 1) / multiple * multiple;
+  }
+
+  // How many keys of per_key bytes fit in bytes after a header, keeping one slot spare, but never fewer than 3.
+  constexpr size_t b_tree_capacity(size_t bytes, size_t header, size_t per_key)
+  {
+    return bytes >= header + 4*per_key ? (bytes - header) / per_key - 1 : 3;
+  }
+
+}
+
+/**
+ *  A set of T kept in a B+ tree, with the same interface as red_black_tree. T needs == and >.
+ *
+ *  Every element sits in a leaf, in order, and the leaves are linked both ways, so scans walk arrays instead of
+ *  chasing a pointer per element. Inner nodes hold copies of elements that route searches down. Nodes are sized to
+ *  NodeBytes, 256 by default, or four cache lines: a lookup costs a handful of misses on neighbouring lines per
+ *  level and about log base 10 to 30 of n levels, instead of one dependent miss for each of about log2(n) levels
+ *  of a binary tree. Within a node, arithmetic keys are counted with simd::count_less_short, inlined without a
+ *  branch per key; other keys are binary searched. Nodes are between half full and full, except the root.
+ *
+ *  Unlike red_black_tree, elements move between nodes as the tree changes, so insert() and remove() invalidate
+ *  every iterator. Memory comes from Allocator rebound to the node types, one node at a time.
+ */
+template <typename T, typename Allocator = heap_allocator<T>, size_t NodeBytes = 256>
+class b_tree : private detail::allocator_holder<Allocator> {
+  private:
+    typedef detail::b_tree_node node;
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type slot;
+
+  public:
+    // The most elements a leaf holds, chosen so a leaf fits in NodeBytes.
+    static const size_t leaf_capacity =
+      detail::b_tree_capacity(NodeBytes, detail::b_tree_round_up(3*sizeof(void*), alignof(T)), sizeof(T));
+    // The most keys an inner node holds. It has one more child than keys.
+    static const size_t inner_capacity =
+      detail::b_tree_capacity(NodeBytes, detail::b_tree_round_up(sizeof(node), alignof(T)) + 2*sizeof(void*),
+                              sizeof(T) + sizeof(void*));
+
+  private:
+    static const size_t leaf_min = leaf_capacity / 2;
+    static const size_t inner_min = inner_capacity / 2;
+    // Deeper than any tree that fits in memory, since every inner node but the root has at least two children.
+    static const int max_height = 64;
+
+    // Each node has room for one key more than its capacity, which insert() fills just before splitting it.
+    struct leaf_node : node
+    {
+      leaf_node* prev;
+      leaf_node* next;
+      slot keys[leaf_capacity + 1];
+    };
+
+    // Every key in children[i] is <= keys[i], and every key in children[i+1] is > keys[i].
+    struct inner_node : node
+    {
+      slot keys[inner_capacity + 1];
+      node* children[inner_capacity + 2];
+    };
+
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<leaf_node> leaf_allocator;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<inner_node> inner_allocator;
+    typedef std::allocator_traits<leaf_allocator> leaf_traits;
+    typedef std::allocator_traits<inner_allocator> inner_traits;
+
+    node* root;
+    leaf_node* head; // The leftmost leaf.
+    leaf_node* tail; // The rightmost leaf.
+    size_t count;
+    int levels; // Edges from the root down to the leaves, or -1 if the tree is empty.
+
+    template <typename Node>
+    static T* keys_of(Node* n)
+    {
+      return reinterpret_cast<T*>(n->keys);
+    }
+
+    template <typename Node>
+    static const T* keys_of(const Node* n)
+    {
+      return reinterpret_cast<const T*>(n->keys);
+    }
+
+    // Counts the keys less than d, which is where d goes among them.
+    static size_t rank(const T* keys, size_t n, const T& d)
+    {
+      return rank(keys, n, d, simd::is_vectorizable<T>());
+    }
+
+    static size_t rank(const T* keys, size_t n, const T& d, std::true_type)
+    {
+      return simd::count_less_short(keys, n, d);
+    }
+
+    static size_t rank(const T* keys, size_t n, const T& d, std::false_type)
+    {
+      size_t lo = 0, hi = n;
+      while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(d > keys[mid]) {
+          lo = mid + 1;
+        } else {
+          hi = mid;
+        }
+      }
+      return lo;
+    }
+
+    // Builds value at keys[pos], moving keys[pos, n) up a slot first.
+    template <typename V>
+    static void insert_key(T* keys, size_t n, size_t pos, V&& value)
+    {
+      if(pos == n) {
+        ::new(static_cast<void*>(keys + n)) T(std::forward<V>(value));
+        return;
+      }
+      ::new(static_cast<void*>(keys + n)) T(std::move(keys[n-1]));
+      std::move_backward(keys + pos, keys + n - 1, keys + n);
+      keys[pos] = std::forward<V>(value);
+    }
+
+    // Removes keys[pos] by moving keys[pos+1, n) down a slot.
+    static void erase_key(T* keys, size_t n, size_t pos)
+    {
+      std::move(keys + pos + 1, keys + n, keys + pos);
+      keys[n-1].~T();
+    }
+
+    // Moves n keys into the empty slots at to, leaving the slots at from empty.
+    static void relocate(T* from, size_t n, T* to)
+    {
+      for(size_t i = 0; i < n; i++) {
+        ::new(static_cast<void*>(to + i)) T(std::move(from[i]));
+        from[i].~T();
+      }
+    }
+
+    static void destroy_keys(T* keys, size_t n)
+    {
+      if(!std::is_trivially_destructible<T>::value) {
+        for(size_t i = 0; i < n; i++) {
+          keys[i].~T();
+        }
+      }
+    }
+
+    leaf_node* new_leaf()
+    {
+      leaf_allocator a(this->allocator());
+      leaf_node* n = ::new(static_cast<void*>(leaf_traits::allocate(a, 1))) leaf_node;
+      n->count = 0;
+      n->leaf = true;
+      n->prev = n->next = nullptr;
+      return n;
+    }
+
+    inner_node* new_inner()
+    {
+      inner_allocator a(this->allocator());
+      inner_node* n = ::new(static_cast<void*>(inner_traits::allocate(a, 1))) inner_node;
+      n->count = 0;
+      n->leaf = false;
+      return n;
+    }
+
+    void free_node(leaf_node* n)
+    {
+      leaf_allocator a(this->allocator());
+      leaf_traits::deallocate(a, n, 1);
+    }
+
+    void free_node(inner_node* n)
+    {
+      inner_allocator a(this->allocator());
+      inner_traits::deallocate(a, n, 1);
+    }
+
+    // Destroys the subtree under n and frees its nodes.
+    void destroy(node* n)
+    {
+      if(n->leaf) {
+        leaf_node* l = static_cast<leaf_node*>(n);
+        destroy_keys(keys_of(l), l->count);
+        free_node(l);
+        return;
+      }
+      inner_node* in = static_cast<inner_node*>(n);
+      for(size_t i = 0; i <= in->count; i++) {
+        destroy(in->children[i]);
+      }
+      destroy_keys(keys_of(in), in->count);
+      free_node(in);
+    }
+
+    const leaf_node* find_leaf(const T& d) const
+    {
+      const node* n = root;
+      while(!n->leaf) {
+        const inner_node* in = static_cast<const inner_node*>(n);
+        n = in->children[rank(keys_of(in), in->count, d)];
+      }
+      return static_cast<const leaf_node*>(n);
+    }
+
+    // Copies the subtree under n, linking its leaves after last.
+    node* clone(const node* n, leaf_node*& last)
+    {
+      if(n->leaf) {
+        const leaf_node* from = static_cast<const leaf_node*>(n);
+        leaf_node* l = new_leaf();
+        try {
+          for(; l->count < from->count; l->count++) {
+            ::new(static_cast<void*>(keys_of(l) + l->count)) T(keys_of(from)[l->count]);
+          }
+        } catch(...) {
+          destroy(l);
+          throw;
+        }
+        l->prev = last;
+        if(last != nullptr) {
+          last->next = l;
+        } else {
+          head = l;
+        }
+        last = l;
+        return l;
+      }
+      const inner_node* from = static_cast<const inner_node*>(n);
+      inner_node* in = new_inner();
+      size_t keys = 0, children = 0;
+      try {
+        for(; keys < from->count; keys++) {
+          ::new(static_cast<void*>(keys_of(in) + keys)) T(keys_of(from)[keys]);
+        }
+        for(; children <= from->count; children++) {
+          in->children[children] = clone(from->children[children], last);
+        }
+      } catch(...) {
+        for(size_t i = 0; i < children; i++) {
+          destroy(in->children[i]);
+        }
+        destroy_keys(keys_of(in), keys);
+        free_node(in);
+        throw;
+      }
+      in->count = from->count;
+      return in;
+    }
+
+    // Replaces the contents of an empty tree with a copy of t's. If an element throws while being copied, the tree
+    // is left empty.
+    void copy_from(const b_tree& t)
+    {
+      if(t.root == nullptr) {
+        return;
+      }
+      leaf_node* last = nullptr;
+      try {
+        root = clone(t.root, last);
+      } catch(...) {
+        head = nullptr;
+        throw;
+      }
+      tail = last;
+      count = t.count;
+      levels = t.levels;
+    }
+
+    /**
+     *  Splits the leaf at the bottom of path, which holds one key too many, then every inner node on the path that
+     *  overflows in turn, growing a new root if the old one splits.
+     *  @param spares the new nodes the splits need, already allocated.
+     */
+    void split(leaf_node* leaf, inner_node** path, size_t* slots, int depth, leaf_node* spare_leaf,
+               inner_node** spares)
+    {
+      leaf_node* right = spare_leaf;
+      size_t keep = (leaf_capacity + 1) / 2;
+      relocate(keys_of(leaf) + keep, leaf->count - keep, keys_of(right));
+      right->count = leaf->count - keep;
+      leaf->count = keep;
+      right->prev = leaf;
+      right->next = leaf->next;
+      if(leaf->next != nullptr) {
+        leaf->next->prev = right;
+      } else {
+        tail = right;
+      }
+      leaf->next = right;
+
+      // Push a separator and the new right sibling into the parent until a node has room for them.
+      T separator(keys_of(leaf)[keep - 1]);
+      node* child = right;
+      for(int level = depth - 1; level >= 0; level--) {
+        inner_node* parent = path[level];
+        size_t i = slots[level];
+        insert_key(keys_of(parent), parent->count, i, std::move(separator));
+        std::copy_backward(parent->children + i + 1, parent->children + parent->count + 1,
+                           parent->children + parent->count + 2);
+        parent->children[i + 1] = child;
+        parent->count++;
+        if(parent->count <= inner_capacity) {
+          return;
+        }
+        // The middle key moves up, the keys and children after it move to a new right sibling.
+        inner_node* sibling = *spares++;
+        keep = (inner_capacity + 1) / 2;
+        T* k = keys_of(parent);
+        separator = std::move(k[keep]);
+        k[keep].~T();
+        relocate(k + keep + 1, parent->count - keep - 1, keys_of(sibling));
+        std::copy(parent->children + keep + 1, parent->children + parent->count + 1, sibling->children);
+        sibling->count = parent->count - keep - 1;
+        parent->count = keep;
+        child = sibling;
+      }
+      inner_node* top = *spares;
+      ::new(static_cast<void*>(keys_of(top))) T(std::move(separator));
+      top->children[0] = root;
+      top->children[1] = child;
+      top->count = 1;
+      root = top;
+      levels++;
+    }
+
+    /**
+     *  Refills children[i] of parent, a leaf that just fell below half full, from a neighbour with keys to spare,
+     *  or merges it with a neighbour.
+     *  @returns true if two leaves merged, so parent lost a key.
+     */
+    bool rebalance_leaf(inner_node* parent, size_t i)
+    {
+      leaf_node* leaf = static_cast<leaf_node*>(parent->children[i]);
+      T* sep = keys_of(parent);
+      if(i < parent->count) {
+        leaf_node* right = static_cast<leaf_node*>(parent->children[i + 1]);
+        if(right->count > leaf_min) {
+          insert_key(keys_of(leaf), leaf->count, leaf->count, std::move(keys_of(right)[0]));
+          leaf->count++;
+          erase_key(keys_of(right), right->count, 0);
+          right->count--;
+          sep[i] = keys_of(leaf)[leaf->count - 1];
+          return false;
+        }
+        merge_leaves(parent, i);
+        return true;
+      }
+      leaf_node* left = static_cast<leaf_node*>(parent->children[i - 1]);
+      if(left->count > leaf_min) {
+        insert_key(keys_of(leaf), leaf->count, 0, std::move(keys_of(left)[left->count - 1]));
+        leaf->count++;
+        keys_of(left)[left->count - 1].~T();
+        left->count--;
+        sep[i - 1] = keys_of(left)[left->count - 1];
+        return false;
+      }
+      merge_leaves(parent, i - 1);
+      return true;
+    }
+
+    // Moves every key of children[i+1] into children[i] and drops children[i+1] and the key between them.
+    void merge_leaves(inner_node* parent, size_t i)
+    {
+      leaf_node* left = static_cast<leaf_node*>(parent->children[i]);
+      leaf_node* right = static_cast<leaf_node*>(parent->children[i + 1]);
+      relocate(keys_of(right), right->count, keys_of(left) + left->count);
+      left->count += right->count;
+      left->next = right->next;
+      if(right->next != nullptr) {
+        right->next->prev = left;
+      } else {
+        tail = left;
+      }
+      free_node(right);
+      erase_child(parent, i);
+    }
+
+    // Removes keys[i] and children[i+1] of parent.
+    static void erase_child(inner_node* parent, size_t i)
+    {
+      erase_key(keys_of(parent), parent->count, i);
+      std::copy(parent->children + i + 2, parent->children + parent->count + 1, parent->children + i + 1);
+      parent->count--;
+    }
+
+    /**
+     *  Refills children[i] of parent, an inner node that just fell below half full, by rotating a key through
+     *  parent from a neighbour with keys to spare, or merges it with a neighbour.
+     *  @returns true if two nodes merged, so parent lost a key.
+     */
+    bool rebalance_inner(inner_node* parent, size_t i)
+    {
+      inner_node* n = static_cast<inner_node*>(parent->children[i]);
+      T* sep = keys_of(parent);
+      if(i < parent->count) {
+        inner_node* right = static_cast<inner_node*>(parent->children[i + 1]);
+        if(right->count > inner_min) {
+          ::new(static_cast<void*>(keys_of(n) + n->count)) T(std::move(sep[i]));
+          n->children[n->count + 1] = right->children[0];
+          n->count++;
+          sep[i] = std::move(keys_of(right)[0]);
+          erase_key(keys_of(right), right->count, 0);
+          std::copy(right->children + 1, right->children + right->count + 1, right->children);
+          right->count--;
+          return false;
+        }
+        merge_inner(parent, i);
+        return true;
+      }
+      inner_node* left = static_cast<inner_node*>(parent->children[i - 1]);
+      if(left->count > inner_min) {
+        insert_key(keys_of(n), n->count, 0, std::move(sep[i - 1]));
+        std::copy_backward(n->children, n->children + n->count + 1, n->children + n->count + 2);
+        n->children[0] = left->children[left->count];
+        n->count++;
+        T* k = keys_of(left);
+        sep[i - 1] = std::move(k[left->count - 1]);
+        k[left->count - 1].~T();
+        left->count--;
+        return false;
+      }
+      merge_inner(parent, i - 1);
+      return true;
+    }
+
+    // Pulls the key between children[i] and children[i+1] of parent down into children[i], then moves every key
+    // and child of children[i+1] after it.
+    void merge_inner(inner_node* parent, size_t i)
+    {
+      inner_node* left = static_cast<inner_node*>(parent->children[i]);
+      inner_node* right = static_cast<inner_node*>(parent->children[i + 1]);
+      ::new(static_cast<void*>(keys_of(left) + left->count)) T(std::move(keys_of(parent)[i]));
+      relocate(keys_of(right), right->count, keys_of(left) + left->count + 1);
+      std::copy(right->children, right->children + right->count + 1, left->children + left->count + 1);
+      left->count += 1 + right->count;
+      free_node(right);
+      erase_child(parent, i);
+    }
+
+  public:
+    typedef Allocator allocator_type;
+    typedef T value_type;
+    typedef T key_type;
+    typedef size_t size_type;
+
+    /**
+     *  Walks the elements in order through the linked leaves. Invalidated by insert() and remove().
+     */
+    class const_iterator
+    {
+      public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const T* pointer;
+        typedef const T& reference;
+
+        const_iterator() : leaf(nullptr), index(0), tree(nullptr) {}
+
+        reference operator*() const
+        {
+          return keys_of(leaf)[index];
+        }
+
+        pointer operator->() const
+        {
+          return keys_of(leaf) + index;
+        }
+
+        const_iterator& operator++()
+        {
+          if(++index == leaf->count) {
+            leaf = leaf->next;
+            index = 0;
+          }
+          return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+          const_iterator old = *this;
+          ++*this;
+          return old;
+        }
+
+        const_iterator& operator--()
+        {
+          if(leaf == nullptr) {
+            leaf = tree->tail;
+            index = leaf->count;
+          } else if(index == 0) {
+            leaf = leaf->prev;
+            index = leaf->count;
+          }
+          index--;
+          return *this;
+        }
+
+        const_iterator operator--(int)
+        {
+          const_iterator old = *this;
+          --*this;
+          return old;
+        }
+
+        bool operator==(const const_iterator& it) const
+        {
+          return leaf == it.leaf && index == it.index;
+        }
+
+        bool operator!=(const const_iterator& it) const
+        {
+          return !(*this == it);
+        }
+
+      private:
+        friend class b_tree;
+
+        const leaf_node* leaf;
+        size_t index;
+        const b_tree* tree;
+
+        const_iterator(const leaf_node* leaf, size_t index, const b_tree* tree) :
+          leaf(leaf), index(index), tree(tree) {}
+    };
+
+    typedef const_iterator iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+    typedef const_reverse_iterator reverse_iterator;
+
+    explicit b_tree(const Allocator& a = Allocator()) :
+      detail::allocator_holder<Allocator>(a), root(nullptr), head(nullptr), tail(nullptr), count(0), levels(-1) {}
+
+    /**
+     *  Builds a tree holding the elements of data.
+     *  @param data the elements, in any order and possibly with repeats.
+     */
+    explicit b_tree(std::vector<T>& data, const Allocator& a = Allocator()) : b_tree(a)
+    {
+      for(const T& d : data) {
+        insert(d);
+      }
+    }
+
+    /**
+     *  Copies t node for node in O(n).
+     */
+    b_tree(const b_tree& t) :
+      b_tree(std::allocator_traits<Allocator>::select_on_container_copy_construction(t.get_allocator()))
+    {
+      copy_from(t);
+    }
+
+    /**
+     *  Replaces the contents with a copy of t's in O(n). The tree takes t's allocator if it propagates on copy
+     *  assignment and differs, building the copy with it before giving up the old nodes, so an element that throws
+     *  while being copied leaves the tree as it was. Otherwise the tree keeps its own allocator and is left empty by
+     *  such an element.
+     */
+    b_tree& operator=(const b_tree& t)
+    {
+      if(this == &t) {
+        return *this;
+      }
+      typedef std::allocator_traits<Allocator> alloc_traits;
+      if(alloc_traits::propagate_on_container_copy_assignment::value && get_allocator() != t.get_allocator()) {
+        b_tree copy(t.get_allocator());
+        copy.copy_from(t);
+        swap(copy);
+      } else {
+        clear();
+        copy_from(t);
+      }
+      return *this;
+    }
+
+    /**
+     *  Takes t's nodes and allocator in O(1), leaving t empty.
+     */
+    b_tree(b_tree&& t) noexcept : b_tree(t.get_allocator())
+    {
+      swap(t);
+    }
+
+    /**
+     *  Replaces the contents with t's, leaving t empty. Takes t's nodes in O(1) if the allocators compare equal or
+     *  t's propagates on move assignment, and copies the elements in O(n) otherwise, since the nodes can't be freed
+     *  through this tree's allocator.
+     */
+    b_tree& operator=(b_tree&& t)
+    {
+      if(this == &t) {
+        return *this;
+      }
+      typedef std::allocator_traits<Allocator> alloc_traits;
+      clear();
+      if(alloc_traits::propagate_on_container_move_assignment::value || get_allocator() == t.get_allocator()) {
+        swap(t);
+      } else {
+        copy_from(t);
+        t.clear();
+      }
+      return *this;
+    }
+
+    /**
+     *  Exchanges the contents and allocators of this tree and t in O(1), without touching a node. As with the
+     *  standard containers, the allocators must compare equal unless they propagate on swap.
+     */
+    void swap(b_tree& t) noexcept
+    {
+      using std::swap;
+      swap(this->allocator(), t.allocator());
+      swap(root, t.root);
+      swap(head, t.head);
+      swap(tail, t.tail);
+      swap(count, t.count);
+      swap(levels, t.levels);
+    }
+
+    /**
+     *  Inserts data into the tree if it isn't in there already.
+     *  @param d the data to insert.
+     *  @returns true if the insertion was successful and false if data already exists in the tree.
+     */
+    bool insert(const T& d)
+    {
+      if(root == nullptr) {
+        root = head = tail = new_leaf();
+        levels = 0;
+      }
+      inner_node* path[max_height];
+      size_t slots[max_height];
+      int depth = 0;
+      node* n = root;
+      while(!n->leaf) {
+        inner_node* in = static_cast<inner_node*>(n);
+        size_t i = rank(keys_of(in), in->count, d);
+        path[depth] = in;
+        slots[depth++] = i;
+        n = in->children[i];
+      }
+      leaf_node* leaf = static_cast<leaf_node*>(n);
+      T* k = keys_of(leaf);
+      size_t i = rank(k, leaf->count, d);
+      if(i < leaf->count && k[i] == d) {
+        return false;
+      }
+      if(leaf->count < leaf_capacity) {
+        insert_key(k, leaf->count, i, d);
+        leaf->count++;
+        count++;
+        return true;
+      }
+
+      // Allocate every node the splits will need before changing anything, so running out leaves the tree as it was.
+      int full = 0;
+      while(full < depth && path[depth - 1 - full]->count == inner_capacity) {
+        full++;
+      }
+      int needed = full + (full == depth ? 1 : 0);
+      inner_node* spares[max_height + 1];
+      leaf_node* spare_leaf = new_leaf();
+      int allocated = 0;
+      try {
+        for(; allocated < needed; allocated++) {
+          spares[allocated] = new_inner();
+        }
+        insert_key(k, leaf->count, i, d);
+      } catch(...) {
+        for(int j = 0; j < allocated; j++) {
+          free_node(spares[j]);
+        }
+        free_node(spare_leaf);
+        throw;
+      }
+      leaf->count++;
+      count++;
+      split(leaf, path, slots, depth, spare_leaf, spares);
+      return true;
+    }
+
+    /**
+     *  Removes data from the tree.
+     *  @param d the data to remove.
+     *  @returns true if the node with data was successfully removed and false if the
+     *  data didn't exist in the tree.
+     */
+    bool remove(const T& d)
+    {
+      if(root == nullptr) {
+        return false;
+      }
+      inner_node* path[max_height];
+      size_t slots[max_height];
+      int depth = 0;
+      node* n = root;
+      while(!n->leaf) {
+        inner_node* in = static_cast<inner_node*>(n);
+        size_t i = rank(keys_of(in), in->count, d);
+        path[depth] = in;
+        slots[depth++] = i;
+        n = in->children[i];
+      }
+      leaf_node* leaf = static_cast<leaf_node*>(n);
+      T* k = keys_of(leaf);
+      size_t i = rank(k, leaf->count, d);
+      if(i == leaf->count || !(k[i] == d)) {
+        return false;
+      }
+      erase_key(k, leaf->count, i);
+      leaf->count--;
+      count--;
+
+      if(depth == 0) {
+        if(leaf->count == 0) {
+          free_node(leaf);
+          root = head = tail = nullptr;
+          levels = -1;
+        }
+        return true;
+      }
+      // Keys left in inner nodes may no longer be in the tree, but they still route searches correctly.
+      bool merged = leaf->count < leaf_min && rebalance_leaf(path[depth - 1], slots[depth - 1]);
+      for(int level = depth - 1; merged && level > 0 && path[level]->count < inner_min; level--) {
+        merged = rebalance_inner(path[level - 1], slots[level - 1]);
+      }
+      if(root->leaf == false && static_cast<inner_node*>(root)->count == 0) {
+        inner_node* old = static_cast<inner_node*>(root);
+        root = old->children[0];
+        free_node(old);
+        levels--;
+      }
+      return true;
+    }
+
+    /**
+     *  Checks if data is in the tree.
+     *  @param d the data to find.
+     *  @returns true if node with data was found and false otherwise.
+     */
+    bool find(const T& d) const
+    {
+      if(root == nullptr) {
+        return false;
+      }
+      const leaf_node* leaf = find_leaf(d);
+      size_t i = rank(keys_of(leaf), leaf->count, d);
+      return i < leaf->count && keys_of(leaf)[i] == d;
+    }
+
+    /**
+     *  @returns an iterator to the smallest element, or end() if the tree is empty.
+     */
+    const_iterator begin() const
+    {
+      return const_iterator(head, 0, this);
+    }
+
+    /**
+     *  @returns an iterator one past the largest element.
+     */
+    const_iterator end() const
+    {
+      return const_iterator(nullptr, 0, this);
+    }
+
+    const_iterator cbegin() const
+    {
+      return begin();
+    }
+
+    const_iterator cend() const
+    {
+      return end();
+    }
+
+    const_reverse_iterator rbegin() const
+    {
+      return const_reverse_iterator(end());
+    }
+
+    const_reverse_iterator rend() const
+    {
+      return const_reverse_iterator(begin());
+    }
+
+    /**
+     *  Finds the first element that is not less than d.
+     *  @param d the value to compare against.
+     *  @returns an iterator to the first element >= d, or end() if there is none.
+     */
+    const_iterator lower_bound(const T& d) const
+    {
+      if(root == nullptr) {
+        return end();
+      }
+      const leaf_node* leaf = find_leaf(d);
+      size_t i = rank(keys_of(leaf), leaf->count, d);
+      // If every element of the leaf is less than d, the next leaf starts with the answer.
+      return i < leaf->count ? const_iterator(leaf, i, this) : const_iterator(leaf->next, 0, this);
+    }
+
+    /**
+     *  Finds the first element that is greater than d.
+     *  @param d the value to compare against.
+     *  @returns an iterator to the first element > d, or end() if there is none.
+     */
+    const_iterator upper_bound(const T& d) const
+    {
+      const_iterator it = lower_bound(d);
+      if(it != end() && !(*it > d)) {
+        ++it;
+      }
+      return it;
+    }
+
+    /**
+     *  @returns the range of elements equal to d: empty, or the one element equal to it.
+     */
+    std::pair<const_iterator, const_iterator> equal_range(const T& d) const
+    {
+      const_iterator first = lower_bound(d);
+      if(first != end() && !(*first > d)) {
+        const_iterator last = first;
+        return std::make_pair(first, ++last);
+      }
+      return std::make_pair(first, first);
+    }
+
+    /**
+     *  Calls visitor on every element in [lo, hi), in order. Costs one descent to the first leaf and then a walk
+     *  along the leaves, and allocates nothing.
+     *  @param lo the smallest value to visit.
+     *  @param hi the value to stop at, which isn't visited.
+     *  @param visitor a callable taking a const T&.
+     *  @returns the number of elements visited.
+     */
+    template <typename Visitor>
+    size_t visit_range(const T& lo, const T& hi, Visitor visitor) const
+    {
+      size_t visited = 0;
+      if(root == nullptr) {
+        return visited;
+      }
+      const leaf_node* leaf = find_leaf(lo);
+      for(size_t i = rank(keys_of(leaf), leaf->count, lo); leaf != nullptr; leaf = leaf->next, i = 0) {
+        const T* k = keys_of(leaf);
+        for(; i < leaf->count; i++) {
+          if(!(hi > k[i])) {
+            return visited;
+          }
+          visitor(k[i]);
+          visited++;
+        }
+      }
+      return visited;
+    }
+
+    /**
+     *  @returns the size of the tree.
+     */
+    size_t size() const
+    {
+      return count;
+    }
+
+    /**
+     *  @returns the number of edges from the root down to any leaf, or -1 if the tree is empty.
+     */
+    int height() const
+    {
+      return levels;
+    }
+
+    /**
+     *  @returns a vector<pair<T,int>> of every key in the tree, node by node in pre-order, where vector[i].second is
+     *  the depth of the key's node, 0 for the root. Inner nodes hold copies of keys, so some appear more than once.
+     */
+    std::vector<std::pair<T,int>> dump() const
+    {
+      std::vector<std::pair<T,int>> out;
+      if(root == nullptr) {
+        return out;
+      }
+      std::vector<std::pair<const node*, int>> stack(1, std::make_pair(static_cast<const node*>(root), 0));
+      while(!stack.empty()) {
+        const node* n = stack.back().first;
+        int depth = stack.back().second;
+        stack.pop_back();
+        const T* k = n->leaf ? keys_of(static_cast<const leaf_node*>(n)) : keys_of(static_cast<const inner_node*>(n));
+        for(size_t i = 0; i < n->count; i++) {
+          out.push_back(std::make_pair(k[i], depth));
+        }
+        if(!n->leaf) {
+          const inner_node* in = static_cast<const inner_node*>(n);
+          for(size_t i = in->count + 1; i-- > 0;) {
+            stack.push_back(std::make_pair(static_cast<const node*>(in->children[i]), depth + 1));
+          }
+        }
+      }
+      return out;
+    }
+
+    /**
+     *  Removes every element and frees the tree's memory.
+     */
+    void clear()
+    {
+      if(root != nullptr) {
+        destroy(root);
+      }
+      root = head = tail = nullptr;
+      count = 0;
+      levels = -1;
+    }
+
+    /**
+     *  @returns a copy of the allocator the tree was constructed with.
+     */
+    Allocator get_allocator() const
+    {
+      return this->allocator();
+    }
+
+    ~b_tree() {
+      if(detail::skips_teardown<Allocator, T>::value) {
+        return;
+      }
+      clear();
+    }
+};
+
+template <typename T, typename Allocator, size_t NodeBytes>
+const size_t b_tree<T, Allocator, NodeBytes>::leaf_capacity;
+
+template <typename T, typename Allocator, size_t NodeBytes>
+const size_t b_tree<T, Allocator, NodeBytes>::inner_capacity;
+
+template <typename T, typename Allocator, size_t NodeBytes>
+const size_t b_tree<T, Allocator, NodeBytes>::leaf_min;
+
+template <typename T, typename Allocator, size_t NodeBytes>
+const size_t b_tree<T, Allocator, NodeBytes>::inner_min;
+
+}
+
+#endif
@@ -0,0 +1,998 @@
+/**
+ *  benchmarks.cpp
+ *  Google Benchmark suite comparing the mqs containers against their standard library counterparts.
+ *
+ *  Build and run with `make bench`, which writes the results to benchmarks.json so runs from different commits can
+ *  be diffed. Every benchmark is registered once per container, element type, size and key order: the first
+ *  argument is the number of elements and the second is 1 for keys in sorted order and 0 for keys in random order.
+ *  Use `make bench BENCHFLAGS=--benchmark_filter=<regex>` to run a subset.
+ *
+ *  @author Marquess Valdez
+ *  @version 1.0
+ */
+#include "b_tree.hpp"
+#include "concurrent_tree.hpp"
+#include "flat_file.hpp"
+#include "frozen_set.hpp"
+#include "parallel.hpp"
+#include "persistent_tree.hpp"
+#include "red_black_map.hpp"
+#include "red_black_tree.hpp"
+#include "vector.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <numeric>
+#include <random>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include <benchmark/benchmark.h>
+
+// Largest number of elements for containers of arithmetic types.
+#ifndef MQS_BENCH_MAX_SIZE
+#define MQS_BENCH_MAX_SIZE 100000000
+#endif
+
+// Largest number of std::string elements. Each one is a separate heap allocation past the small string buffer.
+#ifndef MQS_BENCH_MAX_STRING_SIZE
+#define MQS_BENCH_MAX_STRING_SIZE 1000000
+#endif
+
+// Largest tree. A node costs around 50 bytes with malloc overhead, so 10^8 nodes needs more memory than most
+// machines have to build both the tree under test and its keys.
+#ifndef MQS_BENCH_MAX_TREE_SIZE
+#define MQS_BENCH_MAX_TREE_SIZE 10000000
+#endif
+
+namespace
+{
+
+  /**
+   *  Converts a key index to an element. Indices are spread out so that strings do not share long prefixes, and the
+   *  mapping is strictly increasing so that sorted indices make sorted elements.
+   */
+  template <typename T>
+  T make_key(uint64_t i)
+  {
+    return static_cast<T>(i * 2 + 1);
+  }
+
+  template <>
+  std::string make_key<std::string>(uint64_t i)
+  {
+    char buf[24];
+    std::snprintf(buf, sizeof(buf), "key-%016llx", static_cast<unsigned long long>(i * 2 + 1));
+    return buf;
+  }
+
+  /**
+   *  Returns n distinct keys, in increasing order if sorted and in a fixed pseudo-random order otherwise. The most
+   *  recent set of keys for each type is kept, since Google Benchmark calls each benchmark several times while it
+   *  settles on an iteration count and shuffling 10^8 keys is not free.
+   */
+  template <typename T>
+  const std::vector<T>& keys(size_t n, bool sorted)
+  {
+    static std::vector<T> cached;
+    static bool cached_sorted = false;
+    if(cached.size() != n || cached_sorted != sorted) {
+      std::vector<T>().swap(cached);
+      cached.reserve(n);
+      for(size_t i = 0; i < n; i++) {
+        cached.push_back(make_key<T>(i));
+      }
+      if(!sorted) {
+        std::shuffle(cached.begin(), cached.end(), std::mt19937_64(n));
+      }
+      cached_sorted = sorted;
+    }
+    return cached;
+  }
+
+  // A key that is never returned by keys(), for lookups that have to scan everything.
+  template <typename T>
+  T missing_key()
+  {
+    return static_cast<T>(0);
+  }
+
+  template <>
+  std::string missing_key<std::string>()
+  {
+    return "key-missing";
+  }
+
+  /**
+   *  Registers sizes 10^2, 10^3, ... up to max, each with random and sorted keys.
+   */
+  void sizes(benchmark::internal::Benchmark* b, int64_t max)
+  {
+    b->ArgNames({"n", "sorted"});
+    for(int64_t n = 100; n <= max; n *= 10) {
+      b->Args({n, 0});
+      b->Args({n, 1});
+    }
+  }
+
+  template <typename T>
+  void element_sizes(benchmark::internal::Benchmark* b)
+  {
+    sizes(b, std::is_same<T, std::string>::value ? MQS_BENCH_MAX_STRING_SIZE : MQS_BENCH_MAX_SIZE);
+  }
+
+  template <typename T>
+  void tree_sizes(benchmark::internal::Benchmark* b)
+  {
+    sizes(b, std::min<int64_t>(std::is_same<T, std::string>::value ? MQS_BENCH_MAX_STRING_SIZE : MQS_BENCH_MAX_SIZE,
+                               MQS_BENCH_MAX_TREE_SIZE));
+  }
+
+  // The containers spell a few operations differently, these put them behind one name.
+
+  template <typename T>
+  void insert_at(std::vector<T>& v, size_t i, const T& t)
+  {
+    v.insert(v.begin() + i, t);
+  }
+
+  template <typename T>
+  void insert_at(mqs::Vector<T>& v, size_t i, const T& t)
+  {
+    v.insert(i, t);
+  }
+
+  template <typename T>
+  void remove_at(std::vector<T>& v, size_t i)
+  {
+    v.erase(v.begin() + i);
+  }
+
+  template <typename T>
+  void remove_at(mqs::Vector<T>& v, size_t i)
+  {
+    v.remove(i);
+  }
+
+  template <typename T>
+  void remove_back(std::vector<T>& v)
+  {
+    v.pop_back();
+  }
+
+  template <typename T>
+  void remove_back(mqs::Vector<T>& v)
+  {
+    v.pop();
+  }
+
+  template <typename T>
+  size_t find_in(const std::vector<T>& v, const T& t)
+  {
+    return std::find(v.begin(), v.end(), t) - v.begin();
+  }
+
+  template <typename T>
+  size_t find_in(const mqs::Vector<T>& v, const T& t)
+  {
+    return v.find(t);
+  }
+
+  template <typename T>
+  bool tree_find(std::set<T>& s, const T& t)
+  {
+    return s.find(t) != s.end();
+  }
+
+  template <typename T, typename A, typename L, typename G, typename S>
+  bool tree_find(mqs::red_black_tree<T, A, L, G, S>& s, const T& t)
+  {
+    return s.find(t);
+  }
+
+  // Fills an empty tree with the whole range at once.
+  template <typename T, typename A, size_t N>
+  bool tree_find(mqs::b_tree<T, A, N>& s, const T& t)
+  {
+    return s.find(t);
+  }
+
+  template <typename T, typename A>
+  bool tree_find(mqs::persistent_red_black_tree<T, A>& s, const T& t)
+  {
+    return s.find(t);
+  }
+
+  template <typename T>
+  void tree_build(std::set<T>& s, const std::vector<T>& k)
+  {
+    s.insert(k.begin(), k.end());
+  }
+
+  template <typename T, typename A, typename L, typename G, typename S>
+  void tree_build(mqs::red_black_tree<T, A, L, G, S>& s, const std::vector<T>& k)
+  {
+    s.assign(k.begin(), k.end());
+  }
+
+  template <typename T>
+  bool tree_remove(std::set<T>& s, const T& t)
+  {
+    return s.erase(t) == 1;
+  }
+
+  template <typename T, typename A, typename L, typename G, typename S>
+  bool tree_remove(mqs::red_black_tree<T, A, L, G, S>& s, const T& t)
+  {
+    return s.remove(t);
+  }
+
+  template <typename T, typename A, size_t N>
+  bool tree_remove(mqs::b_tree<T, A, N>& s, const T& t)
+  {
+    return s.remove(t);
+  }
+
+  template <typename T, typename A>
+  bool tree_remove(mqs::persistent_red_black_tree<T, A>& s, const T& t)
+  {
+    return s.remove(t);
+  }
+
+  template <typename T>
+  std::vector<T> tree_dump(std::set<T>& s)
+  {
+    return std::vector<T>(s.begin(), s.end());
+  }
+
+  template <typename T, typename A, typename L, typename G, typename S>
+  std::vector<std::pair<T, bool>> tree_dump(mqs::red_black_tree<T, A, L, G, S>& s)
+  {
+    return s.dump();
+  }
+
+  template <typename T>
+  size_t tree_scan(std::set<T>& s, const T& lo, const T& hi)
+  {
+    size_t visited = 0;
+    for(typename std::set<T>::const_iterator it = s.lower_bound(lo); it != s.end() && *it < hi; ++it) {
+      benchmark::DoNotOptimize(*it);
+      visited++;
+    }
+    return visited;
+  }
+
+  template <typename T, typename A, typename L, typename G, typename S>
+  size_t tree_scan(mqs::red_black_tree<T, A, L, G, S>& s, const T& lo, const T& hi)
+  {
+    return s.visit_range(lo, hi, [](const T& t) { benchmark::DoNotOptimize(t); });
+  }
+
+  template <typename T, typename A, size_t N>
+  size_t tree_scan(mqs::b_tree<T, A, N>& s, const T& lo, const T& hi)
+  {
+    return s.visit_range(lo, hi, [](const T& t) { benchmark::DoNotOptimize(t); });
+  }
+
+  template <typename Container, typename T>
+  void fill(Container& c, const std::vector<T>& k)
+  {
+    for(const T& t : k) {
+      c.push_back(t);
+    }
+  }
+
+  template <typename Tree, typename T>
+  void fill_tree(Tree& tree, const std::vector<T>& k)
+  {
+    for(const T& t : k) {
+      tree.insert(t);
+    }
+  }
+
+  // Vector
+
+  template <typename Container, typename T>
+  void BM_VectorPushBack(benchmark::State& state)
+  {
+    const std::vector<T>& k = keys<T>(state.range(0), state.range(1));
+    for(auto _ : state) {
+      Container c;
+      fill(c, k);
+      benchmark::DoNotOptimize(c.data());
+    }
+    state.SetItemsProcessed(state.iterations() * k.size());
+  }
+
+  // The same as BM_VectorPushBack with the final capacity reserved up front, so the difference is the cost of growth.
+  template <typename Container, typename T>
+  void BM_VectorPushBackReserved(benchmark::State& state)
+  {
+    const std::vector<T>& k = keys<T>(state.range(0), state.range(1));
+    for(auto _ : state) {
+      Container c;
+      c.reserve(k.size());
+      fill(c, k);
+      benchmark::DoNotOptimize(c.data());
+    }
+    state.SetItemsProcessed(state.iterations() * k.size());
+  }
+
+  // One insert at a random position, undone with a removal from the back that costs the same for both containers.
+  template <typename Container, typename T>
+  void BM_VectorInsert(benchmark::State& state)
+  {
+    const std::vector<T>& k = keys<T>(state.range(0), state.range(1));
+    Container c;
+    fill(c, k);
+    std::mt19937_64 rng(1);
+    for(auto _ : state) {
+      insert_at(c, rng() % c.size(), k[0]);
+      remove_back(c);
+    }
+    state.SetItemsProcessed(state.iterations());
+  }
+
+  // One removal from a random position, undone with an append that costs the same for both containers.
+  template <typename Container, typename T>
+  void BM_VectorRemove(benchmark::State& state)
+  {
+    const std::vector<T>& k = keys<T>(state.range(0), state.range(1));
+    Container c;
+    fill(c, k);
+    std::mt19937_64 rng(1);
+    for(auto _ : state) {
+      remove_at(c, rng() % c.size());
+      c.push_back(k[0]);
+    }
+    state.SetItemsProcessed(state.iterations());
+  }
+
+  // Looks for a key that is not there, so every lookup scans all n elements.
+  template <typename Container, typename T>
+  void BM_VectorFind(benchmark::State& state)
+  {
+    const std::vector<T>& k = keys<T>(state.range(0), state.range(1));
+    Container c;
+    fill(c, k);
+    const T missing = missing_key<T>();
+    for(auto _ : state) {
+      benchmark::DoNotOptimize(find_in(c, missing));
+    }
+    state.SetItemsProcessed(state.iterations() * k.size());
+    state.SetBytesProcessed(state.iterations() * k.size() * sizeof(T));
+  }
+
+  // BM_VectorFind for mqs::Vector with a plain loop, the baseline for the vectorized Vector::find.
+  template <typename T>
+  void BM_VectorFindScalar(benchmark::State& state)
+  {
+    const std::vector<T>& k = keys<T>(state.range(0), state.range(1));
+    mqs::Vector<T> c;
+    fill(c, k);
+    const T missing = missing_key<T>();
+    for(auto _ : state) {
+      size_t i = 0;
+      while(i < c.size() && !(c[i] == missing)) {
+        benchmark::DoNotOptimize(i++); // Keeps the compiler from vectorizing the loop on its own.
+      }
+      benchmark::DoNotOptimize(i);
+    }
+    state.SetItemsProcessed(state.iterations() * k.size());
+    state.SetBytesProcessed(state.iterations() * k.size() * sizeof(T));
+  }
+
+  // Trees
+
+  template <typename Tree, typename T>
+  void BM_TreeInsert(benchmark::State& state)
+  {
+    const std::vector<T>& k = keys<T>(state.range(0), state.range(1));
+    for(auto _ : state) {
+      Tree* tree = new Tree();
+      fill_tree(*tree, k);
+      state.PauseTiming();
+      delete tree;
+      state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * k.size());
+  }
+
+  // Builds the tree from all keys in one call, which a sorted range turns into a linear pass.
+  template <typename Tree, typename T>
+  void BM_TreeBuild(benchmark::State& state)
+  {
+    const std::vector<T>& k = keys<T>(state.range(0), state.range(1));
+    for(auto _ : state) {
+      Tree* tree = new Tree();
+      tree_build(*tree, k);
+      state.PauseTiming();
+      delete tree;
+      state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * k.size());
+  }
+
+  // Removes every key, in the same order they were inserted in.
+  template <typename Tree, typename T>
+  void BM_TreeRemove(benchmark::State& state)
+  {
+    const std::vector<T>& k = keys<T>(state.range(0), state.range(1));
+    for(auto _ : state) {
+      state.PauseTiming();
+      Tree tree;
+      fill_tree(tree, k);
+      state.ResumeTiming();
+      for(const T& t : k) {
+        benchmark::DoNotOptimize(tree_remove(tree, t));
+      }
+    }
+    state.SetItemsProcessed(state.iterations() * k.size());
+  }
+
+  // Looks up keys that are present, in the order they were inserted in.
+  template <typename Tree, typename T>
+  void BM_TreeFind(benchmark::State& state)
+  {
+    const std::vector<T>& k = keys<T>(state.range(0), state.range(1));
+    Tree tree;
+    fill_tree(tree, k);
+    size_t i = 0;
+    for(auto _ : state) {
+      benchmark::DoNotOptimize(tree_find(tree, k[i]));
+      if(++i == k.size()) {
+        i = 0;
+      }
+    }
+    state.SetItemsProcessed(state.iterations());
+  }
+
+  // Maps
+
+  // A string's characters and length, the way keys arrive from a parser or the network, comparable with std::string
+  // without copying. std::string_view does this from C++17 on.
+  struct string_ref
+  {
+    const char* data;
+    size_t size;
+  };
+
+  // Compares the first a_size characters at a with the first b_size at b, like std::string::compare().
+  int compare(const char* a, size_t a_size, const char* b, size_t b_size)
+  {
+    int c = std::memcmp(a, b, std::min(a_size, b_size));
+    return c != 0 ? c : (a_size < b_size ? -1 : (a_size > b_size ? 1 : 0));
+  }
+
+  bool operator<(const std::string& a, const string_ref& b)
+  {
+    return compare(a.data(), a.size(), b.data, b.size) < 0;
+  }
+
+  bool operator<(const string_ref& a, const std::string& b)
+  {
+    return compare(a.data, a.size, b.data(), b.size()) < 0;
+  }
+
+  template <typename T>
+  bool map_find(std::map<std::string, T>& m, const string_ref& k)
+  {
+    return m.find(std::string(k.data, k.size)) != m.end(); // Has to build a key first.
+  }
+
+  template <typename T, typename C, typename A, typename L>
+  bool map_find(mqs::red_black_map<std::string, T, C, A, L>& m, const string_ref& k)
+  {
+    return m.find(k) != m.end();
+  }
+
+  template <typename T, typename A, typename L>
+  bool map_find(mqs::red_black_map<std::string, T, std::less<std::string>, A, L>& m, const string_ref& k)
+  {
+    return m.find(std::string(k.data, k.size)) != m.end();
+  }
+
+  // Looks up string keys given as a string_ref. Without a transparent comparator every probe builds a std::string.
+  template <typename Map>
+  void BM_MapFindRef(benchmark::State& state)
+  {
+    const std::vector<std::string>& k = keys<std::string>(state.range(0), state.range(1));
+    Map map;
+    for(const std::string& s : k) {
+      map[s] = 0;
+    }
+    size_t i = 0;
+    for(auto _ : state) {
+      benchmark::DoNotOptimize(map_find(map, string_ref{k[i].data(), k[i].size()}));
+      if(++i == k.size()) {
+        i = 0;
+      }
+    }
+    state.SetItemsProcessed(state.iterations());
+  }
+
+  // Visits the 100 keys following a key that is present. Keys are odd numbers, so [k, k + 200) holds 100 of them.
+  template <typename Tree, typename T>
+  void BM_TreeRange(benchmark::State& state)
+  {
+    const std::vector<T>& k = keys<T>(state.range(0), state.range(1));
+    Tree tree;
+    fill_tree(tree, k);
+    size_t i = 0, visited = 0;
+    for(auto _ : state) {
+      visited += tree_scan(tree, k[i], static_cast<T>(k[i] + 200));
+      if(++i == k.size()) {
+        i = 0;
+      }
+    }
+    state.SetItemsProcessed(visited);
+  }
+
+  template <typename Tree, typename T>
+  void BM_TreeDump(benchmark::State& state)
+  {
+    const std::vector<T>& k = keys<T>(state.range(0), state.range(1));
+    Tree tree;
+    fill_tree(tree, k);
+    for(auto _ : state) {
+      benchmark::DoNotOptimize(tree_dump(tree).data());
+    }
+    state.SetItemsProcessed(state.iterations() * k.size());
+  }
+
+  // Concurrent trees
+
+  // Finds keys from every benchmark thread at once, lock-free or through read(), which holds the lock shared.
+  template <bool Locked>
+  void BM_ConcurrentFind(benchmark::State& state)
+  {
+    static mqs::concurrent_red_black_tree<int>* tree;
+    const std::vector<int>& k = keys<int>(state.range(0), state.range(1));
+    if(state.thread_index() == 0) {
+      tree = new mqs::concurrent_red_black_tree<int>();
+      for(int x : k) {
+        tree->insert(x);
+      }
+    }
+    size_t i = state.thread_index() * 7919 % k.size();
+    for(auto _ : state) {
+      if(Locked) {
+        const int key = k[i];
+        benchmark::DoNotOptimize(tree->read([key](const mqs::red_black_tree<int>& t) { return t.find(key); }));
+      } else {
+        benchmark::DoNotOptimize(tree->find(k[i]));
+      }
+      if(++i == k.size()) {
+        i = 0;
+      }
+    }
+    state.SetItemsProcessed(state.iterations());
+    if(state.thread_index() == 0) {
+      delete tree;
+    }
+  }
+
+  // Fills a tree with the keys in batches of 1000, with insert_batch() or, if Batch is false, one insert() per key.
+  // With sorted keys every batch is appended after the last.
+  template <bool Batch>
+  void BM_TreeInsertBatch(benchmark::State& state)
+  {
+    const std::vector<int>& k = keys<int>(state.range(0), state.range(1));
+    for(auto _ : state) {
+      mqs::red_black_tree<int>* tree = new mqs::red_black_tree<int>();
+      for(size_t i = 0; i < k.size(); i += 1000) {
+        std::vector<int>::const_iterator first = k.begin() + i, last = k.begin() + std::min(k.size(), i + 1000);
+        if(Batch) {
+          tree->insert_batch(first, last);
+        } else {
+          for(; first != last; ++first) {
+            tree->insert(*first);
+          }
+        }
+      }
+      state.PauseTiming();
+      delete tree;
+      state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * k.size());
+  }
+
+  // Finds keys from every benchmark thread at once while the tree's versions are shared, taking a new snapshot for
+  // every lookup, so the cost of getting a version shows up in full.
+  void BM_VersionedFind(benchmark::State& state)
+  {
+    static mqs::versioned_red_black_tree<int>* tree;
+    const std::vector<int>& k = keys<int>(state.range(0), state.range(1));
+    if(state.thread_index() == 0) {
+      tree = new mqs::versioned_red_black_tree<int>();
+      tree->write([&k](mqs::persistent_red_black_tree<int>& t) {
+        for(int x : k) {
+          t.insert(x);
+        }
+      });
+    }
+    size_t i = state.thread_index() * 7919 % k.size();
+    for(auto _ : state) {
+      benchmark::DoNotOptimize(tree->snapshot().find(k[i]));
+      if(++i == k.size()) {
+        i = 0;
+      }
+    }
+    state.SetItemsProcessed(state.iterations());
+    if(state.thread_index() == 0) {
+      delete tree;
+    }
+  }
+
+  // Finds keys in a set served from a mapping of a file saved from a red_black_tree, with or without its index.
+  template <bool Index>
+  void BM_MappedSetFind(benchmark::State& state)
+  {
+    const std::vector<int>& k = keys<int>(state.range(0), state.range(1));
+    const std::string path = "/tmp/mqs_bench_mapped_set";
+    {
+      mqs::red_black_tree<int> tree;
+      fill_tree(tree, k);
+      mqs::save(tree, path, Index);
+    }
+    mqs::mapped_set<int> set(path);
+    size_t i = 0;
+    for(auto _ : state) {
+      benchmark::DoNotOptimize(set.find(k[i]));
+      if(++i == k.size()) {
+        i = 0;
+      }
+    }
+    state.SetItemsProcessed(state.iterations());
+    std::remove(path.c_str());
+  }
+
+  // Rebuilds a tree from a saved file, which the page cache holds after the first run.
+  void BM_TreeLoad(benchmark::State& state)
+  {
+    const std::vector<int>& k = keys<int>(state.range(0), state.range(1));
+    const std::string path = "/tmp/mqs_bench_tree_load";
+    {
+      mqs::red_black_tree<int> tree;
+      fill_tree(tree, k);
+      mqs::save(tree, path);
+    }
+    for(auto _ : state) {
+      mqs::red_black_tree<int> tree;
+      mqs::load(path, tree);
+      benchmark::DoNotOptimize(tree.size());
+    }
+    state.SetItemsProcessed(state.iterations() * k.size());
+    std::remove(path.c_str());
+  }
+
+  // Finds keys one at a time in a set frozen from a red_black_tree.
+  template <typename T>
+  void BM_FrozenFind(benchmark::State& state)
+  {
+    const std::vector<T>& k = keys<T>(state.range(0), state.range(1));
+    mqs::red_black_tree<T> tree;
+    fill_tree(tree, k);
+    mqs::frozen_set<T> set = mqs::freeze(tree);
+    size_t i = 0;
+    for(auto _ : state) {
+      benchmark::DoNotOptimize(set.find(k[i]));
+      if(++i == k.size()) {
+        i = 0;
+      }
+    }
+    state.SetItemsProcessed(state.iterations());
+  }
+
+  // Finds every key with one batched lookup, whose searches overlap their cache misses.
+  template <typename T>
+  void BM_FrozenFindBatch(benchmark::State& state)
+  {
+    const std::vector<T>& k = keys<T>(state.range(0), state.range(1));
+    mqs::red_black_tree<T> tree;
+    fill_tree(tree, k);
+    mqs::frozen_set<T> set = mqs::freeze(tree);
+    std::vector<char> found(k.size());
+    for(auto _ : state) {
+      set.find_batch(k.begin(), k.end(), found.begin());
+      benchmark::DoNotOptimize(found.data());
+    }
+    state.SetItemsProcessed(state.iterations() * k.size());
+  }
+
+  // Finds the intervals containing random points among n short intervals, with an interval_tree's stabbing query
+  // or, for comparison, a scan over all of them.
+  template <bool Tree>
+  void BM_IntervalStab(benchmark::State& state)
+  {
+    typedef std::pair<int, int> interval;
+    const std::vector<int>& k = keys<int>(state.range(0), state.range(1));
+    std::vector<interval> intervals;
+    for(int x : k) {
+      intervals.push_back(interval(x, x + x % 64));
+    }
+    std::sort(intervals.begin(), intervals.end());
+    intervals.erase(std::unique(intervals.begin(), intervals.end()), intervals.end());
+    mqs::interval_tree<interval> tree(mqs::sorted_unique, intervals.begin(), intervals.end());
+    size_t i = 0, found = 0;
+    for(auto _ : state) {
+      if(Tree) {
+        found += tree.visit_containing(k[i], [](const interval&) {});
+      } else {
+        for(const interval& x : intervals) {
+          found += (x.first <= k[i] && k[i] <= x.second);
+        }
+      }
+      if(++i == k.size()) {
+        i = 0;
+      }
+    }
+    benchmark::DoNotOptimize(found);
+    state.SetItemsProcessed(state.iterations());
+  }
+
+  // Merges a tree of n/ratio keys, half of them new, into a tree of n keys. The third argument is the ratio and
+  // the fourth the number of threads unite() runs on, where 0 means inserting the keys one at a time instead.
+  void BM_TreeUnite(benchmark::State& state)
+  {
+    const std::vector<int>& k = keys<int>(state.range(0), false);
+    const size_t small = k.size() / state.range(2);
+    const size_t threads = state.range(3);
+    mqs::thread_pool pool(threads ? threads : 1);
+    mqs::red_black_tree<int> other;
+    for(size_t i = 0; i < small; i++) {
+      other.insert(i % 2 ? k[i] : k[i] + 1);
+    }
+    for(auto _ : state) {
+      state.PauseTiming();
+      mqs::red_black_tree<int>* tree = new mqs::red_black_tree<int>();
+      tree_build(*tree, k);
+      state.ResumeTiming();
+      if(threads) {
+        tree->unite(other, pool);
+      } else {
+        for(int x : other) {
+          tree->insert(x);
+        }
+      }
+      state.PauseTiming();
+      delete tree;
+      state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * small);
+  }
+
+  void unite_sizes(benchmark::internal::Benchmark* b)
+  {
+    b->ArgNames({"n", "sorted", "ratio", "threads"});
+    for(int64_t n = 100000; n <= MQS_BENCH_MAX_TREE_SIZE; n *= 10) {
+      for(int64_t ratio : {1, 100}) {
+        for(int64_t threads : {0, 1, 4}) {
+          b->Args({n, 0, ratio, threads});
+        }
+      }
+    }
+  }
+
+  // Parallel algorithms
+
+  // Sorts n random keys with the given number of threads, the third argument. 0 threads means std::sort.
+  template <typename T>
+  void BM_ParallelSort(benchmark::State& state)
+  {
+    const std::vector<T>& k = keys<T>(state.range(0), false);
+    const size_t threads = state.range(2);
+    mqs::thread_pool pool(threads ? threads : 1);
+    mqs::Vector<T> v;
+    v.reserve(k.size());
+    for(auto _ : state) {
+      state.PauseTiming();
+      v.clear();
+      fill(v, k);
+      state.ResumeTiming();
+      if(threads) {
+        mqs::parallel::sort(pool, v.begin(), v.end(), std::less<T>());
+      } else {
+        std::sort(v.begin(), v.end());
+      }
+      benchmark::DoNotOptimize(v.data());
+    }
+    state.SetItemsProcessed(state.iterations() * k.size());
+  }
+
+  // Applies an affine function to n random keys into a second buffer. 0 threads means std::transform.
+  template <typename T>
+  void BM_ParallelTransform(benchmark::State& state)
+  {
+    const std::vector<T>& k = keys<T>(state.range(0), false);
+    const size_t threads = state.range(2);
+    mqs::thread_pool pool(threads ? threads : 1);
+    std::vector<T> out(k.size());
+    auto f = [](const T& t) { return t * 3 + 1; };
+    for(auto _ : state) {
+      if(threads) {
+        mqs::parallel::transform(pool, k.begin(), k.end(), out.begin(), f);
+      } else {
+        std::transform(k.begin(), k.end(), out.begin(), f);
+      }
+      benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * k.size());
+  }
+
+  // Adds one to each of n random keys in place. 0 threads means std::for_each.
+  template <typename T>
+  void BM_ParallelForEach(benchmark::State& state)
+  {
+    std::vector<T> v = keys<T>(state.range(0), false);
+    const size_t threads = state.range(2);
+    mqs::thread_pool pool(threads ? threads : 1);
+    auto f = [](T& t) { t += 1; };
+    for(auto _ : state) {
+      if(threads) {
+        mqs::parallel::for_each(pool, v.begin(), v.end(), f);
+      } else {
+        std::for_each(v.begin(), v.end(), f);
+      }
+      benchmark::DoNotOptimize(v.data());
+    }
+    state.SetItemsProcessed(state.iterations() * v.size());
+  }
+
+  // Sums n random keys. 0 threads means std::accumulate.
+  template <typename T>
+  void BM_ParallelReduce(benchmark::State& state)
+  {
+    const std::vector<T>& k = keys<T>(state.range(0), false);
+    const size_t threads = state.range(2);
+    mqs::thread_pool pool(threads ? threads : 1);
+    for(auto _ : state) {
+      T sum;
+      if(threads) {
+        sum = mqs::parallel::reduce(pool, k.begin(), k.end(), T(), std::plus<T>());
+      } else {
+        sum = std::accumulate(k.begin(), k.end(), T(), std::plus<T>());
+      }
+      benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * k.size());
+  }
+
+  // Prefix sums of n random keys into a second buffer. 0 threads means std::partial_sum.
+  template <typename T>
+  void BM_ParallelInclusiveScan(benchmark::State& state)
+  {
+    const std::vector<T>& k = keys<T>(state.range(0), false);
+    const size_t threads = state.range(2);
+    mqs::thread_pool pool(threads ? threads : 1);
+    std::vector<T> out(k.size());
+    for(auto _ : state) {
+      if(threads) {
+        mqs::parallel::inclusive_scan(pool, k.begin(), k.end(), out.begin(), std::plus<T>());
+      } else {
+        std::partial_sum(k.begin(), k.end(), out.begin(), std::plus<T>());
+      }
+      benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * k.size());
+  }
+
+  void parallel_sizes(benchmark::internal::Benchmark* b)
+  {
+    b->ArgNames({"n", "sorted", "threads"});
+    for(int64_t n = 100000; n <= MQS_BENCH_MAX_SIZE; n *= 10) {
+      for(int64_t threads : {0, 1, 2, 4, 8, 16}) {
+        b->Args({n, 0, threads});
+      }
+    }
+  }
+
+}
+
+#define MQS_VECTOR_BENCHMARKS(T)                                                                                     \
+  BENCHMARK_TEMPLATE(BM_VectorPushBack, std::vector<T>, T)->Apply(element_sizes<T>);                                 \
+  BENCHMARK_TEMPLATE(BM_VectorPushBack, mqs::Vector<T>, T)->Apply(element_sizes<T>);                                 \
+  BENCHMARK_TEMPLATE(BM_VectorPushBackReserved, std::vector<T>, T)->Apply(element_sizes<T>);                         \
+  BENCHMARK_TEMPLATE(BM_VectorPushBackReserved, mqs::Vector<T>, T)->Apply(element_sizes<T>);                         \
+  BENCHMARK_TEMPLATE(BM_VectorInsert, std::vector<T>, T)->Apply(element_sizes<T>);                                   \
+  BENCHMARK_TEMPLATE(BM_VectorInsert, mqs::Vector<T>, T)->Apply(element_sizes<T>);                                   \
+  BENCHMARK_TEMPLATE(BM_VectorRemove, std::vector<T>, T)->Apply(element_sizes<T>);                                   \
+  BENCHMARK_TEMPLATE(BM_VectorRemove, mqs::Vector<T>, T)->Apply(element_sizes<T>);                                   \
+  BENCHMARK_TEMPLATE(BM_VectorFind, std::vector<T>, T)->Apply(element_sizes<T>);                                     \
+  BENCHMARK_TEMPLATE(BM_VectorFind, mqs::Vector<T>, T)->Apply(element_sizes<T>);                                     \
+  BENCHMARK_TEMPLATE(BM_VectorFindScalar, T)->Apply(element_sizes<T>)
+
+#define MQS_TREE_BENCHMARKS(T)                                                                                       \
+  BENCHMARK_TEMPLATE(BM_TreeInsert, std::set<T>, T)->Apply(tree_sizes<T>);                                           \
+  BENCHMARK_TEMPLATE(BM_TreeInsert, mqs::red_black_tree<T>, T)->Apply(tree_sizes<T>);                                \
+  BENCHMARK_TEMPLATE(BM_TreeBuild, std::set<T>, T)->Apply(tree_sizes<T>);                                            \
+  BENCHMARK_TEMPLATE(BM_TreeBuild, mqs::red_black_tree<T>, T)->Apply(tree_sizes<T>);                                 \
+  BENCHMARK_TEMPLATE(BM_TreeRemove, std::set<T>, T)->Apply(tree_sizes<T>);                                           \
+  BENCHMARK_TEMPLATE(BM_TreeRemove, mqs::red_black_tree<T>, T)->Apply(tree_sizes<T>);                                \
+  BENCHMARK_TEMPLATE(BM_TreeFind, std::set<T>, T)->Apply(tree_sizes<T>);                                             \
+  BENCHMARK_TEMPLATE(BM_TreeFind, mqs::red_black_tree<T>, T)->Apply(tree_sizes<T>);                                  \
+  BENCHMARK_TEMPLATE(BM_TreeDump, std::set<T>, T)->Apply(tree_sizes<T>);                                             \
+  BENCHMARK_TEMPLATE(BM_TreeDump, mqs::red_black_tree<T>, T)->Apply(tree_sizes<T>)
+
+MQS_VECTOR_BENCHMARKS(int);
+MQS_VECTOR_BENCHMARKS(double);
+MQS_VECTOR_BENCHMARKS(std::string);
+
+MQS_TREE_BENCHMARKS(int);
+MQS_TREE_BENCHMARKS(uint64_t);
+MQS_TREE_BENCHMARKS(std::string);
+
+BENCHMARK_TEMPLATE(BM_TreeRange, std::set<int>, int)->Apply(tree_sizes<int>);
+BENCHMARK_TEMPLATE(BM_TreeRange, mqs::red_black_tree<int>, int)->Apply(tree_sizes<int>);
+
+// A B+ tree with the same interface, whose 256-byte nodes hold dozens of keys each.
+#define MQS_B_TREE_BENCHMARKS(T)                                                                                     \
+  BENCHMARK_TEMPLATE(BM_TreeInsert, mqs::b_tree<T>, T)->Apply(tree_sizes<T>);                                        \
+  BENCHMARK_TEMPLATE(BM_TreeRemove, mqs::b_tree<T>, T)->Apply(tree_sizes<T>);                                        \
+  BENCHMARK_TEMPLATE(BM_TreeFind, mqs::b_tree<T>, T)->Apply(tree_sizes<T>)
+
+MQS_B_TREE_BENCHMARKS(int);
+MQS_B_TREE_BENCHMARKS(uint64_t);
+MQS_B_TREE_BENCHMARKS(std::string);
+BENCHMARK_TEMPLATE(BM_TreeRange, mqs::b_tree<int>, int)->Apply(tree_sizes<int>);
+
+// The persistent tree, whose updates copy the path they change, and its lock-free snapshots.
+BENCHMARK_TEMPLATE(BM_TreeInsert, mqs::persistent_red_black_tree<int>, int)->Apply(tree_sizes<int>);
+BENCHMARK_TEMPLATE(BM_TreeRemove, mqs::persistent_red_black_tree<int>, int)->Apply(tree_sizes<int>);
+BENCHMARK_TEMPLATE(BM_TreeFind, mqs::persistent_red_black_tree<int>, int)->Apply(tree_sizes<int>);
+BENCHMARK(BM_VersionedFind)->Apply(tree_sizes<int>)->ThreadRange(1, 8)->UseRealTime();
+
+// Sets and trees saved to flat files, searched straight from the mapping or rebuilt from it.
+BENCHMARK_TEMPLATE(BM_MappedSetFind, true)->Apply(tree_sizes<int>);
+BENCHMARK_TEMPLATE(BM_MappedSetFind, false)->Apply(tree_sizes<int>);
+BENCHMARK(BM_TreeLoad)->Apply(tree_sizes<int>);
+
+// Stabbing queries on intervals, through the max endpoint augmentation and by scanning.
+BENCHMARK_TEMPLATE(BM_IntervalStab, true)->Apply(tree_sizes<int>);
+BENCHMARK_TEMPLATE(BM_IntervalStab, false)->Apply(tree_sizes<int>);
+
+// Sets frozen into a static B-tree layout, searched one key at a time and in batches.
+BENCHMARK_TEMPLATE(BM_FrozenFind, int)->Apply(tree_sizes<int>);
+BENCHMARK_TEMPLATE(BM_FrozenFind, uint64_t)->Apply(tree_sizes<uint64_t>);
+BENCHMARK_TEMPLATE(BM_FrozenFind, std::string)->Apply(tree_sizes<std::string>);
+BENCHMARK_TEMPLATE(BM_FrozenFindBatch, int)->Apply(tree_sizes<int>);
+BENCHMARK_TEMPLATE(BM_FrozenFindBatch, uint64_t)->Apply(tree_sizes<uint64_t>);
+
+// The same tree with 32-bit index links, for comparing node layouts.
+BENCHMARK_TEMPLATE(BM_TreeInsert, mqs::red_black_index_tree<int>, int)->Apply(tree_sizes<int>);
+BENCHMARK_TEMPLATE(BM_TreeRemove, mqs::red_black_index_tree<int>, int)->Apply(tree_sizes<int>);
+BENCHMARK_TEMPLATE(BM_TreeFind, mqs::red_black_index_tree<int>, int)->Apply(tree_sizes<int>);
+BENCHMARK_TEMPLATE(BM_TreeRange, mqs::red_black_index_tree<int>, int)->Apply(tree_sizes<int>);
+
+// Subtree sizes cost a walk to the root on every update.
+BENCHMARK_TEMPLATE(BM_TreeInsert, mqs::order_statistic_tree<int>, int)->Apply(tree_sizes<int>);
+BENCHMARK_TEMPLATE(BM_TreeRemove, mqs::order_statistic_tree<int>, int)->Apply(tree_sizes<int>);
+
+BENCHMARK_TEMPLATE(BM_MapFindRef, std::map<std::string, int>)->Apply(tree_sizes<std::string>);
+BENCHMARK_TEMPLATE(BM_MapFindRef, mqs::red_black_map<std::string, int>)->Apply(tree_sizes<std::string>);
+BENCHMARK_TEMPLATE(BM_MapFindRef, mqs::red_black_map<std::string, int, mqs::transparent_less>)
+  ->Apply(tree_sizes<std::string>);
+
+BENCHMARK_TEMPLATE(BM_ConcurrentFind, false)->Apply(tree_sizes<int>)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_ConcurrentFind, true)->Apply(tree_sizes<int>)->ThreadRange(1, 8)->UseRealTime();
+
+BENCHMARK_TEMPLATE(BM_TreeInsertBatch, false)->Apply(tree_sizes<int>);
+BENCHMARK_TEMPLATE(BM_TreeInsertBatch, true)->Apply(tree_sizes<int>);
+BENCHMARK(BM_TreeUnite)->Apply(unite_sizes)->UseRealTime();
+
+BENCHMARK_TEMPLATE(BM_ParallelSort, int)->Apply(parallel_sizes)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_ParallelSort, double)->Apply(parallel_sizes)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_ParallelTransform, int)->Apply(parallel_sizes)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_ParallelTransform, double)->Apply(parallel_sizes)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_ParallelForEach, int)->Apply(parallel_sizes)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_ParallelForEach, double)->Apply(parallel_sizes)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_ParallelReduce, int)->Apply(parallel_sizes)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_ParallelReduce, double)->Apply(parallel_sizes)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_ParallelInclusiveScan, int)->Apply(parallel_sizes)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_ParallelInclusiveScan, double)->Apply(parallel_sizes)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,321 @@
+/**
+ *  concurrent_tree.hpp
+ *  A red black tree that many threads can read while one thread at a time writes to it.
+ *
+ *  Writers take a reader-writer lock exclusively and bump a sequence counter before and after each change, so the
+ *  counter is odd while the tree is changing. Lookups first try to run without any lock at all, the way a seqlock
+ *  reader does: read the counter, walk the tree, and check the counter again, retrying if a writer got in between.
+ *  Readers then share nothing but a read of the counter, so lookups scale across cores as long as writes are rare.
+ *  A lookup that keeps losing the race falls back to holding the lock shared.
+ *
+ *  @author Marquess Valdez
+ *  @version 1.0
+ */
+#ifndef MQS_CONCURRENT_TREE_HPP
+#define MQS_CONCURRENT_TREE_HPP
+
+#include <atomic>
+#include <cstddef> //for std::size_t
+#include <cstdint> // for std::uint64_t etc.
+#include <mutex>
+#include <system_error> // for std::system_error
+#include <type_traits>
+#include <utility> // for std::declval
+#include "allocator.hpp"
+#include "red_black_tree.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h> // for pthread_rwlock_t
+#define MQS_HAS_PTHREAD_RWLOCK 1
+#else
+#define MQS_HAS_PTHREAD_RWLOCK 0
+#endif
+
+namespace mqs
+{
+
+  namespace detail
+  {
+
+    /**
+     *  A reader-writer lock, since std::shared_mutex needs C++17. Uses pthread_rwlock where there is one, and
+     *  otherwise a plain mutex that lets readers in one at a time.
+     */
+    class rw_lock
+    {
+    private:
+#if MQS_HAS_PTHREAD_RWLOCK
+      pthread_rwlock_t rw;
+#else
+      std::mutex m;
+#endif
+
+    public:
+      rw_lock()
+      {
+#if MQS_HAS_PTHREAD_RWLOCK
+        int error = pthread_rwlock_init(&rw, nullptr);
+        if(error != 0) {
+          throw std::system_error(error, std::system_category(), "mqs::rw_lock: pthread_rwlock_init failed.");
+        }
+#endif
+      }
+
+      rw_lock(const rw_lock&) = delete;
+      rw_lock& operator=(const rw_lock&) = delete;
+
+      ~rw_lock()
+      {
+#if MQS_HAS_PTHREAD_RWLOCK
+        pthread_rwlock_destroy(&rw);
+#endif
+      }
+
+#if MQS_HAS_PTHREAD_RWLOCK
+      void lock() { pthread_rwlock_wrlock(&rw); }
+      void unlock() { pthread_rwlock_unlock(&rw); }
+      void lock_shared() { pthread_rwlock_rdlock(&rw); }
+      void unlock_shared() { pthread_rwlock_unlock(&rw); }
+#else
+      void lock() { m.lock(); }
+      void unlock() { m.unlock(); }
+      void lock_shared() { m.lock(); }
+      void unlock_shared() { m.unlock(); }
+#endif
+    };
+
+    // Loads a word that a writer may be storing to at the same time, as a relaxed atomic so the load isn't torn.
+    template <typename W>
+    W racy_load(const W& w)
+    {
+      return __atomic_load_n(&w, __ATOMIC_RELAXED);
+    }
+
+    // The widest unsigned word, up to 8 bytes, that T's alignment lets racy_copy load in place. sizeof(T) is a
+    // multiple of alignof(T), so T is always a whole number of these.
+    template <typename T>
+    struct racy_word
+    {
+      typedef typename std::conditional<alignof(T) % 8 == 0, std::uint64_t,
+              typename std::conditional<alignof(T) % 4 == 0, std::uint32_t,
+              typename std::conditional<alignof(T) % 2 == 0, std::uint16_t, std::uint8_t>::type>::type>::type type;
+    };
+
+    // Copies a trivially copyable object that a writer may be storing to at the same time into to, one racy_load
+    // per word. The copy can still be torn between words, but no single load races.
+    template <typename T>
+    void racy_copy(void* to, const T& from)
+    {
+      typedef typename racy_word<T>::type W;
+      const W* src = reinterpret_cast<const W*>(&from);
+      W* dst = static_cast<W*>(to);
+      for(size_t i = 0; i < sizeof(T)/sizeof(W); i++) {
+        dst[i] = racy_load(src[i]);
+      }
+    }
+
+  }
+
+  /**
+   *  A red_black_tree<T, Allocator> shared between threads. insert(), remove() and clear() write, find() and size()
+   *  read, and read() and write() run any other code against the tree under the lock.
+   *
+   *  find() only runs without a lock when T is trivially copyable, since it compares copies of elements that a
+   *  writer may be halfway through changing. Those copies and the links it follows can be stale or torn, so T's
+   *  operator== and operator> must only look at the bytes of the copy and never follow a pointer held in it. Beyond
+   *  that, stale or torn reads are fine: nothing read is trusted unless the sequence counter shows no writer ran in
+   *  the meantime, a walk that goes deeper than any valid tree can is abandoned, and node memory is never given back
+   *  while the wrapper lives, so a stale link still points at a node, dead or alive. That is why clear() here
+   *  recycles the nodes instead of freeing them. size() reads a count the wrapper publishes after each write. For
+   *  other element types find() holds the lock shared.
+   */
+  template <typename T, typename Allocator = heap_allocator<T>>
+  class concurrent_red_black_tree
+  {
+  public:
+    typedef red_black_tree<T, Allocator> tree_type;
+    typedef T value_type;
+
+  private:
+    typedef typename tree_type::handle handle;
+    typedef std::integral_constant<bool, std::is_trivially_copyable<T>::value> optimistic;
+
+    // Lock-free attempts before a lookup gives up and takes the lock.
+    static const int max_attempts = 4;
+    // Deeper than any red black tree that fits in memory, so a walk this long has followed links mid-rotation.
+    static const int max_depth = 128;
+
+    tree_type tree;
+    mutable detail::rw_lock lock;
+    // Odd while a writer is changing the tree. Padded onto its own cache line, which readers share without writing
+    // to, wherever the tree is allocated; alignas would over-align the class, which C++11 new doesn't honour.
+    char sequence_before[64];
+    std::atomic<unsigned long> sequence;
+    // The tree's size as of the last write, for size() to read without touching the tree.
+    std::atomic<size_t> count;
+    char sequence_after[64 - sizeof(std::atomic<unsigned long>) - sizeof(std::atomic<size_t>)];
+
+    // Holds the lock exclusively and marks the tree as changing. Publishes the new size when the change is done.
+    class writing
+    {
+    private:
+      concurrent_red_black_tree& t;
+
+    public:
+      explicit writing(concurrent_red_black_tree& t) : t(t)
+      {
+        t.lock.lock();
+        t.sequence.store(t.sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+      }
+
+      ~writing()
+      {
+        t.count.store(t.tree.size(), std::memory_order_relaxed);
+        t.sequence.store(t.sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        t.lock.unlock();
+      }
+    };
+
+    class reading
+    {
+    private:
+      const concurrent_red_black_tree& t;
+
+    public:
+      explicit reading(const concurrent_red_black_tree& t) : t(t)
+      {
+        t.lock.lock_shared();
+      }
+
+      ~reading()
+      {
+        t.lock.unlock_shared();
+      }
+    };
+
+    // Walks the tree for d without a lock. Returns 1 if d was seen, 0 if not, and -1 if the walk ran too deep.
+    int find_unlocked(const T& d, std::true_type) const
+    {
+      handle curr = detail::racy_load(tree.core.root);
+      for(int depth = 0; curr != nullptr; depth++) {
+        if(depth == max_depth) {
+          return -1;
+        }
+        alignas(T) unsigned char bytes[sizeof(T)];
+        detail::racy_copy(bytes, curr->data);
+        const T& data = *reinterpret_cast<const T*>(bytes);
+        if(data == d) {
+          return 1;
+        }
+        // Both children are loaded up front so picking one compiles to a select rather than a branch.
+        handle l = detail::racy_load(curr->left), r = detail::racy_load(curr->right);
+        curr = (data > d ? l : r);
+      }
+      return 0;
+    }
+
+    int find_unlocked(const T&, std::false_type) const
+    {
+      return -1;
+    }
+
+  public:
+    explicit concurrent_red_black_tree(const Allocator& a = Allocator()) : tree(a), sequence(0), count(0) {}
+
+    concurrent_red_black_tree(const concurrent_red_black_tree&) = delete;
+    concurrent_red_black_tree& operator=(const concurrent_red_black_tree&) = delete;
+
+    /**
+     *  Inserts d, blocking readers that hold the lock but not lock-free ones.
+     *  @returns true if d wasn't in the tree yet.
+     */
+    bool insert(const T& d)
+    {
+      writing w(*this);
+      return tree.insert(d);
+    }
+
+    /**
+     *  Removes d.
+     *  @returns true if d was in the tree.
+     */
+    bool remove(const T& d)
+    {
+      writing w(*this);
+      return tree.remove(d);
+    }
+
+    /**
+     *  Removes every element. The nodes are kept for reuse rather than freed, see the class comment.
+     */
+    void clear()
+    {
+      writing w(*this);
+      if(optimistic::value) {
+        tree.core.recycle();
+      } else {
+        tree.clear();
+      }
+    }
+
+    /**
+     *  Checks if d is in the tree, without a lock if T is trivially copyable and writers leave it a gap.
+     *  @param d the data to find.
+     *  @returns true if d was in the tree at some point during the call.
+     */
+    bool find(const T& d) const
+    {
+      if(optimistic::value) {
+        for(int attempt = 0; attempt < max_attempts; attempt++) {
+          unsigned long before = sequence.load(std::memory_order_acquire);
+          if(before & 1) {
+            continue; // A writer is in the middle of a change.
+          }
+          int found = find_unlocked(d, optimistic());
+          std::atomic_thread_fence(std::memory_order_acquire);
+          if(found >= 0 && sequence.load(std::memory_order_relaxed) == before) {
+            return found == 1;
+          }
+        }
+      }
+      reading r(*this);
+      return tree.find(d);
+    }
+
+    /**
+     *  @returns the number of elements as of the last write that finished before the call.
+     */
+    size_t size() const
+    {
+      return count.load(std::memory_order_relaxed);
+    }
+
+    /**
+     *  Runs f(const tree_type&) with the lock held shared, for reads with no lock-free version, such as iterating.
+     *  @returns what f returns.
+     */
+    template <typename F>
+    auto read(F f) const -> decltype(f(std::declval<const tree_type&>()))
+    {
+      reading r(*this);
+      return f(static_cast<const tree_type&>(tree));
+    }
+
+    /**
+     *  Runs f(tree_type&) with the lock held exclusively, for changes that take more than one call. f must not free
+     *  the tree's memory, with clear() or assignment, while lock-free readers may be walking it; use clear() on the
+     *  wrapper instead.
+     *  @returns what f returns.
+     */
+    template <typename F>
+    auto write(F f) -> decltype(f(std::declval<tree_type&>()))
+    {
+      writing w(*this);
+      return f(tree);
+    }
+  };
+
+}
+
+#endif
@@ -0,0 +1,783 @@
+/**
+ *  flat_file.hpp
+ *  A binary file format for Vectors and red black trees of trivially copyable elements, read back either straight
+ *  from a read-only mapping of the file or into a mutable container.
+ *
+ *  A file is a 64-byte header followed by the elements as one raw array, in order for a tree. A tree's file can
+ *  also carry a search index after the elements: every block-th element laid out in Eytzinger order, the order of
+ *  a breadth-first walk of a perfectly balanced tree, so that the first few levels of every search share a handful
+ *  of cache lines and a search ends on the one cache line of elements that holds the answer. The header records the
+ *  format version, the byte order, the element size and a checksum of the whole file, so a file written by a
+ *  different build or cut short is rejected instead of misread. Files are written to a temporary name and renamed
+ *  into place, so a crash never leaves a half-written file under the real name.
+ *
+ *  Opening a file maps it and checks the header, which costs a few page faults however large the file is; the
+ *  elements are only read as queries touch them. Checking the checksum reads the whole file, so it is left to
+ *  verify(), or done by load() which reads the whole file anyway. Needs POSIX mmap.
+ *
+ *  @author Marquess Valdez
+ *  @version 1.0
+ */
+#ifndef MQS_FLAT_FILE_HPP
+#define MQS_FLAT_FILE_HPP
+
+#include <cerrno>
+#include <cstddef> //for std::size_t
+#include <cstdint> // for std::uint32_t, std::uint64_t
+#include <cstdio> // for std::rename
+#include <cstring> // for std::memcpy, std::memcmp
+#include <stdexcept> // for std::runtime_error
+#include <string>
+#include <system_error> // for std::system_error
+#include <type_traits> // for std::is_trivially_copyable
+#include <vector> // for std::vector
+#include "red_black_tree.hpp"
+#include "vector.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h> // for open
+#include <sys/mman.h> // for mmap, munmap, madvise
+#include <sys/stat.h> // for fstat
+#include <unistd.h> // for write, pwrite, close, unlink
+#else
+#error "flat_file.hpp needs POSIX mmap"
+#endif
+
+namespace mqs
+{
+
+  namespace detail
+  {
+
+    // What a flat file holds, so a Vector's file isn't opened as a set.
+    enum class flat_kind : std::uint32_t { array = 1, set = 2 };
+
+    struct flat_header
+    {
+      char magic[8];
+      std::uint32_t version;
+      std::uint32_t byte_order; // flat_byte_order as written, which reads back differently on the other byte order.
+      std::uint32_t kind;
+      std::uint32_t element_size;
+      std::uint64_t count;
+      std::uint64_t block; // Elements per index sample, or 0 without an index.
+      std::uint64_t levels; // The index holds 2^levels slots, the first unused.
+      std::uint64_t checksum; // Of every byte after the header, then of the header with this field zeroed.
+      std::uint64_t reserved;
+    };
+
+    static_assert(sizeof(flat_header) == 64, "mqs::flat_header: the header must fill one cache line.");
+
+    const char flat_magic[8] = {'m', 'q', 's', 'f', 'l', 'a', 't', '\0'};
+    const std::uint32_t flat_version = 2;
+    const std::uint32_t flat_byte_order = 0x01020304;
+
+    // Everything after the header starts on a cache line.
+    inline std::uint64_t flat_align(std::uint64_t offset)
+    {
+      return (offset + 63) & ~std::uint64_t(63);
+    }
+
+    // The number of trailing one bits of k.
+    inline int trailing_ones(std::uint64_t k)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+      return ~k == 0 ? 64 : __builtin_ctzll(~k);
+#else
+      int n = 0;
+      for(; k & 1; k >>= 1) {
+        n++;
+      }
+      return n;
+#endif
+    }
+
+    // floor(log2(k)) for k > 0.
+    inline int log2_floor(std::uint64_t k)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+      return 63 - __builtin_clzll(k);
+#else
+      int n = 0;
+      while(k >>= 1) {
+        n++;
+      }
+      return n;
+#endif
+    }
+
+    /**
+     *  A 64-bit checksum over a stream of bytes, eight at a time. Catches truncation and corruption, not tampering.
+     *  The bytes can come in pieces of any length.
+     */
+    class flat_checksum
+    {
+    private:
+      std::uint64_t h;
+      std::uint64_t bytes;
+      unsigned char pending[8]; // The start of a word whose rest hasn't come yet.
+
+      void mix(std::uint64_t w)
+      {
+        w *= 0x87c37b91114253d5ULL;
+        h ^= (w << 31) | (w >> 33);
+        h = ((h << 27) | (h >> 37)) * 0x4cf5ad432745937fULL + 0x52dce729;
+      }
+
+    public:
+      flat_checksum() : h(0x9e3779b97f4a7c15ULL), bytes(0), pending() {}
+
+      void add(const void* p, size_t n)
+      {
+        const unsigned char* b = static_cast<const unsigned char*>(p);
+        size_t have = size_t(bytes % 8);
+        bytes += n;
+        if(have != 0) {
+          size_t take = (8 - have < n ? 8 - have : n);
+          std::memcpy(pending + have, b, take);
+          b += take;
+          n -= take;
+          if(have + take < 8) {
+            return;
+          }
+          std::uint64_t w;
+          std::memcpy(&w, pending, 8);
+          mix(w);
+        }
+        for(; n >= 8; n -= 8, b += 8) {
+          std::uint64_t w;
+          std::memcpy(&w, b, 8);
+          mix(w);
+        }
+        std::memcpy(pending, b, n);
+      }
+
+      std::uint64_t value() const
+      {
+        // A last partial word is mixed in padded with zeros.
+        flat_checksum last(*this);
+        if(bytes % 8 != 0) {
+          std::uint64_t w = 0;
+          std::memcpy(&w, pending, size_t(bytes % 8));
+          last.mix(w);
+        }
+        std::uint64_t x = last.h ^ bytes;
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        return x;
+      }
+    };
+
+    /**
+     *  Writes a flat file through a buffer into a temporary file next to path, checksumming what it writes, and
+     *  renames it to path in finish(). A writer destroyed before finish() removes the temporary file.
+     */
+    class flat_writer
+    {
+    private:
+      static const size_t buffer_size = size_t(1) << 20;
+
+      std::string path;
+      std::string temp;
+      int fd;
+      std::vector<char> buffer;
+      std::uint64_t written;
+      flat_checksum sum;
+      bool renamed;
+
+      [[noreturn]] void fail(const char* what)
+      {
+        throw std::system_error(errno, std::generic_category(), std::string("mqs::save: ") + what + " " + temp);
+      }
+
+      void write_all(const char* p, size_t n)
+      {
+        while(n > 0) {
+          ssize_t w = ::write(fd, p, n);
+          if(w < 0) {
+            if(errno == EINTR) {
+              continue;
+            }
+            fail("can't write");
+          }
+          p += w;
+          n -= size_t(w);
+        }
+      }
+
+      void flush()
+      {
+        sum.add(buffer.data(), buffer.size());
+        write_all(buffer.data(), buffer.size());
+        buffer.clear();
+      }
+
+    public:
+      explicit flat_writer(const std::string& path) : path(path), temp(path + ".tmp"), written(0), renamed(false)
+      {
+        fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) {
+          fail("can't create");
+        }
+        buffer.reserve(buffer_size);
+        // The header is written last, once the checksum is known.
+        char blank[sizeof(flat_header)] = {};
+        write_all(blank, sizeof(blank));
+      }
+
+      flat_writer(const flat_writer&) = delete;
+      flat_writer& operator=(const flat_writer&) = delete;
+
+      void write(const void* p, size_t n)
+      {
+        const char* b = static_cast<const char*>(p);
+        written += n;
+        while(n > 0) {
+          size_t take = buffer_size - buffer.size();
+          take = (take < n ? take : n);
+          buffer.insert(buffer.end(), b, b + take);
+          b += take;
+          n -= take;
+          if(buffer.size() == buffer_size) {
+            flush();
+          }
+        }
+      }
+
+      // Pads with zeros up to the next cache line.
+      void align()
+      {
+        static const char zeros[64] = {};
+        write(zeros, flat_align(sizeof(flat_header) + written) - sizeof(flat_header) - written);
+      }
+
+      void finish(flat_header header)
+      {
+        flush();
+        header.checksum = 0;
+        sum.add(&header, sizeof(header));
+        header.checksum = sum.value();
+        if(::pwrite(fd, &header, sizeof(header), 0) != ssize_t(sizeof(header))) {
+          fail("can't write");
+        }
+        int closed = ::close(fd);
+        fd = -1;
+        if(closed != 0) {
+          fail("can't close");
+        }
+        if(std::rename(temp.c_str(), path.c_str()) != 0) {
+          fail("can't rename");
+        }
+        renamed = true;
+      }
+
+      ~flat_writer()
+      {
+        if(fd >= 0) {
+          ::close(fd);
+        }
+        if(!renamed) {
+          ::unlink(temp.c_str());
+        }
+      }
+    };
+
+    template <typename T>
+    flat_header make_flat_header(flat_kind kind, std::uint64_t count)
+    {
+      flat_header h = {};
+      std::memcpy(h.magic, flat_magic, sizeof(h.magic));
+      h.version = flat_version;
+      h.byte_order = flat_byte_order;
+      h.kind = std::uint32_t(kind);
+      h.element_size = sizeof(T);
+      h.count = count;
+      return h;
+    }
+
+    // Elements per index sample: one cache line of them, so a search ends by scanning one line.
+    inline std::uint64_t flat_block(size_t element_size)
+    {
+      return element_size >= 64 ? 1 : 64 / element_size;
+    }
+
+    // The number of levels of the index over count elements: enough for a perfectly balanced tree of its samples.
+    inline std::uint64_t flat_levels(std::uint64_t count, std::uint64_t block)
+    {
+      std::uint64_t samples = (count + block - 1) / block, levels = 0;
+      while((std::uint64_t(1) << levels) - 1 < samples) {
+        levels++;
+      }
+      return levels;
+    }
+
+    /**
+     *  A read-only mapping of a flat file whose header has been checked against what the caller expects: the
+     *  magic, version and byte order, the kind, the element size, an index shaped the way save() shapes one for
+     *  that many elements, and a file size that fits the header.
+     */
+    class flat_mapping
+    {
+    private:
+      const char* base;
+      size_t length;
+
+      [[noreturn]] static void bad(const std::string& path, const char* what)
+      {
+        throw std::runtime_error("mqs::flat_mapping: " + path + " " + what);
+      }
+
+    public:
+      flat_mapping(const std::string& path, flat_kind kind, size_t element_size) : base(nullptr), length(0)
+      {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0) {
+          throw std::system_error(errno, std::generic_category(), "mqs::flat_mapping: can't open " + path);
+        }
+        struct stat st;
+        if(::fstat(fd, &st) != 0) {
+          int e = errno;
+          ::close(fd);
+          throw std::system_error(e, std::generic_category(), "mqs::flat_mapping: can't stat " + path);
+        }
+        length = size_t(st.st_size);
+        if(length < sizeof(flat_header)) {
+          ::close(fd);
+          bad(path, "is too short to be a flat file.");
+        }
+        void* p = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        int e = errno;
+        ::close(fd); // The mapping keeps the file open.
+        if(p == MAP_FAILED) {
+          throw std::system_error(e, std::generic_category(), "mqs::flat_mapping: can't map " + path);
+        }
+        base = static_cast<const char*>(p);
+        const flat_header& h = header();
+        const char* problem = nullptr;
+        const std::uint64_t fits = length / element_size; // The most elements the file has room for.
+        bool sized = h.count <= fits;
+        // Searches trust block and levels to stay inside the elements, so they must be exactly what save() writes.
+        if(h.block == 0) {
+          sized = sized && h.levels == 0;
+        } else {
+          sized = sized && kind == flat_kind::set && h.count > 0 && h.block == flat_block(element_size) &&
+                  h.levels == flat_levels(h.count, h.block) && (std::uint64_t(1) << h.levels) <= fits;
+        }
+        std::uint64_t end = sizeof(flat_header) + h.count*element_size;
+        if(sized && h.block != 0) {
+          end = flat_align(end) + (std::uint64_t(1) << h.levels)*element_size;
+        }
+        if(std::memcmp(h.magic, flat_magic, sizeof(h.magic)) != 0) {
+          problem = "isn't a flat file.";
+        } else if(h.byte_order != flat_byte_order) {
+          problem = "was written on a machine with the other byte order.";
+        } else if(h.version != flat_version) {
+          problem = "was written in another version of the format.";
+        } else if(h.kind != std::uint32_t(kind)) {
+          problem = "holds another kind of container.";
+        } else if(h.element_size != element_size) {
+          problem = "holds elements of another size.";
+        } else if(!sized || end != length) {
+          problem = "is truncated or corrupt.";
+        }
+        if(problem) {
+          ::munmap(const_cast<char*>(base), length);
+          bad(path, problem);
+        }
+      }
+
+      flat_mapping(flat_mapping&& m) : base(m.base), length(m.length)
+      {
+        m.base = nullptr;
+        m.length = 0;
+      }
+
+      flat_mapping(const flat_mapping&) = delete;
+      flat_mapping& operator=(const flat_mapping&) = delete;
+
+      const flat_header& header() const
+      {
+        return *reinterpret_cast<const flat_header*>(base);
+      }
+
+      // The elements, which start on the cache line after the header.
+      const char* elements() const
+      {
+        return base + sizeof(flat_header);
+      }
+
+      const char* index() const
+      {
+        return base + flat_align(sizeof(flat_header) + header().count*header().element_size);
+      }
+
+      // Reads the whole file, and is true if it matches the checksum in its header.
+      bool verify() const
+      {
+        flat_checksum sum;
+        sum.add(elements(), length - sizeof(flat_header));
+        flat_header h = header();
+        h.checksum = 0;
+        sum.add(&h, sizeof(h));
+        return sum.value() == header().checksum;
+      }
+
+      // Tells the kernel how the mapping will be read, such as MADV_SEQUENTIAL for one pass front to back.
+      void advise(int advice) const
+      {
+        ::madvise(const_cast<char*>(base), length, advice);
+      }
+
+      ~flat_mapping()
+      {
+        if(base) {
+          ::munmap(const_cast<char*>(base), length);
+        }
+      }
+    };
+
+    template <typename T>
+    void check_flat_element()
+    {
+      static_assert(std::is_trivially_copyable<T>::value, "mqs::flat_file: elements must be trivially copyable.");
+      static_assert(alignof(T) <= 64, "mqs::flat_file: elements can be aligned to at most 64 bytes.");
+    }
+
+  }
+
+  /**
+   *  Writes v's elements to path as a raw array, replacing the file if there is one.
+   *  @param v the Vector to save, whose elements must be trivially copyable.
+   *  @param path the file to write.
+   */
+  template <typename T, typename G, size_t N, typename A>
+  void save(const Vector<T, G, N, A>& v, const std::string& path)
+  {
+    detail::check_flat_element<T>();
+    detail::flat_writer out(path);
+    out.write(v.data(), v.size()*sizeof(T));
+    out.finish(detail::make_flat_header<T>(detail::flat_kind::array, v.size()));
+  }
+
+  /**
+   *  Writes t's elements to path in order, followed by a search index unless index is false, replacing the file if
+   *  there is one. The index takes one element per cache line of elements, under 2/16ths of the file for 4-byte
+   *  elements, and saves a mapped_set most of its cache misses per search.
+   *  @param t the tree to save, whose elements must be trivially copyable.
+   *  @param path the file to write.
+   *  @param index false to leave the index out.
+   */
+  template <typename T, typename A, typename L, typename G, typename S>
+  void save(const red_black_tree<T, A, L, G, S>& t, const std::string& path, bool index = true)
+  {
+    detail::check_flat_element<T>();
+    const size_t block = size_t(detail::flat_block(sizeof(T)));
+    detail::flat_writer out(path);
+    std::vector<T> samples;
+    if(index) {
+      samples.reserve(t.size() / block + 1);
+    }
+    size_t i = 0;
+    for(const T& d : t) {
+      if(index && i++ % block == 0) {
+        samples.push_back(d);
+      }
+      out.write(&d, sizeof(T));
+    }
+    detail::flat_header header = detail::make_flat_header<T>(detail::flat_kind::set, t.size());
+    if(!samples.empty()) {
+      // The samples fill a perfectly balanced tree of 2^levels - 1 slots, padded with the last sample, which no
+      // search stops at since the real one comes before it in order. Slot k's children are 2k and 2k + 1, and the
+      // sample of rank r goes to the slot whose in-order rank is r.
+      const std::uint64_t levels = detail::flat_levels(t.size(), block);
+      const size_t slots = size_t(1) << levels;
+      std::vector<T> layout(slots);
+      std::memset(static_cast<void*>(&layout[0]), 0, sizeof(T)); // Slot 0 is never read.
+      for(size_t r = 0; r + 1 < slots; r++) {
+        int t1 = detail::trailing_ones(r);
+        size_t k = (size_t(1) << (levels - 1 - t1)) + ((r + 1) >> (t1 + 1));
+        layout[k] = samples[r < samples.size() ? r : samples.size() - 1];
+      }
+      out.align();
+      out.write(layout.data(), slots*sizeof(T));
+      header.block = block;
+      header.levels = levels;
+    }
+    out.finish(header);
+  }
+
+  /**
+   *  A read-only Vector saved with save(), served straight from a mapping of its file. Opening it costs a few page
+   *  faults whatever its size; elements are paged in as they are read, and stay in the page cache to be shared by
+   *  every process that maps the same file.
+   */
+  template <typename T>
+  class mapped_vector
+  {
+  private:
+    detail::flat_mapping file;
+
+  public:
+    typedef T value_type;
+    typedef const T* const_iterator;
+
+    /**
+     *  Maps the file at path and checks its header. Throws std::system_error if the file can't be opened or
+     *  mapped, and std::runtime_error if it isn't a Vector of T saved by this version.
+     */
+    explicit mapped_vector(const std::string& path) : file(path, detail::flat_kind::array, sizeof(T))
+    {
+      detail::check_flat_element<T>();
+    }
+
+    /**
+     *  Reads the whole file and checks it against its checksum. Costs a pass over the file.
+     *  @returns true if the file is intact.
+     */
+    bool verify() const
+    {
+      return file.verify();
+    }
+
+    const T* data() const
+    {
+      return reinterpret_cast<const T*>(file.elements());
+    }
+
+    size_t size() const
+    {
+      return file.header().count;
+    }
+
+    bool empty() const
+    {
+      return size() == 0;
+    }
+
+    const T& operator[](const size_t i) const
+    {
+      return data()[i];
+    }
+
+    const_iterator begin() const
+    {
+      return data();
+    }
+
+    const_iterator end() const
+    {
+      return data() + size();
+    }
+  };
+
+  /**
+   *  A read-only set saved from a red_black_tree with save(), searched straight from a mapping of its file. With
+   *  the file's index, a search walks the index's top levels, which stay cached, and then scans the one cache line
+   *  of elements the index points it to. Without one, it binary searches the elements. Either way it compares
+   *  elements with == and > like the tree. Opening it costs a few page faults whatever its size.
+   */
+  template <typename T>
+  class mapped_set
+  {
+  private:
+    detail::flat_mapping file;
+
+    const T* elements() const
+    {
+      return reinterpret_cast<const T*>(file.elements());
+    }
+
+    const T* slots() const
+    {
+      return reinterpret_cast<const T*>(file.index());
+    }
+
+    // The first position in [first, first + n) that doesn't come before d, without a branch on the comparisons.
+    static size_t lower_bound_in(const T* first, size_t n, const T& d)
+    {
+      if(n == 0) {
+        return 0;
+      }
+      const T* base = first;
+      while(n > 1) {
+        size_t half = n / 2;
+        base = (d > base[half - 1] ? base + half : base);
+        n -= half;
+      }
+      return size_t(base - first) + (d > *base);
+    }
+
+  public:
+    typedef T value_type;
+    typedef const T* const_iterator;
+
+    /**
+     *  Maps the file at path and checks its header. Throws std::system_error if the file can't be opened or
+     *  mapped, and std::runtime_error if it isn't a set of T saved by this version.
+     */
+    explicit mapped_set(const std::string& path) : file(path, detail::flat_kind::set, sizeof(T))
+    {
+      detail::check_flat_element<T>();
+    }
+
+    /**
+     *  Reads the whole file and checks it against its checksum. Costs a pass over the file.
+     *  @returns true if the file is intact.
+     */
+    bool verify() const
+    {
+      return file.verify();
+    }
+
+    /**
+     *  @returns the position of the first element that isn't less than d, or size() if there is none.
+     */
+    size_t lower_bound(const T& d) const
+    {
+      const size_t n = size(), block = file.header().block;
+      if(block == 0) {
+        return lower_bound_in(elements(), n, d);
+      }
+      // Walk the index down to below its last level, going right past every sample less than d. The slot that
+      // ends the walk, with its trailing ones and one more bit shifted off, is the last one the walk went left at:
+      // the first sample that isn't less than d, or 0 if every sample is.
+      const T* index = slots();
+      const int levels = int(file.header().levels);
+      size_t k = 1;
+      for(int i = 0; i < levels; i++) {
+        k = 2*k + (d > index[k]);
+      }
+      k >>= detail::trailing_ones(k) + 1;
+      size_t samples = (n + block - 1) / block, rank = samples;
+      if(k != 0) {
+        int depth = detail::log2_floor(k);
+        rank = ((2*(k - (size_t(1) << depth)) + 1) << (levels - 1 - depth)) - 1; // k's in-order rank.
+        // Only the padding ranks past the last sample, and only an index damaged since it was opened stops there.
+        rank = (rank < samples ? rank : samples);
+      }
+      if(rank == 0) {
+        return 0;
+      }
+      // d comes after sample rank - 1 and not after sample rank, so it belongs in the block between them.
+      size_t first = (rank - 1)*block + 1, last = rank*block < n ? rank*block : n;
+      size_t i = first;
+      for(const T* p = elements() + first; p != elements() + last; p++) {
+        i += (d > *p);
+      }
+      return i;
+    }
+
+    /**
+     *  @returns true if d is in the set.
+     */
+    bool find(const T& d) const
+    {
+      size_t i = lower_bound(d);
+      return i != size() && !(elements()[i] > d);
+    }
+
+    /**
+     *  Calls visitor on every element in [lo, hi), in order.
+     *  @param lo the smallest value to visit.
+     *  @param hi the value to stop at, which isn't visited.
+     *  @param visitor a callable taking a const T&.
+     *  @returns the number of elements visited.
+     */
+    template <typename Visitor>
+    size_t visit_range(const T& lo, const T& hi, Visitor visitor) const
+    {
+      const T* first = elements() + lower_bound(lo);
+      const T* p = first;
+      for(; p != end() && hi > *p; p++) {
+        visitor(*p);
+      }
+      return size_t(p - first);
+    }
+
+    /**
+     *  Counts the elements in [lo, hi) with two searches, without visiting them.
+     */
+    size_t count_range(const T& lo, const T& hi) const
+    {
+      return hi > lo ? lower_bound(hi) - lower_bound(lo) : 0;
+    }
+
+    bool has_index() const
+    {
+      return file.header().block != 0;
+    }
+
+    size_t size() const
+    {
+      return file.header().count;
+    }
+
+    bool empty() const
+    {
+      return size() == 0;
+    }
+
+    // The elements in increasing order.
+    const_iterator begin() const
+    {
+      return elements();
+    }
+
+    const_iterator end() const
+    {
+      return elements() + size();
+    }
+  };
+
+  namespace detail
+  {
+
+    // Maps a flat file for one pass front to back and checks it against its checksum.
+    template <typename T>
+    flat_mapping map_for_load(const std::string& path, flat_kind kind)
+    {
+      check_flat_element<T>();
+      flat_mapping file(path, kind, sizeof(T));
+      file.advise(MADV_SEQUENTIAL);
+      if(!file.verify()) {
+        throw std::runtime_error("mqs::load: " + path + " doesn't match its checksum.");
+      }
+      return file;
+    }
+
+  }
+
+  /**
+   *  Replaces v's contents with the Vector saved at path. The file is streamed through a mapping the kernel is told
+   *  will be read in order, so it reads ahead and the pages only take up page cache, and it is checked against its
+   *  checksum before anything is copied, so a damaged file leaves v as it was.
+   *  Throws std::system_error if the file can't be read, and std::runtime_error if it isn't a Vector of T saved by
+   *  this version or doesn't match its checksum.
+   */
+  template <typename T, typename G, size_t N, typename A>
+  void load(const std::string& path, Vector<T, G, N, A>& v)
+  {
+    detail::flat_mapping file = detail::map_for_load<T>(path, detail::flat_kind::array);
+    const T* first = reinterpret_cast<const T*>(file.elements());
+    v.clear();
+    v.reserve(file.header().count);
+    v.append(first, first + file.header().count);
+  }
+
+  /**
+   *  Replaces t's contents with the set saved at path, rebuilding a perfectly balanced tree in O(n) without a
+   *  comparison, with its nodes in one block in order. Read like load() for a Vector, so the only memory it adds
+   *  is the tree's, and a damaged file leaves t as it was. The index in the file isn't needed and isn't read.
+   */
+  template <typename T, typename A, typename L, typename G, typename S>
+  void load(const std::string& path, red_black_tree<T, A, L, G, S>& t)
+  {
+    detail::flat_mapping file = detail::map_for_load<T>(path, detail::flat_kind::set);
+    const T* first = reinterpret_cast<const T*>(file.elements());
+    t.assign_sorted(first, first + file.header().count);
+  }
+
+}
+
+#endif
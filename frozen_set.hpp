@@ -0,0 +1,461 @@
+/**
+ *  frozen_set.hpp
+ *  An immutable sorted set laid out for searching, built once from a red_black_tree or its dump() and then only
+ *  read.
+ *
+ *  The elements sit in one sorted array, cut into nodes of one cache line each. Above them sits a static B-tree
+ *  with the same node size and no pointers: node k of a layer has children k*(B + 1) through k*(B + 1) + B in the
+ *  layer below, and its keys are the first elements under its children from the second on. A search reads one
+ *  cache line per layer, about log base 17 of n layers for 4-byte keys against log base 2 of n nodes for a binary
+ *  tree, and each line is used whole, where a tree node uses a few bytes of the line it costs. Within a node the
+ *  keys less than the one searched for are counted, with simd::count_less_short for arithmetic keys, and the count
+ *  picks the child without a branch.
+ *
+ *  @author Marquess Valdez
+ *  @version 1.0
+ */
+#ifndef MQS_FROZEN_SET_HPP
+#define MQS_FROZEN_SET_HPP
+
+#include <algorithm> // for std::sort, std::unique, std::swap
+#include <cstddef> //for std::size_t
+#include <cstdint> // for std::uintptr_t
+#include <iterator> // for std::distance
+#include <memory> // for std::allocator_traits
+#include <type_traits>
+#include <utility> // for std::pair
+#include <vector> // for std::vector
+#include "allocator.hpp"
+#include "red_black_tree.hpp"
+#include "simd.hpp"
+
+namespace mqs
+{
+
+  namespace detail
+  {
+
+    // Asks for the cache line at p ahead of a read that is coming, where the compiler supports it.
+    inline void prefetch(const void* p)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+      __builtin_prefetch(p);
+#else
+      (void)p;
+#endif
+    }
+
+  }
+
+  /**
+   *  An immutable set of T, searched in O(log n) with one cache line read per layer of its static B-tree. See the
+   *  top of frozen_set.hpp for the layout. T needs == and > like red_black_tree, and must be copy constructible.
+   *
+   *  The elements can be iterated in order like an array, and lower_bound() returns a position in it. Besides
+   *  single lookups, find_batch() and lower_bound_batch() search many keys at once, moving a group of searches
+   *  down a layer together and prefetching the node each needs next, so the cache misses of the group overlap
+   *  instead of following one another. Memory comes from Allocator in one block, about 1/B more than the elements
+   *  alone.
+   */
+  template <typename T, typename Allocator = heap_allocator<T>>
+  class frozen_set : private detail::allocator_holder<Allocator>
+  {
+  public:
+    typedef T value_type;
+    typedef const T* const_iterator;
+
+    // Keys per node: a cache line of them, or 1 for elements bigger than a line.
+    static const size_t node_keys = (sizeof(T) >= 64 ? 1 : 64 / sizeof(T));
+
+  private:
+    typedef std::allocator_traits<Allocator> alloc_traits;
+
+    static const size_t fanout = node_keys + 1;
+    // Layers of nodes, leaves included. Each has at most half the nodes of the one below it.
+    static const int max_layers = 64;
+    // Searches moved down the layers together by the batched lookups.
+    static const size_t group = 16;
+
+    T* block; // The memory from the allocator, which the nodes start in on the first cache line boundary.
+    size_t allocated;
+    T* nodes;
+    size_t n;
+    int layers; // Layers of nodes, 0 for an empty set.
+    size_t first_node[max_layers]; // The index of each layer's first node, the leaves' being layer 0.
+    size_t last_node[max_layers]; // The index within its layer of each layer's last node.
+
+    Allocator& allocator()
+    {
+      return detail::allocator_holder<Allocator>::allocator();
+    }
+
+    const T* layer(int h) const
+    {
+      return nodes + first_node[h]*node_keys;
+    }
+
+    // Counts the keys of a node less than d, which is the child d belongs under.
+    static size_t rank(const T* keys, const T& d)
+    {
+      return rank(keys, d, simd::is_vectorizable<T>());
+    }
+
+    static size_t rank(const T* keys, const T& d, std::true_type)
+    {
+      return simd::count_less_short(keys, node_keys, d);
+    }
+
+    static size_t rank(const T* keys, const T& d, std::false_type)
+    {
+      size_t less = 0;
+      for(size_t i = 0; i < node_keys; i++) {
+        less += (d > keys[i]);
+      }
+      return less;
+    }
+
+    // Moves from node k of layer h + 1 to the child d belongs under. A key past the last element counts every key
+    // as less and would run off the end of a layer, so the child is clamped to the layer's last node, which leaves
+    // such a search at the end of the last leaf.
+    size_t child(int h, size_t k, const T& d) const
+    {
+      size_t c = k*fanout + rank(layer(h + 1) + k*node_keys, d);
+      return c < last_node[h] ? c : last_node[h];
+    }
+
+    // The position of the first element not less than d, once the search has reached leaf k.
+    size_t leaf_position(size_t k, const T& d) const
+    {
+      size_t i = k*node_keys + rank(layer(0) + k*node_keys, d);
+      return i < n ? i : n;
+    }
+
+    // The first leaf under node k of layer h.
+    size_t leftmost_leaf(int h, size_t k) const
+    {
+      for(; h > 0; h--) {
+        if(k > last_node[h - 1] / fanout + 1) {
+          return last_node[0] + 1; // Past the last leaf, which keeps the multiplications from overflowing.
+        }
+        k *= fanout;
+      }
+      return k;
+    }
+
+    void destroy_all()
+    {
+      if(!block) {
+        return;
+      }
+      if(!std::is_trivially_destructible<T>::value) {
+        const size_t slots = (first_node[0] + last_node[0] + 1)*node_keys;
+        for(size_t i = 0; i < slots; i++) {
+          alloc_traits::destroy(allocator(), nodes + i);
+        }
+      }
+      alloc_traits::deallocate(allocator(), block, allocated);
+      block = nullptr;
+      nodes = nullptr;
+      n = 0;
+      layers = 0;
+    }
+
+    /**
+     *  Lays out the count elements starting at first, which are sorted in strictly increasing order. The leaves
+     *  go last, after the layers above them from the root down, and are filled out to whole nodes with copies of
+     *  the largest element, which no search counts as less than anything it doesn't also pass. Inner keys for
+     *  children a node doesn't have are copies of it too.
+     */
+    template <typename ForwardIt>
+    void build(ForwardIt first, size_t count)
+    {
+      if(count == 0) {
+        return;
+      }
+      size_t layer_nodes[max_layers];
+      layer_nodes[0] = (count + node_keys - 1) / node_keys;
+      layers = 1;
+      while(layer_nodes[layers - 1] > 1) {
+        layer_nodes[layers] = (layer_nodes[layers - 1] + fanout - 1) / fanout;
+        layers++;
+      }
+      size_t total = 0;
+      for(int h = layers - 1; h >= 0; h--) {
+        first_node[h] = total;
+        last_node[h] = layer_nodes[h] - 1;
+        total += layer_nodes[h];
+      }
+      // One node of slack lets the nodes start on a cache line when whole elements can get them there.
+      const size_t slack = (64 % sizeof(T) == 0 && alignof(T) < 64 ? 64 / sizeof(T) : 0);
+      allocated = total*node_keys + slack;
+      block = alloc_traits::allocate(allocator(), allocated);
+      nodes = block;
+      if(slack) {
+        std::uintptr_t address = reinterpret_cast<std::uintptr_t>(block);
+        nodes = block + ((64 - address % 64) % 64) / sizeof(T);
+      }
+      // The leaves are built first, since the keys above are copies of theirs, and the inner layers after them
+      // from the root down, which is their order in memory.
+      T* leaves = nodes + first_node[0]*node_keys;
+      size_t leaves_built = 0, inner_built = 0;
+      try {
+        for(; leaves_built < count; ++leaves_built, ++first) {
+          alloc_traits::construct(allocator(), leaves + leaves_built, *first);
+        }
+        const T& largest = leaves[count - 1];
+        for(; leaves_built < layer_nodes[0]*node_keys; leaves_built++) {
+          alloc_traits::construct(allocator(), leaves + leaves_built, largest);
+        }
+        for(int h = layers - 1; h >= 1; h--) {
+          for(size_t k = 0; k < layer_nodes[h]; k++) {
+            for(size_t j = 0; j < node_keys; j++, inner_built++) {
+              size_t leaf = leftmost_leaf(h - 1, k*fanout + j + 1);
+              const T& key = (leaf <= last_node[0] ? leaves[leaf*node_keys] : largest);
+              alloc_traits::construct(allocator(), nodes + inner_built, key);
+            }
+          }
+        }
+      } catch(...) {
+        for(size_t i = 0; i < inner_built; i++) {
+          alloc_traits::destroy(allocator(), nodes + i);
+        }
+        for(size_t i = 0; i < leaves_built; i++) {
+          alloc_traits::destroy(allocator(), leaves + i);
+        }
+        alloc_traits::deallocate(allocator(), block, allocated);
+        block = nullptr;
+        nodes = nullptr;
+        layers = 0;
+        throw;
+      }
+      n = count;
+    }
+
+    // Orders elements for sorting them.
+    struct element_less
+    {
+      bool operator()(const T& a, const T& b) const
+      {
+        return b > a;
+      }
+    };
+
+  public:
+    /**
+     *  Creates an empty set.
+     */
+    explicit frozen_set(const Allocator& a = Allocator()) :
+      detail::allocator_holder<Allocator>(a), block(nullptr), allocated(0), nodes(nullptr), n(0), layers(0) {}
+
+    /**
+     *  Lays out [first, last) in O(n).
+     *  @param first the first element of a range sorted in strictly increasing order.
+     *  @param last one past the last element.
+     */
+    template <typename ForwardIt>
+    frozen_set(sorted_unique_t, ForwardIt first, ForwardIt last, const Allocator& a = Allocator()) : frozen_set(a)
+    {
+      build(first, std::distance(first, last));
+    }
+
+    /**
+     *  Lays out the elements of [first, last), which are copied, sorted and deduplicated first, in O(n log n).
+     *  @param first the first element, in any order and possibly with repeats.
+     *  @param last one past the last element.
+     */
+    template <typename ForwardIt>
+    frozen_set(ForwardIt first, ForwardIt last, const Allocator& a = Allocator()) : frozen_set(a)
+    {
+      std::vector<T> sorted(first, last);
+      std::sort(sorted.begin(), sorted.end(), element_less());
+      sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+      build(sorted.begin(), sorted.size());
+    }
+
+    frozen_set(const frozen_set& s) :
+      frozen_set(alloc_traits::select_on_container_copy_construction(s.get_allocator()))
+    {
+      build(s.begin(), s.size());
+    }
+
+    frozen_set(frozen_set&& s) noexcept : frozen_set(s.get_allocator())
+    {
+      swap(s);
+    }
+
+    // Copies or moves s in, along with the allocator its memory came from.
+    frozen_set& operator=(frozen_set s)
+    {
+      swap(s);
+      return *this;
+    }
+
+    // Swaps the elements and the allocators, so each block stays with the allocator it came from.
+    void swap(frozen_set& s) noexcept
+    {
+      std::swap(allocator(), s.allocator());
+      std::swap(block, s.block);
+      std::swap(allocated, s.allocated);
+      std::swap(nodes, s.nodes);
+      std::swap(n, s.n);
+      std::swap(layers, s.layers);
+      std::swap(first_node, s.first_node);
+      std::swap(last_node, s.last_node);
+    }
+
+    /**
+     *  Finds the first element that isn't less than d, reading one node per layer.
+     *  @param d the value to compare against.
+     *  @returns an iterator to the first element >= d, or end() if there is none.
+     */
+    const_iterator lower_bound(const T& d) const
+    {
+      if(layers == 0) {
+        return end();
+      }
+      size_t k = 0;
+      for(int h = layers - 2; h >= 0; h--) {
+        k = child(h, k, d);
+      }
+      return nodes + first_node[0]*node_keys + leaf_position(k, d);
+    }
+
+    /**
+     *  @returns true if d is in the set.
+     */
+    bool find(const T& d) const
+    {
+      const_iterator it = lower_bound(d);
+      return it != end() && !(*it > d);
+    }
+
+    /**
+     *  lower_bound() for every key in [first, last), written to out in the same order. Searches go down the layers
+     *  in groups, each prefetching the node it reads next while the others in its group take their step, which
+     *  hides most of the memory latency a single search waits out.
+     *  @param first the first key, in any order.
+     *  @param last one past the last key.
+     *  @param out where the results go, const_iterators like lower_bound()'s.
+     *  @returns out, one past the last result written.
+     */
+    template <typename ForwardIt, typename OutputIt>
+    OutputIt lower_bound_batch(ForwardIt first, ForwardIt last, OutputIt out) const
+    {
+      if(layers == 0) {
+        for(; first != last; ++first) {
+          *out++ = end();
+        }
+        return out;
+      }
+      const T* leaves = nodes + first_node[0]*node_keys;
+      while(first != last) {
+        ForwardIt keys[group];
+        size_t k[group];
+        size_t g = 0;
+        for(; g < group && first != last; ++first, g++) {
+          keys[g] = first;
+          k[g] = 0;
+        }
+        for(int h = layers - 2; h >= 0; h--) {
+          const T* below = layer(h);
+          for(size_t i = 0; i < g; i++) {
+            k[i] = child(h, k[i], *keys[i]);
+            detail::prefetch(below + k[i]*node_keys);
+          }
+        }
+        for(size_t i = 0; i < g; i++) {
+          *out++ = leaves + leaf_position(k[i], *keys[i]);
+        }
+      }
+      return out;
+    }
+
+    /**
+     *  find() for every key in [first, last), like lower_bound_batch().
+     *  @param out where the results go, a bool for each key that is true if the key is in the set.
+     *  @returns out, one past the last result written.
+     */
+    template <typename ForwardIt, typename OutputIt>
+    OutputIt find_batch(ForwardIt first, ForwardIt last, OutputIt out) const
+    {
+      const_iterator found[group];
+      while(first != last) {
+        ForwardIt keys = first;
+        size_t g = 0;
+        for(; g < group && first != last; ++first) {
+          g++;
+        }
+        lower_bound_batch(keys, first, found);
+        for(size_t i = 0; i < g; i++, ++keys) {
+          *out++ = (found[i] != end() && !(*found[i] > *keys));
+        }
+      }
+      return out;
+    }
+
+    /**
+     *  @returns an iterator to the smallest element. The elements can be read in order up to end().
+     */
+    const_iterator begin() const
+    {
+      return nodes + (layers == 0 ? 0 : first_node[0]*node_keys);
+    }
+
+    const_iterator end() const
+    {
+      return begin() + n;
+    }
+
+    size_t size() const
+    {
+      return n;
+    }
+
+    bool empty() const
+    {
+      return n == 0;
+    }
+
+    /**
+     *  @returns a copy of the allocator the set was constructed with.
+     */
+    Allocator get_allocator() const
+    {
+      return detail::allocator_holder<Allocator>::allocator();
+    }
+
+    ~frozen_set()
+    {
+      destroy_all();
+    }
+  };
+
+  /**
+   *  Lays out t's elements in a frozen_set, in O(n) and without a comparison.
+   *  @param t the tree to take the elements from, which is left as it was.
+   */
+  template <typename T, typename A, typename L, typename G, typename S>
+  frozen_set<T> freeze(const red_black_tree<T, A, L, G, S>& t)
+  {
+    return frozen_set<T>(sorted_unique, t.begin(), t.end());
+  }
+
+  /**
+   *  Lays out the elements of a red_black_tree's dump() in a frozen_set. A dump is in pre-order, so this sorts it,
+   *  in O(n log n).
+   *  @param dumped the output of dump(); the colors are ignored.
+   */
+  template <typename T>
+  frozen_set<T> freeze(const std::vector<std::pair<T, bool>>& dumped)
+  {
+    std::vector<T> elements;
+    elements.reserve(dumped.size());
+    for(const std::pair<T, bool>& p : dumped) {
+      elements.push_back(p.first);
+    }
+    return frozen_set<T>(elements.begin(), elements.end());
+  }
+
+}
+
+#endif
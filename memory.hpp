@@ -0,0 +1,145 @@
+/**
+ *  memory.hpp
+ *  Raw memory helpers shared by the containers: a trait for types that can be moved with memcpy, and a heap that
+ *  can grow buffers in place with realloc, or with mremap for very large buffers.
+ *
+ *  @author Marquess Valdez
+ *  @version 1.0
+ */
+#ifndef MQS_MEMORY_HPP
+#define MQS_MEMORY_HPP
+
+#include <cstddef> //for std::size_t
+#include <cstdlib> // for std::malloc, std::realloc, std::free
+#include <cstring> // for std::memcpy
+#include <new> // for std::bad_alloc
+#include <type_traits>
+#include <utility> // for std::pair
+
+#if defined(__linux__)
+#include <sys/mman.h> // for mmap, mremap, munmap
+#define MQS_HAS_MREMAP 1
+#else
+#define MQS_HAS_MREMAP 0
+#endif
+
+// Buffers of at least this many bytes are mapped directly from the kernel, so that growing them remaps pages
+// instead of copying them.
+#ifndef MQS_MMAP_THRESHOLD
+#define MQS_MMAP_THRESHOLD (std::size_t(1) << 25)
+#endif
+
+namespace mqs
+{
+
+  /**
+   *  True if moving a T to a new address and forgetting the old one is the same as copying its bytes, so a buffer
+   *  of them can be moved with memcpy or realloc instead of element by element. This holds for every trivially
+   *  copyable type, and can be specialized for others, such as a type that owns a heap pointer but never points
+   *  into itself.
+   */
+  template <typename T>
+  struct is_trivially_relocatable : std::is_trivially_copyable<T> {};
+
+  // A pair is relocatable if both of its members are, such as the elements of a map from int to int.
+  template <typename A, typename B>
+  struct is_trivially_relocatable<std::pair<A, B>> :
+    std::integral_constant<bool, is_trivially_relocatable<typename std::remove_const<A>::type>::value &&
+                                 is_trivially_relocatable<typename std::remove_const<B>::type>::value> {};
+
+  namespace detail
+  {
+  namespace heap
+  {
+
+    inline bool mapped(std::size_t bytes)
+    {
+      return MQS_HAS_MREMAP && bytes >= MQS_MMAP_THRESHOLD;
+    }
+
+    /**
+     *  Returns uninitialized memory for bytes bytes, or nullptr if bytes is 0. Throws std::bad_alloc on failure.
+     */
+    inline void* allocate(std::size_t bytes)
+    {
+      if(bytes == 0) {
+        return nullptr;
+      }
+#if MQS_HAS_MREMAP
+      if(mapped(bytes)) {
+        void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(p == MAP_FAILED) {
+          throw std::bad_alloc();
+        }
+        return p;
+      }
+#endif
+      void* p = std::malloc(bytes);
+      if(!p) {
+        throw std::bad_alloc();
+      }
+      return p;
+    }
+
+    /**
+     *  Frees memory returned by allocate() or reallocate(). bytes must be the size it was requested with.
+     */
+    inline void deallocate(void* p, std::size_t bytes)
+    {
+      if(!p) {
+        return;
+      }
+#if MQS_HAS_MREMAP
+      if(mapped(bytes)) {
+        munmap(p, bytes);
+        return;
+      }
+#endif
+      std::free(p);
+    }
+
+    /**
+     *  Resizes a buffer from allocate() to new_bytes, keeping the first min(old_bytes, new_bytes) bytes. Small
+     *  buffers go through realloc, which can often extend them where they are. Mapped buffers go through mremap,
+     *  which moves page table entries rather than data, so resizing one costs the same no matter what it holds.
+     *  Throws std::bad_alloc on failure, leaving p untouched.
+     */
+    inline void* reallocate(void* p, std::size_t old_bytes, std::size_t new_bytes)
+    {
+      if(!p) {
+        return allocate(new_bytes);
+      }
+      if(new_bytes == 0) {
+        deallocate(p, old_bytes);
+        return nullptr;
+      }
+      const bool was_mapped = mapped(old_bytes), will_be_mapped = mapped(new_bytes);
+#if MQS_HAS_MREMAP
+      if(was_mapped && will_be_mapped) {
+        void* q = mremap(p, old_bytes, new_bytes, MREMAP_MAYMOVE);
+        if(q == MAP_FAILED) {
+          throw std::bad_alloc();
+        }
+        return q;
+      }
+#endif
+      if(!was_mapped && !will_be_mapped) {
+        void* q = std::realloc(p, new_bytes);
+        if(!q) {
+          throw std::bad_alloc();
+        }
+        return q;
+      }
+      // Crossing the threshold: this copy happens once on the way up and once on the way down.
+      void* q = allocate(new_bytes);
+      std::memcpy(q, p, (old_bytes < new_bytes ? old_bytes : new_bytes));
+      deallocate(p, old_bytes);
+      return q;
+    }
+
+  }
+  }
+
+}
+
+#endif
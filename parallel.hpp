@@ -0,0 +1,570 @@
+/**
+ *  parallel.hpp
+ *  A fork-join thread pool and parallel versions of sort, transform, reduce, for_each and inclusive_scan over
+ *  random-access ranges such as mqs::Vector.
+ *
+ *  Work is split into a few chunks per thread, handed out dynamically so faster threads pick up more of it. Chunk
+ *  boundaries are moved to cache line boundaries so two threads never write the same line, and per-chunk results are
+ *  accumulated locally and written once to their own padded slot.
+ *
+ *  @author Marquess Valdez
+ *  @version 1.0
+ */
+#ifndef MQS_PARALLEL_HPP
+#define MQS_PARALLEL_HPP
+
+#include <algorithm> // for std::sort, std::upper_bound
+#include <atomic>
+#include <condition_variable>
+#include <cstddef> //for std::size_t
+#include <cstdint> // for std::uintptr_t
+#include <exception> // for std::exception_ptr
+#include <functional> // for std::function, std::less, std::plus
+#include <iterator> // for std::iterator_traits
+#include <memory> // for std::addressof
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility> // for std::move
+#include <vector>
+#include "memory.hpp"
+#include "vector.hpp"
+
+namespace mqs
+{
+
+  /**
+   *  A fixed set of worker threads that run fork-join jobs. A job is a number of tasks; the workers and the thread
+   *  that submitted the job claim tasks one at a time until none are left, and the submitter returns once every
+   *  task has finished. Jobs from different threads run one after another. A job submitted from inside a task runs
+   *  on the submitting thread alone instead of waiting on workers that are busy with the outer job.
+   */
+  class thread_pool
+  {
+  private:
+    std::vector<std::thread> workers;
+    std::mutex lock;               // Guards everything below it.
+    std::condition_variable wake;
+    std::condition_variable finished;
+    std::mutex submit;             // Held while a job runs, so jobs run one at a time.
+    const std::function<void(size_t)>* job;
+    size_t job_size;
+    std::atomic<size_t> next_task;
+    size_t busy_workers;
+    unsigned long generation;
+    bool stopping;
+    std::exception_ptr error;
+
+    static bool& inside_task()
+    {
+      static thread_local bool inside = false;
+      return inside;
+    }
+
+    void run_tasks(const std::function<void(size_t)>& fn, size_t count)
+    {
+      bool& inside = inside_task();
+      const bool was_inside = inside;
+      inside = true;
+      for(size_t i = next_task.fetch_add(1); i < count; i = next_task.fetch_add(1)) {
+        try {
+          fn(i);
+        } catch(...) {
+          std::lock_guard<std::mutex> guard(lock);
+          if(!error) {
+            error = std::current_exception();
+          }
+          next_task.store(count); // Stop handing out tasks.
+        }
+      }
+      inside = was_inside;
+    }
+
+    void worker_loop()
+    {
+      unsigned long seen = 0;
+      std::unique_lock<std::mutex> guard(lock);
+      while(true) {
+        wake.wait(guard, [&] { return stopping || generation != seen; });
+        if(stopping) {
+          return;
+        }
+        seen = generation;
+        const std::function<void(size_t)>* fn = job;
+        size_t count = job_size;
+        guard.unlock();
+        run_tasks(*fn, count);
+        guard.lock();
+        if(--busy_workers == 0) {
+          finished.notify_all();
+        }
+      }
+    }
+
+  public:
+    /**
+     *  Creates a pool that runs jobs on threads threads in total: threads-1 workers plus the submitting thread.
+     *  @param the number of threads, which defaults to the number of hardware threads.
+     */
+    explicit thread_pool(size_t threads = std::thread::hardware_concurrency())
+      : job(nullptr), job_size(0), next_task(0), busy_workers(0), generation(0), stopping(false)
+    {
+      for(size_t i = 1; i < threads; i++) {
+        workers.emplace_back(&thread_pool::worker_loop, this);
+      }
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    /**
+     *  @returns the number of threads a job runs on, counting the thread that submits it.
+     */
+    size_t size() const
+    {
+      return workers.size() + 1;
+    }
+
+    /**
+     *  Calls fn(i) for every i in [0, tasks) across the pool and returns when all calls have finished. If a call
+     *  throws, no further tasks are started and the first exception is rethrown here.
+     *  @param the number of tasks and the function to run for each.
+     */
+    void run(size_t tasks, const std::function<void(size_t)>& fn)
+    {
+      if(workers.empty() || tasks <= 1 || inside_task()) {
+        for(size_t i = 0; i < tasks; i++) {
+          fn(i);
+        }
+        return;
+      }
+      std::lock_guard<std::mutex> one_job(submit);
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        job = &fn;
+        job_size = tasks;
+        next_task.store(0);
+        busy_workers = workers.size();
+        error = nullptr;
+        generation++;
+      }
+      wake.notify_all();
+      run_tasks(fn, tasks);
+      std::exception_ptr failure;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        finished.wait(guard, [&] { return busy_workers == 0; });
+        job = nullptr;
+        failure = error;
+        error = nullptr;
+      }
+      if(failure) {
+        std::rethrow_exception(failure);
+      }
+    }
+
+    ~thread_pool()
+    {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+      }
+      wake.notify_all();
+      for(std::thread& worker : workers) {
+        worker.join();
+      }
+    }
+  };
+
+  /**
+   *  @returns the pool the parallel algorithms use when none is given, sized to the number of hardware threads.
+   */
+  inline thread_pool& default_thread_pool()
+  {
+    static thread_pool pool;
+    return pool;
+  }
+
+namespace parallel
+{
+
+  namespace detail
+  {
+
+    const size_t cache_line = 64;
+
+    // Ranges shorter than this aren't worth splitting further.
+    const size_t min_chunk = 4096;
+
+    // Ranges shorter than this are sorted with std::sort on the calling thread.
+    const size_t sort_cutoff = size_t(1) << 15;
+
+    // Holds one per-chunk result on its own cache line.
+    template <typename T>
+    struct alignas(64) padded
+    {
+      T value;
+      explicit padded(const T& t) : value(t) {}
+    };
+
+    // Splits [0, n) of the range starting at first into at most pieces chunks. Inner boundaries are moved forward
+    // to the next cache line boundary of the underlying storage, so that no two chunks write the same line.
+    template <typename RandomIt>
+    std::vector<size_t> split(RandomIt first, size_t n, size_t pieces)
+    {
+      typedef typename std::iterator_traits<RandomIt>::value_type T;
+      const size_t per_line = (sizeof(T) < cache_line && cache_line % sizeof(T) == 0 ? cache_line/sizeof(T) : 1);
+      // Index of the first element that starts a cache line.
+      size_t lead = 0;
+      if(per_line > 1 && n != 0) {
+        std::uintptr_t address = reinterpret_cast<std::uintptr_t>(std::addressof(*first));
+        if(address % sizeof(T) == 0) {
+          lead = ((cache_line - address % cache_line) % cache_line)/sizeof(T);
+        }
+      }
+      std::vector<size_t> bounds(1, 0);
+      for(size_t j = 1; j < pieces; j++) {
+        size_t b = n/pieces*j + n%pieces*j/pieces;
+        if(per_line > 1 && b > lead) {
+          b = lead + (b - lead + per_line - 1)/per_line*per_line;
+        }
+        if(b >= n) {
+          break;
+        }
+        if(b > bounds.back()) {
+          bounds.push_back(b);
+        }
+      }
+      bounds.push_back(n);
+      return bounds;
+    }
+
+    // Enough chunks per thread for dynamic scheduling to even out the load, but none smaller than min_chunk.
+    inline size_t pieces_for(size_t n, const thread_pool& pool)
+    {
+      size_t by_size = (n + min_chunk - 1)/min_chunk;
+      size_t by_threads = (pool.size() == 1 ? 1 : 4*pool.size());
+      return (by_size < by_threads ? by_size : by_threads);
+    }
+
+    // Sample sort: choose bucket splitters from a sample, count each chunk's elements per bucket, scatter them into a
+    // scratch buffer, then sort and move back each bucket on its own.
+    template <typename RandomIt, typename Compare>
+    void sample_sort(thread_pool& pool, RandomIt first, size_t n, Compare comp)
+    {
+      typedef typename std::iterator_traits<RandomIt>::value_type T;
+      const size_t buckets = (pool.size()*4 < 256 ? pool.size()*4 : 256);
+      const size_t oversample = 16;
+
+      std::vector<T> sample;
+      sample.reserve(buckets*oversample);
+      unsigned long long state = 0x9e3779b97f4a7c15ULL;
+      for(size_t i = 0; i < buckets*oversample; i++) {
+        state = state*6364136223846793005ULL + 1442695040888963407ULL;
+        sample.push_back(first[static_cast<size_t>((state >> 33) % n)]);
+      }
+      std::sort(sample.begin(), sample.end(), comp);
+      std::vector<T> splitters;
+      for(size_t b = 1; b < buckets; b++) {
+        splitters.push_back(sample[b*oversample]);
+      }
+
+      // Classify every element once, remembering its bucket so the scatter needs no comparisons.
+      const std::vector<size_t> parts = split(first, n, pieces_for(n, pool));
+      const size_t part_count = parts.size() - 1;
+      std::vector<unsigned char> bucket_of(n);
+      std::vector<size_t> counts(part_count*buckets, 0);
+      pool.run(part_count, [&](size_t p) {
+        size_t* count = &counts[p*buckets];
+        for(size_t i = parts[p]; i < parts[p+1]; i++) {
+          size_t b = static_cast<size_t>(std::upper_bound(splitters.begin(), splitters.end(), first[i], comp) - splitters.begin());
+          bucket_of[i] = static_cast<unsigned char>(b);
+          count[b]++;
+        }
+      });
+
+      // Turn the counts into each chunk's write position within each bucket.
+      std::vector<size_t> bucket_start(buckets+1, 0);
+      size_t offset = 0;
+      for(size_t b = 0; b < buckets; b++) {
+        bucket_start[b] = offset;
+        for(size_t p = 0; p < part_count; p++) {
+          size_t c = counts[p*buckets+b];
+          counts[p*buckets+b] = offset;
+          offset += c;
+        }
+      }
+      bucket_start[buckets] = n;
+
+      T* scratch = static_cast<T*>(mqs::detail::heap::allocate(n*sizeof(T)));
+      pool.run(part_count, [&](size_t p) {
+        size_t* position = &counts[p*buckets];
+        for(size_t i = parts[p]; i < parts[p+1]; i++) {
+          ::new(static_cast<void*>(scratch + position[bucket_of[i]]++)) T(std::move(first[i]));
+        }
+      });
+
+      std::vector<unsigned char> returned(buckets, 0);
+      try {
+        pool.run(buckets, [&](size_t b) {
+          T* begin = scratch + bucket_start[b];
+          T* end = scratch + bucket_start[b+1];
+          std::sort(begin, end, comp);
+          RandomIt out = first + static_cast<std::ptrdiff_t>(bucket_start[b]);
+          for(T* it = begin; it != end; ++it, ++out) {
+            *out = std::move(*it);
+            it->~T();
+          }
+          returned[b] = 1;
+        });
+      } catch(...) {
+        // A bucket that didn't make it back still owns its elements in scratch, and its slots in the range hold
+        // moved-from values. Moves can't throw, so put the elements back before giving up.
+        for(size_t b = 0; b < buckets; b++) {
+          if(!returned[b]) {
+            for(size_t i = bucket_start[b]; i < bucket_start[b+1]; i++) {
+              first[static_cast<std::ptrdiff_t>(i)] = std::move(scratch[i]);
+              scratch[i].~T();
+            }
+          }
+        }
+        mqs::detail::heap::deallocate(scratch, n*sizeof(T));
+        throw;
+      }
+      mqs::detail::heap::deallocate(scratch, n*sizeof(T));
+    }
+
+  }
+
+  /**
+   *  Sorts [first, last) with comp using the pool. Large ranges of elements whose moves can't throw are sample
+   *  sorted across the pool; anything else falls back to std::sort on the calling thread. Like std::sort, the sort
+   *  isn't stable. If comp throws, the exception is rethrown once every thread has stopped and every bucket has been
+   *  moved back, so the range is left as std::sort leaves it after a throwing comparison: in an unspecified order.
+   *  @param the pool, the range to sort and a strict weak ordering.
+   */
+  template <typename RandomIt, typename Compare>
+  void sort(thread_pool& pool, RandomIt first, RandomIt last, Compare comp)
+  {
+    typedef typename std::iterator_traits<RandomIt>::value_type T;
+    const size_t n = static_cast<size_t>(last - first);
+    if(pool.size() < 2 || n < detail::sort_cutoff || !std::is_nothrow_move_constructible<T>::value ||
+       !std::is_nothrow_move_assignable<T>::value) {
+      std::sort(first, last, comp);
+      return;
+    }
+    detail::sample_sort(pool, first, n, comp);
+  }
+
+  template <typename RandomIt, typename Compare>
+  void sort(RandomIt first, RandomIt last, Compare comp)
+  {
+    parallel::sort(default_thread_pool(), first, last, comp);
+  }
+
+  template <typename RandomIt>
+  void sort(RandomIt first, RandomIt last)
+  {
+    parallel::sort(default_thread_pool(), first, last, std::less<typename std::iterator_traits<RandomIt>::value_type>());
+  }
+
+  /**
+   *  Writes f(x) for every x in [first, last) to the range starting at out, using the pool. out may equal first.
+   *  @param the pool, the input range, the start of the output range and the function to apply.
+   */
+  template <typename InputIt, typename OutputIt, typename UnaryFunction>
+  void transform(thread_pool& pool, InputIt first, InputIt last, OutputIt out, UnaryFunction f)
+  {
+    const size_t n = static_cast<size_t>(last - first);
+    // Split on the output, since that is the side threads write to.
+    const std::vector<size_t> parts = detail::split(out, n, detail::pieces_for(n, pool));
+    pool.run(parts.size()-1, [&](size_t p) {
+      for(size_t i = parts[p]; i < parts[p+1]; i++) {
+        out[i] = f(first[i]);
+      }
+    });
+  }
+
+  template <typename InputIt, typename OutputIt, typename UnaryFunction>
+  void transform(InputIt first, InputIt last, OutputIt out, UnaryFunction f)
+  {
+    parallel::transform(default_thread_pool(), first, last, out, f);
+  }
+
+  /**
+   *  Calls f(x) on every element of [first, last), using the pool. Calls happen concurrently and in no particular
+   *  order.
+   *  @param the pool, the range and the function to call.
+   */
+  template <typename RandomIt, typename UnaryFunction>
+  void for_each(thread_pool& pool, RandomIt first, RandomIt last, UnaryFunction f)
+  {
+    const size_t n = static_cast<size_t>(last - first);
+    const std::vector<size_t> parts = detail::split(first, n, detail::pieces_for(n, pool));
+    pool.run(parts.size()-1, [&](size_t p) {
+      for(size_t i = parts[p]; i < parts[p+1]; i++) {
+        f(first[i]);
+      }
+    });
+  }
+
+  template <typename RandomIt, typename UnaryFunction>
+  void for_each(RandomIt first, RandomIt last, UnaryFunction f)
+  {
+    parallel::for_each(default_thread_pool(), first, last, f);
+  }
+
+  /**
+   *  Combines init and every element of [first, last) with op, using the pool. Each chunk is reduced left to right
+   *  and the chunk results are combined in order, so op only needs to be associative. For floating point, the
+   *  result can differ from a sequential sum with the number of chunks.
+   *  @param the pool, the range, the initial value and an associative binary operation.
+   *  @return the reduced value.
+   */
+  template <typename RandomIt, typename T, typename BinaryOp>
+  T reduce(thread_pool& pool, RandomIt first, RandomIt last, T init, BinaryOp op)
+  {
+    const size_t n = static_cast<size_t>(last - first);
+    if(n == 0) {
+      return init;
+    }
+    const std::vector<size_t> parts = detail::split(first, n, detail::pieces_for(n, pool));
+    std::vector<detail::padded<T> > partial(parts.size()-1, detail::padded<T>(init));
+    pool.run(parts.size()-1, [&](size_t p) {
+      T local = first[parts[p]];
+      for(size_t i = parts[p]+1; i < parts[p+1]; i++) {
+        local = op(local, first[i]);
+      }
+      partial[p].value = local;
+    });
+    for(size_t p = 0; p < partial.size(); p++) {
+      init = op(init, partial[p].value);
+    }
+    return init;
+  }
+
+  template <typename RandomIt, typename T, typename BinaryOp>
+  T reduce(RandomIt first, RandomIt last, T init, BinaryOp op)
+  {
+    return parallel::reduce(default_thread_pool(), first, last, init, op);
+  }
+
+  template <typename RandomIt, typename T>
+  T reduce(RandomIt first, RandomIt last, T init)
+  {
+    return parallel::reduce(default_thread_pool(), first, last, init, std::plus<T>());
+  }
+
+  /**
+   *  Writes the running combination of [first, last) under op to the range starting at out, so out[i] is
+   *  first[0] op ... op first[i]. out may equal first. Runs in two passes: one that reduces each chunk, and one that
+   *  rescans each chunk starting from the combined total of the chunks before it. op only needs to be associative.
+   *  @param the pool, the input range, the start of the output range and an associative binary operation.
+   */
+  template <typename InputIt, typename OutputIt, typename BinaryOp>
+  void inclusive_scan(thread_pool& pool, InputIt first, InputIt last, OutputIt out, BinaryOp op)
+  {
+    typedef typename std::iterator_traits<InputIt>::value_type T;
+    const size_t n = static_cast<size_t>(last - first);
+    if(n == 0) {
+      return;
+    }
+    const std::vector<size_t> parts = detail::split(out, n, detail::pieces_for(n, pool));
+    const size_t part_count = parts.size()-1;
+    std::vector<detail::padded<T> > carry(part_count, detail::padded<T>(first[0]));
+    pool.run(part_count, [&](size_t p) {
+      if(p + 1 == part_count) {
+        return; // Nothing comes after the last chunk, so its total isn't needed.
+      }
+      T local = first[parts[p]];
+      for(size_t i = parts[p]+1; i < parts[p+1]; i++) {
+        local = op(local, first[i]);
+      }
+      carry[p].value = local;
+    });
+    // carry[p] becomes the combination of every chunk before p.
+    for(size_t p = part_count-1; p > 0; p--) {
+      carry[p].value = carry[p-1].value;
+    }
+    for(size_t p = 2; p < part_count; p++) {
+      carry[p].value = op(carry[p-1].value, carry[p].value);
+    }
+    pool.run(part_count, [&](size_t p) {
+      T running = (p == 0 ? first[0] : op(carry[p].value, first[parts[p]]));
+      out[parts[p]] = running;
+      for(size_t i = parts[p]+1; i < parts[p+1]; i++) {
+        running = op(running, first[i]);
+        out[i] = running;
+      }
+    });
+  }
+
+  template <typename InputIt, typename OutputIt, typename BinaryOp>
+  void inclusive_scan(InputIt first, InputIt last, OutputIt out, BinaryOp op)
+  {
+    parallel::inclusive_scan(default_thread_pool(), first, last, out, op);
+  }
+
+  template <typename InputIt, typename OutputIt>
+  void inclusive_scan(InputIt first, InputIt last, OutputIt out)
+  {
+    parallel::inclusive_scan(default_thread_pool(), first, last, out, std::plus<typename std::iterator_traits<InputIt>::value_type>());
+  }
+
+  /**
+   *  Whole-Vector versions of the algorithms above, run on the default pool.
+   */
+  template <typename T, typename P, size_t N, typename A>
+  void sort(Vector<T, P, N, A>& v)
+  {
+    parallel::sort(v.begin(), v.end());
+  }
+
+  template <typename T, typename P, size_t N, typename A, typename Compare>
+  void sort(Vector<T, P, N, A>& v, Compare comp)
+  {
+    parallel::sort(v.begin(), v.end(), comp);
+  }
+
+  template <typename T, typename P, size_t N, typename A, typename UnaryFunction>
+  void for_each(Vector<T, P, N, A>& v, UnaryFunction f)
+  {
+    parallel::for_each(v.begin(), v.end(), f);
+  }
+
+  // Applies f to every element in place.
+  template <typename T, typename P, size_t N, typename A, typename UnaryFunction>
+  void transform(Vector<T, P, N, A>& v, UnaryFunction f)
+  {
+    parallel::transform(v.begin(), v.end(), v.begin(), f);
+  }
+
+  template <typename T, typename P, size_t N, typename A, typename U, typename BinaryOp>
+  U reduce(const Vector<T, P, N, A>& v, U init, BinaryOp op)
+  {
+    return parallel::reduce(v.begin(), v.end(), init, op);
+  }
+
+  template <typename T, typename P, size_t N, typename A, typename U>
+  U reduce(const Vector<T, P, N, A>& v, U init)
+  {
+    return parallel::reduce(v.begin(), v.end(), init);
+  }
+
+  // Replaces every element with the running combination up to and including it.
+  template <typename T, typename P, size_t N, typename A, typename BinaryOp>
+  void inclusive_scan(Vector<T, P, N, A>& v, BinaryOp op)
+  {
+    parallel::inclusive_scan(v.begin(), v.end(), v.begin(), op);
+  }
+
+  template <typename T, typename P, size_t N, typename A>
+  void inclusive_scan(Vector<T, P, N, A>& v)
+  {
+    parallel::inclusive_scan(v.begin(), v.end(), v.begin());
+  }
+
+}
+}
+
+#endif
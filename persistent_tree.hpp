@@ -0,0 +1,742 @@
+/**
+ *  persistent_tree.hpp
+ *  A red black tree whose versions share their unchanged nodes, and a wrapper that publishes versions from one
+ *  writer to any number of readers without locking them.
+ *
+ *  Nodes never change once a version can see them. An update copies the path it changes and points the copies at
+ *  the subtrees it leaves alone, so the old version stays intact next to the new one, and copying a tree is O(1).
+ *  Every node counts the nodes and trees that point to it, and the last one to let go frees it, from whichever
+ *  thread that happens on.
+ *
+ *  @author Marquess Valdez
+ *  @version 1.0
+ */
+#ifndef MQS_PERSISTENT_TREE_HPP
+#define MQS_PERSISTENT_TREE_HPP
+
+#include <atomic>
+#include <cstddef> //for std::size_t
+#include <cstdint> // for std::uint32_t
+#include <memory> // for std::allocator_traits
+#include <mutex>
+#include <new> // for placement new
+#include <thread> // for std::this_thread::yield
+#include <type_traits> // for std::is_void
+#include <utility> // for std::forward, std::move, std::swap, std::declval
+#include "allocator.hpp"
+
+namespace mqs
+{
+
+  namespace detail
+  {
+
+    template <typename T>
+    struct persistent_node
+    {
+      // Trees and nodes pointing here. 32 bits covers more references than fit in memory with the nodes.
+      std::atomic<std::uint32_t> refs;
+      bool black;
+      persistent_node *left;
+      persistent_node *right;
+      T data;
+
+      template <typename... Args>
+      explicit persistent_node(Args&&... args) : refs(1), black(false), left(nullptr), right(nullptr),
+        data(std::forward<Args>(args)...) {}
+    };
+
+  }
+
+  template <typename T, typename Allocator>
+  class versioned_red_black_tree;
+
+  /**
+   *  A set of T in a red black tree whose copies share nodes. T needs == and >.
+   *
+   *  Copying and snapshot() cost O(1), and insert() and remove() copy the O(log n) nodes on the path they change,
+   *  leaving every other version as it was. Updates give the strong guarantee: if an element or the allocator
+   *  throws, the tree is unchanged. Like std::shared_ptr, separate trees can be used from separate threads even when
+   *  they share nodes, but one tree can't be read and written at the same time; versioned_red_black_tree hands
+   *  readers their own copies. Nodes come one at a time from Allocator rebound to the node type and go back through
+   *  whichever copy of the tree drops them last, so with more than one thread the allocator has to be thread safe,
+   *  as heap_allocator is.
+   */
+  template <typename T, typename Allocator = heap_allocator<T>>
+  class persistent_red_black_tree : private detail::allocator_holder<typename std::allocator_traits<Allocator>::template
+                                                                       rebind_alloc<detail::persistent_node<T>>>
+  {
+  private:
+    typedef detail::persistent_node<T> node;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<node> node_allocator;
+    typedef std::allocator_traits<node_allocator> node_traits;
+
+    template <typename, typename> friend class versioned_red_black_tree;
+
+    /**
+     *  One counted reference to a node, given up when it goes out of scope. Updates build the new version out of
+     *  these, so if anything throws halfway, every node made so far is freed and the references taken are dropped.
+     *  A node with a count of 1 is referenced only by the ref holding it, which may then change it in place.
+     */
+    class ref
+    {
+    private:
+      node *n;
+      persistent_red_black_tree *t;
+
+    public:
+      ref(node *n, persistent_red_black_tree *t) : n(n), t(t) {}
+
+      ref(ref&& r) : n(r.n), t(r.t)
+      {
+        r.n = nullptr;
+      }
+
+      ref& operator=(ref&& r)
+      {
+        std::swap(n, r.n);
+        return *this;
+      }
+
+      ref(const ref&) = delete;
+      ref& operator=(const ref&) = delete;
+
+      ~ref()
+      {
+        t->release(n);
+      }
+
+      node* get() const
+      {
+        return n;
+      }
+
+      node* operator->() const
+      {
+        return n;
+      }
+
+      explicit operator bool() const
+      {
+        return n != nullptr;
+      }
+
+      // Hands the reference over to whatever stores the returned pointer.
+      node* take()
+      {
+        node *taken = n;
+        n = nullptr;
+        return taken;
+      }
+    };
+
+    // Taller than any red black tree with fewer than 2^64 nodes.
+    static const int max_height = 128;
+
+    node *root;
+    size_t count;
+
+    static bool red(const node *n)
+    {
+      return n && !n->black;
+    }
+
+    static node* retain(node *n)
+    {
+      if(n) {
+        n->refs.fetch_add(1, std::memory_order_relaxed);
+      }
+      return n;
+    }
+
+    // Drops a reference to n, freeing n and dropping its references to its children if it was the last.
+    void release(node *n)
+    {
+      while(n && n->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        release(n->left);
+        node *right = n->right;
+        n->~node();
+        node_traits::deallocate(this->allocator(), n, 1);
+        n = right;
+      }
+    }
+
+    template <typename... Args>
+    ref make(Args&&... args)
+    {
+      node *n = node_traits::allocate(this->allocator(), 1);
+      try {
+        ::new(static_cast<void*>(n)) node(std::forward<Args>(args)...);
+      } catch(...) {
+        node_traits::deallocate(this->allocator(), n, 1);
+        throw;
+      }
+      return ref(n, this);
+    }
+
+    ref own(node *n)
+    {
+      return ref(retain(n), this);
+    }
+
+    // Returns a reference to n that can change it: n itself if nothing else refers to it, and otherwise a copy.
+    ref unique(ref n)
+    {
+      if(n->refs.load(std::memory_order_acquire) == 1) {
+        return n;
+      }
+      ref copy = make(static_cast<const T&>(n->data));
+      copy->black = n->black;
+      copy->left = retain(n->left);
+      copy->right = retain(n->right);
+      return copy;
+    }
+
+    /**
+     *  Makes p's left or right child unique, copying it in place if it is shared, and returns it. p must be unique.
+     *  If the copy throws, p is left without that child, which only matters to the new nodes being thrown away.
+     */
+    node* unique_child(node *p, bool left)
+    {
+      node *&slot = (left ? p->left : p->right);
+      ref c(slot, this);
+      slot = nullptr;
+      c = unique(std::move(c));
+      slot = c.take();
+      return slot;
+    }
+
+    /**
+     *  Fixes a red node with a red child right below t, if t is black, the way Okasaki's functional red black trees
+     *  do: of the three nodes, the middle one in order goes on top, red, with the other two black below it. An insert
+     *  only ever leaves red nodes meeting on its own path, all of it already copied, so nothing else is touched.
+     */
+    ref balance(ref t)
+    {
+      if(red(t.get())) {
+        return t;
+      }
+      node *l = t->left, *r = t->right, *x, *y, *z, *a, *b, *c, *d;
+      if(red(l) && red(l->left)) {
+        x = l->left, y = l, z = t.get();
+        a = x->left, b = x->right, c = y->right, d = z->right;
+      } else if(red(l) && red(l->right)) {
+        x = l, y = l->right, z = t.get();
+        a = x->left, b = y->left, c = y->right, d = z->right;
+      } else if(red(r) && red(r->left)) {
+        x = t.get(), y = r->left, z = r;
+        a = x->left, b = y->left, c = y->right, d = z->right;
+      } else if(red(r) && red(r->right)) {
+        x = t.get(), y = r, z = r->right;
+        a = x->left, b = y->left, c = z->left, d = z->right;
+      } else {
+        return t;
+      }
+      // Every node keeps exactly one reference to it, so no count changes.
+      x->left = a;
+      x->right = b;
+      x->black = true;
+      z->left = c;
+      z->right = d;
+      z->black = true;
+      y->left = x;
+      y->right = z;
+      y->black = false;
+      t.take();
+      return ref(y, this);
+    }
+
+    // Inserts m, a red node with no children, below t, copying t and the path below it where they are shared.
+    ref insert_below(ref t, ref& m)
+    {
+      if(!t) {
+        return std::move(m);
+      }
+      t = unique(std::move(t));
+      node *&slot = (t->data > m->data ? t->left : t->right);
+      ref c(slot, this);
+      slot = nullptr;
+      slot = insert_below(std::move(c), m).take();
+      return balance(std::move(t));
+    }
+
+    // Points whatever pointed to n, parent's link or top if parent is nil, at m instead.
+    void replace_child(node *parent, node *n, node *m, ref& top)
+    {
+      if(!parent) {
+        top.take();
+        top = ref(m, this);
+      } else if(parent->left == n) {
+        parent->left = m;
+      } else {
+        parent->right = m;
+      }
+    }
+
+    // Rotates n's right child up into n's place. Both must be unique.
+    void rotate_left(node *n, node *parent, ref& top)
+    {
+      node *r = n->right;
+      n->right = r->left;
+      r->left = n;
+      replace_child(parent, n, r, top);
+    }
+
+    void rotate_right(node *n, node *parent, ref& top)
+    {
+      node *l = n->left;
+      n->left = l->right;
+      l->right = n;
+      replace_child(parent, n, l, top);
+    }
+
+    /**
+     *  The remove repair from red_black_core, on nodes without parent links: a black node came out of path[i]'s
+     *  left or right subtree, which is now a black short. path holds the unique nodes from the root down to
+     *  path[i], and has room for one more, since the first case pushes a node into it. The sibling subtree and
+     *  the nephews it recolors or rotates get copied where they are shared.
+     */
+    void remove_repair(node **path, int i, bool left, ref& top)
+    {
+      while(i >= 0) {
+        node *p = path[i], *g = (i > 0 ? path[i - 1] : nullptr);
+        node *s = unique_child(p, !left);
+        if(red(s)) {
+          // A red sibling is rotated above p, which turns one of its black children into p's sibling.
+          s->black = true;
+          p->black = false;
+          if(left) {
+            rotate_left(p, g, top);
+          } else {
+            rotate_right(p, g, top);
+          }
+          path[i] = s;
+          path[++i] = p;
+          continue;
+        }
+        if(!red(s->left) && !red(s->right)) {
+          // Taking a black off both sides moves the shortage up to p, or ends it there if p is red.
+          s->black = false;
+          if(red(p)) {
+            p->black = true;
+            return;
+          }
+          left = (g && g->left == p);
+          i--;
+          continue;
+        }
+        if(left) {
+          if(!red(s->right)) {
+            // The red nephew is the near one, so it is rotated up to make it the far one.
+            node *near = unique_child(s, true);
+            near->black = true;
+            s->black = false;
+            rotate_right(s, p, top);
+            s = near;
+          }
+          node *far = unique_child(s, false);
+          far->black = true;
+          s->black = p->black;
+          p->black = true;
+          rotate_left(p, g, top);
+        } else {
+          if(!red(s->left)) {
+            node *near = unique_child(s, false);
+            near->black = true;
+            s->black = false;
+            rotate_left(s, p, top);
+            s = near;
+          }
+          node *far = unique_child(s, true);
+          far->black = true;
+          s->black = p->black;
+          p->black = true;
+          rotate_right(p, g, top);
+        }
+        return;
+      }
+    }
+
+    // Puts t in place of the root, painted black. The old root is dropped after, so nodes the two share are never
+    // freed.
+    void replace_root(ref t)
+    {
+      if(red(t.get())) {
+        t = unique(std::move(t));
+        t->black = true;
+      }
+      node *old = root;
+      root = t.take();
+      release(old);
+    }
+
+    static int depth(const node *n)
+    {
+      if(!n) {
+        return 0;
+      }
+      int l = depth(n->left), r = depth(n->right);
+      return 1 + (l > r ? l : r);
+    }
+
+    template <typename Visitor>
+    static size_t visit_range(const node *n, const T& lo, const T& hi, Visitor& visitor)
+    {
+      size_t visited = 0;
+      while(n) {
+        if(lo > n->data) { // n and its left subtree come before the range.
+          n = n->right;
+        } else if(!(hi > n->data)) { // n and its right subtree come after it.
+          n = n->left;
+        } else {
+          visited += visit_range(n->left, lo, hi, visitor) + 1;
+          visitor(static_cast<const T&>(n->data));
+          n = n->right;
+        }
+      }
+      return visited;
+    }
+
+    template <typename Visitor>
+    static void visit(const node *n, Visitor& visitor)
+    {
+      while(n) {
+        visit(n->left, visitor);
+        visitor(static_cast<const T&>(n->data));
+        n = n->right;
+      }
+    }
+
+  public:
+    typedef Allocator allocator_type;
+    typedef T value_type;
+    typedef size_t size_type;
+
+    explicit persistent_red_black_tree(const Allocator& a = Allocator()) :
+      detail::allocator_holder<node_allocator>(node_allocator(a)), root(nullptr), count(0) {}
+
+    /**
+     *  Copies t in O(1). The copy shares t's nodes, and changing either leaves the other as it was.
+     */
+    persistent_red_black_tree(const persistent_red_black_tree& t) :
+      detail::allocator_holder<node_allocator>(t.allocator()), root(retain(t.root)), count(t.count) {}
+
+    persistent_red_black_tree& operator=(const persistent_red_black_tree& t)
+    {
+      node *old = root;
+      root = retain(t.root);
+      count = t.count;
+      release(old);
+      return *this;
+    }
+
+    /**
+     *  @returns a copy of the tree in O(1), which later changes to the tree don't show up in.
+     */
+    persistent_red_black_tree snapshot() const
+    {
+      return *this;
+    }
+
+    /**
+     *  Inserts d, copying the O(log n) nodes between the root and where it goes.
+     *  @param d the data to insert.
+     *  @returns true if d wasn't in the tree yet.
+     */
+    bool insert(const T& d)
+    {
+      if(find(d)) {
+        return false;
+      }
+      ref m = make(d);
+      // The tree keeps its own reference to the old root throughout, so nodes are copied, never changed in place.
+      replace_root(insert_below(own(root), m));
+      count++;
+      return true;
+    }
+
+    /**
+     *  Removes d, copying the O(log n) nodes between the root and where it was, and the few next to that path that
+     *  rebalancing recolors or rotates.
+     *  @param d the data to remove.
+     *  @returns true if d was in the tree.
+     */
+    bool remove(const T& d)
+    {
+      if(!find(d)) {
+        return false;
+      }
+      // As in insert(), the old root keeps the tree's reference, so the path is copied rather than changed.
+      ref top = unique(own(root));
+      node *path[max_height + 1];
+      int levels = 0;
+      node *n = top.get();
+      while(!(n->data == d)) {
+        path[levels++] = n;
+        n = unique_child(n, n->data > d);
+      }
+      if(n->left && n->right) {
+        // The predecessor has no right child, so it is easier to take out. It trades elements with n first.
+        path[levels++] = n;
+        node *pred = unique_child(n, true);
+        while(pred->right) {
+          path[levels++] = pred;
+          pred = unique_child(pred, false);
+        }
+        using std::swap;
+        swap(n->data, pred->data);
+        n = pred;
+      }
+      node *parent = (levels > 0 ? path[levels - 1] : nullptr), *child = (n->left ? n->left : n->right);
+      bool left = (parent && parent->left == n), black = n->black;
+      n->left = n->right = nullptr;
+      replace_child(parent, n, child, top);
+      release(n);
+      if(black) {
+        if(red(child)) {
+          // Painting the child black makes up for it. A child that is now the root gets that from replace_root().
+          if(parent) {
+            unique_child(parent, left)->black = true;
+          }
+        } else {
+          remove_repair(path, levels - 1, left, top);
+        }
+      }
+      replace_root(std::move(top));
+      count--;
+      return true;
+    }
+
+    /**
+     *  Checks if d is in the tree.
+     *  @param d the data to find.
+     *  @returns true if d was found and false otherwise.
+     */
+    bool find(const T& d) const
+    {
+      const node *curr = root;
+      while(curr) {
+        if(curr->data == d) {
+          return true;
+        }
+        curr = (curr->data > d ? curr->left : curr->right);
+      }
+      return false;
+    }
+
+    /**
+     *  Calls visitor on every element, in order.
+     *  @param visitor a callable taking a const T&.
+     */
+    template <typename Visitor>
+    void visit(Visitor visitor) const
+    {
+      visit(root, visitor);
+    }
+
+    /**
+     *  Calls visitor on every element in [lo, hi), in order, in O(log n + k) for k elements visited.
+     *  @param lo the smallest value to visit.
+     *  @param hi the value to stop at, which isn't visited.
+     *  @param visitor a callable taking a const T&.
+     *  @returns the number of elements visited.
+     */
+    template <typename Visitor>
+    size_t visit_range(const T& lo, const T& hi, Visitor visitor) const
+    {
+      return visit_range(root, lo, hi, visitor);
+    }
+
+    /**
+     *  @returns the size of the tree.
+     */
+    size_t size() const
+    {
+      return count;
+    }
+
+    bool empty() const
+    {
+      return count == 0;
+    }
+
+    /**
+     *  @returns the height of the tree.
+     */
+    int height() const
+    {
+      return depth(root);
+    }
+
+    /**
+     *  Removes every element. Nodes that other copies still use stay alive for them.
+     */
+    void clear()
+    {
+      replace_root(own(nullptr));
+      count = 0;
+    }
+
+    /**
+     *  @returns a copy of the allocator the tree was constructed with.
+     */
+    Allocator get_allocator() const
+    {
+      return Allocator(this->allocator());
+    }
+
+    ~persistent_red_black_tree()
+    {
+      release(root);
+    }
+  };
+
+  /**
+   *  A persistent_red_black_tree that one thread at a time updates and any number of threads read, each from a
+   *  version of its own. Every update publishes a new version, and snapshot() hands out the latest in O(1) without
+   *  locking anything: readers never wait for the writer or for each other, and keep their version, unchanged, for as
+   *  long as they hold it. Readers that look up many keys should take one snapshot for all of them.
+   *
+   *  A version is published by swapping a pointer, and the old pointer is only deleted once no reader can still be
+   *  about to copy the tree behind it. Readers announce themselves in one of two counters picked by an epoch that
+   *  each publish moves forward, and the writer waits for the previous epoch's counter to drain. A reader stays
+   *  counted only between reading the pointer and copying the tree, so the writer's wait is a few instructions long
+   *  unless a reader is descheduled right there, and new readers can't prolong it since they count in the other
+   *  epoch.
+   */
+  template <typename T, typename Allocator = heap_allocator<T>>
+  class versioned_red_black_tree
+  {
+  public:
+    typedef persistent_red_black_tree<T, Allocator> tree_type;
+    typedef T value_type;
+
+  private:
+    // The writer's version, which the published one is a copy of.
+    tree_type tree;
+    std::mutex writer;
+    std::atomic<tree_type*> published;
+    std::atomic<unsigned> epoch;
+    // Readers copying the published tree in each epoch's parity. Every reader writes here, so the counters are
+    // padded onto a cache line of their own, away from the rest, wherever the tree is allocated.
+    char readers_before[64];
+    mutable std::atomic<size_t> readers[2];
+    char readers_after[64 - 2*sizeof(std::atomic<size_t>)];
+
+    // Publishes the writer's version and frees the one it replaces once no reader can still be copying it.
+    void publish()
+    {
+      tree_type *old = published.exchange(new tree_type(tree));
+      unsigned e = epoch.load();
+      epoch.store(e + 1);
+      while(readers[e & 1].load() != 0) {
+        std::this_thread::yield();
+      }
+      delete old;
+    }
+
+    // Runs f on the writer's version and publishes the result.
+    template <typename F>
+    auto apply(F& f, std::false_type) -> decltype(f(std::declval<tree_type&>()))
+    {
+      typedef decltype(f(std::declval<tree_type&>())) result_type;
+      result_type result = f(tree);
+      publish();
+      return std::forward<result_type>(result);
+    }
+
+    template <typename F>
+    void apply(F& f, std::true_type)
+    {
+      f(tree);
+      publish();
+    }
+
+  public:
+    explicit versioned_red_black_tree(const Allocator& a = Allocator()) : tree(a), published(new tree_type(tree)),
+      epoch(0)
+    {
+      readers[0] = 0;
+      readers[1] = 0;
+    }
+
+    versioned_red_black_tree(const versioned_red_black_tree&) = delete;
+    versioned_red_black_tree& operator=(const versioned_red_black_tree&) = delete;
+
+    /**
+     *  @returns the latest published version, in O(1) and without a lock.
+     */
+    tree_type snapshot() const
+    {
+      unsigned e;
+      for(;;) {
+        e = epoch.load();
+        readers[e & 1].fetch_add(1);
+        if(epoch.load() == e) {
+          break;
+        }
+        readers[e & 1].fetch_sub(1); // A publish got in between, so count in the new epoch instead.
+      }
+      tree_type copy(*published.load());
+      readers[e & 1].fetch_sub(1, std::memory_order_release);
+      return copy;
+    }
+
+    /**
+     *  Inserts d and publishes the result, in O(log n).
+     *  @returns true if d wasn't in the tree yet.
+     */
+    bool insert(const T& d)
+    {
+      std::lock_guard<std::mutex> lock(writer);
+      if(!tree.insert(d)) {
+        return false;
+      }
+      publish();
+      return true;
+    }
+
+    /**
+     *  Removes d and publishes the result, in O(log n).
+     *  @returns true if d was in the tree.
+     */
+    bool remove(const T& d)
+    {
+      std::lock_guard<std::mutex> lock(writer);
+      if(!tree.remove(d)) {
+        return false;
+      }
+      publish();
+      return true;
+    }
+
+    /**
+     *  Runs f(tree_type&) on the writer's version and then publishes it, so readers see all of f's changes at once
+     *  or none of them. If f or the publish throws, the tree goes back to how it was before f ran. Other writers wait until it is
+     *  done.
+     *  @returns what f returns.
+     */
+    template <typename F>
+    auto write(F f) -> decltype(f(std::declval<tree_type&>()))
+    {
+      std::lock_guard<std::mutex> lock(writer);
+      tree_type before(tree); // O(1), and shares nodes with the tree rather than keeping more alive.
+      try {
+        return apply(f, std::is_void<decltype(f(std::declval<tree_type&>()))>());
+      } catch(...) {
+        // Whether f or the publish threw, the published version is still the one before f ran, so going back to it
+        // leaves nothing to publish.
+        tree = before;
+        throw;
+      }
+    }
+
+    ~versioned_red_black_tree()
+    {
+      delete published.load();
+    }
+  };
+
+}
+
+#endif
@@ -0,0 +1,1962 @@
+/**
+ *  red_black_core.hpp
+ *  The balancing code shared by the red black tree containers: rotations, insert and remove repair, join and split
+ *  with the set operations built on them, and in-order navigation, written against a node storage so the same code
+ *  runs on pointer-linked and index-linked nodes.
+ *
+ *  A storage owns the nodes and says how they link up. It provides a handle type and nil(), the accessors left,
+ *  right, parent, is_red and data, the setters set_left, set_right, set_parent, set_red and set_black, and
+ *  create(parent, args...) and destroy(handle) for single nodes, reserve(n) to make room for n more nodes,
+ *  release() to free every node at once, and swap(s) to trade nodes and allocator with another storage.
+ *
+ *  @author Marquess Valdez
+ *  @version 1.0
+ */
+#ifndef MQS_RED_BLACK_CORE_HPP
+#define MQS_RED_BLACK_CORE_HPP
+
+#include <cstddef> //for std::size_t
+#include <cstdint> // for std::uint32_t, std::uintptr_t
+#include <cstring> // for std::memcpy
+#include <exception> // for std::exception_ptr
+#include <iterator> // for std::bidirectional_iterator_tag
+#include <memory> // for std::allocator_traits
+#include <new> // for placement new
+#include <stdexcept> // for std::length_error
+#include <type_traits>
+#include <utility> // for std::forward, std::move
+#include <vector> // for std::vector
+#include "allocator.hpp"
+#include "memory.hpp"
+
+namespace mqs
+{
+
+  /**
+   *  Node layouts for the red black tree containers.
+   *  pointer_nodes links nodes with pointers and keeps each node's color in the low bit of its parent pointer. Nodes
+   *  live in slabs and never move, so references to elements stay valid until the element is removed.
+   *  index_nodes keeps every node in one array and links them with 32-bit indices, the color in the low bit of the
+   *  parent index, which halves the links of a node on a 64-bit machine. The array grows by doubling, which moves
+   *  the nodes, so references to elements are invalidated by insertions, although iterators are not. It holds at
+   *  most 2^31 - 1 nodes and needs trivially relocatable elements.
+   */
+  struct pointer_nodes {};
+  struct index_nodes {};
+
+  /**
+   *  Tags a range as already sorted in strictly increasing order, so a container can be built from it without
+   *  checking or sorting it first.
+   */
+  struct sorted_unique_t {};
+  const sorted_unique_t sorted_unique = sorted_unique_t();
+
+  /**
+   *  Augmentations keep extra data in every node, computed from the node and its children, and the core keeps it up
+   *  to date through every insert, erase and rotation. An augmentation has a node_data<Size> template, where Size is
+   *  the storage's size type, and a static update(core, n) that recomputes n's data from its children's.
+   *
+   *  no_augment is the default: its node_data is empty and takes no space, and its update is a no-op that compiles
+   *  away, so a plain tree pays nothing for the hooks.
+   */
+  struct no_augment
+  {
+    template <typename Size>
+    struct node_data {};
+
+    template <typename Core>
+    static void update(const Core&, typename Core::handle) {}
+  };
+
+  /**
+   *  Keeps the size of every subtree, which finds the k-th element and counts the elements below a value in
+   *  O(log n). Costs one size per node and a walk up to the root on every insert and erase.
+   */
+  struct order_statistics
+  {
+    template <typename Size>
+    struct node_data
+    {
+      Size subtree_size;
+    };
+
+    // The number of nodes in the subtree under n, 0 for nil.
+    template <typename Core>
+    static size_t size_of(const Core& core, typename Core::handle n)
+    {
+      return n == Core::nil() ? 0 : core.aug(n).subtree_size;
+    }
+
+    template <typename Core>
+    static void update(const Core& core, typename Core::handle n)
+    {
+      core.aug(n).subtree_size = 1 + size_of(core, core.left(n)) + size_of(core, core.right(n));
+    }
+  };
+
+  /**
+   *  Says how to read the endpoints of an interval kept in an interval_tree. The default reads a std::pair as the
+   *  closed interval [first, second]; specialize it for other element types. Endpoints need <.
+   */
+  template <typename T>
+  struct interval_traits
+  {
+    typedef typename T::first_type point_type;
+
+    static const point_type& low(const T& t)
+    {
+      return t.first;
+    }
+
+    static const point_type& high(const T& t)
+    {
+      return t.second;
+    }
+  };
+
+  /**
+   *  Keeps the largest high endpoint under every node of a tree of closed intervals, which must be ordered by their
+   *  low endpoint first. A search for the intervals overlapping a range skips every subtree whose intervals all end
+   *  before it. Costs one endpoint per node and a walk up to the root on every insert and erase.
+   */
+  template <typename T, typename Traits = interval_traits<T>>
+  struct max_endpoint
+  {
+    typedef Traits traits;
+    typedef typename Traits::point_type point_type;
+
+    template <typename Size>
+    struct node_data
+    {
+      point_type max_high;
+    };
+
+    // The largest high endpoint in the subtree under n, which must not be nil.
+    template <typename Core>
+    static const point_type& max_of(const Core& core, typename Core::handle n)
+    {
+      return core.aug(n).max_high;
+    }
+
+    template <typename Core>
+    static void update(const Core& core, typename Core::handle n)
+    {
+      const point_type* m = &Traits::high(core.data(n));
+      typename Core::handle l = core.left(n), r = core.right(n);
+      if(l != Core::nil() && *m < max_of(core, l)) {
+        m = &max_of(core, l);
+      }
+      if(r != Core::nil() && *m < max_of(core, r)) {
+        m = &max_of(core, r);
+      }
+      core.aug(n).max_high = *m;
+    }
+  };
+
+  /**
+   *  Stats policies count what the tree does on its hot paths. The core calls on_lookup() at the start of every
+   *  search, on_compare() for every node a search compares a key against, on_rotate() for every rotation,
+   *  on_insert_case(c) and on_remove_case(c) for every case of a repair it runs, numbered as in the repair code, and
+   *  on_allocate(bytes) for every node it creates.
+   *
+   *  no_stats is the default: it is empty, so it takes no space in the tree, and its hooks are no-ops that compile
+   *  away, so a tree without stats runs the same code as before they existed.
+   */
+  struct no_stats
+  {
+    void on_lookup() {}
+    void on_compare() {}
+    void on_rotate() {}
+    void on_insert_case(int) {}
+    void on_remove_case(int) {}
+    void on_allocate(size_t) {}
+  };
+
+  /**
+   *  Counts everything no_stats ignores, for finding out why a tree got slow: deep searches show up as comparisons
+   *  per lookup, and skewed insert and erase patterns as rotations and long recolor cascades. Case 3 of both repairs
+   *  recolors and moves the repair up two levels or one, and a cascade is a run of them in one repair. Nodes come
+   *  out of slabs or a free list, so allocations counts nodes handed out rather than calls to the allocator. The
+   *  counters are plain integers, so a tree that keeps stats runs its set operations on the calling thread even
+   *  when given a pool.
+   */
+  struct rb_stats
+  {
+    size_t lookups = 0;
+    size_t comparisons = 0;
+    size_t rotations = 0;
+    size_t insert_cases[4] = {}; // insert_cases[0] counts case 1.
+    size_t remove_cases[6] = {};
+    size_t recolors = 0; // Repair steps that recolored and moved up, case 3 of either repair.
+    size_t longest_cascade = 0; // The most recolors in one repair.
+    size_t allocations = 0;
+    size_t allocated_bytes = 0;
+
+    double comparisons_per_lookup() const
+    {
+      return lookups == 0 ? 0.0 : double(comparisons) / double(lookups);
+    }
+
+    void on_lookup()
+    {
+      lookups++;
+    }
+
+    void on_compare()
+    {
+      comparisons++;
+    }
+
+    void on_rotate()
+    {
+      rotations++;
+    }
+
+    void on_insert_case(int c)
+    {
+      insert_cases[c - 1]++;
+      on_repair_step(c == 3);
+    }
+
+    void on_remove_case(int c)
+    {
+      remove_cases[c - 1]++;
+      on_repair_step(c == 3);
+    }
+
+    void on_allocate(size_t bytes)
+    {
+      allocations++;
+      allocated_bytes += bytes;
+    }
+
+  private:
+    size_t cascade = 0; // Recolors so far in the running repair.
+
+    // Every repair ends in a case other than 3, which closes its cascade.
+    void on_repair_step(bool recolored)
+    {
+      if(recolored) {
+        recolors++;
+        cascade++;
+        return;
+      }
+      if(cascade > longest_cascade) {
+        longest_cascade = cascade;
+      }
+      cascade = 0;
+    }
+  };
+
+  namespace detail
+  {
+
+    // True for the augmentations that make a tree an interval tree.
+    template <typename Augment>
+    struct is_max_endpoint : std::false_type {};
+
+    template <typename T, typename Traits>
+    struct is_max_endpoint<max_endpoint<T, Traits>> : std::true_type {};
+
+    template <typename T, typename Aug>
+    struct rb_pointer_node : Aug
+    {
+      std::uintptr_t parent_color; // The parent's address, with the low bit set if this node is black.
+      rb_pointer_node *left;
+      rb_pointer_node *right;
+      T data;
+
+      // New nodes are red.
+      template <typename... Args>
+      explicit rb_pointer_node(rb_pointer_node *parent, Args&&... args) :
+        parent_color(reinterpret_cast<std::uintptr_t>(parent)), left(nullptr), right(nullptr),
+        data(std::forward<Args>(args)...) {}
+    };
+
+    /**
+     *  Pointer-linked nodes carved out of slabs in the order they are created, so nodes created close together in
+     *  time sit close together in memory. Destroyed nodes go on a free list and are reused first. Slabs start at 16
+     *  nodes and double up to 4096, and are only given back by release().
+     */
+    template <typename T, typename Allocator, typename Augment>
+    class rb_pointer_storage : private allocator_holder<typename std::allocator_traits<Allocator>::template
+                                 rebind_alloc<rb_pointer_node<T, typename Augment::template node_data<size_t>>>>
+    {
+    public:
+      typedef T value_type;
+      typedef Augment augment;
+      typedef typename Augment::template node_data<size_t> aug_type;
+      typedef rb_pointer_node<T, aug_type> node;
+      typedef node* handle;
+      typedef typename std::allocator_traits<Allocator>::template rebind_alloc<node> node_allocator;
+
+    private:
+      typedef std::allocator_traits<node_allocator> node_traits;
+
+      // The first node-sized slot of every slab holds this instead of a node.
+      struct slab_header
+      {
+        slab_header *next;
+        size_t nodes;
+      };
+
+      // What a node slot on the free list holds.
+      struct free_slot
+      {
+        free_slot *next;
+      };
+
+      static_assert(sizeof(slab_header) <= sizeof(node), "mqs::rb_pointer_storage: node too small for a slab header.");
+
+      static const size_t initial_slab_nodes = 16;
+      static const size_t max_slab_nodes = 4096;
+
+      slab_header *slabs;
+      node *slab_cur;  // The next unused slot in the newest slab.
+      node *slab_end;
+      free_slot *free_nodes;
+      size_t next_slab_nodes;
+
+      // Returns an unconstructed node slot, reusing the most recently freed one if there is one.
+      node* take_node()
+      {
+        if(free_nodes) {
+          free_slot *slot = free_nodes;
+          free_nodes = slot->next;
+          return reinterpret_cast<node*>(slot);
+        }
+        if(slab_cur == slab_end) {
+          add_slab(next_slab_nodes);
+          next_slab_nodes = (next_slab_nodes < max_slab_nodes/2 ? 2*next_slab_nodes : size_t(max_slab_nodes));
+        }
+        return slab_cur++;
+      }
+
+      // Starts a new slab of the given number of node slots, one of which holds its header.
+      void add_slab(size_t nodes)
+      {
+        node *slab = node_traits::allocate(this->allocator(), nodes);
+        slabs = ::new(static_cast<void*>(slab)) slab_header{slabs, nodes};
+        slab_cur = slab + 1;
+        slab_end = slab + nodes;
+      }
+
+      void give_back(node *n)
+      {
+        free_nodes = ::new(static_cast<void*>(n)) free_slot{free_nodes};
+      }
+
+    public:
+      explicit rb_pointer_storage(const Allocator& a) : allocator_holder<node_allocator>(node_allocator(a)),
+        slabs(nullptr), slab_cur(nullptr), slab_end(nullptr), free_nodes(nullptr),
+        next_slab_nodes(initial_slab_nodes) {}
+
+      rb_pointer_storage(const rb_pointer_storage&) = delete;
+      rb_pointer_storage& operator=(const rb_pointer_storage&) = delete;
+
+      static handle nil()
+      {
+        return nullptr;
+      }
+
+      handle left(handle n) const
+      {
+        return n->left;
+      }
+
+      handle right(handle n) const
+      {
+        return n->right;
+      }
+
+      handle parent(handle n) const
+      {
+        return reinterpret_cast<handle>(n->parent_color & ~std::uintptr_t(1));
+      }
+
+      bool is_red(handle n) const
+      {
+        return !(n->parent_color & 1);
+      }
+
+      T& data(handle n) const
+      {
+        return n->data;
+      }
+
+      aug_type& aug(handle n) const
+      {
+        return *n;
+      }
+
+      void set_left(handle n, handle l)
+      {
+        n->left = l;
+      }
+
+      void set_right(handle n, handle r)
+      {
+        n->right = r;
+      }
+
+      void set_parent(handle n, handle p)
+      {
+        n->parent_color = reinterpret_cast<std::uintptr_t>(p) | (n->parent_color & 1);
+      }
+
+      void set_red(handle n)
+      {
+        n->parent_color &= ~std::uintptr_t(1);
+      }
+
+      void set_black(handle n)
+      {
+        n->parent_color |= 1;
+      }
+
+      // Makes sure the next n nodes that don't reuse a destroyed one come from the rest of the newest slab and at
+      // most one more. The newest slab stays in use, since n may count keys that are never inserted, and starting a
+      // slab early would strand the rest of it until release(). In an empty storage the n nodes come from one slab.
+      void reserve(size_t n)
+      {
+        if(static_cast<size_t>(slab_end - slab_cur) < n) {
+          size_t needed = n + 1 - static_cast<size_t>(slab_end - slab_cur);
+          next_slab_nodes = (next_slab_nodes < needed ? needed : next_slab_nodes);
+        }
+      }
+
+      template <typename... Args>
+      handle create(handle parent, Args&&... args)
+      {
+        node *n = take_node();
+        try {
+          ::new(static_cast<void*>(n)) node(parent, std::forward<Args>(args)...);
+        } catch(...) {
+          give_back(n);
+          throw;
+        }
+        return n;
+      }
+
+      void destroy(handle n)
+      {
+        n->~node();
+        give_back(n);
+      }
+
+      // Exchanges every node and the allocator with s, without touching a node.
+      void swap(rb_pointer_storage& s)
+      {
+        using std::swap;
+        swap(this->allocator(), s.allocator());
+        swap(slabs, s.slabs);
+        swap(slab_cur, s.slab_cur);
+        swap(slab_end, s.slab_end);
+        swap(free_nodes, s.free_nodes);
+        swap(next_slab_nodes, s.next_slab_nodes);
+      }
+
+      // Frees every slab at once; every node must already be destroyed or trivially destructible.
+      void release()
+      {
+        while(slabs) {
+          slab_header *next = slabs->next;
+          size_t nodes = slabs->nodes;
+          node_traits::deallocate(this->allocator(), reinterpret_cast<node*>(slabs), nodes);
+          slabs = next;
+        }
+        slab_cur = slab_end = nullptr;
+        free_nodes = nullptr;
+        next_slab_nodes = initial_slab_nodes;
+      }
+
+      node_allocator get_allocator() const
+      {
+        return this->allocator();
+      }
+    };
+
+    template <typename T, typename Aug>
+    struct rb_index_node : Aug
+    {
+      std::uint32_t parent_color; // The parent's index shifted left by one, with the low bit set if this node is black.
+      std::uint32_t left;
+      std::uint32_t right;
+      T data;
+
+      // New nodes are red and have no children, and nil is 0x7FFFFFFF.
+      template <typename... Args>
+      explicit rb_index_node(std::uint32_t parent, Args&&... args) : parent_color(parent << 1), left(0x7FFFFFFF),
+        right(0x7FFFFFFF), data(std::forward<Args>(args)...) {}
+    };
+
+    /**
+     *  Index-linked nodes in one array that doubles when it fills up. Destroyed nodes go on a free list threaded
+     *  through their slots and are reused first. Growing moves the array with the allocator's reallocate() if it has
+     *  one, and memcpy otherwise, which is why the elements have to be trivially relocatable.
+     */
+    template <typename T, typename Allocator, typename Augment>
+    class rb_index_storage : private allocator_holder<typename std::allocator_traits<Allocator>::template
+                               rebind_alloc<rb_index_node<T, typename Augment::template node_data<std::uint32_t>>>>
+    {
+    public:
+      typedef T value_type;
+      typedef Augment augment;
+      typedef typename Augment::template node_data<std::uint32_t> aug_type;
+      typedef rb_index_node<T, aug_type> node;
+      typedef std::uint32_t handle;
+      typedef typename std::allocator_traits<Allocator>::template rebind_alloc<node> node_allocator;
+
+    private:
+      typedef std::allocator_traits<node_allocator> node_traits;
+
+      static_assert(is_trivially_relocatable<T>::value,
+                    "mqs::index_nodes: elements must be trivially relocatable, since growing moves them with memcpy.");
+
+      struct free_slot
+      {
+        std::uint32_t next;
+      };
+
+      static const std::uint32_t max_nodes = 0x7FFFFFFF;
+
+      node *nodes;
+      std::uint32_t capacity;
+      std::uint32_t used;      // Slots below this have been handed out at least once.
+      std::uint32_t free_head;
+
+      // Doubles the array, or grows it to hold at least min_capacity nodes if that is more.
+      void grow(size_t min_capacity = 0)
+      {
+        if(capacity == max_nodes || min_capacity > max_nodes) {
+          throw std::length_error("mqs::red_black_tree: index_nodes can hold at most 2^31 - 1 nodes.");
+        }
+        std::uint32_t new_capacity = (capacity == 0 ? 16 : (capacity > max_nodes/2 ? max_nodes : 2*capacity));
+        if(new_capacity < min_capacity) {
+          new_capacity = static_cast<std::uint32_t>(min_capacity);
+        }
+        if(detail::has_reallocate<node_allocator>::value && nodes) {
+          nodes = detail::reallocate(this->allocator(), nodes, capacity, new_capacity,
+                                     detail::has_reallocate<node_allocator>());
+        } else {
+          node *new_nodes = node_traits::allocate(this->allocator(), new_capacity);
+          if(nodes) {
+            std::memcpy(static_cast<void*>(new_nodes), static_cast<const void*>(nodes), used*sizeof(node));
+            node_traits::deallocate(this->allocator(), nodes, capacity);
+          }
+          nodes = new_nodes;
+        }
+        capacity = new_capacity;
+      }
+
+      template <typename... Args>
+      handle construct(handle h, handle parent, Args&&... args)
+      {
+        try {
+          ::new(static_cast<void*>(nodes + h)) node(parent, std::forward<Args>(args)...);
+        } catch(...) {
+          give_back(h);
+          throw;
+        }
+        return h;
+      }
+
+      void give_back(handle h)
+      {
+        ::new(static_cast<void*>(nodes + h)) free_slot{free_head};
+        free_head = h;
+      }
+
+    public:
+      explicit rb_index_storage(const Allocator& a) : allocator_holder<node_allocator>(node_allocator(a)),
+        nodes(nullptr), capacity(0), used(0), free_head(max_nodes) {}
+
+      rb_index_storage(const rb_index_storage&) = delete;
+      rb_index_storage& operator=(const rb_index_storage&) = delete;
+
+      static handle nil()
+      {
+        return max_nodes;
+      }
+
+      handle left(handle n) const
+      {
+        return nodes[n].left;
+      }
+
+      handle right(handle n) const
+      {
+        return nodes[n].right;
+      }
+
+      handle parent(handle n) const
+      {
+        return nodes[n].parent_color >> 1;
+      }
+
+      bool is_red(handle n) const
+      {
+        return !(nodes[n].parent_color & 1);
+      }
+
+      T& data(handle n) const
+      {
+        return nodes[n].data;
+      }
+
+      aug_type& aug(handle n) const
+      {
+        return nodes[n];
+      }
+
+      void set_left(handle n, handle l)
+      {
+        nodes[n].left = l;
+      }
+
+      void set_right(handle n, handle r)
+      {
+        nodes[n].right = r;
+      }
+
+      void set_parent(handle n, handle p)
+      {
+        nodes[n].parent_color = (p << 1) | (nodes[n].parent_color & 1);
+      }
+
+      void set_red(handle n)
+      {
+        nodes[n].parent_color &= ~std::uint32_t(1);
+      }
+
+      void set_black(handle n)
+      {
+        nodes[n].parent_color |= 1;
+      }
+
+      // Makes sure the next n nodes that don't reuse a destroyed one fit without growing the array.
+      void reserve(size_t n)
+      {
+        if(capacity - used < n) {
+          grow(used + n);
+        }
+      }
+
+      template <typename... Args>
+      handle create(handle parent, Args&&... args)
+      {
+        if(free_head != max_nodes) {
+          handle h = free_head;
+          free_head = reinterpret_cast<free_slot*>(nodes + h)->next;
+          return construct(h, parent, std::forward<Args>(args)...);
+        }
+        if(used == capacity) {
+          // The arguments may refer to an element that growing is about to move, so build the value first.
+          T value(std::forward<Args>(args)...);
+          grow();
+          return construct(used++, parent, std::move(value));
+        }
+        return construct(used++, parent, std::forward<Args>(args)...);
+      }
+
+      void destroy(handle h)
+      {
+        nodes[h].~node();
+        give_back(h);
+      }
+
+      // Exchanges every node and the allocator with s, without touching a node.
+      void swap(rb_index_storage& s)
+      {
+        using std::swap;
+        swap(this->allocator(), s.allocator());
+        swap(nodes, s.nodes);
+        swap(capacity, s.capacity);
+        swap(used, s.used);
+        swap(free_head, s.free_head);
+      }
+
+      // Frees the array; every node must already be destroyed or trivially destructible.
+      void release()
+      {
+        if(nodes) {
+          node_traits::deallocate(this->allocator(), nodes, capacity);
+        }
+        nodes = nullptr;
+        capacity = used = 0;
+        free_head = max_nodes;
+      }
+
+      node_allocator get_allocator() const
+      {
+        return this->allocator();
+      }
+    };
+
+    // Returns b if c is true and a otherwise, computed with a mask so compilers can't turn it into a branch.
+    template <typename P>
+    P* select_handle(bool c, P *a, P *b)
+    {
+      std::uintptr_t x = reinterpret_cast<std::uintptr_t>(a), y = reinterpret_cast<std::uintptr_t>(b);
+      return reinterpret_cast<P*>(x ^ ((x ^ y) & (std::uintptr_t(0) - c)));
+    }
+
+    inline std::uint32_t select_handle(bool c, std::uint32_t a, std::uint32_t b)
+    {
+      return a ^ ((a ^ b) & (std::uint32_t(0) - c));
+    }
+
+    // The set operations red_black_core::merge() runs.
+    enum class set_operation { unite, intersect, subtract };
+
+    // Runs every task on the calling thread, for merges that aren't given a thread pool.
+    struct no_pool
+    {
+      size_t size() const
+      {
+        return 1;
+      }
+
+      template <typename Fn>
+      void run(size_t tasks, const Fn& fn)
+      {
+        for(size_t i = 0; i < tasks; i++) {
+          fn(i);
+        }
+      }
+    };
+
+    template <typename T, typename Allocator, typename Layout, typename Augment = no_augment>
+    struct rb_storage;
+
+    template <typename T, typename Allocator, typename Augment>
+    struct rb_storage<T, Allocator, pointer_nodes, Augment>
+    {
+      typedef rb_pointer_storage<T, Allocator, Augment> type;
+    };
+
+    template <typename T, typename Allocator, typename Augment>
+    struct rb_storage<T, Allocator, index_nodes, Augment>
+    {
+      typedef rb_index_storage<T, Allocator, Augment> type;
+    };
+
+    /**
+     *  Holds a stats policy for the core. Searches are const but still count, so the counters are mutable. An empty
+     *  policy is held as a base instead and takes no space; it has no state for a const search to change.
+     */
+    template <typename Stats, bool = std::is_empty<Stats>::value>
+    class stats_holder : private Stats
+    {
+    public:
+      Stats& stats() const
+      {
+        return const_cast<stats_holder&>(*this);
+      }
+    };
+
+    template <typename Stats>
+    class stats_holder<Stats, false>
+    {
+    private:
+      mutable Stats counters;
+
+    public:
+      Stats& stats() const
+      {
+        return counters;
+      }
+    };
+
+    /**
+     *  The root, the size, and the red black balancing on top of a node storage. Containers find where a node
+     *  belongs with their own comparisons and hand the position to insert_at(); everything that restructures the
+     *  tree happens here. Stats is told about searches, rotations, repairs and new nodes; see no_stats.
+     */
+    template <typename Storage, typename Stats = no_stats>
+    class red_black_core : public Storage, public stats_holder<Stats>
+    {
+    public:
+      typedef typename Storage::handle handle;
+      typedef typename Storage::augment augment;
+      typedef typename Storage::value_type T;
+      typedef Stats stats_type;
+
+      // False for no_augment, which lets the augmentation upkeep that isn't a no-op compile away as well.
+      static const bool augmented = !std::is_same<augment, no_augment>::value;
+
+      handle root;
+      size_t count;
+
+      template <typename Allocator>
+      explicit red_black_core(const Allocator& a) : Storage(a), root(Storage::nil()), count(0) {}
+
+      // Exchanges the trees, their storage and their stats with c's in O(1).
+      void swap(red_black_core& c)
+      {
+        using std::swap;
+        Storage::swap(c);
+        swap(root, c.root);
+        swap(count, c.count);
+        swap(this->stats(), c.stats());
+      }
+
+      static handle nil()
+      {
+        return Storage::nil();
+      }
+
+      bool is_black(handle n) const
+      {
+        return !this->is_red(n);
+      }
+
+      // True if n is a node and red; nil nodes count as black.
+      bool red_node(handle n) const
+      {
+        return n != nil() && this->is_red(n);
+      }
+
+      handle leftmost(handle n) const
+      {
+        if(n == nil()) {
+          return n;
+        }
+        while(this->left(n) != nil()) {
+          n = this->left(n);
+        }
+        return n;
+      }
+
+      handle rightmost(handle n) const
+      {
+        if(n == nil()) {
+          return n;
+        }
+        while(this->right(n) != nil()) {
+          n = this->right(n);
+        }
+        return n;
+      }
+
+      // Returns the node after n in order, or nil if n is the last.
+      handle successor(handle n) const
+      {
+        if(this->right(n) != nil()) {
+          return leftmost(this->right(n));
+        }
+        // Without a right subtree, the successor is the first ancestor whose left subtree n is in.
+        handle p = this->parent(n);
+        while(p != nil() && n == this->right(p)) {
+          n = p;
+          p = this->parent(p);
+        }
+        return p;
+      }
+
+      // Returns the node before n in order, or nil if n is the first.
+      handle predecessor(handle n) const
+      {
+        if(this->left(n) != nil()) {
+          return rightmost(this->left(n));
+        }
+        handle p = this->parent(n);
+        while(p != nil() && n == this->left(p)) {
+          n = p;
+          p = this->parent(p);
+        }
+        return p;
+      }
+
+      /**
+       *  Finds the first node that doesn't come before a key, with one comparison per node: nodes that come before
+       *  it send the search right, and every other node is a candidate that sends it left. Whether the candidate
+       *  equals the key then takes one more comparison, instead of an equality test at every level.
+       *  @param before a callable that takes a node and returns true if the node comes before the key.
+       *  @param parent set to the last node visited, where the key would be attached if it isn't in the tree.
+       *  @param left set to true if the key would be parent's left child.
+       *  @returns the first node that doesn't come before the key, or nil if every node does.
+       */
+      template <typename Before>
+      handle lower_bound(Before before, handle& parent, bool& left) const
+      {
+        return lower_bound(before, root, nil(), parent, left);
+      }
+
+      /**
+       *  lower_bound() within the subtree at node, for a key that belongs in it.
+       *  @param bound the first node after the subtree, or nil if nothing comes after it.
+       */
+      template <typename Before>
+      handle lower_bound(Before before, handle node, handle bound, handle& parent, bool& left) const
+      {
+        handle candidate = bound;
+        parent = nil();
+        left = false;
+        this->stats().on_lookup();
+        while(node != nil()) {
+          this->stats().on_compare();
+          parent = node;
+          // Both children are loaded alongside the key and one is picked with a mask instead of a branch. For random
+          // keys the direction is a coin flip that a branch would mispredict half the time, and this way the next
+          // load waits only on the comparison, so independent searches overlap.
+          handle l = this->left(node), r = this->right(node);
+          bool right = before(node);
+          candidate = select_handle(right, node, candidate);
+          node = select_handle(right, l, r);
+          left = !right;
+        }
+        return candidate;
+      }
+
+      template <typename Before>
+      handle lower_bound(Before before) const
+      {
+        handle parent;
+        bool left;
+        return lower_bound(before, parent, left);
+      }
+
+      /**
+       *  lower_bound() for a key that comes after finger, starting from finger instead of the root. It climbs while
+       *  the parent still comes before the key and then searches the subtree it stopped in, whose parent is the first
+       *  node after it. A key near the finger is found near the finger.
+       *  @param finger a node that comes before the key.
+       */
+      template <typename Before>
+      handle lower_bound_after(handle finger, Before before, handle& parent, bool& left) const
+      {
+        handle node = finger, up = this->parent(finger);
+        while(up != nil()) {
+          this->stats().on_compare();
+          if(!before(up)) {
+            break;
+          }
+          node = up;
+          up = this->parent(up);
+        }
+        return lower_bound(before, node, up, parent, left);
+      }
+
+      /**
+       *  Rotates n's right child up into n's place:
+       *        n                r
+       *       / \              / \
+       *      a   r     =>     n   c
+       *         / \          / \
+       *        b   c        a   b
+       *  top is the root of the tree n is in, which is updated if n was the root. It is root for the whole tree and
+       *  a local for a detached subtree.
+       */
+      void rotate_left(handle n, handle& top)
+      {
+        handle r = this->right(n), p = this->parent(n), b = this->left(r);
+        this->stats().on_rotate();
+        this->set_right(n, b);
+        if(b != nil()) {
+          this->set_parent(b, n);
+        }
+        replace_child(p, n, r, top);
+        this->set_parent(r, p);
+        this->set_left(r, n);
+        this->set_parent(n, r);
+        augment::update(*this, n);
+        augment::update(*this, r);
+      }
+
+      // The mirror image of rotate_left: n's left child comes up into n's place.
+      void rotate_right(handle n, handle& top)
+      {
+        handle l = this->left(n), p = this->parent(n), b = this->right(l);
+        this->stats().on_rotate();
+        this->set_left(n, b);
+        if(b != nil()) {
+          this->set_parent(b, n);
+        }
+        replace_child(p, n, l, top);
+        this->set_parent(l, p);
+        this->set_right(l, n);
+        this->set_parent(n, l);
+        augment::update(*this, n);
+        augment::update(*this, l);
+      }
+
+      /**
+       *  Creates a node from args and attaches it as parent's left or right child, which must be empty, or as the
+       *  root if parent is nil. Then rebalances.
+       *  @returns the new node.
+       */
+      template <typename... Args>
+      handle insert_at(handle parent, bool left, Args&&... args)
+      {
+        handle node = this->create(parent, std::forward<Args>(args)...);
+        this->stats().on_allocate(sizeof(typename Storage::node));
+        if(parent == nil()) {
+          root = node;
+        } else if(left) {
+          this->set_left(parent, node);
+        } else {
+          this->set_right(parent, node);
+        }
+        count++;
+        update_path(node);
+        insert_repair(node, root);
+        return node;
+      }
+
+      /**
+       *  Unlinks node, rebalances and destroys it. Other nodes keep their place in memory, so iterators to them stay
+       *  valid.
+       */
+      void erase(handle node)
+      {
+        unlink(node, root);
+        count--;
+        this->destroy(node);
+      }
+
+      /**
+       *  Builds a perfectly balanced tree from n elements in strictly increasing order, in O(n) and without a single
+       *  comparison or rotation. Each node takes the middle element of its range, so every level but the deepest is
+       *  full. Making the nodes on the deepest level red and all others black then gives every path the same number
+       *  of black nodes. The nodes are created in order from one block, so an in-order walk reads memory front to
+       *  back. The tree must be empty. If creating an element throws, the elements built so far are destroyed and
+       *  the tree stays empty.
+       */
+      template <typename ForwardIt>
+      void build_sorted(ForwardIt first, size_t n)
+      {
+        root = build_detached(first, n);
+        count = n;
+      }
+
+      /**
+       *  Builds n elements in strictly increasing order into a perfectly balanced tree like build_sorted(), but
+       *  leaves it detached instead of making it the tree, and doesn't count its nodes.
+       *  @returns the root of the new tree, which is black, or nil if n is 0.
+       */
+      template <typename ForwardIt>
+      handle build_detached(ForwardIt first, size_t n)
+      {
+        this->reserve(n);
+        int red_depth = 0; // floor(log2(n)), the deepest level.
+        for(size_t m = n; m > 1; m >>= 1) {
+          red_depth++;
+        }
+        return build_subtree(first, n, 0, red_depth);
+      }
+
+      /**
+       *  @returns the number of edges on the longest path down from n, or -1 for an empty tree.
+       */
+      int height(handle n) const
+      {
+        int h = -1;
+        walk(n, [&h](handle, int depth, int) {
+          h = (depth > h ? depth : h);
+          return true;
+        });
+        return h;
+      }
+
+      /**
+       *  Counts the nodes at each depth, the root's being 0, which shows how far the tree is from perfectly
+       *  balanced and how deep a typical search goes. Costs O(n) without recursion.
+       *  @returns the number of nodes at each depth, empty for an empty tree.
+       */
+      std::vector<size_t> depth_histogram() const
+      {
+        std::vector<size_t> nodes;
+        walk(root, [&nodes](handle, int depth, int) {
+          if(size_t(depth) >= nodes.size()) {
+            nodes.resize(depth + 1, 0);
+          }
+          nodes[depth]++;
+          return true;
+        });
+        return nodes;
+      }
+
+      /**
+       *  Checks the structure and the red black rules in O(n) without recursion: the root is black and has no parent,
+       *  every child links back to its parent, no red node has a red child, every way down from the root passes the
+       *  same number of black nodes, and there are count nodes. The order of the elements is the container's to
+       *  check.
+       *  @returns true if the tree is a valid red black tree.
+       */
+      bool validate() const
+      {
+        if(root != nil() && (this->parent(root) != nil() || this->is_red(root))) {
+          return false;
+        }
+        size_t nodes = 0;
+        int leaf_blacks = -1; // The black nodes on the way down to the first nil child.
+        bool valid = walk(root, [&](handle n, int, int blacks) {
+          nodes++;
+          handle l = this->left(n), r = this->right(n);
+          if(this->is_red(n) && (red_node(l) || red_node(r))) {
+            return false;
+          }
+          if(l == nil() || r == nil()) {
+            leaf_blacks = (leaf_blacks < 0 ? blacks : leaf_blacks);
+            return blacks == leaf_blacks;
+          }
+          return true;
+        });
+        return valid && nodes == count;
+      }
+
+      /**
+       *  Destroys every node. Elements with trivial destructors aren't visited, so this costs one deallocation per
+       *  slab, or one in all for index_nodes.
+       */
+      void clear()
+      {
+        if(!std::is_trivially_destructible<T>::value) {
+          destroy_subtree(root);
+        }
+        this->release();
+        root = nil();
+        count = 0;
+      }
+
+      /**
+       *  Destroys every node like clear(), but keeps the memory and puts every node on the free list for reuse.
+       *  Nothing is given back, so a reader that still holds a stale handle reads a dead node instead of freed memory.
+       */
+      void recycle()
+      {
+        destroy_subtree(root);
+        root = nil();
+        count = 0;
+      }
+
+      /**
+       *  Counts the black nodes on the way down from n to a nil child, n included, which is the same on every way
+       *  down. Costs O(log n).
+       */
+      int black_height(handle n) const
+      {
+        int h = 0;
+        for(; n != nil(); n = this->left(n)) {
+          h += is_black(n);
+        }
+        return h;
+      }
+
+      /**
+       *  Joins two detached trees and a detached node k that goes between them: every element of l comes before
+       *  k's and every element of r after it. Walks down the inner edge of the taller tree to the first black node
+       *  no taller than the other tree, links k in there as a red node over both, and repairs upwards as after an
+       *  insertion. Costs O(|black_height(l) - black_height(r)| + 1) once the heights are known, and O(log n) to
+       *  find them here. The roots of l and r may be red.
+       *  @returns the root of the joined tree, black and detached.
+       */
+      handle join(handle l, handle k, handle r)
+      {
+        int h;
+        return join(l, black_height(l), k, r, black_height(r), h);
+      }
+
+      /**
+       *  Joins two detached trees where every element of l comes before every element of r, by taking the last
+       *  node of l out and joining over it. Costs O(log n).
+       *  @returns the root of the joined tree, detached.
+       */
+      handle join(handle l, handle r)
+      {
+        int h;
+        return join(l, black_height(l), r, black_height(r), h);
+      }
+
+      /**
+       *  Splits the detached tree t into the nodes whose elements come before key, in l, and those whose elements
+       *  come after it, in r, both detached. Each node on the search path is joined onto its side on the way back
+       *  up, and since the heights of the joined trees only grow, the joins cost O(log n) in all.
+       *  @param less compares two elements.
+       *  @returns the node whose element equals key, detached and without children, or nil if there is none.
+       */
+      template <typename Less>
+      handle split(handle t, const T& key, const Less& less, handle& l, handle& r)
+      {
+        int hl, hr;
+        return split(t, black_height(t), key, less, l, hl, r, hr);
+      }
+
+      /**
+       *  Combines the tree with the tree under o in other using a set operation built from split() and join(),
+       *  which costs O(m log(n/m + 1)) for trees of m <= n nodes, so a small tree merges into a large one in far
+       *  less than m separate lookups. The tree is split around o's element, the halves are merged with o's
+       *  subtrees, and the results are joined back. For unite, o must be detached in this core, and its nodes are
+       *  taken over and counted; intersect and subtract only read other. Nodes that drop out are destroyed at the
+       *  end, and nothing is allocated until then, so nothing can throw unless less does, which it must not.
+       *
+       *  With a pool of more than one thread and at least parallel_merge_cutoff nodes in all, the first few levels
+       *  of splits run on the calling thread, the pieces they leave are merged as separate tasks on the pool, and
+       *  the results are joined back on the calling thread. A core that keeps stats always merges on the calling
+       *  thread, since the tasks would update the same counters at once.
+       *  @param other the core o is in, which is *this for unite.
+       *  @param o_nodes the number of nodes under o.
+       *  @param less compares two elements.
+       *  @param pool anything with size() and run(tasks, fn), such as thread_pool, or no_pool.
+       */
+      template <set_operation Op, typename Other, typename Less, typename Pool>
+      void merge(const Other& other, typename Other::handle o, size_t o_nodes, const Less& less, Pool& pool)
+      {
+        typedef std::integral_constant<set_operation, Op> op;
+        size_t nodes = count + o_nodes;
+        if(Op == set_operation::unite) {
+          count = nodes;
+        }
+        handle t = root, dead = nil();
+        int ht = black_height(t), ho = other.black_height(o), h;
+        root = nil();
+        if(pool.size() > 1 && nodes >= parallel_merge_cutoff && std::is_same<Stats, no_stats>::value) {
+          // About four pieces per thread, so threads that finish early can pick up more.
+          int levels = 0;
+          while((size_t(1) << levels) < 4*pool.size() && levels < 16) {
+            levels++;
+          }
+          std::vector<merge_piece<Other>> pieces;
+          pieces.reserve((size_t(1) << (levels + 1)) - 1);
+          std::vector<size_t> leaves;
+          leaves.reserve(size_t(1) << levels);
+          plan_merge(op(), pieces, leaves, t, ht, other, o, ho, less, levels);
+          pool.run(leaves.size(), [&](size_t i) {
+            merge_piece<Other>& p = pieces[leaves[i]];
+            p.result = merge_subtrees(op(), p.t, p.ht, other, p.o, p.ho, less, p.dead, p.h);
+          });
+          root = finish_merge(op(), pieces, 0, dead, h);
+        } else {
+          root = merge_subtrees(op(), t, ht, other, o, ho, less, dead, h);
+        }
+        detach(root);
+        while(dead != nil()) {
+          handle next = this->parent(dead);
+          this->set_parent(dead, nil());
+          count -= destroy_subtree(dead);
+          dead = next;
+        }
+      }
+
+      /**
+       *  Keeps only the nodes whose elements satisfy keep, joining what is left of each subtree back together on
+       *  the way up, in O(n). The tree stays balanced however many nodes go. If keep throws, the node it threw on and
+       *  every node it hadn't been called on yet are kept, the pieces are still joined into a valid tree, and the
+       *  exception is rethrown.
+       *  @returns the number of nodes removed.
+       */
+      template <typename Predicate>
+      size_t filter(Predicate& keep)
+      {
+        size_t before = count;
+        handle t = root;
+        int h;
+        std::exception_ptr error;
+        root = nil();
+        root = filter_subtree(t, black_height(t), keep, error, h);
+        detach(root);
+        if(error) {
+          std::rethrow_exception(error);
+        }
+        return before - count;
+      }
+
+      // Merges with fewer nodes than this run on the calling thread, since splitting the work costs more than it saves.
+      static const size_t parallel_merge_cutoff = size_t(1) << 15;
+
+    private:
+      /**
+       *  Visits the subtree under n in pre-order in O(1) memory, following parent links back up instead of keeping
+       *  a stack, so it works on trees of any height. Each child's parent link is checked before the walk goes
+       *  down to it, since the walk back up relies on it.
+       *  @param visit called with each node, its depth below n and the black nodes from n down to it, n and the
+       *  node included. Returning false stops the walk.
+       *  @returns false if visit stopped the walk or a parent link was wrong.
+       */
+      template <typename Visit>
+      bool walk(handle n, Visit visit) const
+      {
+        handle top = (n == nil() ? nil() : this->parent(n)), prev = top;
+        int depth = 0, blacks = (n == nil() ? 0 : is_black(n));
+        while(n != top) {
+          handle l = this->left(n), r = this->right(n), next;
+          if(prev == this->parent(n)) {
+            // Arrived from above.
+            if(!visit(n, depth, blacks)) {
+              return false;
+            }
+            next = (l != nil() ? l : r);
+          } else {
+            // Arrived from a child: the right subtree is left to visit after the left one.
+            next = (prev == l ? r : nil());
+          }
+          if(next == nil()) {
+            next = this->parent(n);
+            depth--;
+            blacks -= is_black(n);
+          } else if(this->parent(next) != n) {
+            return false;
+          } else {
+            depth++;
+            blacks += is_black(next);
+          }
+          prev = n;
+          n = next;
+        }
+        return true;
+      }
+
+      // Part of a merge split up for a pool: either a pair of subtrees that one task merges, or a split of this
+      // tree around o's element, whose halves are the pieces left and right and whose match is t. The h fields are
+      // black heights.
+      template <typename Other>
+      struct merge_piece
+      {
+        handle t;
+        int ht;
+        typename Other::handle o;
+        int ho;
+        size_t left;
+        size_t right;
+        handle result;
+        int h;
+        handle dead;
+      };
+
+      // The pieces of a merge are never one of their own children, so 0 marks a piece a task merges.
+      static const size_t merge_leaf = 0;
+
+      // Makes n a root: nil parent, black. Returns 1 if that made it one black taller, and 0 otherwise.
+      int detach(handle n)
+      {
+        if(n == nil()) {
+          return 0;
+        }
+        bool red = this->is_red(n);
+        this->set_parent(n, nil());
+        this->set_black(n);
+        return red;
+      }
+
+      // Makes l and r the children of n.
+      void link_below(handle n, handle l, handle r)
+      {
+        this->set_left(n, l);
+        this->set_right(n, r);
+        if(l != nil()) {
+          this->set_parent(l, n);
+        }
+        if(r != nil()) {
+          this->set_parent(r, n);
+        }
+      }
+
+      /**
+       *  join(l, k, r) given the black heights hl and hr of l and r, which saves walking down to find them.
+       *  @param h set to the black height of the joined tree.
+       */
+      handle join(handle l, int hl, handle k, handle r, int hr, int& h)
+      {
+        // Painting a red root black breaks nothing, and after that each tree's height counts its root.
+        hl += detach(l);
+        hr += detach(r);
+        if(hl == hr) {
+          this->set_parent(k, nil());
+          link_below(k, l, r);
+          this->set_black(k);
+          augment::update(*this, k);
+          h = hl + 1;
+          return k;
+        }
+        handle top = (hl > hr ? l : r);
+        handle p = nil(), c = top;
+        int ch = (hl > hr ? hl : hr), target = (hl > hr ? hr : hl);
+        while(c != nil() && (this->is_red(c) || ch > target)) {
+          ch -= is_black(c);
+          p = c;
+          c = (hl > hr ? this->right(c) : this->left(c));
+        }
+        // c is as tall as the shorter tree, and p is above it, since top is taller.
+        this->set_parent(k, p);
+        this->set_red(k);
+        if(hl > hr) {
+          this->set_right(p, k);
+          link_below(k, c, r);
+        } else {
+          this->set_left(p, k);
+          link_below(k, l, c);
+        }
+        update_path(k);
+        h = (hl > hr ? hl : hr) + insert_repair(k, top);
+        return top;
+      }
+
+      // join(l, r) given the black heights of l and r, setting h to that of the joined tree.
+      handle join(handle l, int hl, handle r, int hr, int& h)
+      {
+        if(l == nil()) {
+          h = hr + detach(r);
+          return r;
+        }
+        if(r == nil()) {
+          h = hl + detach(l);
+          return l;
+        }
+        hl += detach(l);
+        handle last = rightmost(l);
+        hl -= unlink(last, l);
+        return join(l, hl, last, r, hr, h);
+      }
+
+      // split(t, key, less, l, r) given the black height of t, setting hl and hr to those of l and r.
+      template <typename Less>
+      handle split(handle t, int ht, const T& key, const Less& less, handle& l, int& hl, handle& r, int& hr)
+      {
+        if(t == nil()) {
+          l = r = nil();
+          hl = hr = 0;
+          return nil();
+        }
+        handle tl = this->left(t), tr = this->right(t);
+        int hc = ht - is_black(t);
+        if(less(this->data(t), key)) {
+          handle below;
+          int hb;
+          handle match = split(tr, hc, key, less, below, hb, r, hr);
+          l = join(tl, hc, t, below, hb, hl);
+          return match;
+        }
+        if(less(key, this->data(t))) {
+          handle above;
+          int ha;
+          handle match = split(tl, hc, key, less, l, hl, above, ha);
+          r = join(above, ha, t, tr, hc, hr);
+          return match;
+        }
+        hl = hc + detach(tl);
+        hr = hc + detach(tr);
+        l = tl;
+        r = tr;
+        this->set_parent(t, nil());
+        link_below(t, nil(), nil());
+        augment::update(*this, t);
+        return t;
+      }
+
+      // Puts the detached subtree n on the chain of subtrees a merge destroys at the end, linked by parent links.
+      void bury(handle n, handle& dead)
+      {
+        if(n != nil()) {
+          this->set_parent(n, dead);
+          dead = n;
+        }
+      }
+
+      typedef std::integral_constant<set_operation, set_operation::unite> unite_op;
+      typedef std::integral_constant<set_operation, set_operation::intersect> intersect_op;
+      typedef std::integral_constant<set_operation, set_operation::subtract> subtract_op;
+
+      // Merges t with the tree under o, see merge(). ht and ho are their black heights, and h is set to the
+      // result's.
+      template <typename Op, typename Other, typename Less>
+      handle merge_subtrees(Op op, handle t, int ht, const Other& other, typename Other::handle o, int ho,
+                            const Less& less, handle& dead, int& h)
+      {
+        if(t == nil() || o == Other::nil()) {
+          return merge_ends(op, t, ht, o, ho, dead, h);
+        }
+        handle l, r;
+        int hl, hr;
+        handle match = split(t, ht, other.data(o), less, l, hl, r, hr);
+        // Read o's children first, since unite is about to relink o.
+        typename Other::handle ol = other.left(o), orr = other.right(o);
+        int hoc = ho - other.is_black(o);
+        l = merge_subtrees(op, l, hl, other, ol, hoc, less, dead, hl);
+        r = merge_subtrees(op, r, hr, other, orr, hoc, less, dead, hr);
+        return merge_step(op, l, hl, match, o, r, hr, dead, h);
+      }
+
+      // What a merge makes of t and the tree under o once one of them is empty.
+      handle merge_ends(unite_op, handle t, int ht, handle o, int ho, handle&, int& h)
+      {
+        h = (t == nil() ? ho : ht);
+        return (t == nil() ? o : t);
+      }
+
+      template <typename OtherHandle>
+      handle merge_ends(intersect_op, handle t, int, OtherHandle, int, handle& dead, int& h)
+      {
+        bury(t, dead);
+        h = 0;
+        return nil();
+      }
+
+      template <typename OtherHandle>
+      handle merge_ends(subtract_op, handle t, int ht, OtherHandle, int, handle&, int& h)
+      {
+        h = ht;
+        return t;
+      }
+
+      // Joins the merged halves l and r back around o's element, given the node of this tree that held it, if any.
+      handle merge_step(unite_op, handle l, int hl, handle match, handle o, handle r, int hr, handle& dead, int& h)
+      {
+        bury(match, dead);
+        return join(l, hl, o, r, hr, h);
+      }
+
+      template <typename OtherHandle>
+      handle merge_step(intersect_op, handle l, int hl, handle match, OtherHandle, handle r, int hr, handle&, int& h)
+      {
+        return (match != nil() ? join(l, hl, match, r, hr, h) : join(l, hl, r, hr, h));
+      }
+
+      template <typename OtherHandle>
+      handle merge_step(subtract_op, handle l, int hl, handle match, OtherHandle, handle r, int hr, handle& dead,
+                        int& h)
+      {
+        bury(match, dead);
+        return join(l, hl, r, hr, h);
+      }
+
+      // Does the splits on the first levels of a merge and records the pieces they leave. Returns the index of the
+      // piece for t and o.
+      template <typename Op, typename Other, typename Less>
+      size_t plan_merge(Op op, std::vector<merge_piece<Other>>& pieces, std::vector<size_t>& leaves, handle t, int ht,
+                        const Other& other, typename Other::handle o, int ho, const Less& less, int levels)
+      {
+        size_t i = pieces.size();
+        pieces.push_back(merge_piece<Other>{t, ht, o, ho, merge_leaf, merge_leaf, nil(), 0, nil()});
+        if(levels == 0 || t == nil() || o == Other::nil()) {
+          leaves.push_back(i);
+          return i;
+        }
+        handle l, r;
+        int hl, hr, hoc = ho - other.is_black(o);
+        pieces[i].t = split(t, ht, other.data(o), less, l, hl, r, hr);
+        size_t left = plan_merge(op, pieces, leaves, l, hl, other, other.left(o), hoc, less, levels - 1);
+        size_t right = plan_merge(op, pieces, leaves, r, hr, other, other.right(o), hoc, less, levels - 1);
+        pieces[i].left = left;
+        pieces[i].right = right;
+        return i;
+      }
+
+      // Joins the merged pieces back together from the bottom up, and moves what the tasks dropped onto dead.
+      template <typename Op, typename Other>
+      handle finish_merge(Op op, std::vector<merge_piece<Other>>& pieces, size_t i, handle& dead, int& h)
+      {
+        merge_piece<Other>& p = pieces[i];
+        while(p.dead != nil()) {
+          handle next = this->parent(p.dead);
+          bury(p.dead, dead);
+          p.dead = next;
+        }
+        if(p.left == merge_leaf) {
+          h = p.h;
+          return p.result;
+        }
+        int hl, hr;
+        handle l = finish_merge(op, pieces, p.left, dead, hl);
+        handle r = finish_merge(op, pieces, p.right, dead, hr);
+        return merge_step(op, l, hl, p.t, p.o, r, hr, dead, h);
+      }
+
+      template <typename Predicate>
+      handle filter_subtree(handle t, int ht, Predicate& keep, std::exception_ptr& error, int& h)
+      {
+        if(t == nil()) {
+          h = 0;
+          return t;
+        }
+        int hc = ht - is_black(t), hl, hr;
+        handle l = filter_subtree(this->left(t), hc, keep, error, hl);
+        handle r = filter_subtree(this->right(t), hc, keep, error, hr);
+        // Once keep has thrown, the rest of the nodes are kept so the pieces held up the stack still get joined.
+        bool kept = true;
+        if(!error) {
+          try {
+            kept = keep(static_cast<const T&>(this->data(t)));
+          } catch(...) {
+            error = std::current_exception();
+          }
+        }
+        if(kept) {
+          return join(l, hl, t, r, hr, h);
+        }
+        count--;
+        this->destroy(t);
+        return join(l, hl, r, hr, h);
+      }
+
+      /**
+       *  Takes node out of the tree under top and rebalances, leaving node detached. Other nodes keep their place
+       *  in memory.
+       *  @returns true if the tree under top lost a black level.
+       */
+      bool unlink(handle node, handle& top)
+      {
+        // With two children, node trades places with its in-order predecessor, which has at most one.
+        if(this->left(node) != nil() && this->right(node) != nil()) {
+          swap_with_predecessor(node, rightmost(this->left(node)), top);
+        }
+        // node now has at most one child, and if it has one, the child is red and node is black.
+        bool shorter = false;
+        handle child = (this->left(node) != nil() ? this->left(node) : this->right(node));
+        if(child != nil()) {
+          this->set_black(child);  // The child takes node's place and its black.
+        } else if(is_black(node)) {
+          // A black leaf leaves its path one black short, fix that while it is still linked.
+          shorter = remove_repair(node, top);
+        }
+        handle p = this->parent(node);
+        if(child != nil()) {
+          this->set_parent(child, p);
+        }
+        replace_child(p, node, child, top);
+        update_path(p);
+        return shorter;
+      }
+
+      // Recomputes the augmented data of n and every node above it.
+      void update_path(handle n)
+      {
+        if(!augmented) {
+          return;
+        }
+        for(; n != nil(); n = this->parent(n)) {
+          augment::update(*this, n);
+        }
+      }
+
+      // Points p's link to old_child at new_child instead, or top if p is nil.
+      void replace_child(handle p, handle old_child, handle new_child, handle& top)
+      {
+        if(p == nil()) {
+          top = new_child;
+        } else if(this->left(p) == old_child) {
+          this->set_left(p, new_child);
+        } else {
+          this->set_right(p, new_child);
+        }
+      }
+
+      void set_color_of(handle n, handle from)
+      {
+        if(this->is_red(from)) {
+          this->set_red(n);
+        } else {
+          this->set_black(n);
+        }
+      }
+
+      // Exchanges the positions and colors of n and its predecessor pred, the rightmost node of n's left subtree.
+      void swap_with_predecessor(handle n, handle pred, handle& top)
+      {
+        handle p = this->parent(n), l = this->left(n), r = this->right(n);
+        handle pred_parent = this->parent(pred), pred_left = this->left(pred);
+        bool n_red = this->is_red(n);
+        // pred takes n's place.
+        replace_child(p, n, pred, top);
+        this->set_parent(pred, p);
+        this->set_right(pred, r);
+        this->set_parent(r, pred);
+        if(pred_parent == n) {
+          this->set_left(pred, n);
+          this->set_parent(n, pred);
+        } else {
+          this->set_left(pred, l);
+          this->set_parent(l, pred);
+          this->set_right(pred_parent, n);
+          this->set_parent(n, pred_parent);
+        }
+        // n takes pred's place, which has no right child.
+        this->set_left(n, pred_left);
+        if(pred_left != nil()) {
+          this->set_parent(pred_left, n);
+        }
+        this->set_right(n, nil());
+        set_color_of(n, pred);
+        if(n_red) {
+          this->set_red(pred);
+        } else {
+          this->set_black(pred);
+        }
+        // Each position still holds the same set of nodes below it, so its augmented data stays with it too. The
+        // data n now holds may count pred instead of n, which only n's ancestors read, and unlink() recomputes those.
+        std::swap(this->aug(n), this->aug(pred));
+      }
+
+      // Restores the red black rules after node was linked in red. Returns true if the tree under top grew a black
+      // level, which only happens when the repair reaches top.
+      bool insert_repair(handle node, handle& top)
+      {
+        handle parent = this->parent(node);
+        // Case 1: node is the root node, it must be set to black.
+        if(parent == nil()) {
+          this->stats().on_insert_case(1);
+          bool grew = this->is_red(node);
+          this->set_black(node);
+          return grew;
+        }
+        // Case 2: The parent of node is black, theres nothing to be done.
+        if(is_black(parent)) {
+          this->stats().on_insert_case(2);
+          return false;
+        }
+        handle grandparent = this->parent(parent); // The parent is red, so it isn't the root.
+        handle uncle = (this->left(grandparent) == parent ? this->right(grandparent) : this->left(grandparent));
+        // Case 3: The parent and uncle are both red. Push the grandparent's black down and repair from it.
+        if(red_node(uncle)) {
+          this->stats().on_insert_case(3);
+          this->set_black(parent);
+          this->set_black(uncle);
+          this->set_red(grandparent);
+          return insert_repair(grandparent, top);
+        }
+        // Case 4: The parent is red and the uncle is black. Rotate the parent into the grandparent's position.
+        this->stats().on_insert_case(4);
+        // Part 1: If node is on the "inside" of the tree, we need to rotate it to the outside first.
+        if(parent == this->left(grandparent) && node == this->right(parent)) {
+          rotate_left(parent, top);
+          parent = node;
+        } else if(parent == this->right(grandparent) && node == this->left(parent)) {
+          rotate_right(parent, top);
+          parent = node;
+        }
+        // Part 2: Now we can rotate the parent into place by rotating in the correct direction.
+        if(parent == this->left(grandparent)) {
+          rotate_right(grandparent, top);
+        } else {
+          rotate_left(grandparent, top);
+        }
+        // Finally, we make the parent and grandparent the appropriate colors.
+        this->set_black(parent);
+        this->set_red(grandparent);
+        return false;
+      }
+
+      /**
+       *  Restores the black height after a black leaf loses its place. node is still linked into the tree and
+       *  carries an extra "double" black that has to be pushed up or absorbed by a rotation.
+       *  @returns true if the extra black was pushed all the way up to top, so the tree under top lost a black level.
+       */
+      bool remove_repair(handle node, handle& top)
+      {
+        handle parent = this->parent(node);
+        // Case 1: The node is the root: the extra black simply disappears.
+        if(parent == nil()) {
+          this->stats().on_remove_case(1);
+          return true;
+        }
+        bool is_left = (this->left(parent) == node);
+        // Never nil, the sibling's side holds at least one black.
+        handle sibling = (is_left ? this->right(parent) : this->left(parent));
+        // Case 2: The sibling is red. Rotate it above the parent so that node gets a black sibling.
+        if(this->is_red(sibling)) {
+          this->stats().on_remove_case(2);
+          this->set_red(parent);
+          this->set_black(sibling);
+          if(is_left) {
+            rotate_left(parent, top);
+            sibling = this->right(parent);
+          } else {
+            rotate_right(parent, top);
+            sibling = this->left(parent);
+          }
+        }
+        handle near = (is_left ? this->left(sibling) : this->right(sibling));
+        handle far = (is_left ? this->right(sibling) : this->left(sibling));
+        if(!red_node(near) && !red_node(far)) {
+          this->set_red(sibling);
+          // Case 3: The parent is black, so the whole subtree is now one black short and we recurse on the parent.
+          if(is_black(parent)) {
+            this->stats().on_remove_case(3);
+            return remove_repair(parent, top);
+          }
+          // Case 4: The parent is red, swapping its color with the sibling's makes up for the missing black.
+          this->stats().on_remove_case(4);
+          this->set_black(parent);
+          return false;
+        }
+        // Case 5: Only the sibling's near child is red. Rotate it into the sibling's place so the far child is red.
+        if(!red_node(far)) {
+          this->stats().on_remove_case(5);
+          this->set_red(sibling);
+          this->set_black(near);
+          if(is_left) {
+            rotate_right(sibling, top);
+          } else {
+            rotate_left(sibling, top);
+          }
+          far = sibling;
+          sibling = near;
+        }
+        // Case 6: The sibling's far child is red. Rotating the sibling above the parent adds a black to node's side.
+        this->stats().on_remove_case(6);
+        set_color_of(sibling, parent);
+        this->set_black(parent);
+        this->set_black(far);
+        if(is_left) {
+          rotate_left(parent, top);
+        } else {
+          rotate_right(parent, top);
+        }
+        return false;
+      }
+
+      // Builds the n elements starting at it below a detached root at the given depth and returns that root, leaving
+      // it one past the last element used. On an exception, destroys what it built before passing it on.
+      template <typename ForwardIt>
+      handle build_subtree(ForwardIt& it, size_t n, int depth, int red_depth)
+      {
+        if(n == 0) {
+          return nil();
+        }
+        size_t left_n = n / 2;
+        handle left = build_subtree(it, left_n, depth + 1, red_depth);
+        handle node;
+        try {
+          node = this->create(nil(), *it);
+        } catch(...) {
+          destroy_subtree(left);
+          throw;
+        }
+        this->stats().on_allocate(sizeof(typename Storage::node));
+        ++it;
+        if(depth == red_depth && depth != 0) {
+          this->set_red(node);
+        } else {
+          this->set_black(node);
+        }
+        this->set_left(node, left);
+        if(left != nil()) {
+          this->set_parent(left, node);
+        }
+        handle right;
+        try {
+          right = build_subtree(it, n - left_n - 1, depth + 1, red_depth);
+        } catch(...) {
+          destroy_subtree(node);
+          throw;
+        }
+        this->set_right(node, right);
+        if(right != nil()) {
+          this->set_parent(right, node);
+        }
+        augment::update(*this, node);
+        return node;
+      }
+
+      // Destroys top and everything below it without recursion: descend to a leaf, destroy it, unlink it and carry
+      // on from its parent. Each edge is walked once down and once up. top must be the root or detached, and is
+      // left dangling. Returns the number of nodes destroyed.
+      size_t destroy_subtree(handle top)
+      {
+        size_t destroyed = 0;
+        handle node = top;
+        while(node != nil()) {
+          if(this->left(node) != nil()) {
+            node = this->left(node);
+          } else if(this->right(node) != nil()) {
+            node = this->right(node);
+          } else {
+            handle parent = this->parent(node);
+            replace_child(parent, node, nil(), top);
+            this->destroy(node);
+            destroyed++;
+            node = parent;
+          }
+        }
+        return destroyed;
+      }
+    };
+
+    /**
+     *  An in-order iterator over a red_black_core that follows parent links, so it needs no stack. It stays valid as
+     *  long as the node it is on isn't removed. Value is the element type as seen through the iterator, const for
+     *  sets.
+     */
+    template <typename Core, typename Value>
+    class red_black_iterator
+    {
+    private:
+      typedef typename Core::handle handle;
+
+      handle node;
+      const Core *core; // Needed to step back from end().
+
+      template <typename, typename> friend class red_black_iterator;
+
+    public:
+      typedef std::bidirectional_iterator_tag iterator_category;
+      typedef typename std::remove_const<Value>::type value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef Value* pointer;
+      typedef Value& reference;
+
+      red_black_iterator() : node(Core::nil()), core(nullptr) {}
+
+      red_black_iterator(handle n, const Core *c) : node(n), core(c) {}
+
+      // Mutable iterators convert to const ones.
+      template <typename V, typename = typename std::enable_if<std::is_same<const V, Value>::value>::type>
+      red_black_iterator(const red_black_iterator<Core, V>& it) : node(it.node), core(it.core) {}
+
+      handle position() const
+      {
+        return node;
+      }
+
+      reference operator*() const
+      {
+        return core->data(node);
+      }
+
+      pointer operator->() const
+      {
+        return &core->data(node);
+      }
+
+      red_black_iterator& operator++()
+      {
+        node = core->successor(node);
+        return *this;
+      }
+
+      red_black_iterator operator++(int)
+      {
+        red_black_iterator old = *this;
+        ++*this;
+        return old;
+      }
+
+      red_black_iterator& operator--()
+      {
+        node = (node == Core::nil() ? core->rightmost(core->root) : core->predecessor(node));
+        return *this;
+      }
+
+      red_black_iterator operator--(int)
+      {
+        red_black_iterator old = *this;
+        --*this;
+        return old;
+      }
+
+      bool operator==(const red_black_iterator& it) const
+      {
+        return node == it.node;
+      }
+
+      bool operator!=(const red_black_iterator& it) const
+      {
+        return node != it.node;
+      }
+    };
+
+  }
+
+}
+
+#endif
@@ -0,0 +1,516 @@
+/**
+ *  red_black_map.hpp
+ *  An ordered map from keys to values, kept in a red black tree.
+ *
+ *  @author Marquess Valdez
+ *  @version 1.0
+ */
+#ifndef RED_BLACK_MAP_HPP
+#define RED_BLACK_MAP_HPP
+
+#include <cstddef> //for std::size_t
+#include <functional> // for std::less
+#include <iterator> // for std::reverse_iterator, std::distance
+#include <memory> // for std::allocator_traits
+#include <stdexcept> // for std::out_of_range
+#include <tuple> // for std::forward_as_tuple
+#include <type_traits>
+#include <utility> // for std::pair, std::piecewise_construct
+#include "allocator.hpp"
+#include "red_black_core.hpp"
+
+namespace mqs {
+
+/**
+ *  Compares any two values with <. Being transparent, it lets maps look keys up by anything that compares with
+ *  them, such as a std::string key by a const char*, without building a key first.
+ */
+struct transparent_less
+{
+  typedef void is_transparent;
+
+  template <typename A, typename B>
+  bool operator()(const A& a, const B& b) const
+  {
+    return a < b;
+  }
+};
+
+namespace detail {
+
+  template <typename>
+  struct void_type
+  {
+    typedef void type;
+  };
+
+  // True if Compare declares is_transparent, so it can compare keys with other types.
+  template <typename Compare, typename = void>
+  struct is_transparent : std::false_type {};
+
+  template <typename Compare>
+  struct is_transparent<Compare, typename void_type<typename Compare::is_transparent>::type> : std::true_type {};
+
+}
+
+/**
+ *  A map from K to V ordered by Compare, a less-than on keys, on the same balancing code as red_black_tree. Every
+ *  search makes one comparison per level of the tree, plus one to tell whether it found the key.
+ *
+ *  If Compare is transparent, such as transparent_less, find() and the bounds also take any type Compare can
+ *  compare with K. try_emplace() and operator[] only build a value when the key is missing, and build it in place.
+ *  Iterators stay valid until their element is removed. Layout picks the node storage as for red_black_tree.
+ */
+template <typename K, typename V, typename Compare = std::less<K>,
+          typename Allocator = heap_allocator<std::pair<const K, V>>, typename Layout = pointer_nodes>
+class red_black_map {
+  public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<const K, V> value_type;
+    typedef Compare key_compare;
+    typedef Allocator allocator_type;
+    typedef size_t size_type;
+
+  private:
+    typedef detail::red_black_core<typename detail::rb_storage<value_type, Allocator, Layout>::type> core_type;
+    typedef typename core_type::handle handle;
+
+    core_type core;
+    Compare comp;
+
+    handle nil() const
+    {
+      return core_type::nil();
+    }
+
+    // Says whether a node's key comes before k, for core.lower_bound().
+    template <typename Key>
+    struct node_before
+    {
+      const core_type& core;
+      const Compare& comp;
+      const Key& k;
+
+      bool operator()(handle n) const
+      {
+        return comp(core.data(n).first, k);
+      }
+    };
+
+    template <typename Key>
+    node_before<Key> before(const Key& k) const
+    {
+      return node_before<Key>{core, comp, k};
+    }
+
+    // Returns the node whose key is equivalent to k, or nil.
+    template <typename Key>
+    handle find_node(const Key& k) const
+    {
+      handle match = core.lower_bound(before(k));
+      return (match != nil() && !comp(k, core.data(match).first)) ? match : nil();
+    }
+
+    template <typename Key>
+    handle upper_bound_node(const Key& k) const
+    {
+      handle curr = core.root, result = nil();
+      while(curr != nil()) {
+        if(comp(k, core.data(curr).first)) {
+          result = curr;
+          curr = core.left(curr);
+        } else {
+          curr = core.right(curr);
+        }
+      }
+      return result;
+    }
+
+    // Finds k, or builds a value from args where it belongs.
+    template <typename Key, typename... Args>
+    std::pair<handle, bool> emplace_key(Key&& k, Args&&... args)
+    {
+      handle parent;
+      bool left;
+      handle match = core.lower_bound(before(k), parent, left);
+      if(match != nil() && !comp(k, core.data(match).first)) {
+        return std::make_pair(match, false);
+      }
+      handle node = core.insert_at(parent, left, std::piecewise_construct, std::forward_as_tuple(std::forward<Key>(k)),
+                                   std::forward_as_tuple(std::forward<Args>(args)...));
+      return std::make_pair(node, true);
+    }
+
+    // Only lets the heterogeneous overloads in when Compare is transparent. A K still picks the overload taking K.
+    template <typename Key, typename Result>
+    struct if_transparent : std::enable_if<detail::is_transparent<Compare>::value, Result> {};
+
+    V& value_at(const K& k) const
+    {
+      handle n = find_node(k);
+      if(n == nil()) {
+        throw std::out_of_range("mqs::red_black_map::at: The key is not in the map.");
+      }
+      return core.data(n).second;
+    }
+
+  public:
+    typedef detail::red_black_iterator<core_type, value_type> iterator;
+    typedef detail::red_black_iterator<core_type, const value_type> const_iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    explicit red_black_map(const Compare& c = Compare(), const Allocator& a = Allocator()) : core(a), comp(c) {}
+
+    explicit red_black_map(const Allocator& a) : core(a), comp() {}
+
+    /**
+     *  Builds a balanced map from [first, last) in O(n) with its nodes in one block.
+     *  @param first the first element of a range sorted by key, with no two keys equivalent.
+     *  @param last one past the last element.
+     */
+    template <typename ForwardIt>
+    red_black_map(sorted_unique_t, ForwardIt first, ForwardIt last, const Compare& c = Compare(),
+                  const Allocator& a = Allocator()) : core(a), comp(c)
+    {
+      core.build_sorted(first, std::distance(first, last));
+    }
+
+    /**
+     *  Copies m in O(n). The copy is perfectly balanced and its nodes sit in one block, in order.
+     */
+    red_black_map(const red_black_map& m) :
+      core(std::allocator_traits<Allocator>::select_on_container_copy_construction(m.get_allocator())), comp(m.comp)
+    {
+      core.build_sorted(m.begin(), m.size());
+    }
+
+    /**
+     *  Replaces the contents with a copy of m's in O(n). The map takes m's allocator if it propagates on copy
+     *  assignment, building the copy with it before giving up the old nodes, and keeps its own otherwise.
+     */
+    red_black_map& operator=(const red_black_map& m)
+    {
+      if(this == &m) {
+        return *this;
+      }
+      typedef std::allocator_traits<Allocator> alloc_traits;
+      if(alloc_traits::propagate_on_container_copy_assignment::value && get_allocator() != m.get_allocator()) {
+        red_black_map copy(sorted_unique, m.begin(), m.end(), m.comp, m.get_allocator());
+        core.swap(copy.core);
+        comp = m.comp;
+      } else {
+        core.clear();
+        comp = m.comp;
+        core.build_sorted(m.begin(), m.size());
+      }
+      return *this;
+    }
+
+    /**
+     *  Takes m's nodes and allocator in O(1), leaving m empty.
+     */
+    red_black_map(red_black_map&& m) noexcept : core(m.get_allocator()), comp(m.comp)
+    {
+      core.swap(m.core);
+    }
+
+    /**
+     *  Replaces the contents with m's, leaving m empty. Takes m's nodes in O(1) if the allocators compare equal or
+     *  m's propagates on move assignment, and moves the elements over in O(n) otherwise, since the nodes can't be
+     *  freed through this map's allocator.
+     */
+    red_black_map& operator=(red_black_map&& m)
+    {
+      if(this == &m) {
+        return *this;
+      }
+      typedef std::allocator_traits<Allocator> alloc_traits;
+      core.clear();
+      comp = m.comp;
+      if(alloc_traits::propagate_on_container_move_assignment::value || get_allocator() == m.get_allocator()) {
+        core.swap(m.core);
+      } else {
+        core.build_sorted(std::make_move_iterator(m.begin()), m.size());
+        m.core.clear();
+      }
+      return *this;
+    }
+
+    /**
+     *  Inserts a value for k built from args, unless k is already in the map, in which case args are left alone.
+     *  @param k the key.
+     *  @param args the arguments for V's constructor.
+     *  @returns an iterator to the element with key k, and true if it was inserted.
+     */
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(const K& k, Args&&... args)
+    {
+      std::pair<handle, bool> result = emplace_key(k, std::forward<Args>(args)...);
+      return std::make_pair(iterator(result.first, &core), result.second);
+    }
+
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(K&& k, Args&&... args)
+    {
+      std::pair<handle, bool> result = emplace_key(std::move(k), std::forward<Args>(args)...);
+      return std::make_pair(iterator(result.first, &core), result.second);
+    }
+
+    /**
+     *  Inserts v if k isn't in the map, and assigns v to k's value otherwise.
+     *  @returns an iterator to the element with key k, and true if it was inserted.
+     */
+    template <typename M>
+    std::pair<iterator, bool> insert_or_assign(const K& k, M&& v)
+    {
+      std::pair<iterator, bool> result = try_emplace(k, std::forward<M>(v));
+      if(!result.second) {
+        result.first->second = std::forward<M>(v);
+      }
+      return result;
+    }
+
+    template <typename M>
+    std::pair<iterator, bool> insert_or_assign(K&& k, M&& v)
+    {
+      std::pair<iterator, bool> result = try_emplace(std::move(k), std::forward<M>(v));
+      if(!result.second) {
+        result.first->second = std::forward<M>(v);
+      }
+      return result;
+    }
+
+    /**
+     *  @returns the value for k, which is value-initialized first if k isn't in the map.
+     */
+    V& operator[](const K& k)
+    {
+      return try_emplace(k).first->second;
+    }
+
+    V& operator[](K&& k)
+    {
+      return try_emplace(std::move(k)).first->second;
+    }
+
+    /**
+     *  @returns the value for k. Throws std::out_of_range if k isn't in the map.
+     */
+    V& at(const K& k)
+    {
+      return value_at(k);
+    }
+
+    const V& at(const K& k) const
+    {
+      return value_at(k);
+    }
+
+    /**
+     *  Removes the element with key k.
+     *  @returns true if there was one.
+     */
+    bool remove(const K& k)
+    {
+      handle n = find_node(k);
+      if(n == nil()) {
+        return false;
+      }
+      core.erase(n);
+      return true;
+    }
+
+    /**
+     *  Removes the element at pos, which must not be end().
+     *  @returns an iterator to the element after it.
+     */
+    iterator erase(const_iterator pos)
+    {
+      handle n = pos.position(), next = core.successor(n);
+      core.erase(n); // Other nodes don't move, so next is still good.
+      return iterator(next, &core);
+    }
+
+    /**
+     *  @returns an iterator to the element with key k, or end() if there isn't one.
+     */
+    iterator find(const K& k)
+    {
+      return iterator(find_node(k), &core);
+    }
+
+    const_iterator find(const K& k) const
+    {
+      return const_iterator(find_node(k), &core);
+    }
+
+    template <typename Key>
+    typename if_transparent<Key, iterator>::type find(const Key& k)
+    {
+      return iterator(find_node(k), &core);
+    }
+
+    template <typename Key>
+    typename if_transparent<Key, const_iterator>::type find(const Key& k) const
+    {
+      return const_iterator(find_node(k), &core);
+    }
+
+    /**
+     *  @returns true if there is an element with key k.
+     */
+    bool contains(const K& k) const
+    {
+      return find_node(k) != nil();
+    }
+
+    template <typename Key>
+    typename if_transparent<Key, bool>::type contains(const Key& k) const
+    {
+      return find_node(k) != nil();
+    }
+
+    /**
+     *  @returns an iterator to the first element whose key isn't less than k, or end() if there is none.
+     */
+    iterator lower_bound(const K& k)
+    {
+      return iterator(core.lower_bound(before(k)), &core);
+    }
+
+    const_iterator lower_bound(const K& k) const
+    {
+      return const_iterator(core.lower_bound(before(k)), &core);
+    }
+
+    template <typename Key>
+    typename if_transparent<Key, iterator>::type lower_bound(const Key& k)
+    {
+      return iterator(core.lower_bound(before(k)), &core);
+    }
+
+    template <typename Key>
+    typename if_transparent<Key, const_iterator>::type lower_bound(const Key& k) const
+    {
+      return const_iterator(core.lower_bound(before(k)), &core);
+    }
+
+    /**
+     *  @returns an iterator to the first element whose key is greater than k, or end() if there is none.
+     */
+    iterator upper_bound(const K& k)
+    {
+      return iterator(upper_bound_node(k), &core);
+    }
+
+    const_iterator upper_bound(const K& k) const
+    {
+      return const_iterator(upper_bound_node(k), &core);
+    }
+
+    template <typename Key>
+    typename if_transparent<Key, iterator>::type upper_bound(const Key& k)
+    {
+      return iterator(upper_bound_node(k), &core);
+    }
+
+    template <typename Key>
+    typename if_transparent<Key, const_iterator>::type upper_bound(const Key& k) const
+    {
+      return const_iterator(upper_bound_node(k), &core);
+    }
+
+    iterator begin()
+    {
+      return iterator(core.leftmost(core.root), &core);
+    }
+
+    const_iterator begin() const
+    {
+      return const_iterator(core.leftmost(core.root), &core);
+    }
+
+    iterator end()
+    {
+      return iterator(nil(), &core);
+    }
+
+    const_iterator end() const
+    {
+      return const_iterator(nil(), &core);
+    }
+
+    const_iterator cbegin() const
+    {
+      return begin();
+    }
+
+    const_iterator cend() const
+    {
+      return end();
+    }
+
+    reverse_iterator rbegin()
+    {
+      return reverse_iterator(end());
+    }
+
+    const_reverse_iterator rbegin() const
+    {
+      return const_reverse_iterator(end());
+    }
+
+    reverse_iterator rend()
+    {
+      return reverse_iterator(begin());
+    }
+
+    const_reverse_iterator rend() const
+    {
+      return const_reverse_iterator(begin());
+    }
+
+    size_t size() const
+    {
+      return core.count;
+    }
+
+    bool empty() const
+    {
+      return core.count == 0;
+    }
+
+    /**
+     *  Removes every element and frees the map's memory.
+     */
+    void clear()
+    {
+      core.clear();
+    }
+
+    Compare key_comp() const
+    {
+      return comp;
+    }
+
+    /**
+     *  @returns a copy of the allocator the map was constructed with.
+     */
+    Allocator get_allocator() const
+    {
+      return Allocator(core.get_allocator());
+    }
+
+    ~red_black_map() {
+      if(detail::skips_teardown<Allocator, value_type>::value) {
+        return;
+      }
+      clear();
+    }
+};
+
+}
+
+#endif
@@ -8,385 +8,369 @@
 #ifndef RED_BLACK_TREE_HPP
 #define RED_BLACK_TREE_HPP
 
+#include <algorithm> // for std::sort, std::unique, std::is_sorted
 #include <cstddef> //for std::size_t
+#include <iterator> // for std::reverse_iterator, std::distance, std::make_move_iterator
+#include <memory> // for std::allocator_traits
+#include <type_traits> // for std::is_trivially_destructible
+#include <utility> // for std::pair
 #include <vector>  //for std::vector
+#include "allocator.hpp"
+#include "red_black_core.hpp"
 
 namespace mqs {
 
-template <typename T>
+/**
+ *  A set of T kept in a red black tree. T needs == and >.
+ *
+ *  Layout picks how nodes are stored; see pointer_nodes and index_nodes. With the default pointer_nodes, a node is
+ *  three pointers with the color in the low bit of the parent pointer, and nodes are carved out of slabs in
+ *  insertion order, so nodes inserted close together in time sit close together in memory. index_nodes, also
+ *  available as red_black_index_tree, links nodes in one array with 32-bit indices instead, about half the memory
+ *  per node for small keys. Either way removed nodes are recycled, and memory comes from Allocator rebound to the
+ *  node type, heap_allocator by default. A tree keeps its memory until clear() or destruction, which free it without
+ *  visiting trivially destructible elements; with an arena_allocator, destruction is O(1).
+ *
+ *  Augment adds data to every node that the tree keeps up to date as it changes. With order_statistics, also
+ *  available as order_statistic_tree, the tree supports select(), rank() and count_range() in O(log n). With
+ *  max_endpoint, also available as interval_tree, the elements are intervals and the tree finds the ones overlapping
+ *  a range or containing a point with find_overlapping(), visit_overlapping() and visit_containing().
+ *
+ *  Stats counts searches, comparisons, rotations, repair cases and node allocations, read with stats(). With the
+ *  default no_stats nothing is counted and nothing is paid; rb_stats keeps the counts.
+ */
+template <typename T, typename Allocator = heap_allocator<T>, typename Layout = pointer_nodes,
+          typename Augment = no_augment, typename Stats = no_stats>
 class red_black_tree {
   private:
-    class red_black_tree_node {
-      public:
-        T data;
-        enum Color {red = 0, black = 1}; 
-        Color color;
-        red_black_tree_node *parent;
-        red_black_tree_node *left;
-        red_black_tree_node *right;
-
-        // Default constructor
-        red_black_tree_node() : color(red), parent(nullptr), left(nullptr), right(nullptr) {};
-        // Construct a node with data, black by default since if a parent isn't known this will probably be used for the root.
-        explicit red_black_tree_node(const T& d) : data(d), color(red), parent(nullptr), left(nullptr), right(nullptr) {}
-        // Construct a node with data and parent, red by default since this will probably be used for an insertion not at the root.
-        red_black_tree_node(const T& d, red_black_tree_node *p) : data(d), color(red), parent(p), left(nullptr), right(nullptr) {};
-        // Construct a node where everything is known.
-        red_black_tree_node(const T& d, Color c, red_black_tree_node *p, red_black_tree_node *l, red_black_tree_node *r) : data(d), color(red), parent(p), left(l), right(r) {};
-
-        inline T getData()
-        {
-          return this->data;
-        }
-
-        inline bool isBlack()
-        {
-          return this->color == black;
-        }
-
-        inline bool isRed()
-        {
-          return this->color == red;
-        }
+    typedef detail::red_black_core<typename detail::rb_storage<T, Allocator, Layout, Augment>::type, Stats> core_type;
+    typedef typename core_type::handle handle;
 
-        inline void setBlack()
-        {
-          this->color = black;
-        }
-
-        inline void setRed()
-        {
-          this->color = red;
-        }
-
-        inline red_black_tree_node* getParent()
-        {
-          return this->parent;
-        }
+    core_type core;
 
-        inline red_black_tree_node* getSibling()
-        {
-          red_black_tree_node* p = this->parent;
-          if(p) {
-            if(p->left == this) {
-              return p->right;
-            }
-            return p->left;
-          }
-          return nullptr;
-        }
+    // Reads nodes directly for its lock-free lookups.
+    template <typename, typename> friend class concurrent_red_black_tree;
+    // Reads the nodes of the other tree in set operations.
+    template <typename, typename, typename, typename, typename> friend class red_black_tree;
 
-        inline red_black_tree_node* getGrandparent()
-        {
-          if(this->parent) {
-            return this->parent->parent;
-          }
-          return nullptr;
-        }
+    handle nil() const
+    {
+      return core_type::nil();
+    }
 
-        inline red_black_tree_node* getUncle()
-        {
-          red_black_tree_node* gp = this->getGrandparent();
-          if(gp) {
-            if(gp->left == this->parent) {
-              return gp->right;
-            }
-            return gp->left;
-          }
-          return nullptr;
-        }
+    // Says whether a node comes before d, for core.lower_bound().
+    struct node_before
+    {
+      const core_type& core;
+      const T& d;
 
-        inline red_black_tree_node* getPredecessor()
-        {
-          red_black_tree_node* curr = this->left;
-          while(curr->right) {
-            curr = curr->right; 
-          }
-          return curr;
-        }
+      bool operator()(handle n) const
+      {
+        return d > core.data(n);
+      }
+    };
 
-        inline red_black_tree_node* getSuccessor()
-        {
-          red_black_tree_node *p = this->parent; 
-          if(!p) {
-            p = this; 
-          }
-          if(p->right) {
-            p = p->right;
-            while(p->left) {
-              p = p->left;
-            }
-            return p;
-          }
-          red_black_tree_node *curr = this;
-          while(p->left != curr) {
-            curr = p;
-            p = p->parent;
-          }
-          return p;
-        }
+    node_before before(const T& d) const
+    {
+      return node_before{core, d};
+    }
 
-        inline void rotateLeft()
-        {
-          if(this->right) {
-            red_black_tree_node* nn = this->right;
-            if(this->parent) {
-              if(this->parent->left == this) {
-                this->parent->left = nn; 
-              } else {
-                this->parent->right = nn;
-              }
-            }
-            nn->parent = this->parent;
-            this->parent = nn;
-            this->right = nn->left;
-            nn->left = this;
-            if(this->right) {
-              this->right->parent = this;
-            }
-          }
+    // Returns the node holding d, or nil. Checking for d on the way down stops the search at d's level instead of a
+    // leaf's, the deepest and least cached ones, which is worth the extra comparison when T compares cheaply.
+    handle find_node(const T& d) const
+    {
+      handle curr = core.root;
+      core.stats().on_lookup();
+      while(curr != nil()) {
+        core.stats().on_compare();
+        const T& data = core.data(curr);
+        if(data == d) {
+          break;
         }
+        curr = (data > d ? core.left(curr) : core.right(curr));
+      }
+      return curr;
+    }
 
-        inline void rotateRight()
-        {
-          if(this->left) {
-            red_black_tree_node* nn = this->left;
-            if(this->parent) {
-              if(this->parent->right == this) {
-                this->parent->right = nn;
-              } else {
-                this->parent->left = nn;
-              }
-            }
-            nn->parent = this->parent;
-            this->parent = nn;
-            this->left = nn->right;
-            nn->right = this;
-            if(this->left) {
-              this->left->parent = this;
-            }
-          }
-        }
-       
-        ~red_black_tree_node()
-        {
-          if(left) {
-            delete left;
-          }
-          if(right) {
-            delete right;
-          }
-        }
+    // Orders elements for the core's set operations.
+    struct element_less
+    {
+      bool operator()(const T& a, const T& b) const
+      {
+        return b > a;
+      }
     };
-    
-    red_black_tree_node *root;
-    size_t _size;
 
-    int height(red_black_tree_node* node)
+    template <typename ForwardIt>
+    static bool sorted_without_repeats(ForwardIt first, ForwardIt last)
     {
-      if(!node) {
-        return -1;
+      if(first == last) {
+        return true;
+      }
+      for(ForwardIt next = first; ++next != last; first = next) {
+        if(!(*next > *first)) {
+          return false;
+        }
       }
-      return 1 + std::max(height(node->right), height(node->left));
+      return true;
     }
 
-    void insert_repair(red_black_tree_node* node)
+    // Inserts the sorted range [first, last), which may hold repeats. prev is the node the last key went into, or
+    // the one that already held it, and next is the node after prev. A key that falls between them is attached
+    // without a search, and any other is searched for from next.
+    template <typename ForwardIt>
+    size_t insert_sorted(ForwardIt first, ForwardIt last)
     {
-      red_black_tree_node *parent = node->getParent();
-      // Case 1: node is the root node, it must be set to black.
-      if(!parent) {
-        node->setBlack();
-        root = node;
-        return;
-      }
-      // Case 2: The parent of node is black, theres nothing to be done.
-      if(parent->isBlack()) {
-        return;
-      }
-      red_black_tree_node *grandparent = node->getGrandparent(), *uncle = node->getUncle();
-      // Case 3: The parent is red and the uncle is black
-      if(!uncle || uncle->isBlack()) {
-        // Goal: Rotate parent into grandparent position
-        // Part 1: If node is on the "inside" of the tree, we need to rotate it to the outside first.
-        if(grandparent->left && node == grandparent->left->right) {
-          parent->rotateLeft();
-          node = node->left;
-        } else if(grandparent->right && node == grandparent->right->left) {
-          parent->rotateRight(); 
-          node = node->right;
+      core.reserve(std::distance(first, last));
+      size_t inserted = 0;
+      handle prev = nil(), next = nil();
+      for(; first != last; ++first) {
+        const T& d = *first;
+        if(prev != nil() && !(d > core.data(prev))) { // A repeat of the last key.
+          continue;
         }
-        parent = node->getParent();
-        grandparent = node->getGrandparent();
-        // Part 2: Now we can rotate the parent into place by rotating in the correct direction.
-        if(node == parent->left) {
-          grandparent->rotateRight(); // Parent is the left child of grandparent, so we rotate the grandparent right.
+        handle parent;
+        bool left;
+        if(prev == nil()) {
+          next = core.lower_bound(before(d), parent, left);
+        } else if(next != nil() && d > core.data(next)) {
+          next = core.lower_bound_after(next, before(d), parent, left);
+        } else if(core.right(prev) == nil()) { // Between prev and next, so it goes right below one of them.
+          parent = prev;
+          left = false;
         } else {
-          grandparent->rotateLeft();  // Parent is the right child of grandparent, so we rotate the grandparent left.
+          parent = next;
+          left = true;
         }
-        // Finally, we make the parent and grandparent the appropriate colors and return true.
-        parent->setBlack();
-        grandparent->setRed();
-        if(grandparent == root) {
-          root = parent;
+        if(next != nil() && !(core.data(next) > d)) { // Already in the tree.
+          prev = next;
+          next = core.successor(next);
+          continue;
         }
-        return;
+        prev = core.insert_at(parent, left, d);
+        inserted++;
       }
-      //Case 4: The parent and uncle are both red
-      parent->setBlack();
-      uncle->setBlack();
-      grandparent->setRed();
-      insert_repair(grandparent);
+      return inserted;
     }
 
-    void remove_repair(red_black_tree_node *node, red_black_tree_node *curr)
+    // Removes the sorted range [first, last), which may hold repeats. next is the first node that doesn't come before
+    // the last key, where the search for the next key starts.
+    template <typename ForwardIt>
+    size_t remove_sorted(ForwardIt first, ForwardIt last)
     {
-      // curr hasn't been deleted yet so we use it here instead of node, since node isn't guaranteed to exist.
-      red_black_tree_node *parent = curr->parent, *sibling = curr->getSibling();
-      // Case 1: The node is the root: We just need to paint it black.
-      if(!parent) {
-        root = node;
-        if(node) { // Edge case, the node that we deleted was the only node, we will reach this case and node won't exist.
-          node->setBlack();
+      if(first == last) {
+        return 0;
+      }
+      size_t removed = 0;
+      handle parent;
+      bool left;
+      handle next = core.lower_bound(before(*first), parent, left);
+      for(; first != last && next != nil(); ++first) {
+        const T& d = *first;
+        if(d > core.data(next)) {
+          next = core.lower_bound_after(next, before(d), parent, left);
         }
-        return;
-      } 
-      // Case 2: The nodes sibling is red.
-      if(sibling && sibling->isRed()) {
-        parent->setRed();
-        sibling->setBlack();
-        parent->rotateLeft();
-        if(root->parent) {
-          while(root->parent) {
-            root = root->parent;
-          }
+        if(next != nil() && !(core.data(next) > d)) {
+          handle match = next;
+          next = core.successor(match);
+          core.erase(match);
+          removed++;
         }
-        // Since we've rotated, node has a new sibling and we update accordingly.
-        if(node) {
-          sibling = node->getSibling();
+      }
+      return removed;
+    }
+
+    // Says whether n's interval overlaps [lo, hi]. This and the searches below need max_endpoint.
+    template <typename Point>
+    bool overlaps(handle n, const Point& lo, const Point& hi) const
+    {
+      typedef typename Augment::traits traits;
+      return !(traits::high(core.data(n)) < lo) && !(hi < traits::low(core.data(n)));
+    }
+
+    // Returns the first node in order under n whose interval overlaps [lo, hi], or nil, walking down one path. If
+    // an interval on the left reaches lo, either it overlaps or it starts after hi, and so does everything after it,
+    // so the answer is on the left or nowhere.
+    template <typename Point>
+    handle first_overlap(handle n, const Point& lo, const Point& hi) const
+    {
+      while(n != nil() && !(Augment::max_of(core, n) < lo)) {
+        handle l = core.left(n);
+        if(l != nil() && !(Augment::max_of(core, l) < lo)) {
+          n = l;
+        } else if(overlaps(n, lo, hi)) {
+          return n;
+        } else if(hi < Augment::traits::low(core.data(n))) {
+          return nil();
         } else {
-          sibling = (parent->left ? parent->left : parent->right);
+          n = core.right(n);
         }
       }
-      // Case 3: The nodes parent is black, and both of siblings children is black.
-      if(parent->isBlack() && sibling && (!sibling->left || sibling->left->isBlack()) && (!sibling->right || sibling->right->isBlack())) {
-        sibling->setRed();                // We repaint the sibling red and recurse on the parent, since there is now
-        remove_repair(parent, parent);    // one less black node when passing through parent.
-        return;
-      }
-      // Case 4: The nodes parent is red, its sibling is black, and both its children are black
-      if(parent->isRed() && sibling && sibling->isBlack() && (!sibling->left || sibling->left->isBlack()) && (!sibling->right || sibling->right->isBlack())) {
-        parent->setBlack();   // By swapping colors, we've made up for the missing black node on the path of node, but
-        if(parent->left) {
-          parent->left->setRed();
+      return nil();
+    }
+
+    // Returns the first node after n in order whose interval overlaps [lo, hi], or nil: the first one under n's
+    // right subtree, or else the first at or right of an ancestor n is left of. Every interval after one that starts
+    // past hi starts past hi too, which ends the climb.
+    template <typename Point>
+    handle next_overlap(handle n, const Point& lo, const Point& hi) const
+    {
+      handle next = first_overlap(core.right(n), lo, hi);
+      for(handle p = core.parent(n); next == nil() && p != nil(); n = p, p = core.parent(p)) {
+        if(core.left(p) != n) {
+          continue;
         }
-        if(parent->right) {
-          parent->right->setRed();
+        if(hi < Augment::traits::low(core.data(p))) {
+          return nil();
         }
-        //sibling->setRed();    // haven't effected the path through the sibling.
-        return;
+        next = (overlaps(p, lo, hi) ? p : first_overlap(core.right(p), lo, hi));
       }
-      // Case 5: The sibling is non null and black...
-      if(sibling && sibling->isBlack() && sibling->left && sibling->left->isRed()) {
-        // With the node on its parents left side, and siblings right child black and its left child red.
-        if(parent->left == node && (!sibling->right || sibling->right->isBlack()) && sibling->left && sibling->left->isRed()) {
-          sibling->setRed();
-          sibling->left->setBlack();
-          sibling->rotateRight();
-          if(root->parent) {
-            while(root->parent) {
-              root = root->parent;
-            }
-          } else if(parent->right == node && sibling->right && sibling->right->isRed() && (!sibling->left || sibling->left->isBlack())) {
-            sibling->setRed();
-            sibling->right->setBlack();
-            sibling->rotateLeft();
-            if(root->parent) {
-              while(root->parent) {
-                root = root->parent;
-              }
-            }
-          }
-          // Again, since we (possibly) rotated, we update the sibling.
-          if(node) {
-            sibling = node->getSibling();
-          }
-          else {
-            sibling = (parent->left ? parent->left : parent->right);
-          }
-        }  
-      }
-      // Case 6: Sibling is not null and black, and its right child is red.
-      if(sibling && sibling->isBlack() && sibling->right && sibling->right->isRed()) {
-        sibling->color = parent->color;
-        parent->setBlack();
-        sibling->right->setBlack();
-        if(parent->left == curr) {
-          parent->rotateLeft();
-          if(root->parent) {
-            while(root->parent) {
-              root = root->parent;
-            }
-          }
-        } else {
-          parent->rotateRight();
-          if(root->parent) {
-            while(root->parent) {
-              root = root->parent;
-            }
-          }
-        }
+      return next;
+    }
+
+  public:
+    typedef Allocator allocator_type;
+    typedef T value_type;
+    typedef T key_type;
+    typedef size_t size_type;
+    // The elements are the keys, so they can't be modified through an iterator.
+    typedef detail::red_black_iterator<core_type, const T> const_iterator;
+    typedef const_iterator iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+    typedef const_reverse_iterator reverse_iterator;
+
+    explicit red_black_tree(const Allocator& a = Allocator()) : core(a) {}
+
+    /**
+     *  Builds a tree holding the elements of data. Costs O(n) if data is already sorted and O(n log n) otherwise.
+     *  @param data the elements, in any order and possibly with repeats.
+     */
+    explicit red_black_tree(std::vector<T>& data, const Allocator& a = Allocator()) : core(a)
+    {
+      assign(data.begin(), data.end());
+    }
+
+    /**
+     *  Builds a balanced tree from [first, last) in O(n) with its nodes in one block.
+     *  @param first the first element of a range sorted in strictly increasing order.
+     *  @param last one past the last element.
+     */
+    template <typename ForwardIt>
+    red_black_tree(sorted_unique_t, ForwardIt first, ForwardIt last, const Allocator& a = Allocator()) : core(a)
+    {
+      core.build_sorted(first, std::distance(first, last));
+    }
+
+    /**
+     *  Copies t in O(n). The copy is perfectly balanced and its nodes sit in one block, in order.
+     */
+    red_black_tree(const red_black_tree& t) :
+      core(std::allocator_traits<Allocator>::select_on_container_copy_construction(t.get_allocator()))
+    {
+      core.build_sorted(t.begin(), t.size());
+    }
+
+    /**
+     *  Replaces the contents with a copy of t's in O(n). The tree takes t's allocator if it propagates on copy
+     *  assignment, building the copy with it before giving up the old nodes, and keeps its own otherwise.
+     */
+    red_black_tree& operator=(const red_black_tree& t)
+    {
+      if(this == &t) {
+        return *this;
+      }
+      typedef std::allocator_traits<Allocator> alloc_traits;
+      if(alloc_traits::propagate_on_container_copy_assignment::value && get_allocator() != t.get_allocator()) {
+        red_black_tree copy(sorted_unique, t.begin(), t.end(), t.get_allocator());
+        core.swap(copy.core);
+      } else {
+        assign_sorted(t.begin(), t.end());
       }
+      return *this;
     }
 
+    /**
+     *  Takes t's nodes and allocator in O(1), leaving t empty.
+     */
+    red_black_tree(red_black_tree&& t) noexcept : core(t.get_allocator())
+    {
+      core.swap(t.core);
+    }
 
-  public:
-    red_black_tree() : root(nullptr), _size(0) {}
+    /**
+     *  Replaces the contents with t's, leaving t empty. Takes t's nodes in O(1) if the allocators compare equal or
+     *  t's propagates on move assignment, and copies the elements in O(n) otherwise, since the nodes can't be freed
+     *  through this tree's allocator.
+     */
+    red_black_tree& operator=(red_black_tree&& t)
+    {
+      if(this == &t) {
+        return *this;
+      }
+      typedef std::allocator_traits<Allocator> alloc_traits;
+      if(alloc_traits::propagate_on_container_move_assignment::value || get_allocator() == t.get_allocator()) {
+        core.clear();
+        core.swap(t.core);
+      } else {
+        assign_sorted(t.begin(), t.end());
+        t.clear();
+      }
+      return *this;
+    }
 
-    explicit red_black_tree(std::vector<T>& data)
+    /**
+     *  Replaces the contents with [first, last) in O(n), in a perfectly balanced tree whose nodes sit in one block.
+     *  If an element throws while being copied, the tree is left empty.
+     *  @param first the first element of a range sorted in strictly increasing order.
+     *  @param last one past the last element.
+     */
+    template <typename ForwardIt>
+    void assign_sorted(ForwardIt first, ForwardIt last)
+    {
+      core.clear();
+      core.build_sorted(first, std::distance(first, last));
+    }
+
+    /**
+     *  Replaces the contents with the elements in [first, last). A range that is already sorted without repeats is
+     *  built in O(n) like assign_sorted(). Anything else is copied, sorted and deduplicated first, which is still
+     *  far cheaper than inserting the elements one by one.
+     *  @param first the first element, in any order and possibly with repeats.
+     *  @param last one past the last element.
+     */
+    template <typename ForwardIt>
+    void assign(ForwardIt first, ForwardIt last)
     {
-      root = nullptr;
-      _size = 0;
-      for(T d : data) {
-        insert(d);
-      } 
+      if(sorted_without_repeats(first, last)) {
+        assign_sorted(first, last);
+        return;
+      }
+      std::vector<T> sorted(first, last);
+      std::sort(sorted.begin(), sorted.end(), [](const T& a, const T& b) { return b > a; });
+      sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+      assign_sorted(std::make_move_iterator(sorted.begin()), std::make_move_iterator(sorted.end()));
     }
 
     /**
      *  Inserts a single piece of data into the tree.
-     *  @param d the data to insert. 
-     *  @returns true if new node was created and inserted and 
+     *  @param d the data to insert.
+     *  @returns true if new node was created and inserted and
      *  false if a node with the data already existed in tree.
      */
     bool insert(const T& d)
     {
       // First we find the position of the node.
-      red_black_tree_node *node = root, *parent = nullptr;
-      bool lastLeft;
-      while(node) {
-        parent = node;
-        if(node->data == d) { // A node with the data already exists.
-          return false;       // So we return false;
-        } else if(node->data > d) {
-          node = node->left;
-          lastLeft = true;
-        } else {
-          node = node->right; 
-          lastLeft = false;
-        }
+      handle parent;
+      bool left;
+      handle match = core.lower_bound(before(d), parent, left);
+      if(match != nil() && !(core.data(match) > d)) { // A node with the data already exists.
+        return false;                                 // So we return false;
       }
-      // Then we create the node.
-      node = new red_black_tree_node(d, parent);
-      _size++;
-      if(parent && lastLeft) { // And set the children properly. Notice, we check for existence of the parent, in case
-        parent->left = node;   // this node is the root node.
-      }
-      else if(parent) {
-        parent->right = node;
-      }
-      insert_repair(node);    // Repair balance to the tree.
+      // Then we create the node below its parent, or as the root if there is no parent, and repair the balance.
+      core.insert_at(parent, left, d);
       return true;
     }
-    
+
     /**
      *  Removes a single piece of data from the tree.
      *  @param d the data to remove.
@@ -395,67 +379,164 @@ class red_black_tree {
      */
     bool remove(const T& d)
     {
-      red_black_tree_node* curr = root;
-      while(curr && curr->data != d) {
-        if(curr->data > d) {
-          curr = curr->left;
-        } else {
-          curr = curr->right;
-        }
-      }
+      handle curr = find_node(d);
       // If curr is null, there isn't a node with the data and we return false.
-      if(!curr) {
+      if(curr == nil()) {
         return false;
       }
-      if(_size == 1) {
-        delete curr;
-        root = nullptr;
-        _size--;
-        return true;
+      core.erase(curr);
+      return true;
+    }
+
+    /**
+     *  Inserts every element of [first, last) that isn't in the tree yet. The batch is sorted first, unless it
+     *  already is, and each element's place is then searched for from the previous one's instead of from the root.
+     *  Keys that land next to each other, such as appended keys that are mostly ascending, cost O(1) amortized each,
+     *  since the insert repair is amortized O(1) as well, and the batch's nodes come from one block in key order.
+     *  If an element throws while being copied, the elements already inserted stay.
+     *  @param first the first element, in any order and possibly with repeats.
+     *  @param last one past the last element.
+     *  @returns the number of elements inserted.
+     */
+    template <typename ForwardIt>
+    size_t insert_batch(ForwardIt first, ForwardIt last)
+    {
+      if(std::is_sorted(first, last, element_less())) {
+        return insert_sorted(first, last);
       }
-      // If there are two non-null children, replace with the value of inorder predecessor and delete the predecessor.
-      if(curr->left && curr->right) {
-        red_black_tree_node *predecessor = curr->getPredecessor();
-        curr->data = predecessor->data;
-        curr = predecessor;
+      std::vector<T> sorted(first, last);
+      std::sort(sorted.begin(), sorted.end(), element_less());
+      return insert_sorted(sorted.begin(), sorted.end());
+    }
+
+    /**
+     *  Removes every element of [first, last) that is in the tree, sorting the batch first unless it already is and
+     *  searching for each element from where the previous one was. Other nodes keep their place in memory.
+     *  @param first the first element, in any order and possibly with repeats.
+     *  @param last one past the last element.
+     *  @returns the number of elements removed.
+     */
+    template <typename ForwardIt>
+    size_t remove_batch(ForwardIt first, ForwardIt last)
+    {
+      if(std::is_sorted(first, last, element_less())) {
+        return remove_sorted(first, last);
       }
-      if(curr->isRed()) {
-        _size--;
-        if(curr == curr->parent->left) {
-          curr->parent->left = nullptr;
-        } else {
-          curr->parent->right = nullptr;
+      std::vector<T> sorted(first, last);
+      std::sort(sorted.begin(), sorted.end(), element_less());
+      return remove_sorted(sorted.begin(), sorted.end());
+    }
+
+    /**
+     *  Adds every element of other that isn't in the tree yet. other's elements are copied into a balanced tree of
+     *  new nodes, in O(m) for m = other.size(), which is then merged in with splits and joins in O(m log(n/m + 1)).
+     *  Every step of a merge touches a node that probably isn't cached, while inserting other's elements in order
+     *  walks mostly the same path each time, so when other is under a quarter of the tree's size and there is no
+     *  pool to share the merge, its elements are inserted one at a time instead. If an element throws while being
+     *  copied, the elements already added stay.
+     *  @param other the tree to take the elements from.
+     */
+    template <typename A, typename L, typename G, typename S>
+    void unite(const red_black_tree<T, A, L, G, S>& other)
+    {
+      detail::no_pool pool;
+      unite(other, pool);
+    }
+
+    /**
+     *  unite() with the merge split into tasks on pool, for large trees. A tree that keeps stats merges on the
+     *  calling thread instead.
+     *  @param pool anything with size() and run(tasks, fn), such as thread_pool.
+     */
+    template <typename A, typename L, typename G, typename S, typename Pool>
+    void unite(const red_black_tree<T, A, L, G, S>& other, Pool& pool)
+    {
+      if(static_cast<const void*>(&other) == this) {
+        return;
+      }
+      if(pool.size() < 2 && 4*other.size() <= size()) {
+        for(const T& d : other) {
+          insert(d);
         }
-        /*
-        curr->left = nullptr;
-        curr->right = nullptr;
-        */
-        delete curr;
-        return true;
+        return;
       }
-      red_black_tree_node *child = (curr->right ? curr->right : curr->left);
-      if(!child || child->isBlack()) {  // If the child is black, we need to perform some number of the 6 "double-back" transformations.
-        remove_repair(child, curr); // Since multiple "repairs" may need to be done we use a seperate recursive function.
-      }
-      if(child) { // If the child wasn't a null node, we set the parent, and make sure its black.
-        child->parent = curr->parent;
-        child->setBlack();
-      }
-      // We replace the node with its child node.
-      if(curr == root) {
-        root = child;
-      } else if(child != root && curr->parent->left == curr) {
-        curr->parent->left = child;
-      } else if(child != root) {
-        curr->parent->right = child;
-      }
-      _size--;
-      // Set currs children to null, since destructor would destroy its former children otherwise.
-      curr->left = nullptr;
-      curr->right = nullptr;
-      // Finally, we delete the node.
-      delete curr;
-      return true;
+      handle copy = core.build_detached(other.begin(), other.size());
+      core.template merge<detail::set_operation::unite>(core, copy, other.size(), element_less(), pool);
+    }
+
+    /**
+     *  Removes every element that isn't also in other, in O(m log(n/m + 1)) for trees of m <= n elements. other is
+     *  only read, and nothing is allocated.
+     *  @param other the tree to compare against.
+     */
+    template <typename A, typename L, typename G, typename S>
+    void intersect(const red_black_tree<T, A, L, G, S>& other)
+    {
+      detail::no_pool pool;
+      intersect(other, pool);
+    }
+
+    /**
+     *  intersect() with the merge split into tasks on pool, for large trees. A tree that keeps stats merges on the
+     *  calling thread instead.
+     *  @param pool anything with size() and run(tasks, fn), such as thread_pool.
+     */
+    template <typename A, typename L, typename G, typename S, typename Pool>
+    void intersect(const red_black_tree<T, A, L, G, S>& other, Pool& pool)
+    {
+      if(static_cast<const void*>(&other) == this) {
+        return;
+      }
+      core.template merge<detail::set_operation::intersect>(other.core, other.core.root, other.size(), element_less(),
+                                                            pool);
+    }
+
+    /**
+     *  Removes every element that is also in other, in O(m log(n/m + 1)) for trees of m <= n elements. other is
+     *  only read, and nothing is allocated. Like unite(), when other is under a quarter of the tree's size and there
+     *  is no pool, its elements are removed one at a time instead.
+     *  @param other the tree holding the elements to remove.
+     */
+    template <typename A, typename L, typename G, typename S>
+    void subtract(const red_black_tree<T, A, L, G, S>& other)
+    {
+      detail::no_pool pool;
+      subtract(other, pool);
+    }
+
+    /**
+     *  subtract() with the merge split into tasks on pool, for large trees. A tree that keeps stats merges on the
+     *  calling thread instead.
+     *  @param pool anything with size() and run(tasks, fn), such as thread_pool.
+     */
+    template <typename A, typename L, typename G, typename S, typename Pool>
+    void subtract(const red_black_tree<T, A, L, G, S>& other, Pool& pool)
+    {
+      if(static_cast<const void*>(&other) == this) {
+        clear();
+        return;
+      }
+      if(pool.size() < 2 && 4*other.size() <= size()) {
+        for(const T& d : other) {
+          remove(d);
+        }
+        return;
+      }
+      core.template merge<detail::set_operation::subtract>(other.core, other.core.root, other.size(), element_less(),
+                                                           pool);
+    }
+
+    /**
+     *  Removes every element for which keep returns false, in O(n) whatever the number removed, by joining the
+     *  kept parts of each subtree back together instead of removing elements one by one. If keep throws, the element
+     *  it threw on and those it hadn't reached are kept, and the exception is rethrown with the tree still valid.
+     *  @param keep a callable taking a const T& and returning true for elements to keep.
+     *  @returns the number of elements removed.
+     */
+    template <typename Predicate>
+    size_t filter(Predicate keep)
+    {
+      return core.filter(keep);
     }
 
     /**
@@ -463,75 +544,351 @@ class red_black_tree {
      *  @param d the data to find.
      *  @returns true if node with data was found and false otherwise.
      */
-    inline bool find(const T& d)
+    inline bool find(const T& d) const
+    {
+      return find_node(d) != nil();
+    }
+
+    /**
+     *  @returns an iterator to the smallest element, or end() if the tree is empty.
+     */
+    const_iterator begin() const
     {
-      red_black_tree_node* curr = root;
-      while(curr) {
-        if(curr->data == d) {
-          return true;
+      return const_iterator(core.leftmost(core.root), &core);
+    }
+
+    /**
+     *  @returns an iterator one past the largest element.
+     */
+    const_iterator end() const
+    {
+      return const_iterator(nil(), &core);
+    }
+
+    const_iterator cbegin() const
+    {
+      return begin();
+    }
+
+    const_iterator cend() const
+    {
+      return end();
+    }
+
+    const_reverse_iterator rbegin() const
+    {
+      return const_reverse_iterator(end());
+    }
+
+    const_reverse_iterator rend() const
+    {
+      return const_reverse_iterator(begin());
+    }
+
+    /**
+     *  Finds the first element that is not less than d.
+     *  @param d the value to compare against.
+     *  @returns an iterator to the first element >= d, or end() if there is none.
+     */
+    const_iterator lower_bound(const T& d) const
+    {
+      return const_iterator(core.lower_bound(before(d)), &core);
+    }
+
+    /**
+     *  Finds the first element that is greater than d.
+     *  @param d the value to compare against.
+     *  @returns an iterator to the first element > d, or end() if there is none.
+     */
+    const_iterator upper_bound(const T& d) const
+    {
+      handle curr = core.root, result = nil();
+      core.stats().on_lookup();
+      while(curr != nil()) {
+        core.stats().on_compare();
+        if(core.data(curr) > d) {
+          result = curr;
+          curr = core.left(curr);
+        } else {
+          curr = core.right(curr);
         }
-        if(curr->data > d) {
-          curr = curr->left;
+      }
+      return const_iterator(result, &core);
+    }
+
+    /**
+     *  @returns the range of elements equal to d: empty, or the one element equal to it.
+     */
+    std::pair<const_iterator, const_iterator> equal_range(const T& d) const
+    {
+      const_iterator first = lower_bound(d);
+      if(first != end() && !(*first > d)) {
+        const_iterator last = first;
+        return std::make_pair(first, ++last);
+      }
+      return std::make_pair(first, first);
+    }
+
+    /**
+     *  Calls visitor on every element in [lo, hi), in order. Costs O(log n + k) for k elements visited, since the
+     *  walk between neighbours climbs and descends each edge of the visited subtree at most twice, and allocates
+     *  nothing.
+     *  @param lo the smallest value to visit.
+     *  @param hi the value to stop at, which isn't visited.
+     *  @param visitor a callable taking a const T&.
+     *  @returns the number of elements visited.
+     */
+    template <typename Visitor>
+    size_t visit_range(const T& lo, const T& hi, Visitor visitor) const
+    {
+      size_t visited = 0;
+      for(handle curr = lower_bound(lo).position(); curr != nil() && hi > core.data(curr); curr = core.successor(curr)) {
+        visitor(static_cast<const T&>(core.data(curr)));
+        visited++;
+      }
+      return visited;
+    }
+
+    /**
+     *  Finds the element with k smaller elements in the tree. Needs order_statistics.
+     *  @param k the position of the element in sorted order, counting from 0.
+     *  @returns an iterator to the element, or end() if k >= size().
+     */
+    const_iterator select(size_t k) const
+    {
+      static_assert(std::is_same<Augment, order_statistics>::value,
+                    "mqs::red_black_tree: select() needs order_statistics.");
+      handle curr = core.root;
+      while(curr != nil()) {
+        size_t left = order_statistics::size_of(core, core.left(curr));
+        if(k == left) {
+          break;
+        }
+        if(k < left) {
+          curr = core.left(curr);
+        } else {
+          k -= left + 1;
+          curr = core.right(curr);
         }
-        else {
-          curr = curr->right;
+      }
+      return const_iterator(curr, &core);
+    }
+
+    /**
+     *  Counts the elements less than d, which is d's position in sorted order if it is in the tree. Needs
+     *  order_statistics.
+     *  @param d the value to compare against.
+     *  @returns the number of elements less than d.
+     */
+    size_t rank(const T& d) const
+    {
+      static_assert(std::is_same<Augment, order_statistics>::value,
+                    "mqs::red_black_tree: rank() needs order_statistics.");
+      size_t below = 0;
+      handle curr = core.root;
+      while(curr != nil()) {
+        if(d > core.data(curr)) {
+          below += order_statistics::size_of(core, core.left(curr)) + 1;
+          curr = core.right(curr);
+        } else {
+          curr = core.left(curr);
         }
       }
-      return false;
+      return below;
+    }
+
+    /**
+     *  Counts the elements in [lo, hi) without visiting them. Needs order_statistics.
+     *  @param lo the smallest value to count.
+     *  @param hi the value to stop at, which isn't counted.
+     *  @returns the number of elements in the range.
+     */
+    size_t count_range(const T& lo, const T& hi) const
+    {
+      return hi > lo ? rank(hi) - rank(lo) : 0;
+    }
+
+    /**
+     *  Finds the first interval in order that overlaps [lo, hi], endpoints included, in O(log n). Needs
+     *  max_endpoint.
+     *  @param lo the low end of the range.
+     *  @param hi the high end of the range, not less than lo.
+     *  @returns an iterator to the interval, or end() if none overlaps.
+     */
+    template <typename Point>
+    const_iterator find_overlapping(const Point& lo, const Point& hi) const
+    {
+      static_assert(detail::is_max_endpoint<Augment>::value,
+                    "mqs::red_black_tree: find_overlapping() needs max_endpoint.");
+      return const_iterator(first_overlap(core.root, lo, hi), &core);
+    }
+
+    /**
+     *  Calls visitor on every interval that overlaps [lo, hi], endpoints included, in order. Subtrees whose
+     *  intervals all end before lo are skipped whole, so when the intervals found sit next to each other in order,
+     *  as disjoint ranges do, this costs O(log n + k) for k found like visit_range(). Otherwise each costs at most
+     *  O(log n). Needs max_endpoint.
+     *  @param lo the low end of the range.
+     *  @param hi the high end of the range, not less than lo.
+     *  @param visitor a callable taking a const T&.
+     *  @returns the number of intervals visited.
+     */
+    template <typename Point, typename Visitor>
+    size_t visit_overlapping(const Point& lo, const Point& hi, Visitor visitor) const
+    {
+      static_assert(detail::is_max_endpoint<Augment>::value,
+                    "mqs::red_black_tree: visit_overlapping() needs max_endpoint.");
+      size_t visited = 0;
+      for(handle curr = first_overlap(core.root, lo, hi); curr != nil(); curr = next_overlap(curr, lo, hi)) {
+        visitor(static_cast<const T&>(core.data(curr)));
+        visited++;
+      }
+      return visited;
+    }
+
+    /**
+     *  Calls visitor on every interval that contains x, in order. The same as visit_overlapping(x, x, visitor).
+     *  @param x the point to stab the intervals with.
+     *  @param visitor a callable taking a const T&.
+     *  @returns the number of intervals visited.
+     */
+    template <typename Point, typename Visitor>
+    size_t visit_containing(const Point& x, Visitor visitor) const
+    {
+      return visit_overlapping(x, x, visitor);
     }
 
     /**
      *  @returns the size of the tree.
      */
-    inline size_t size()
+    inline size_t size() const
     {
-      return _size;
+      return core.count;
     }
 
     /**
      *  @returns the height of the ree.
      */
-    int height()
+    int height() const
+    {
+      return core.height(core.root);
+    }
+
+    /**
+     *  @returns the number of elements at each depth, the root's being 0. See red_black_core::depth_histogram().
+     */
+    std::vector<size_t> depth_histogram() const
     {
-      return height(root);
+      return core.depth_histogram();
     }
 
     /**
-     *  @returns a vector<pair<T,bool>> of the tree in-order where vector[i].second is true if the node was black.
+     *  Checks that the tree is a valid red black tree holding its elements in strictly increasing order, in O(n)
+     *  without recursion. Meant for tests and for tracking down corruption, not for every operation.
+     *  @returns true if the links, colors, black heights, size and order all check out.
      */
-    std::vector<std::pair<T,bool>> dump()
+    bool validate() const
+    {
+      if(!core.validate()) {
+        return false;
+      }
+      handle prev = nil();
+      for(handle curr = core.leftmost(core.root); curr != nil(); prev = curr, curr = core.successor(curr)) {
+        if(prev != nil() && !(core.data(curr) > core.data(prev))) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    /**
+     *  @returns the counts kept by Stats since the tree was created or reset_stats() was last called.
+     */
+    const Stats& stats() const
+    {
+      return core.stats();
+    }
+
+    // Starts the counts over.
+    void reset_stats()
+    {
+      core.stats() = Stats();
+    }
+
+    /**
+     *  @returns a vector<pair<T,bool>> of the tree in pre-order, each node before its left and then its right
+     *  subtree, where vector[i].second is true if the node was black. Follows parent links back up instead of
+     *  rewriting any, so concurrent readers are safe.
+     */
+    std::vector<std::pair<T,bool>> dump() const
     {
       std::vector<std::pair<T,bool>> out;
-      red_black_tree_node *curr = root;
-      while(curr) {
-        if(!curr->left) {
-          out.push_back(std::make_pair(curr->data, curr->isBlack()));
-          curr = curr->right;
+      out.reserve(core.count);
+      handle curr = core.root;
+      while(curr != nil()) {
+        out.push_back(std::make_pair(core.data(curr), core.is_black(curr)));
+        if(core.left(curr) != nil()) {
+          curr = core.left(curr);
+        } else if(core.right(curr) != nil()) {
+          curr = core.right(curr);
         } else {
-          red_black_tree_node *pre = curr->left;
-          while(pre->right && pre->right != curr) {
-            pre = pre->right;
-          }
-          if(!pre->right) {
-            pre->right = curr;
-            out.push_back(std::make_pair(curr->data, curr->isBlack()));
-            curr = curr->left;
-          } else {
-            pre->right = nullptr;
-            curr = curr->right;
+          // A leaf ends a subtree: climb to the nearest ancestor whose right subtree hasn't been visited yet.
+          handle child = curr, parent = core.parent(curr);
+          while(parent != nil() && (core.right(parent) == child || core.right(parent) == nil())) {
+            child = parent;
+            parent = core.parent(parent);
           }
+          curr = (parent == nil() ? nil() : core.right(parent));
         }
       }
       return out;
     }
 
+    /**
+     *  Removes every element and frees the tree's memory. Elements with trivial destructors aren't visited, so
+     *  this costs one deallocation per slab.
+     */
+    void clear()
+    {
+      core.clear();
+    }
+
+    /**
+     *  @returns a copy of the allocator the tree was constructed with.
+     */
+    Allocator get_allocator() const
+    {
+      return Allocator(core.get_allocator());
+    }
+
     ~red_black_tree() {
-      if(root) {
-        delete root;
+      if(detail::skips_teardown<Allocator, T>::value) {
+        return;
       }
+      clear();
     }
 };
 
+/**
+ *  A red_black_tree whose nodes sit in one array and link to each other with 32-bit indices. See index_nodes.
+ */
+template <typename T, typename Allocator = heap_allocator<T>>
+using red_black_index_tree = red_black_tree<T, Allocator, index_nodes>;
+
+/**
+ *  A red_black_tree that keeps subtree sizes for select(), rank() and count_range(). See order_statistics.
+ */
+template <typename T, typename Allocator = heap_allocator<T>, typename Layout = pointer_nodes>
+using order_statistic_tree = red_black_tree<T, Allocator, Layout, order_statistics>;
+
+/**
+ *  A red_black_tree of closed intervals, ordered by low endpoint and then high, that keeps the largest high endpoint
+ *  under every node for the overlap and stabbing queries. See max_endpoint and interval_traits. Sorted intervals
+ *  build one in O(n) with the sorted_unique constructor or assign_sorted().
+ */
+template <typename T, typename Allocator = heap_allocator<T>, typename Layout = pointer_nodes>
+using interval_tree = red_black_tree<T, Allocator, Layout, max_endpoint<T>>;
+
 }
 
 #endif
@@ -0,0 +1,480 @@
+/**
+ *  simd.hpp
+ *  Vectorized scans over contiguous arrays of arithmetic values, used by mqs::Vector.
+ *
+ *  On x86 with GCC or Clang each scan is compiled twice, once for SSE2 and once for AVX2, and the AVX2 version is
+ *  picked at runtime when the CPU supports it. Everywhere else a scalar loop is used. Every version returns exactly
+ *  what the scalar loop would: floating point sums, minimums and maximums depend on evaluation order and NaN
+ *  handling, so those always use the scalar loop.
+ *
+ *  @author Marquess Valdez
+ *  @version 1.0
+ */
+#ifndef MQS_SIMD_HPP
+#define MQS_SIMD_HPP
+
+#include <cstddef> //for std::size_t
+#include <cstring> // for std::memcpy
+#include <type_traits>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define MQS_SIMD_X86 1
+#else
+#define MQS_SIMD_X86 0
+#endif
+
+namespace mqs
+{
+namespace simd
+{
+
+  /**
+   *  True for the element types the vectorized scans handle: integers and floating point types of 1, 2, 4 or 8
+   *  bytes, except bool.
+   */
+  template <typename T>
+  struct is_vectorizable : std::integral_constant<bool, std::is_arithmetic<T>::value && !std::is_same<T, bool>::value &&
+                                                        (sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8)> {};
+
+  namespace detail
+  {
+
+    // Same-width unsigned integer, used for wrapping sums and for counting matches lane by lane.
+    template <size_t Bytes> struct unsigned_of;
+    template <> struct unsigned_of<1> { typedef unsigned char type; };
+    template <> struct unsigned_of<2> { typedef unsigned short type; };
+    template <> struct unsigned_of<4> { typedef unsigned int type; };
+    template <> struct unsigned_of<8> { typedef unsigned long long type; };
+
+    template <typename T>
+    struct lane_unsigned
+    {
+      typedef typename unsigned_of<sizeof(T)>::type type;
+    };
+
+    template <typename T>
+    size_t find_scalar(const T* p, size_t n, T value)
+    {
+      for(size_t i = 0; i < n; i++) {
+        if(p[i] == value) {
+          return i;
+        }
+      }
+      return n;
+    }
+
+    template <typename T>
+    size_t count_scalar(const T* p, size_t n, T value)
+    {
+      size_t found = 0;
+      for(size_t i = 0; i < n; i++) {
+        found += (p[i] == value);
+      }
+      return found;
+    }
+
+    template <typename T>
+    size_t count_less_scalar(const T* p, size_t n, T value)
+    {
+      size_t found = 0;
+      for(size_t i = 0; i < n; i++) {
+        found += (p[i] < value);
+      }
+      return found;
+    }
+
+    template <typename T>
+    T min_scalar(const T* p, size_t n)
+    {
+      T best = p[0];
+      for(size_t i = 1; i < n; i++) {
+        if(p[i] < best) {
+          best = p[i];
+        }
+      }
+      return best;
+    }
+
+    template <typename T>
+    T max_scalar(const T* p, size_t n)
+    {
+      T best = p[0];
+      for(size_t i = 1; i < n; i++) {
+        if(best < p[i]) {
+          best = p[i];
+        }
+      }
+      return best;
+    }
+
+    // Integer sums wrap around modulo 2^bits instead of overflowing.
+    template <typename T>
+    T sum_scalar(const T* p, size_t n, std::true_type)
+    {
+      typedef typename lane_unsigned<T>::type U;
+      U total = 0;
+      for(size_t i = 0; i < n; i++) {
+        total += static_cast<U>(p[i]);
+      }
+      return static_cast<T>(total);
+    }
+
+    template <typename T>
+    T sum_scalar(const T* p, size_t n, std::false_type)
+    {
+      T total = 0;
+      for(size_t i = 0; i < n; i++) {
+        total += p[i];
+      }
+      return total;
+    }
+
+#if MQS_SIMD_X86
+
+#define MQS_SIMD_INLINE inline __attribute__((always_inline))
+
+    // GCC vector extension types, Bytes wide. The kernels below are written once against these and inlined into an
+    // SSE2 (16 byte) and an AVX2 (32 byte) entry point, which lets the compiler pick instructions for each.
+    template <typename T, size_t Bytes> struct vec;
+    template <typename T> struct vec<T, 16> { typedef T type __attribute__((vector_size(16))); };
+    template <typename T> struct vec<T, 32> { typedef T type __attribute__((vector_size(32))); };
+
+    // Vectors are passed by reference so no AVX types cross a function boundary compiled without AVX.
+    template <typename V, typename T>
+    MQS_SIMD_INLINE void load(V& v, const T* p)
+    {
+      std::memcpy(&v, p, sizeof(V));
+    }
+
+    template <size_t Bytes, typename M>
+    MQS_SIMD_INLINE bool any(const M& mask)
+    {
+      typedef typename vec<unsigned long long, Bytes>::type W;
+      W w = reinterpret_cast<W>(mask);
+      unsigned long long bits = 0;
+      for(size_t k = 0; k < Bytes/8; k++) {
+        bits |= w[k];
+      }
+      return bits != 0;
+    }
+
+    template <typename T, size_t Bytes>
+    MQS_SIMD_INLINE size_t find_kernel(const T* p, size_t n, T value)
+    {
+      typedef typename vec<T, Bytes>::type V;
+      const size_t lanes = Bytes/sizeof(T);
+      const V needle = V() + value;
+      size_t i = 0;
+      // Test four vectors per iteration, then find the exact index with the scalar loop.
+      for(; i + 4*lanes <= n; i += 4*lanes) {
+        V a, b, c, d;
+        load(a, p+i);
+        load(b, p+i+lanes);
+        load(c, p+i+2*lanes);
+        load(d, p+i+3*lanes);
+        if(any<Bytes>((a == needle) | (b == needle) | (c == needle) | (d == needle))) {
+          break;
+        }
+      }
+      return i + find_scalar(p+i, n-i, value);
+    }
+
+    template <typename T, size_t Bytes>
+    MQS_SIMD_INLINE size_t count_kernel(const T* p, size_t n, T value)
+    {
+      typedef typename vec<T, Bytes>::type V;
+      typedef typename lane_unsigned<T>::type U;
+      typedef typename vec<U, Bytes>::type C;
+      const size_t lanes = Bytes/sizeof(T);
+      // Each lane counts at most this many matches before the counters are flushed.
+      const size_t flush = (sizeof(T) >= 4 ? (size_t(1) << 30) : ((size_t(1) << (8*sizeof(T))) - 1));
+      const V needle = V() + value;
+      size_t found = 0, i = 0;
+      while(i + lanes <= n) {
+        C counts = C();
+        for(size_t round = 0; round < flush && i + lanes <= n; round++, i += lanes) {
+          V x;
+          load(x, p+i);
+          counts -= reinterpret_cast<C>(x == needle); // A match is all ones, i.e. -1.
+        }
+        for(size_t k = 0; k < lanes; k++) {
+          found += counts[k];
+        }
+      }
+      return found + count_scalar(p+i, n-i, value);
+    }
+
+    template <typename T, size_t Bytes>
+    MQS_SIMD_INLINE size_t count_less_kernel(const T* p, size_t n, T value)
+    {
+      typedef typename vec<T, Bytes>::type V;
+      typedef typename lane_unsigned<T>::type U;
+      typedef typename vec<U, Bytes>::type C;
+      const size_t lanes = Bytes/sizeof(T);
+      // Each lane counts at most this many elements before the counters are flushed, as in count_kernel.
+      const size_t flush = (sizeof(T) >= 4 ? (size_t(1) << 30) : ((size_t(1) << (8*sizeof(T))) - 1));
+      const V needle = V() + value;
+      size_t found = 0, i = 0;
+      while(i + lanes <= n) {
+        C counts = C();
+        for(size_t round = 0; round < flush && i + lanes <= n; round++, i += lanes) {
+          V x;
+          load(x, p+i);
+          counts -= reinterpret_cast<C>(x < needle);
+        }
+        for(size_t k = 0; k < lanes; k++) {
+          found += counts[k];
+        }
+      }
+      return found + count_less_scalar(p+i, n-i, value);
+    }
+
+    template <typename T, size_t Bytes>
+    MQS_SIMD_INLINE T min_kernel(const T* p, size_t n)
+    {
+      typedef typename vec<T, Bytes>::type V;
+      const size_t lanes = Bytes/sizeof(T);
+      if(n < 2*lanes) {
+        return min_scalar(p, n);
+      }
+      V best, x;
+      load(best, p);
+      size_t i = lanes;
+      for(; i + lanes <= n; i += lanes) {
+        load(x, p+i);
+        best = (x < best ? x : best);
+      }
+      T out = min_scalar(p+i-lanes, n-i+lanes); // Overlaps the last full vector, which doesn't change the result.
+      for(size_t k = 0; k < lanes; k++) {
+        out = (best[k] < out ? best[k] : out);
+      }
+      return out;
+    }
+
+    template <typename T, size_t Bytes>
+    MQS_SIMD_INLINE T max_kernel(const T* p, size_t n)
+    {
+      typedef typename vec<T, Bytes>::type V;
+      const size_t lanes = Bytes/sizeof(T);
+      if(n < 2*lanes) {
+        return max_scalar(p, n);
+      }
+      V best, x;
+      load(best, p);
+      size_t i = lanes;
+      for(; i + lanes <= n; i += lanes) {
+        load(x, p+i);
+        best = (best < x ? x : best);
+      }
+      T out = max_scalar(p+i-lanes, n-i+lanes);
+      for(size_t k = 0; k < lanes; k++) {
+        out = (out < best[k] ? best[k] : out);
+      }
+      return out;
+    }
+
+    template <typename T, size_t Bytes>
+    MQS_SIMD_INLINE T sum_kernel(const T* p, size_t n)
+    {
+      typedef typename lane_unsigned<T>::type U;
+      typedef typename vec<U, Bytes>::type C;
+      const size_t lanes = Bytes/sizeof(T);
+      const U* q = reinterpret_cast<const U*>(p);
+      C a = C(), b = C();
+      size_t i = 0;
+      for(; i + 2*lanes <= n; i += 2*lanes) {
+        C x, y;
+        load(x, q+i);
+        load(y, q+i+lanes);
+        a += x;
+        b += y;
+      }
+      a += b;
+      U total = 0;
+      for(size_t k = 0; k < lanes; k++) {
+        total += a[k];
+      }
+      for(; i < n; i++) {
+        total += q[i];
+      }
+      return static_cast<T>(total);
+    }
+
+#define MQS_SIMD_ENTRY_POINTS(name, target, bytes)                                                                    \
+    template <typename T> target size_t find_##name(const T* p, size_t n, T value) { return find_kernel<T, bytes>(p, n, value); }   \
+    template <typename T> target size_t count_##name(const T* p, size_t n, T value) { return count_kernel<T, bytes>(p, n, value); } \
+    template <typename T> target size_t count_less_##name(const T* p, size_t n, T value)                                          \
+    {                                                                                                                             \
+      return count_less_kernel<T, bytes>(p, n, value);                                                                            \
+    }                                                                                                                             \
+    template <typename T> target T min_##name(const T* p, size_t n) { return min_kernel<T, bytes>(p, n); }                        \
+    template <typename T> target T max_##name(const T* p, size_t n) { return max_kernel<T, bytes>(p, n); }                        \
+    template <typename T> target T sum_##name(const T* p, size_t n) { return sum_kernel<T, bytes>(p, n); }
+
+    MQS_SIMD_ENTRY_POINTS(sse2, , 16)
+    MQS_SIMD_ENTRY_POINTS(avx2, __attribute__((target("avx2"))), 32)
+
+#undef MQS_SIMD_ENTRY_POINTS
+#undef MQS_SIMD_INLINE
+
+    inline bool has_avx2()
+    {
+      static const bool avx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2") != 0);
+      return avx2;
+    }
+
+#endif
+
+    // Minimum, maximum and sum are only vectorized for integers, where the result doesn't depend on the order the
+    // elements are combined in.
+    template <typename T>
+    T min(const T* p, size_t n, std::true_type)
+    {
+#if MQS_SIMD_X86
+      return (has_avx2() ? min_avx2(p, n) : min_sse2(p, n));
+#else
+      return min_scalar(p, n);
+#endif
+    }
+
+    template <typename T>
+    T min(const T* p, size_t n, std::false_type)
+    {
+      return min_scalar(p, n);
+    }
+
+    template <typename T>
+    T max(const T* p, size_t n, std::true_type)
+    {
+#if MQS_SIMD_X86
+      return (has_avx2() ? max_avx2(p, n) : max_sse2(p, n));
+#else
+      return max_scalar(p, n);
+#endif
+    }
+
+    template <typename T>
+    T max(const T* p, size_t n, std::false_type)
+    {
+      return max_scalar(p, n);
+    }
+
+    template <typename T>
+    T sum(const T* p, size_t n, std::true_type)
+    {
+#if MQS_SIMD_X86
+      return (has_avx2() ? sum_avx2(p, n) : sum_sse2(p, n));
+#else
+      return sum_scalar(p, n, std::true_type());
+#endif
+    }
+
+    template <typename T>
+    T sum(const T* p, size_t n, std::false_type)
+    {
+      return sum_scalar(p, n, std::false_type());
+    }
+
+  }
+
+  /**
+   *  Finds the first element equal to value.
+   *  @param the array, its length and the value to look for.
+   *  @return the index of the first match, or n if there is none.
+   */
+  template <typename T>
+  size_t find(const T* p, size_t n, T value)
+  {
+    static_assert(is_vectorizable<T>::value, "mqs::simd::find: T must be a non-bool arithmetic type.");
+#if MQS_SIMD_X86
+    return (detail::has_avx2() ? detail::find_avx2(p, n, value) : detail::find_sse2(p, n, value));
+#else
+    return detail::find_scalar(p, n, value);
+#endif
+  }
+
+  /**
+   *  Counts the elements equal to value.
+   *  @param the array, its length and the value to count.
+   *  @return the number of matches.
+   */
+  template <typename T>
+  size_t count(const T* p, size_t n, T value)
+  {
+    static_assert(is_vectorizable<T>::value, "mqs::simd::count: T must be a non-bool arithmetic type.");
+#if MQS_SIMD_X86
+    return (detail::has_avx2() ? detail::count_avx2(p, n, value) : detail::count_sse2(p, n, value));
+#else
+    return detail::count_scalar(p, n, value);
+#endif
+  }
+
+  /**
+   *  Counts the elements less than value. On a sorted array that is the index of the first element not less than
+   *  value, found without a branch per element.
+   *  @param the array, its length and the value to compare against.
+   *  @return the number of elements less than value.
+   */
+  template <typename T>
+  size_t count_less(const T* p, size_t n, T value)
+  {
+    static_assert(is_vectorizable<T>::value, "mqs::simd::count_less: T must be a non-bool arithmetic type.");
+#if MQS_SIMD_X86
+    return (detail::has_avx2() ? detail::count_less_avx2(p, n, value) : detail::count_less_sse2(p, n, value));
+#else
+    return detail::count_less_scalar(p, n, value);
+#endif
+  }
+
+  /**
+   *  count_less for arrays of a cache line or so searched in a hot loop, such as the keys of a tree node. It is the
+   *  SSE2 kernel inlined into the caller, without the call and the runtime dispatch, which cost more than AVX2
+   *  saves on a few vectors.
+   *  @param the array, its length and the value to compare against.
+   *  @return the number of elements less than value.
+   */
+  template <typename T>
+  size_t count_less_short(const T* p, size_t n, T value)
+  {
+    static_assert(is_vectorizable<T>::value, "mqs::simd::count_less_short: T must be a non-bool arithmetic type.");
+#if MQS_SIMD_X86
+    return detail::count_less_kernel<T, 16>(p, n, value);
+#else
+    return detail::count_less_scalar(p, n, value);
+#endif
+  }
+
+  /**
+   *  Returns the smallest of the n > 0 elements, as chosen by operator<.
+   */
+  template <typename T>
+  T min(const T* p, size_t n)
+  {
+    static_assert(is_vectorizable<T>::value, "mqs::simd::min: T must be a non-bool arithmetic type.");
+    return detail::min(p, n, std::is_integral<T>());
+  }
+
+  /**
+   *  Returns the largest of the n > 0 elements, as chosen by operator<.
+   */
+  template <typename T>
+  T max(const T* p, size_t n)
+  {
+    static_assert(is_vectorizable<T>::value, "mqs::simd::max: T must be a non-bool arithmetic type.");
+    return detail::max(p, n, std::is_integral<T>());
+  }
+
+  /**
+   *  Adds up the n elements. Integer sums wrap around modulo 2^bits; floating point sums are added left to right.
+   */
+  template <typename T>
+  T sum(const T* p, size_t n)
+  {
+    static_assert(is_vectorizable<T>::value, "mqs::simd::sum: T must be a non-bool arithmetic type.");
+    return detail::sum(p, n, std::is_integral<T>());
+  }
+
+}
+}
+
+#endif
@@ -1,6 +1,31 @@
+#include "allocator.hpp"
+#include "b_tree.hpp"
+#include "concurrent_tree.hpp"
+#include "flat_file.hpp"
+#include "frozen_set.hpp"
+#include "parallel.hpp"
+#include "persistent_tree.hpp"
+#include "red_black_map.hpp"
 #include "red_black_tree.hpp"
 #include "vector.hpp"
+#include <algorithm>
+#include <atomic>
 #include <climits>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
 #include <gtest/gtest.h>
 
 TEST(VectorConstructorTest, VectorConstuctorDefault) {
@@ -54,7 +79,7 @@ TEST(VectorGrowTest, VectorGrowShrink) {
     to_grow.pop();
   }
   ASSERT_EQ(2, to_grow.size());
-  ASSERT_EQ(4, to_grow.capacity());
+  ASSERT_EQ(8, to_grow.capacity()); // Already below the initial capacity of 16, which shrinking stops at.
   for(size_t i = 0; i < to_grow.size(); i++) {
     ASSERT_EQ(i, to_grow.at(i));
   }
@@ -73,12 +98,106 @@ TEST(VectorGrowTest, VectorGrowShrink) {
     to_grow2.pop();
   }
   ASSERT_EQ(5, to_grow2.size());
-  ASSERT_EQ(10, to_grow2.capacity());
+  ASSERT_EQ(20, to_grow2.capacity()); // Halving would go below the initial capacity.
   for(size_t i = 0; i < to_grow2.size(); i++) {
     ASSERT_EQ(i, to_grow2.at(i));
   }
 }
 
+TEST(VectorGrowTest, VectorDefaultDoesNotAllocate)
+{
+  mqs::Vector<int> v;
+  ASSERT_EQ(0, v.capacity());
+  ASSERT_EQ(nullptr, v.data());
+  v.push_back(1);
+  ASSERT_EQ(16, v.capacity());
+}
+
+TEST(VectorGrowTest, VectorReserveResize)
+{
+  mqs::Vector<int> v;
+  v.reserve(1000);
+  const int* buffer = v.data();
+  size_t capacity = v.capacity();
+  ASSERT_LT(1000, capacity);
+  for(int i = 0; i < 1000; i++) {
+    v.push_back(i);
+  }
+  ASSERT_EQ(buffer, v.data());
+  ASSERT_EQ(capacity, v.capacity());
+
+  v.resize(10);
+  ASSERT_EQ(10, v.size());
+  ASSERT_EQ(capacity, v.capacity());
+  ASSERT_EQ(9, v.back());
+  v.resize(20, 7);
+  ASSERT_EQ(20, v.size());
+  ASSERT_EQ(7, v.at(19));
+  v.shrink_to_fit();
+  ASSERT_EQ(20, v.capacity());
+  ASSERT_EQ(7, v.back());
+  v.resize(30);
+  ASSERT_EQ(0, v.at(29));
+  v.clear();
+  ASSERT_TRUE(v.empty());
+  v.shrink_to_fit();
+  ASSERT_EQ(0, v.capacity());
+}
+
+TEST(VectorGrowTest, VectorGrowthPolicy)
+{
+  mqs::Vector<int, mqs::no_shrink_policy> kept;
+  for(int i = 0; i < 100; i++) {
+    kept.push_back(i);
+  }
+  size_t capacity = kept.capacity();
+  while(!kept.empty()) {
+    kept.pop();
+  }
+  ASSERT_EQ(capacity, kept.capacity());
+
+  // Grows by 1.5x and only shrinks once it is an eighth full.
+  mqs::Vector<int, mqs::growth_policy<3, 2, true, 8, 4> > v;
+  v.push_back(0);
+  ASSERT_EQ(4, v.capacity());
+  v.push_back(1);
+  v.push_back(2);
+  ASSERT_EQ(4, v.capacity());
+  v.push_back(3);
+  ASSERT_EQ(6, v.capacity());
+  for(int i = 4; i < 64; i++) {
+    v.push_back(i);
+  }
+  capacity = v.capacity();
+  while(v.size() > capacity/8 + 1) {
+    v.pop();
+  }
+  ASSERT_EQ(capacity, v.capacity());
+  v.pop();
+  ASSERT_EQ(capacity/2, v.capacity());
+  for(size_t i = 0; i < v.size(); i++) {
+    ASSERT_EQ(i, v[i]);
+  }
+
+  // A queue that fills and empties over and over keeps a buffer of at least the initial capacity, or the inline
+  // capacity if that is larger, instead of freeing it every time it empties.
+  mqs::Vector<int> queue;
+  mqs::SmallVector<int, 32> small;
+  for(int round = 0; round < 5; round++) {
+    for(int i = 0; i < 100; i++) {
+      queue.push_back(i);
+      small.push_back(i);
+    }
+    while(!queue.empty()) {
+      queue.pop();
+      small.pop();
+      ASSERT_LE(16, queue.capacity());
+      ASSERT_LE(32, small.capacity());
+    }
+    ASSERT_EQ(16, queue.capacity());
+  }
+}
+
 TEST(VectorInsertTest, VectorInsert)
 {
   mqs::Vector<int> verify = {0, 1, 2, 3, 4, 5};
@@ -110,6 +229,105 @@ TEST(VectorRemoveTest, VectorRemove)
   }
 }
 
+TEST(VectorRemoveTest, VectorEraseIf)
+{
+  mqs::Vector<int> test;
+  for(int i = 0; i < 100000; i++) {
+    test.push_back(i);
+  }
+  ASSERT_EQ(50000, test.erase_if([](int x) { return x % 2 == 1; }));
+  ASSERT_EQ(50000, test.size());
+  for(size_t i = 0; i < test.size(); i++) {
+    ASSERT_EQ(2*i, test[i]);
+  }
+  ASSERT_EQ(0, test.erase_if([](int x) { return x < 0; }));
+
+  // A shrinking erase reallocates once, straight to a capacity that fits.
+  ASSERT_EQ(49990, test.erase_if([](int x) { return x >= 20; }));
+  ASSERT_EQ(10, test.size());
+  ASSERT_LT(10, test.capacity());
+  ASSERT_GE(4*10, test.capacity()/2);
+
+  mqs::Vector<std::string> words = {"a", "b", "a", "c", "a"};
+  ASSERT_EQ(3, words.remove(words[0]));
+  ASSERT_EQ(2, words.size());
+  ASSERT_EQ("b", words[0]);
+  ASSERT_EQ("c", words[1]);
+}
+
+TEST(VectorRemoveTest, VectorEraseRange)
+{
+  mqs::Vector<std::string> test = {"0", "1", "2", "3", "4", "5", "6"};
+  auto it = test.erase(test.begin()+1, test.begin()+4);
+  ASSERT_EQ("4", *it);
+  ASSERT_EQ(4, test.size());
+  ASSERT_EQ("0", test[0]);
+  ASSERT_EQ("6", test[3]);
+  it = test.erase(test.begin());
+  ASSERT_EQ("4", *it);
+  ASSERT_EQ(3, test.size());
+  test.erase(test.begin(), test.end());
+  ASSERT_TRUE(test.empty());
+}
+
+TEST(VectorInsertTest, VectorInsertRange)
+{
+  mqs::Vector<int> test = {0, 1, 7, 8};
+  std::vector<int> middle = {2, 3, 4, 5, 6};
+  test.insert(2, middle.begin(), middle.end());
+  ASSERT_EQ(9, test.size());
+  for(size_t i = 0; i < test.size(); i++) {
+    ASSERT_EQ(i, test[i]);
+  }
+  test.append({9, 10});
+  std::list<int> more = {11, 12, 13};
+  test.append(more.begin(), more.end());
+  ASSERT_EQ(14, test.size());
+  for(size_t i = 0; i < test.size(); i++) {
+    ASSERT_EQ(i, test[i]);
+  }
+  test.insert(0, {-2, -1});
+  ASSERT_EQ(-2, test[0]);
+  ASSERT_EQ(0, test[2]);
+
+  // Inserting from a stream buffers the single-pass input once.
+  std::istringstream in("100 200 300");
+  test.insert(1, std::istream_iterator<int>(in), std::istream_iterator<int>());
+  ASSERT_EQ(100, test[1]);
+  ASSERT_EQ(300, test[3]);
+  ASSERT_EQ(-1, test[4]);
+}
+
+TEST(VectorInsertTest, VectorInsertRangeInPlace)
+{
+  mqs::Vector<std::string> test;
+  test.reserve(32);
+  test.append({"a", "e", "f"});
+  const std::string* buffer = test.data();
+  // Gap longer than the tail, then shorter than the tail.
+  std::string bcd[] = {"b", "c", "d"};
+  test.insert(1, bcd, bcd+3);
+  test.insert(6, {"g", "h"});
+  std::string xy[] = {"x", "y"};
+  test.insert(0, xy, xy+2);
+  ASSERT_EQ(buffer, test.data());
+  const char* expected[] = {"x", "y", "a", "b", "c", "d", "e", "f", "g", "h"};
+  ASSERT_EQ(10, test.size());
+  for(size_t i = 0; i < test.size(); i++) {
+    ASSERT_EQ(expected[i], test[i]);
+  }
+
+  // Inserting a Vector's own elements into itself, with and without reallocating.
+  test.insert(0, test.begin()+2, test.begin()+4);
+  ASSERT_EQ("a", test[0]);
+  ASSERT_EQ("b", test[1]);
+  ASSERT_EQ("x", test[2]);
+  test.insert(test.size(), test.begin(), test.end());
+  ASSERT_EQ(24, test.size());
+  ASSERT_EQ("a", test[12]);
+  ASSERT_EQ("h", test[23]);
+}
+
 TEST(VectorStressTest, VectorStressFind)
 {
   mqs::Vector<int> test;
@@ -121,6 +339,659 @@ TEST(VectorStressTest, VectorStressFind)
   }
 }
 
+// Counts how often elements are constructed, copied and moved so tests can check how a Vector relocates them.
+struct Tracked {
+  static int copies;
+  static int moves;
+  static int live;
+  int value;
+  Tracked() : value(0) { live++; }
+  Tracked(int v) : value(v) { live++; }
+  Tracked(const Tracked& t) : value(t.value) { copies++; live++; }
+  Tracked(Tracked&& t) noexcept : value(t.value) { moves++; live++; }
+  Tracked& operator=(const Tracked& t) { value = t.value; copies++; return *this; }
+  Tracked& operator=(Tracked&& t) noexcept { value = t.value; moves++; return *this; }
+  bool operator==(const Tracked& t) const { return value == t.value; }
+  ~Tracked() { live--; }
+  static void reset() { copies = 0; moves = 0; }
+};
+int Tracked::copies = 0;
+int Tracked::moves = 0;
+int Tracked::live = 0;
+
+TEST(VectorMoveTest, VectorMoveConstructAssign)
+{
+  mqs::Vector<std::string> a = {"zero", "one", "two"};
+  mqs::Vector<std::string> b(std::move(a));
+  ASSERT_EQ(0, a.size());
+  ASSERT_EQ(3, b.size());
+  ASSERT_EQ("two", b.at(2));
+  a.push_back("reused");
+  ASSERT_EQ("reused", a.at(0));
+  a = std::move(b);
+  ASSERT_EQ(3, a.size());
+  ASSERT_EQ("one", a.at(1));
+  b = a;
+  ASSERT_EQ(3, b.size());
+  ASSERT_EQ("zero", b.at(0));
+  ASSERT_EQ("zero", a.at(0));
+}
+
+TEST(VectorMoveTest, VectorGrowthMovesElements)
+{
+  {
+    mqs::Vector<Tracked> v;
+    Tracked::reset();
+    for(int i = 0; i < 1000; i++) {
+      v.emplace_back(i);
+    }
+    // Each growth moves the existing elements exactly once and nothing is ever copied.
+    ASSERT_EQ(0, Tracked::copies);
+    ASSERT_LT(Tracked::moves, 2000);
+    ASSERT_EQ(1000, Tracked::live);
+    for(int i = 0; i < 1000; i++) {
+      ASSERT_EQ(i, v.at(i).value);
+    }
+    Tracked t(5000);
+    Tracked::reset();
+    v.push_back(std::move(t));
+    ASSERT_EQ(0, Tracked::copies);
+  }
+  ASSERT_EQ(0, Tracked::live);
+}
+
+TEST(VectorMoveTest, VectorEmplaceAliasing)
+{
+  mqs::Vector<std::string> v(0);
+  v.push_back("first");
+  for(int i = 0; i < 100; i++) {
+    v.emplace_back(v[0]);
+  }
+  for(size_t i = 0; i < v.size(); i++) {
+    ASSERT_EQ("first", v.at(i));
+  }
+  v.prepend("head");
+  v.emplace(1, 3, 'x');
+  ASSERT_EQ("head", v.at(0));
+  ASSERT_EQ("xxx", v.at(1));
+  ASSERT_EQ("first", v.pop());
+  ASSERT_EQ(102, v.size());
+}
+
+TEST(VectorAccessTest, VectorReferenceAccess)
+{
+  mqs::Vector<std::string> v = {"a", "b", "c"};
+  v[0] += "x";
+  v.at(1).append("y");
+  v.back() = "z";
+  ASSERT_EQ("ax", v.front());
+  ASSERT_EQ("by", v[1]);
+  ASSERT_EQ("z", v.at(2));
+  const mqs::Vector<std::string>& cv = v;
+  ASSERT_EQ(&v[1], &cv.at(1));
+  ASSERT_THROW(cv.at(3), std::out_of_range);
+}
+
+TEST(VectorAccessTest, VectorIterators)
+{
+  mqs::Vector<int> v;
+  for(int i = 0; i < 100; i++) {
+    v.push_back((i*37) % 100);
+  }
+  std::sort(v.begin(), v.end());
+  int expected = 0;
+  for(int x : v) {
+    ASSERT_EQ(expected++, x);
+  }
+  ASSERT_EQ(100, v.end() - v.begin());
+  ASSERT_EQ(v.data(), &*v.begin());
+  ASSERT_EQ(99, *v.rbegin());
+  int copy[100];
+  std::memcpy(copy, v.data(), v.size()*sizeof(int));
+  ASSERT_EQ(42, copy[42]);
+  for(int& x : v) {
+    x *= 2;
+  }
+  ASSERT_EQ(198, v.back());
+  ASSERT_EQ(50, std::find(v.cbegin(), v.cend(), 100) - v.cbegin());
+}
+
+// Checks every scan against a plain loop over the same data, for a range of lengths that hit each vector tail.
+template <typename T>
+void check_scans(T step, T needle)
+{
+  for(size_t n = 1; n < 300; n += 7) {
+    mqs::Vector<T> v;
+    for(size_t i = 0; i < n; i++) {
+      v.push_back(static_cast<T>(static_cast<T>((i*37) % 101)*step));
+    }
+    size_t first = n, matches = 0;
+    T lo = v[0], hi = v[0], total = 0;
+    for(size_t i = 0; i < n; i++) {
+      if(v[i] == needle) {
+        first = (first == n ? i : first);
+        matches++;
+      }
+      lo = (v[i] < lo ? v[i] : lo);
+      hi = (hi < v[i] ? v[i] : hi);
+      total = static_cast<T>(total + v[i]);
+    }
+    ASSERT_EQ(first, v.find(needle));
+    ASSERT_EQ(matches, v.count(needle));
+    ASSERT_EQ(first != n, v.contains(needle));
+    ASSERT_EQ(lo, v.min());
+    ASSERT_EQ(hi, v.max());
+    ASSERT_EQ(total, v.sum());
+  }
+}
+
+TEST(VectorScanTest, VectorScanArithmetic)
+{
+  check_scans<signed char>(1, 42);
+  check_scans<unsigned char>(2, 84);
+  check_scans<short>(-3, -126);
+  check_scans<int>(-1000, -42000);
+  check_scans<unsigned int>(7, 294);
+  check_scans<long long>(-(1LL << 40), -(42LL << 40));
+  check_scans<unsigned long>(3, 300);
+  check_scans<float>(0.5f, 21.0f);
+  check_scans<double>(-0.25, -10.5);
+}
+
+TEST(VectorScanTest, VectorScanEdgeCases)
+{
+  mqs::Vector<int> empty;
+  ASSERT_EQ(0, empty.find(1));
+  ASSERT_EQ(0, empty.count(1));
+  ASSERT_FALSE(empty.contains(1));
+  ASSERT_EQ(0, empty.sum());
+  ASSERT_THROW(empty.min(), std::out_of_range);
+  ASSERT_THROW(empty.max(), std::out_of_range);
+
+  // Counting more matches than an 8-bit lane can hold.
+  mqs::Vector<unsigned char> bytes(100000, 7);
+  bytes[99999] = 8;
+  ASSERT_EQ(99999, bytes.count(7));
+  ASSERT_EQ(99999, bytes.find(8));
+  ASSERT_EQ(8, bytes.max());
+
+  // Floating point comparisons behave exactly like ==: NaN matches nothing and -0.0 matches 0.0.
+  mqs::Vector<double> d(64, 1.0);
+  d[10] = std::numeric_limits<double>::quiet_NaN();
+  d[20] = -0.0;
+  ASSERT_EQ(64, d.find(std::numeric_limits<double>::quiet_NaN()));
+  ASSERT_EQ(20, d.find(0.0));
+
+  mqs::Vector<std::string> words = {"pear", "apple", "fig", "apple"};
+  ASSERT_EQ(1, words.find("apple"));
+  ASSERT_EQ(2, words.count("apple"));
+  ASSERT_EQ("apple", words.min());
+  ASSERT_EQ("pear", words.max());
+  ASSERT_EQ("pearapplefigapple", words.sum());
+}
+
+// Owns a heap pointer but never points into itself, so it is safe to move as bytes.
+struct Owner {
+  std::unique_ptr<int> p;
+  explicit Owner(int v) : p(new int(v)) {}
+};
+
+namespace mqs {
+  template <>
+  struct is_trivially_relocatable<Owner> : std::true_type {};
+}
+
+TEST(VectorRelocateTest, VectorRelocatableGrowth)
+{
+  mqs::Vector<Owner> v;
+  for(int i = 0; i < 10000; i++) {
+    v.emplace_back(i);
+  }
+  for(int i = 0; i < 10000; i++) {
+    ASSERT_EQ(i, *v[i].p);
+  }
+  v.erase_if([](const Owner& o) { return *o.p % 3 != 0; });
+  v.shrink_to_fit();
+  ASSERT_EQ(3334, v.size());
+  ASSERT_EQ(9999, *v.back().p);
+  mqs::Vector<Owner> more;
+  more.emplace_back(-1);
+  more.emplace_back(-2);
+  v.insert(1, std::make_move_iterator(more.begin()), std::make_move_iterator(more.end()));
+  ASSERT_EQ(0, *v[0].p);
+  ASSERT_EQ(-2, *v[2].p);
+  ASSERT_EQ(3, *v[3].p);
+}
+
+TEST(VectorRelocateTest, VectorMappedGrowth)
+{
+  // Grows well past MQS_MMAP_THRESHOLD, so the last few doublings are page remaps.
+  const size_t n = 3*MQS_MMAP_THRESHOLD/sizeof(int);
+  mqs::Vector<int> v;
+  for(size_t i = 0; i < n; i++) {
+    v.push_back(static_cast<int>(i));
+  }
+  ASSERT_TRUE(mqs::detail::heap::mapped(v.capacity()*sizeof(int)));
+  for(size_t i = 0; i < n; i += 4099) {
+    ASSERT_EQ(static_cast<int>(i), v[i]);
+  }
+  v.push_back(-1);
+  ASSERT_EQ(-1, v.back());
+  // Shrinking back under the threshold moves the data to the ordinary heap.
+  v.erase(v.begin()+10, v.end());
+  ASSERT_FALSE(mqs::detail::heap::mapped(v.capacity()*sizeof(int)));
+  for(int i = 0; i < 10; i++) {
+    ASSERT_EQ(i, v[i]);
+  }
+}
+
+TEST(VectorRelocateTest, HeapReallocatePreservesData)
+{
+  size_t bytes = MQS_MMAP_THRESHOLD;
+  unsigned char* p = static_cast<unsigned char*>(mqs::detail::heap::allocate(bytes));
+  for(size_t i = 0; i < bytes; i += 4096) {
+    p[i] = static_cast<unsigned char>(i/4096);
+  }
+  p = static_cast<unsigned char*>(mqs::detail::heap::reallocate(p, bytes, 4*bytes));
+  for(size_t i = 0; i < bytes; i += 4096) {
+    ASSERT_EQ(static_cast<unsigned char>(i/4096), p[i]);
+  }
+  p[4*bytes-1] = 1;
+  p[1] = 2;
+  p = static_cast<unsigned char*>(mqs::detail::heap::reallocate(p, 4*bytes, 100));
+  ASSERT_EQ(0, p[0]);
+  ASSERT_EQ(2, p[1]);
+  mqs::detail::heap::deallocate(p, 100);
+}
+
+// True if the vector's elements live inside the vector object itself.
+template <typename V>
+bool stored_inline(const V& v)
+{
+  const char* p = reinterpret_cast<const char*>(v.data());
+  const char* self = reinterpret_cast<const char*>(&v);
+  return p >= self && p < self + sizeof(v);
+}
+
+TEST(SmallVectorTest, SmallVectorInline)
+{
+  ASSERT_EQ(3*sizeof(void*), sizeof(mqs::Vector<int>));
+  mqs::SmallVector<std::string, 4> v;
+  ASSERT_EQ(4, v.capacity());
+  for(int i = 0; i < 4; i++) {
+    v.push_back(std::to_string(i));
+  }
+  ASSERT_TRUE(stored_inline(v));
+  ASSERT_EQ(4, v.capacity());
+  v.push_back("4");
+  ASSERT_FALSE(stored_inline(v));
+  ASSERT_LT(5, v.capacity());
+  for(size_t i = 0; i < v.size(); i++) {
+    ASSERT_EQ(std::to_string(i), v[i]);
+  }
+  v.insert(0, "x");
+  ASSERT_EQ(1, v.find("0"));
+  ASSERT_EQ(1, v.remove(std::string("x")));
+  while(v.size() > 2) {
+    v.pop();
+  }
+  v.shrink_to_fit();
+  ASSERT_TRUE(stored_inline(v));
+  ASSERT_EQ(4, v.capacity());
+  ASSERT_EQ("0", v[0]);
+  ASSERT_EQ("1", v[1]);
+}
+
+TEST(SmallVectorTest, SmallVectorMoveCopySwap)
+{
+  {
+    mqs::SmallVector<Tracked, 3> small;
+    small.emplace_back(1);
+    small.emplace_back(2);
+    mqs::SmallVector<Tracked, 3> big;
+    for(int i = 0; i < 10; i++) {
+      big.emplace_back(10+i);
+    }
+    const Tracked* heap = big.data();
+
+    mqs::SmallVector<Tracked, 3> copy(small);
+    ASSERT_TRUE(stored_inline(copy));
+    ASSERT_EQ(2, copy[1].value);
+
+    mqs::SmallVector<Tracked, 3> moved(std::move(big));
+    ASSERT_EQ(heap, moved.data());
+    ASSERT_TRUE(big.empty());
+    ASSERT_TRUE(stored_inline(big));
+
+    moved.swap(small);
+    ASSERT_EQ(2, moved.size());
+    ASSERT_TRUE(stored_inline(moved));
+    ASSERT_EQ(heap, small.data());
+    ASSERT_EQ(19, small.back().value);
+
+    big = std::move(moved);
+    ASSERT_EQ(1, big[0].value);
+    ASSERT_TRUE(moved.empty());
+    big = small;
+    ASSERT_EQ(10, big.size());
+    ASSERT_EQ(10, big[0].value);
+  }
+  ASSERT_EQ(0, Tracked::live);
+}
+
+// Counts what goes through it, so tests can check that a container allocates only through its allocator. The
+// counts are shared by every rebinding.
+struct AllocationCounts {
+  static int live;
+  static int allocations;
+};
+int AllocationCounts::live = 0;
+int AllocationCounts::allocations = 0;
+
+template <typename T>
+struct CountingAllocator : AllocationCounts {
+  typedef T value_type;
+
+  CountingAllocator() {}
+  template <typename U>
+  CountingAllocator(const CountingAllocator<U>&) {}
+
+  T* allocate(size_t n)
+  {
+    live++;
+    allocations++;
+    return static_cast<T*>(::operator new(n*sizeof(T)));
+  }
+
+  void deallocate(T* p, size_t)
+  {
+    live--;
+    ::operator delete(p);
+  }
+};
+template <typename T, typename U>
+bool operator==(const CountingAllocator<T>&, const CountingAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const CountingAllocator<T>&, const CountingAllocator<U>&) { return false; }
+
+// An arena_allocator that a container takes over along with the elements on copy assignment.
+template <typename T>
+struct PropagatingArenaAllocator : mqs::arena_allocator<T> {
+  typedef std::true_type propagate_on_container_copy_assignment;
+
+  explicit PropagatingArenaAllocator(mqs::arena& a) : mqs::arena_allocator<T>(a) {}
+  template <typename U>
+  PropagatingArenaAllocator(const PropagatingArenaAllocator<U>& a) : mqs::arena_allocator<T>(a) {}
+};
+
+TEST(AllocatorTest, VectorCustomAllocator)
+{
+  typedef mqs::Vector<std::string, mqs::default_growth_policy, 0, CountingAllocator<std::string>> StringVector;
+  {
+    StringVector v;
+    ASSERT_EQ(0, AllocationCounts::allocations);
+    for(int i = 0; i < 1000; i++) {
+      v.push_back(std::to_string(i));
+    }
+    StringVector copy(v);
+    copy.insert(500, "x");
+    v.shrink_to_fit();
+    ASSERT_EQ(2, AllocationCounts::live);
+    ASSERT_EQ("999", copy.back());
+  }
+  ASSERT_EQ(0, AllocationCounts::live);
+  ASSERT_LT(2, AllocationCounts::allocations);
+}
+
+TEST(AllocatorTest, VectorArena)
+{
+  typedef mqs::Vector<int, mqs::default_growth_policy, 0, mqs::arena_allocator<int>> ArenaVector;
+  mqs::arena a(1 << 20);
+  {
+    ArenaVector v{mqs::arena_allocator<int>(a)};
+    v.push_back(0);
+    const int* first = v.data();
+    for(int i = 1; i < 100000; i++) {
+      v.push_back(i);
+    }
+    // The only thing in the arena, so growth extended the buffer in place.
+    ASSERT_EQ(first, v.data());
+    ASSERT_EQ(v.capacity()*sizeof(int), a.bytes_used());
+    for(int i = 0; i < 100000; i++) {
+      ASSERT_EQ(i, v[i]);
+    }
+    mqs::arena other;
+    ArenaVector w{mqs::arena_allocator<int>(other)};
+    w = std::move(v); // Different arenas, so the elements are moved over one by one.
+    ASSERT_TRUE(v.empty());
+    ASSERT_EQ(100000u, w.size());
+    ASSERT_EQ(99999, w.back());
+    ASSERT_LE(w.size()*sizeof(int), other.bytes_used());
+    ASSERT_TRUE(&w.get_allocator().resource() == &other);
+  }
+  a.release();
+  ASSERT_EQ(0u, a.bytes_reserved());
+}
+
+TEST(AllocatorTest, CopyAssignmentAllocators)
+{
+  mqs::arena a, b;
+  typedef PropagatingArenaAllocator<int> Propagating;
+  mqs::red_black_tree<int, Propagating> from{Propagating(a)}, to{Propagating(b)};
+  for(int i = 0; i < 1000; i++) {
+    from.insert(i);
+  }
+  to.insert(-1);
+  size_t used = a.bytes_used();
+  to = from; // The allocator propagates, so the copy is built in from's arena.
+  ASSERT_TRUE(&to.get_allocator().resource() == &a);
+  ASSERT_LT(used, a.bytes_used());
+  ASSERT_EQ(1000u, to.size());
+  ASSERT_EQ(0, *to.begin());
+  ASSERT_TRUE(to.validate());
+
+  typedef PropagatingArenaAllocator<std::pair<const int, int>> PropagatingPairs;
+  mqs::red_black_map<int, int, std::less<int>, PropagatingPairs> from_map{PropagatingPairs(a)};
+  mqs::red_black_map<int, int, std::less<int>, PropagatingPairs> to_map{PropagatingPairs(b)};
+  for(int i = 0; i < 1000; i++) {
+    from_map.try_emplace(i, -i);
+  }
+  to_map.try_emplace(-1, 1);
+  used = a.bytes_used();
+  to_map = from_map;
+  ASSERT_TRUE(&to_map.get_allocator().resource() == &a);
+  ASSERT_LT(used, a.bytes_used());
+  ASSERT_EQ(1000u, to_map.size());
+  ASSERT_EQ(-999, to_map.find(999)->second);
+  ASSERT_TRUE(to_map.find(-1) == to_map.end());
+
+  mqs::b_tree<int, Propagating> from_b{Propagating(a)}, to_b{Propagating(b)};
+  for(int i = 0; i < 1000; i++) {
+    from_b.insert(i);
+  }
+  to_b.insert(-1);
+  used = a.bytes_used();
+  to_b = from_b;
+  ASSERT_TRUE(&to_b.get_allocator().resource() == &a);
+  ASSERT_LT(used, a.bytes_used());
+  ASSERT_EQ(1000u, to_b.size());
+  ASSERT_TRUE(to_b.find(999));
+  ASSERT_FALSE(to_b.find(-1));
+
+  typedef mqs::red_black_tree<int, mqs::arena_allocator<int>> ArenaTree;
+  ArenaTree source(mqs::sorted_unique, from.begin(), from.end(), mqs::arena_allocator<int>(a));
+  ArenaTree kept{mqs::arena_allocator<int>(b)};
+  kept = source;
+  ASSERT_TRUE(&kept.get_allocator().resource() == &b); // arena_allocator doesn't propagate.
+  ASSERT_EQ(1000u, kept.size());
+}
+
+TEST(AllocatorTest, ObjectPool)
+{
+  mqs::object_pool pool(24, 8, 4);
+  std::vector<void*> objects;
+  for(int i = 0; i < 10; i++) {
+    objects.push_back(pool.allocate());
+  }
+  ASSERT_EQ(3u, pool.slabs_allocated());
+  ASSERT_EQ(10u, pool.objects_in_use());
+  // Consecutive objects within a slab are adjacent.
+  ASSERT_EQ(static_cast<char*>(objects[0]) + 24, objects[1]);
+  pool.deallocate(objects[3]);
+  ASSERT_EQ(objects[3], pool.allocate()); // Freed objects are reused first.
+  pool.release();
+  ASSERT_EQ(0u, pool.slabs_allocated());
+}
+
+TEST(AllocatorTest, TreeAllocators)
+{
+  std::vector<int> nums;
+  for(int i = 0; i < 5000; i++) {
+    nums.push_back((i * 7919) % 5000);
+  }
+  {
+    mqs::red_black_tree<int, CountingAllocator<int>> tree(nums);
+    // Built in bulk, so every node comes from one block.
+    ASSERT_EQ(1, AllocationCounts::live);
+    for(int i = 0; i < 5000; i += 2) {
+      ASSERT_TRUE(tree.remove(i));
+    }
+    for(int i = 0; i < 5000; i += 2) {
+      ASSERT_TRUE(tree.insert(i)); // Reuses the removed nodes.
+    }
+    ASSERT_EQ(1, AllocationCounts::live);
+    tree.clear();
+    ASSERT_EQ(0, AllocationCounts::live);
+    ASSERT_EQ(0u, tree.size());
+    for(int n : nums) {
+      tree.insert(n);
+    }
+    // Slabs of 16, 32, ..., 4096 nodes, each with one slot for bookkeeping.
+    ASSERT_EQ(9, AllocationCounts::live);
+  }
+  ASSERT_EQ(0, AllocationCounts::live);
+
+  mqs::red_black_tree<int, mqs::pool_allocator<int>> pooled(nums);
+  for(int i = 0; i < 5000; i += 2) {
+    ASSERT_TRUE(pooled.remove(i));
+  }
+  for(int i = 0; i < 5000; i++) {
+    ASSERT_EQ(i % 2 == 1, pooled.find(i));
+  }
+
+  mqs::arena a;
+  {
+    mqs::red_black_tree<int, mqs::arena_allocator<int>> tree{mqs::arena_allocator<int>(a)};
+    for(int n : nums) {
+      tree.insert(n);
+    }
+    ASSERT_EQ(5000u, tree.size());
+    ASSERT_TRUE(tree.find(4999));
+  }
+  ASSERT_LT(0u, a.bytes_used()); // Destroying the tree left its nodes for the arena to free.
+}
+
+TEST(ParallelTest, ParallelSort)
+{
+  mqs::thread_pool pool(4);
+  srand(42);
+  mqs::Vector<int> v;
+  for(int i = 0; i < 1000000; i++) {
+    v.push_back(rand() % 1000);
+  }
+  std::vector<int> expected(v.begin(), v.end());
+  std::sort(expected.begin(), expected.end());
+  mqs::parallel::sort(pool, v.begin(), v.end(), std::less<int>());
+  ASSERT_TRUE(std::equal(expected.begin(), expected.end(), v.begin()));
+
+  mqs::parallel::sort(v, std::greater<int>());
+  ASSERT_TRUE(std::is_sorted(v.begin(), v.end(), std::greater<int>()));
+
+  mqs::Vector<std::string> words;
+  for(int i = 0; i < 100000; i++) {
+    words.push_back(std::to_string((i*7919) % 100000));
+  }
+  mqs::parallel::sort(pool, words.begin(), words.end(), std::less<std::string>());
+  ASSERT_TRUE(std::is_sorted(words.begin(), words.end()));
+  ASSERT_EQ("0", words.front());
+  ASSERT_EQ("99999", words.back());
+
+  // A comparison that throws once the buckets are being sorted still leaves the strings in the range. std::sort
+  // itself may lose the value it was inserting in each bucket it was working on, but no more than that.
+  std::random_shuffle(words.begin(), words.end());
+  std::atomic<size_t> comparisons(0);
+  auto throwing = [&](const std::string& a, const std::string& b) {
+    if(comparisons++ >= 10*words.size()) throw std::runtime_error("comparison failed");
+    return a < b;
+  };
+  ASSERT_THROW(mqs::parallel::sort(pool, words.begin(), words.end(), throwing), std::runtime_error);
+  ASSERT_GE(std::count_if(words.begin(), words.end(), [](const std::string& w) { return !w.empty(); }),
+            static_cast<std::ptrdiff_t>(words.size() - pool.size()*4));
+}
+
+TEST(ParallelTest, ParallelTransformForEach)
+{
+  mqs::thread_pool pool(3);
+  mqs::Vector<int> v(100003, 2);
+  mqs::Vector<long long> out(v.size());
+  mqs::parallel::transform(pool, v.begin(), v.end(), out.begin(), [](int x) { return 10LL*x; });
+  ASSERT_EQ(0, out.count(20) - out.size());
+  mqs::parallel::for_each(pool, v.begin(), v.end(), [](int& x) { x += 1; });
+  ASSERT_EQ(v.size(), v.count(3));
+  mqs::parallel::transform(v, [](int x) { return -x; });
+  ASSERT_EQ(-3, v.max());
+}
+
+TEST(ParallelTest, ParallelReduceScan)
+{
+  mqs::thread_pool pool(4);
+  mqs::Vector<long long> v;
+  for(long long i = 1; i <= 200000; i++) {
+    v.push_back(i);
+  }
+  ASSERT_EQ(200000LL*200001/2 + 5, mqs::parallel::reduce(pool, v.begin(), v.end(), 5LL, std::plus<long long>()));
+  ASSERT_EQ(200000, mqs::parallel::reduce(v.begin(), v.end(), 0LL, [](long long a, long long b) { return a > b ? a : b; }));
+
+  mqs::Vector<long long> prefix(v.size());
+  mqs::parallel::inclusive_scan(pool, v.begin(), v.end(), prefix.begin(), std::plus<long long>());
+  mqs::parallel::inclusive_scan(v);
+  for(size_t i = 0; i < v.size(); i++) {
+    ASSERT_EQ((long long)(i+1)*(i+2)/2, v[i]);
+    ASSERT_EQ(v[i], prefix[i]);
+  }
+
+  // Non-commutative operations keep their order.
+  mqs::Vector<std::string> letters;
+  for(int i = 0; i < 20000; i++) {
+    letters.push_back(std::string(1, (char)('a' + i % 26)));
+  }
+  std::string joined = mqs::parallel::reduce(pool, letters.begin(), letters.end(), std::string(), std::plus<std::string>());
+  ASSERT_EQ(20000, joined.size());
+  ASSERT_EQ("abc", joined.substr(0, 3));
+  ASSERT_EQ("xyzab", joined.substr(26*700-3, 5));
+}
+
+TEST(ParallelTest, ThreadPoolRun)
+{
+  mqs::thread_pool pool(4);
+  ASSERT_EQ(4, pool.size());
+  std::vector<int> hits(1000, 0);
+  pool.run(hits.size(), [&](size_t i) {
+    hits[i]++;
+    // Nested jobs run on the calling thread instead of deadlocking.
+    if(i == 0) {
+      pool.run(3, [&](size_t) { hits[0]++; });
+    }
+  });
+  ASSERT_EQ(4, hits[0]);
+  ASSERT_EQ(999, std::count(hits.begin()+1, hits.end(), 1));
+  ASSERT_THROW(pool.run(100, [](size_t i) { if(i == 50) { throw std::runtime_error("task failed"); } }), std::runtime_error);
+  int total = 0;
+  std::mutex m;
+  pool.run(10, [&](size_t i) { std::lock_guard<std::mutex> guard(m); total += (int)i; });
+  ASSERT_EQ(45, total);
+}
+
 
 TEST(RBTInsertTest, RBTInsertFind) {
   std::vector<int> nums = {5, 4, 1, 3, 2, 6, 7, 8};
@@ -220,6 +1091,1068 @@ TEST(RBTRemoveTest, RBTRemoveSuccess) {
   }
 }
 
+TEST(RBTRemoveTest, RBTRemoveInterleaved) {
+  std::mt19937 rng(7);
+  mqs::red_black_tree<int> tree;
+  std::set<int> reference;
+  for(int i = 0; i < 20000; i++) {
+    int x = rng() % 2000;
+    if(rng() % 3) {
+      ASSERT_EQ(reference.insert(x).second, tree.insert(x));
+    } else {
+      ASSERT_EQ(reference.erase(x) == 1, tree.remove(x));
+    }
+  }
+  ASSERT_EQ(reference.size(), tree.size());
+  std::vector<int> keys;
+  for(const std::pair<int, bool>& p : tree.dump()) {
+    keys.push_back(p.first);
+  }
+  std::sort(keys.begin(), keys.end());
+  ASSERT_TRUE(std::equal(reference.begin(), reference.end(), keys.begin()));
+  // A red-black tree with n nodes is never taller than 2log2(n+1).
+  ASSERT_LE(tree.height(), 2 * std::log2(tree.size() + 1));
+  for(int x : reference) {
+    ASSERT_TRUE(tree.remove(x));
+  }
+  ASSERT_EQ(0u, tree.size());
+  ASSERT_EQ(-1, tree.height());
+}
+
+TEST(RBTIteratorTest, RBTIterateInOrder) {
+  std::mt19937 rng(3);
+  mqs::red_black_tree<int> tree;
+  std::set<int> reference;
+  ASSERT_TRUE(tree.begin() == tree.end());
+  for(int i = 0; i < 3000; i++) {
+    int x = rng() % 5000;
+    tree.insert(x);
+    reference.insert(x);
+  }
+  for(int i = 0; i < 1000; i++) {
+    int x = rng() % 5000;
+    tree.remove(x);
+    reference.erase(x);
+  }
+  ASSERT_TRUE(std::equal(reference.begin(), reference.end(), tree.begin()));
+  ASSERT_EQ(reference.size(), static_cast<size_t>(std::distance(tree.begin(), tree.end())));
+  ASSERT_TRUE(std::equal(reference.rbegin(), reference.rend(), tree.rbegin()));
+  mqs::red_black_tree<int>::const_iterator last = tree.end();
+  --last;
+  ASSERT_EQ(*reference.rbegin(), *last);
+}
+
+TEST(RBTIteratorTest, RBTBoundsAndRanges) {
+  std::vector<int> nums;
+  for(int i = 0; i < 1000; i++) {
+    nums.push_back(i * 3); // 0, 3, 6, ..., 2997
+  }
+  mqs::red_black_tree<int> tree(nums);
+  ASSERT_EQ(300, *tree.lower_bound(300));
+  ASSERT_EQ(303, *tree.lower_bound(301));
+  ASSERT_EQ(303, *tree.upper_bound(300));
+  ASSERT_EQ(0, *tree.lower_bound(-5));
+  ASSERT_TRUE(tree.lower_bound(2998) == tree.end());
+  ASSERT_TRUE(tree.upper_bound(2997) == tree.end());
+
+  std::pair<mqs::red_black_tree<int>::iterator, mqs::red_black_tree<int>::iterator> hit = tree.equal_range(42);
+  ASSERT_EQ(1, std::distance(hit.first, hit.second));
+  ASSERT_EQ(42, *hit.first);
+  std::pair<mqs::red_black_tree<int>::iterator, mqs::red_black_tree<int>::iterator> miss = tree.equal_range(43);
+  ASSERT_TRUE(miss.first == miss.second);
+  ASSERT_EQ(45, *miss.first);
+
+  std::vector<int> visited;
+  ASSERT_EQ(4u, tree.visit_range(100, 112, [&](const int& x) { visited.push_back(x); }));
+  ASSERT_EQ(std::vector<int>({102, 105, 108, 111}), visited);
+  ASSERT_EQ(0u, tree.visit_range(10, 10, [](const int&) {}));
+  ASSERT_EQ(1000u, tree.visit_range(-1, 3000, [](const int&) {}));
+}
+
+TEST(RBTTeardownTest, RBTTeardownDestroysElements) {
+  {
+    mqs::red_black_tree<std::string> tree;
+    for(int i = 0; i < 100000; i++) {
+      tree.insert(std::string(40, 'a') + std::to_string(i)); // Long enough to live on the heap.
+    }
+    for(int i = 0; i < 100000; i += 3) {
+      ASSERT_TRUE(tree.remove(std::string(40, 'a') + std::to_string(i)));
+    }
+  }
+  mqs::red_black_tree<std::string> tree;
+  tree.insert("a");
+  tree.clear();
+  ASSERT_EQ(0u, tree.size());
+  ASSERT_FALSE(tree.find("a"));
+  tree.insert("b");
+  ASSERT_TRUE(tree.find("b"));
+}
+
+TEST(RBTBulkTest, RBTBuildSorted) {
+  for(int n = 0; n < 300; n++) {
+    std::vector<int> nums;
+    for(int i = 0; i < n; i++) {
+      nums.push_back(2*i);
+    }
+    mqs::red_black_tree<int> tree(mqs::sorted_unique, nums.begin(), nums.end());
+    ASSERT_EQ(nums.size(), tree.size());
+    ASSERT_TRUE(std::equal(nums.begin(), nums.end(), tree.begin()));
+    // Perfectly balanced: no deeper than a complete binary tree.
+    ASSERT_EQ(n == 0 ? -1 : static_cast<int>(std::log2(n)), tree.height());
+    // The coloring has to hold up under later updates.
+    for(int i = 0; i < n; i += 3) {
+      ASSERT_TRUE(tree.insert(2*i + 1));
+      ASSERT_TRUE(tree.remove(2*i));
+    }
+    ASSERT_GE(2*std::log2(tree.size() + 1), tree.height());
+  }
+  mqs::red_black_index_tree<int> indexed;
+  std::vector<int> nums = {1, 2, 3, 5, 8, 13};
+  indexed.assign_sorted(nums.begin(), nums.end());
+  ASSERT_TRUE(std::equal(nums.begin(), nums.end(), indexed.begin()));
+  ASSERT_TRUE(indexed.insert(4));
+  ASSERT_FALSE(indexed.insert(5));
+}
+
+TEST(RBTBulkTest, RBTAssignAndCopy) {
+  std::vector<std::string> words = {"pear", "apple", "fig", "apple", "kiwi", "fig"};
+  mqs::red_black_tree<std::string> tree;
+  tree.insert("old");
+  tree.assign(words.begin(), words.end()); // Unsorted with repeats, so it's sorted and deduplicated first.
+  std::set<std::string> reference(words.begin(), words.end());
+  ASSERT_EQ(reference.size(), tree.size());
+  ASSERT_TRUE(std::equal(reference.begin(), reference.end(), tree.begin()));
+  ASSERT_FALSE(tree.find("old"));
+
+  mqs::red_black_tree<std::string> copy(tree);
+  ASSERT_TRUE(copy.remove("fig"));
+  ASSERT_TRUE(tree.find("fig"));
+  ASSERT_TRUE(std::equal(reference.begin(), reference.end(), tree.begin()));
+  copy = tree;
+  ASSERT_TRUE(std::equal(reference.begin(), reference.end(), copy.begin()));
+  copy = copy;
+  ASSERT_EQ(reference.size(), copy.size());
+
+  // Moves and swaps hand the nodes over without allocating, and leave the source empty and usable.
+  std::vector<int> keys(1000);
+  std::iota(keys.begin(), keys.end(), 0);
+  typedef mqs::red_black_tree<int, CountingAllocator<int>> CountedTree;
+  typedef mqs::red_black_tree<int, CountingAllocator<int>, mqs::index_nodes> CountedIndexTree;
+  CountedTree counted(mqs::sorted_unique, keys.begin(), keys.end());
+  CountedIndexTree indexed(mqs::sorted_unique, keys.begin(), keys.end());
+  int allocations = AllocationCounts::allocations;
+  CountedTree moved(std::move(counted));
+  CountedIndexTree moved_indexed(std::move(indexed));
+  ASSERT_EQ(0, counted.size());
+  ASSERT_EQ(0, indexed.size());
+  ASSERT_EQ(1000, moved.size());
+  ASSERT_TRUE(moved_indexed.validate());
+  counted = std::move(moved);
+  std::swap(counted, moved);
+  std::swap(indexed, moved_indexed);
+  ASSERT_EQ(allocations, AllocationCounts::allocations);
+  ASSERT_TRUE(std::equal(keys.begin(), keys.end(), moved.begin()));
+  ASSERT_TRUE(std::equal(keys.begin(), keys.end(), indexed.begin()));
+  ASSERT_TRUE(counted.insert(5));
+  ASSERT_TRUE(moved.validate() && counted.validate());
+}
+
+TEST(RBTBatchTest, RBTInsertRemoveBatch) {
+  // Ascending appends, near-sorted and random batches with repeats, and keys already in the tree.
+  std::mt19937 gen(5);
+  std::set<int> expected;
+  mqs::order_statistic_tree<int> t;
+  mqs::red_black_index_tree<int> u;
+  int next = 0;
+  for(int round = 0; round < 60; round++) {
+    std::vector<int> batch;
+    for(int i = 0; i < 500; i++) {
+      switch(round % 3) {
+        case 0: batch.push_back(next += gen() % 3); break;
+        case 1: batch.push_back(next - 200 + int(gen() % 400)); break;
+        default: batch.push_back(gen() % (next + 1)); break;
+      }
+    }
+    size_t before = expected.size();
+    expected.insert(batch.begin(), batch.end());
+    ASSERT_EQ(expected.size() - before, t.insert_batch(batch.begin(), batch.end()));
+    ASSERT_EQ(expected.size() - before, u.insert_batch(batch.begin(), batch.end()));
+    if(round % 4 == 3) {
+      std::vector<int> gone;
+      for(int i = 0; i < 300; i++) {
+        gone.push_back(gen() % (next + 1));
+      }
+      size_t removed = 0;
+      for(int x : gone) {
+        removed += expected.erase(x);
+      }
+      ASSERT_EQ(removed, t.remove_batch(gone.begin(), gone.end()));
+      ASSERT_EQ(removed, u.remove_batch(gone.begin(), gone.end()));
+    }
+    ASSERT_EQ(expected.size(), t.size());
+    ASSERT_TRUE(std::equal(expected.begin(), expected.end(), t.begin()));
+    ASSERT_TRUE(std::equal(expected.begin(), expected.end(), u.begin()));
+    ASSERT_LE(t.height(), 2*std::log2(t.size() + 1.0));
+    for(size_t k = 0; k < t.size(); k += 1 + t.size()/20) {
+      ASSERT_EQ(*std::next(expected.begin(), k), *t.select(k));
+    }
+  }
+  // Already sorted batches aren't copied, and empty ones change nothing.
+  const int sorted[] = {-5, -5, -3, 0, 1, 1};
+  size_t before = expected.size();
+  expected.insert(std::begin(sorted), std::end(sorted));
+  ASSERT_EQ(expected.size() - before, t.insert_batch(std::begin(sorted), std::end(sorted)));
+  ASSERT_EQ(0, t.insert_batch(std::begin(sorted), std::begin(sorted)));
+  ASSERT_EQ(0, t.remove_batch(std::begin(sorted), std::begin(sorted)));
+  ASSERT_EQ(*t.begin(), -5);
+  const std::vector<int> all(t.begin(), t.end());
+  ASSERT_EQ(all.size(), t.remove_batch(all.rbegin(), all.rend()));
+  ASSERT_EQ(0, t.size());
+  ASSERT_EQ(t.end(), t.begin());
+
+  // Batches of keys that are mostly in the tree already add nodes from the slabs in use, not a slab per batch.
+  std::vector<int> keys(1000);
+  std::iota(keys.begin(), keys.end(), 0);
+  int live = AllocationCounts::live;
+  mqs::red_black_tree<int, CountingAllocator<int>> counted(mqs::sorted_unique, keys.begin(), keys.end());
+  for(int round = 0; round < 100; round++) {
+    keys.back() = 1000 + round;
+    ASSERT_EQ(1, counted.insert_batch(keys.begin(), keys.end()));
+  }
+  ASSERT_EQ(1100, counted.size());
+  ASSERT_GE(live + 3, AllocationCounts::live);
+}
+
+// A pool of four that runs its tasks on the calling thread and remembers whether it was asked to.
+struct RecordingPool {
+  bool used = false;
+
+  size_t size() const
+  {
+    return 4;
+  }
+
+  template <typename Fn>
+  void run(size_t tasks, Fn fn)
+  {
+    used = true;
+    for(size_t i = 0; i < tasks; i++) {
+      fn(i);
+    }
+  }
+};
+
+TEST(RBTStatsTest, RBTStatsValidateHistogram) {
+  mqs::red_black_tree<int, mqs::heap_allocator<int>, mqs::pointer_nodes, mqs::no_augment, mqs::rb_stats> tree;
+  ASSERT_TRUE(tree.validate());
+  ASSERT_TRUE(tree.depth_histogram().empty());
+  ASSERT_EQ(-1, tree.height());
+  // Ascending inserts rotate and cascade; every insert and remove repair ends in exactly one case that isn't 3.
+  for(int i = 0; i < 4096; i++) {
+    tree.insert(i);
+  }
+  ASSERT_TRUE(tree.validate());
+  const mqs::rb_stats& s = tree.stats();
+  ASSERT_EQ(4096, s.allocations);
+  ASSERT_EQ(4096, s.lookups);
+  ASSERT_GE(s.allocated_bytes, 4096*(3*sizeof(void*) + sizeof(int)));
+  ASSERT_GT(s.rotations, 0);
+  ASSERT_EQ(4096, s.insert_cases[0] + s.insert_cases[1] + s.insert_cases[3]);
+  ASSERT_EQ(s.recolors, s.insert_cases[2]);
+  ASSERT_GT(s.longest_cascade, 1);
+  ASSERT_LE(s.longest_cascade, tree.height());
+  std::vector<size_t> depths = tree.depth_histogram();
+  ASSERT_EQ(tree.height() + 1, int(depths.size()));
+  ASSERT_EQ(1, depths[0]);
+  ASSERT_EQ(tree.size(), std::accumulate(depths.begin(), depths.end(), size_t(0)));
+  tree.reset_stats();
+  ASSERT_EQ(0, tree.stats().lookups);
+  for(int i = 0; i < 4096; i += 64) {
+    ASSERT_TRUE(tree.find(i));
+  }
+  ASSERT_EQ(64, tree.stats().lookups);
+  ASSERT_LE(tree.stats().comparisons_per_lookup(), tree.height() + 1.0);
+  for(int i = 0; i < 4096; i += 2) {
+    tree.remove(i);
+  }
+  ASSERT_TRUE(tree.validate());
+  ASSERT_GT(tree.stats().remove_cases[2] + tree.stats().remove_cases[5], 0);
+  ASSERT_EQ(0, tree.stats().allocations);
+  // Set operations on a tree with stats keep the pool's threads off its counters.
+  RecordingPool pool;
+  mqs::red_black_tree<int> odds;
+  for(int i = 1; i < 100000; i += 2) {
+    odds.insert(i);
+  }
+  tree.unite(odds, pool);
+  ASSERT_FALSE(pool.used);
+  ASSERT_EQ(50000, tree.size());
+  ASSERT_TRUE(tree.validate());
+  // The default tree has the same checks and pays nothing for stats it doesn't keep.
+  mqs::red_black_index_tree<int> plain;
+  std::mt19937 gen(22);
+  for(int i = 0; i < 5000; i++) {
+    plain.insert(gen() % 2000);
+    if(i % 3 == 0) {
+      plain.remove(gen() % 2000);
+    }
+  }
+  ASSERT_TRUE(plain.validate());
+  typedef mqs::red_black_tree<int, mqs::heap_allocator<int>, mqs::index_nodes, mqs::no_augment, mqs::rb_stats> counted;
+  ASSERT_LE(sizeof(mqs::red_black_index_tree<int>) + sizeof(mqs::rb_stats), sizeof(counted));
+}
+
+TEST(RBTOrderStatisticTest, RBTSelectRank) {
+  mqs::order_statistic_tree<int> tree;
+  std::set<int> reference;
+  std::mt19937 gen(15);
+  for(int i = 0; i < 20000; i++) {
+    int x = gen() % 5000;
+    if(gen() % 3) {
+      ASSERT_EQ(reference.insert(x).second, tree.insert(x));
+    } else {
+      ASSERT_EQ(reference.erase(x) == 1, tree.remove(x));
+    }
+  }
+  std::vector<int> sorted(reference.begin(), reference.end());
+  for(size_t k = 0; k < sorted.size(); k++) {
+    ASSERT_EQ(sorted[k], *tree.select(k));
+    ASSERT_EQ(k, tree.rank(sorted[k]));
+    ASSERT_EQ(k + 1, tree.rank(sorted[k] + 1));
+  }
+  ASSERT_TRUE(tree.select(sorted.size()) == tree.end());
+  ASSERT_EQ(0u, tree.rank(-1));
+  ASSERT_EQ(sorted.size(), tree.rank(5000));
+  ASSERT_EQ(static_cast<size_t>(std::distance(reference.lower_bound(1000), reference.lower_bound(3000))),
+            tree.count_range(1000, 3000));
+  ASSERT_EQ(0u, tree.count_range(3000, 1000));
+
+  // Bulk builds and copies keep the sizes too, in either layout.
+  typedef mqs::order_statistic_tree<int, mqs::heap_allocator<int>, mqs::index_nodes> IndexTree;
+  IndexTree indexed(mqs::sorted_unique, sorted.begin(), sorted.end());
+  ASSERT_TRUE(indexed.insert(-5));
+  ASSERT_TRUE(indexed.remove(sorted[sorted.size()/2]));
+  ASSERT_EQ(-5, *indexed.select(0));
+  ASSERT_EQ(sorted[1], *indexed.select(2));
+  mqs::order_statistic_tree<int> copy(tree);
+  ASSERT_EQ(sorted.back(), *copy.select(sorted.size() - 1));
+}
+
+TEST(RBTIntervalTest, RBTOverlapQueries) {
+  typedef std::pair<int, int> interval;
+  mqs::interval_tree<interval> tree;
+  std::set<interval> reference;
+  std::mt19937 gen(17);
+  for(int i = 0; i < 20000; i++) {
+    int lo = gen() % 10000;
+    interval x(lo, lo + gen() % (gen() % 4 ? 20 : 2000));
+    if(gen() % 3) {
+      ASSERT_EQ(reference.insert(x).second, tree.insert(x));
+    } else {
+      ASSERT_EQ(reference.erase(x) == 1, tree.remove(x));
+    }
+  }
+  ASSERT_TRUE(tree.validate());
+  // The queries must find exactly what a scan finds, in order, after the repairs have moved the maxima around.
+  std::vector<interval> sorted(reference.begin(), reference.end());
+  for(int q = 0; q < 300; q++) {
+    int lo = static_cast<int>(gen() % 12000) - 1000, hi = lo + (q % 2 ? 0 : gen() % 300);
+    std::vector<interval> expected, found;
+    for(const interval& x : sorted) {
+      if(x.first <= hi && x.second >= lo) {
+        expected.push_back(x);
+      }
+    }
+    auto collect = [&](const interval& x) { found.push_back(x); };
+    size_t visited = (lo == hi ? tree.visit_containing(lo, collect) : tree.visit_overlapping(lo, hi, collect));
+    ASSERT_EQ(expected.size(), visited);
+    ASSERT_EQ(expected, found);
+    ASSERT_TRUE(expected.empty() ? tree.find_overlapping(lo, hi) == tree.end()
+                                 : *tree.find_overlapping(lo, hi) == expected.front());
+  }
+
+  // A bulk build from sorted intervals computes the maxima too, in either layout.
+  typedef mqs::interval_tree<interval, mqs::heap_allocator<interval>, mqs::index_nodes> IndexTree;
+  IndexTree indexed(mqs::sorted_unique, sorted.begin(), sorted.end());
+  ASSERT_TRUE(indexed.insert(interval(-50, 20000)));
+  ASSERT_EQ(interval(-50, 20000), *indexed.find_overlapping(15000, 16000));
+  ASSERT_TRUE(indexed.remove(interval(-50, 20000)));
+  ASSERT_TRUE(indexed.find_overlapping(15000, 16000) == indexed.end());
+  size_t stabbed = 0;
+  for(const interval& x : sorted) {
+    stabbed += (x.first <= 5000 && 5000 <= x.second);
+  }
+  ASSERT_EQ(stabbed, indexed.visit_containing(5000, [](const interval&) {}));
+}
+
+TEST(RBTLayoutTest, RBTNodeSizes) {
+  typedef mqs::no_augment::node_data<size_t> plain;
+  typedef mqs::no_augment::node_data<uint32_t> plain_index;
+  // The color rides in the parent link, so a node is three links and the element.
+  ASSERT_EQ(3*sizeof(void*) + sizeof(uint64_t), sizeof(mqs::detail::rb_pointer_node<uint64_t, plain>));
+  ASSERT_EQ(16u, sizeof(mqs::detail::rb_index_node<int, plain_index>));
+  // Subtree sizes are as wide as the links.
+  ASSERT_EQ(20u, sizeof(mqs::detail::rb_index_node<int, mqs::order_statistics::node_data<uint32_t>>));
+}
+
+TEST(RBTLayoutTest, RBTIndexTree) {
+  mqs::red_black_index_tree<int> tree;
+  std::set<int> reference;
+  std::mt19937 gen(13);
+  for(int i = 0; i < 50000; i++) {
+    int x = gen() % 20000;
+    if(gen() % 3) {
+      ASSERT_EQ(reference.insert(x).second, tree.insert(x));
+    } else {
+      ASSERT_EQ(reference.erase(x) == 1, tree.remove(x));
+    }
+  }
+  ASSERT_EQ(reference.size(), tree.size());
+  ASSERT_TRUE(std::equal(reference.begin(), reference.end(), tree.begin()));
+  ASSERT_TRUE(std::equal(reference.rbegin(), reference.rend(), tree.rbegin()));
+  ASSERT_EQ(*reference.lower_bound(10000), *tree.lower_bound(10000));
+  ASSERT_EQ(*reference.upper_bound(10000), *tree.upper_bound(10000));
+  ASSERT_GE(2*std::log2(tree.size() + 1), tree.height());
+  // Iterators hold indices, so they survive the array moving as it grows.
+  mqs::red_black_index_tree<int> growing;
+  growing.insert(-1);
+  mqs::red_black_index_tree<int>::iterator first = growing.begin();
+  for(int i = 0; i < 1000; i++) {
+    growing.insert(i);
+  }
+  ASSERT_EQ(-1, *first);
+  ASSERT_EQ(0, *++first);
+  growing.clear();
+  ASSERT_EQ(0u, growing.size());
+  ASSERT_TRUE(growing.begin() == growing.end());
+}
+
+TEST(RBMapTest, RBMapInsertFind) {
+  mqs::red_black_map<std::string, int> ages;
+  ages["carol"] = 41;
+  ages["alice"] = 30;
+  ASSERT_TRUE(ages.try_emplace("bob", 25).second);
+  ASSERT_FALSE(ages.try_emplace("bob", 99).second);
+  ASSERT_EQ(25, ages.at("bob"));
+  ASSERT_FALSE(ages.insert_or_assign("alice", 31).second);
+  ASSERT_EQ(31, ages["alice"]);
+  ASSERT_EQ(0, ages["dave"]); // Value-initialized on first use.
+  ASSERT_EQ(4u, ages.size());
+  ASSERT_THROW(ages.at("erin"), std::out_of_range);
+
+  std::vector<std::string> names;
+  for(const std::pair<const std::string, int>& p : ages) {
+    names.push_back(p.first);
+  }
+  ASSERT_EQ((std::vector<std::string>{"alice", "bob", "carol", "dave"}), names);
+  ages.find("carol")->second++;
+  ASSERT_EQ(42, ages.at("carol"));
+  mqs::red_black_map<std::string, int>::iterator next = ages.erase(ages.find("bob"));
+  ASSERT_EQ("carol", next->first);
+  ASSERT_TRUE(ages.remove("dave"));
+  ASSERT_FALSE(ages.remove("dave"));
+  ASSERT_TRUE(ages.find("dave") == ages.end());
+  ASSERT_EQ("carol", ages.lower_bound("b")->first);
+  ASSERT_EQ("carol", ages.upper_bound("alice")->first);
+
+  // try_emplace leaves its arguments alone when the key is already there.
+  mqs::red_black_map<int, std::unique_ptr<int>> owners;
+  std::unique_ptr<int> p(new int(7));
+  ASSERT_TRUE(owners.try_emplace(1, std::move(p)).second);
+  std::unique_ptr<int> q(new int(8));
+  ASSERT_FALSE(owners.try_emplace(1, std::move(q)).second);
+  ASSERT_TRUE(q != nullptr);
+  ASSERT_EQ(7, *owners.at(1));
+
+  // Moving a map hands its nodes over, so move-only values come along.
+  mqs::red_black_map<int, std::unique_ptr<int>> moved(std::move(owners));
+  ASSERT_EQ(0u, owners.size());
+  ASSERT_EQ(7, *moved.at(1));
+  owners = std::move(moved);
+  ASSERT_EQ(7, *owners.at(1));
+  ASSERT_TRUE(moved.find(1) == moved.end());
+  std::swap(owners, moved);
+  ASSERT_EQ(7, *moved.at(1));
+  ASSERT_TRUE(owners.empty());
+}
+
+TEST(RBMapTest, RBMapComparators) {
+  // A transparent comparator finds std::string keys by const char* without building a string.
+  mqs::red_black_map<std::string, int, mqs::transparent_less> words;
+  words["pear"] = 1;
+  words["apple"] = 2;
+  const char* key = "apple";
+  ASSERT_EQ(2, words.find(key)->second);
+  ASSERT_TRUE(words.contains("pear"));
+  ASSERT_FALSE(words.contains("fig"));
+  // Bounds on a non-const map pick the transparent overloads and hand back mutable iterators.
+  words.lower_bound("apr")->second = 3;
+  words.upper_bound("apple")->second++;
+  ASSERT_EQ(4, words["pear"]);
+
+  mqs::red_black_map<int, int, std::greater<int>> descending;
+  for(int i = 0; i < 100; i++) {
+    descending[i] = i*i;
+  }
+  ASSERT_EQ(99, descending.begin()->first);
+  ASSERT_EQ(50, descending.lower_bound(50)->first);
+  ASSERT_EQ(49, descending.upper_bound(50)->first);
+
+  // One comparison per level, plus one to check for a match.
+  static size_t comparisons;
+  struct counting_less {
+    bool operator()(int a, int b) const { comparisons++; return a < b; }
+  };
+  typedef mqs::heap_allocator<std::pair<const int, int>> Alloc;
+  typedef mqs::red_black_map<int, int, counting_less, Alloc, mqs::index_nodes> CountedMap;
+  CountedMap counted;
+  std::mt19937 gen(16);
+  std::map<int, int> reference;
+  for(int i = 0; i < 20000; i++) {
+    int k = gen() % 10000;
+    counted[k] = i;
+    reference[k] = i;
+  }
+  ASSERT_TRUE(std::equal(reference.begin(), reference.end(), counted.begin()));
+  for(int k = 0; k < 10000; k += 7) {
+    comparisons = 0;
+    ASSERT_EQ(reference.count(k) == 1, counted.find(k) != counted.end());
+    ASSERT_GE(2*std::log2(counted.size() + 1) + 2, comparisons);
+  }
+  CountedMap copy(counted);
+  ASSERT_TRUE(std::equal(reference.begin(), reference.end(), copy.begin()));
+}
+
+TEST(RBTSetOperationTest, RBTUniteIntersectSubtract) {
+  // Overlapping trees of very different sizes, merged both ways round, on the calling thread and on a pool big
+  // enough to split the merge into tasks.
+  mqs::thread_pool pool(4);
+  std::mt19937 gen(11);
+  for(int round = 0; round < 12; round++) {
+    const int range = (round < 6 ? 3000 : 100000);
+    std::set<int> a_set, b_set;
+    mqs::order_statistic_tree<int> a;
+    mqs::red_black_index_tree<int> b;
+    for(int i = 0, n = (round % 2 ? range/10 : range); i < n; i++) {
+      int x = gen() % range;
+      a.insert(x);
+      a_set.insert(x);
+    }
+    for(int i = 0, n = (round % 2 ? range : range/50); i < n; i++) {
+      int x = gen() % range;
+      b.insert(x);
+      b_set.insert(x);
+    }
+    std::set<int> expected;
+    switch(round % 3) {
+      case 0:
+        if(round < 6) {
+          a.unite(b);
+        } else {
+          a.unite(b, pool);
+        }
+        std::set_union(a_set.begin(), a_set.end(), b_set.begin(), b_set.end(), std::inserter(expected, expected.end()));
+        break;
+      case 1:
+        if(round < 6) {
+          a.intersect(b);
+        } else {
+          a.intersect(b, pool);
+        }
+        std::set_intersection(a_set.begin(), a_set.end(), b_set.begin(), b_set.end(),
+                              std::inserter(expected, expected.end()));
+        break;
+      default:
+        if(round < 6) {
+          a.subtract(b);
+        } else {
+          a.subtract(b, pool);
+        }
+        std::set_difference(a_set.begin(), a_set.end(), b_set.begin(), b_set.end(),
+                            std::inserter(expected, expected.end()));
+        break;
+    }
+    ASSERT_EQ(expected.size(), a.size());
+    ASSERT_TRUE(std::equal(expected.begin(), expected.end(), a.begin()));
+    ASSERT_EQ(b_set.size(), b.size());
+    ASSERT_LE(a.height(), 2*std::log2(a.size() + 1.0));
+    // Joins keep the subtree sizes up to date.
+    for(size_t k = 0; k < a.size(); k += 1 + a.size()/20) {
+      ASSERT_EQ(*std::next(expected.begin(), k), *a.select(k));
+    }
+    ASSERT_TRUE(a.insert(-1));
+    ASSERT_TRUE(a.remove(-1));
+  }
+
+  mqs::red_black_tree<std::string> words;
+  mqs::red_black_tree<std::string> more;
+  for(int i = 0; i < 1000; i++) {
+    words.insert(std::to_string(i));
+    more.insert(std::to_string(i + 500));
+  }
+  words.unite(more);
+  ASSERT_EQ(1500, words.size());
+  ASSERT_EQ(750, words.filter([](const std::string& w) { return std::stoi(w) % 2 == 0; }));
+  ASSERT_EQ(750, words.size());
+  ASSERT_TRUE(words.find("1498"));
+  ASSERT_FALSE(words.find("1499"));
+  ASSERT_LE(words.height(), 2*std::log2(words.size() + 1.0));
+  // A predicate that throws partway leaves every element it didn't reject in a valid tree.
+  mqs::order_statistic_tree<int> odds;
+  for(int i = 0; i < 1000; i++) {
+    odds.insert(i);
+  }
+  size_t calls = 0;
+  std::set<int> rejected;
+  ASSERT_THROW(odds.filter([&](int i) {
+    if(++calls == 500) throw std::runtime_error("filter failed");
+    if(i % 2 == 0) rejected.insert(i);
+    return i % 2 == 1;
+  }), std::runtime_error);
+  ASSERT_TRUE(odds.validate());
+  ASSERT_FALSE(rejected.empty());
+  ASSERT_EQ(1000 - rejected.size(), odds.size());
+  ASSERT_EQ(static_cast<size_t>(std::distance(odds.begin(), odds.end())), odds.size());
+  for(int i = 0; i < 1000; i++) {
+    ASSERT_EQ(rejected.count(i) == 0, odds.find(i));
+  }
+  ASSERT_EQ(odds.size() - 1, odds.rank(*odds.rbegin()));
+  words.subtract(more);
+  ASSERT_EQ(250, words.size());
+  ASSERT_EQ("0", *words.begin());
+  ASSERT_EQ("98", *words.rbegin());
+  words.unite(words);
+  words.intersect(words);
+  ASSERT_EQ(250, words.size());
+  words.subtract(words);
+  ASSERT_EQ(0, words.size());
+}
+
+TEST(RBTConcurrentTest, RBTConcurrentReadersWriter) {
+  // Even keys stay in the tree while a writer churns the odd ones, so readers must always find the even keys and
+  // never find negative ones, however their lookups interleave with the writes.
+  mqs::concurrent_red_black_tree<int> tree;
+  for(int i = 0; i < 2000; i += 2) {
+    tree.insert(i);
+  }
+  std::atomic<bool> done(false);
+  std::atomic<int> misses(0);
+  std::vector<std::thread> readers;
+  for(int r = 0; r < 3; r++) {
+    readers.emplace_back([&, r]() {
+      std::mt19937 gen(r);
+      while(!done.load()) {
+        int k = gen() % 1000;
+        if(!tree.find(2*k) || tree.find(-k - 1)) {
+          misses++;
+        }
+      }
+    });
+  }
+  for(int round = 0; round < 20; round++) {
+    for(int i = 1; i < 2000; i += 2) {
+      ASSERT_TRUE(tree.insert(i));
+    }
+    ASSERT_EQ(2000, tree.size());
+    for(int i = 1; i < 2000; i += 2) {
+      ASSERT_TRUE(tree.remove(i));
+    }
+  }
+  done = true;
+  for(std::thread& t : readers) {
+    t.join();
+  }
+  ASSERT_EQ(0, misses.load());
+
+  ASSERT_EQ(1000, tree.read([](const mqs::red_black_tree<int>& t) { return std::distance(t.begin(), t.end()); }));
+  tree.write([](mqs::red_black_tree<int>& t) { t.insert(-1); t.insert(-3); t.remove(0); });
+  ASSERT_EQ(1001, tree.size()); // The size is published when write() returns.
+  ASSERT_TRUE(tree.find(-1));
+  ASSERT_TRUE(tree.find(-3));
+  ASSERT_FALSE(tree.find(0));
+  tree.clear();
+  ASSERT_EQ(0, tree.size());
+  ASSERT_FALSE(tree.find(2));
+  tree.insert(2);
+  ASSERT_TRUE(tree.find(2));
+
+  // Lock-free lookups copy elements a word at a time, with the word as wide as the element's alignment allows.
+  mqs::concurrent_red_black_tree<char> chars;
+  mqs::concurrent_red_black_tree<short> shorts;
+  mqs::concurrent_red_black_tree<double> doubles;
+  for(int i = 0; i < 100; i++) {
+    chars.insert(static_cast<char>(i));
+    shorts.insert(static_cast<short>(i*300));
+    doubles.insert(i/4.0);
+  }
+  ASSERT_TRUE(chars.find(42) && shorts.find(42*300) && doubles.find(10.25));
+  ASSERT_FALSE(chars.find(-1) || shorts.find(1) || doubles.find(0.1));
+
+  // Elements that can't be copied bytewise are always looked up under the lock.
+  mqs::concurrent_red_black_tree<std::string> words;
+  words.insert("pear");
+  ASSERT_TRUE(words.find("pear"));
+  ASSERT_FALSE(words.find("fig"));
+  words.clear();
+  ASSERT_EQ(0, words.size());
+}
+
+// An int whose copy constructor throws once a budget of copies runs out, for checking exception guarantees.
+struct fragile_int
+{
+  static int copies_left;
+  int v;
+
+  fragile_int(int v) : v(v) {}
+
+  fragile_int(const fragile_int& f) : v(f.v)
+  {
+    if(copies_left-- == 0) {
+      throw std::runtime_error("copy failed");
+    }
+  }
+
+  bool operator==(const fragile_int& f) const { return v == f.v; }
+  bool operator>(const fragile_int& f) const { return v > f.v; }
+};
+
+int fragile_int::copies_left = -1;
+
+TEST(PersistentTreeTest, PersistentSnapshots) {
+  // Snapshots taken along the way keep their contents however the tree changes after them.
+  std::mt19937 gen(9);
+  mqs::persistent_red_black_tree<int> t;
+  std::set<int> expected;
+  std::vector<std::pair<mqs::persistent_red_black_tree<int>, std::vector<int>>> snapshots;
+  for(int i = 0; i < 40000; i++) {
+    int x = gen() % 3000;
+    if(gen() % 3) {
+      ASSERT_EQ(expected.insert(x).second, t.insert(x));
+    } else {
+      ASSERT_EQ(expected.erase(x) == 1, t.remove(x));
+    }
+    if(i % 2000 == 0) {
+      snapshots.emplace_back(t.snapshot(), std::vector<int>(expected.begin(), expected.end()));
+    }
+  }
+  ASSERT_EQ(expected.size(), t.size());
+  ASSERT_LE(t.height(), 2*std::log2(t.size() + 1.0));
+  for(const auto& s : snapshots) {
+    std::vector<int> seen;
+    s.first.visit([&seen](int x) { seen.push_back(x); });
+    ASSERT_EQ(s.second, seen);
+  }
+  std::vector<int> range;
+  ASSERT_EQ(std::distance(expected.lower_bound(100), expected.lower_bound(200)),
+            t.visit_range(100, 200, [&range](int x) { range.push_back(x); }));
+  ASSERT_TRUE(std::equal(range.begin(), range.end(), expected.lower_bound(100)));
+  mqs::persistent_red_black_tree<int> copy = t;
+  t.clear();
+  ASSERT_TRUE(t.empty());
+  ASSERT_EQ(expected.size(), copy.size());
+  ASSERT_TRUE(copy.find(*expected.begin()));
+
+  // A copy that throws partway through an update leaves the tree as it was, shared nodes and all.
+  mqs::persistent_red_black_tree<fragile_int> f;
+  for(int i = 0; i < 100; i++) {
+    f.insert(i);
+  }
+  mqs::persistent_red_black_tree<fragile_int> before = f;
+  for(int budget = 0; budget < 10; budget++) {
+    fragile_int::copies_left = budget;
+    ASSERT_THROW(f.insert(1000 + budget), std::runtime_error);
+    fragile_int::copies_left = budget;
+    ASSERT_THROW(f.remove(50), std::runtime_error);
+    fragile_int::copies_left = -1;
+    ASSERT_EQ(100, f.size());
+    ASSERT_TRUE(f.find(50));
+    ASSERT_FALSE(f.find(1000 + budget));
+  }
+  ASSERT_TRUE(f.remove(50));
+  ASSERT_FALSE(f.find(50));
+  ASSERT_TRUE(before.find(50));
+}
+
+TEST(PersistentTreeTest, VersionedReadersWriter) {
+  // The writer inserts 0, 1, 2, ... in order, so every version a reader sees holds exactly 0 to size() - 1.
+  mqs::versioned_red_black_tree<int> tree;
+  std::atomic<bool> done(false);
+  std::atomic<int> torn(0);
+  std::vector<std::thread> readers;
+  for(int r = 0; r < 3; r++) {
+    readers.emplace_back([&]() {
+      while(!done.load()) {
+        mqs::persistent_red_black_tree<int> version = tree.snapshot();
+        int n = version.size();
+        if((n > 0 && !version.find(n - 1)) || version.find(n)) {
+          torn++;
+        }
+      }
+    });
+  }
+  for(int i = 0; i < 5000; i++) {
+    ASSERT_TRUE(tree.insert(i));
+  }
+  ASSERT_FALSE(tree.insert(0));
+  done = true;
+  for(std::thread& t : readers) {
+    t.join();
+  }
+  ASSERT_EQ(0, torn.load());
+
+  // Changes made in write() are published together, and undone if it throws.
+  tree.write([](mqs::persistent_red_black_tree<int>& t) { t.remove(0); t.insert(-1); });
+  ASSERT_THROW(tree.write([](mqs::persistent_red_black_tree<int>& t) {
+    t.insert(-2);
+    throw std::runtime_error("write failed");
+  }), std::runtime_error);
+  mqs::persistent_red_black_tree<int> latest = tree.snapshot();
+  ASSERT_TRUE(latest.find(-1));
+  ASSERT_FALSE(latest.find(0));
+  ASSERT_FALSE(latest.find(-2));
+  ASSERT_TRUE(tree.write([](mqs::persistent_red_black_tree<int>& t) { return t.insert(-3); }));
+  ASSERT_TRUE(tree.snapshot().find(-3));
+  ASSERT_TRUE(tree.remove(-3));
+  ASSERT_TRUE(tree.remove(-1));
+  ASSERT_EQ(4999, tree.snapshot().size());
+  ASSERT_TRUE(latest.find(-1));
+}
+
+TEST(FlatFileTest, SaveMapLoad) {
+  const std::string path = "/tmp/mqs_flat_test_" + std::to_string(::getpid());
+  mqs::Vector<int> v;
+  for(int i = 0; i < 5000; i++) {
+    v.push_back(i*7 % 1001);
+  }
+  mqs::save(v, path);
+  {
+    mqs::mapped_vector<int> m(path);
+    ASSERT_TRUE(m.verify());
+    ASSERT_EQ(v.size(), m.size());
+    ASSERT_TRUE(std::equal(v.begin(), v.end(), m.begin()));
+    ASSERT_THROW(mqs::mapped_set<int> wrong(path), std::runtime_error);
+    ASSERT_THROW(mqs::mapped_vector<double> wider(path), std::runtime_error);
+  }
+  mqs::Vector<int> back;
+  mqs::load(path, back);
+  ASSERT_EQ(v.size(), back.size());
+  ASSERT_TRUE(std::equal(v.begin(), v.end(), back.begin()));
+  // Sizes around the index's blocks of 16 ints and its padding, with and without the index.
+  std::mt19937 gen(23);
+  for(size_t n : {0, 1, 15, 16, 17, 33, 1000, 70000}) {
+    std::set<int> expected;
+    mqs::red_black_tree<int> tree;
+    while(expected.size() < n) {
+      int x = gen() % (4*n + 1);
+      expected.insert(x);
+      tree.insert(x);
+    }
+    const std::vector<int> sorted(expected.begin(), expected.end());
+    for(bool index : {true, false}) {
+      mqs::save(tree, path, index);
+      mqs::mapped_set<int> m(path);
+      ASSERT_TRUE(m.verify());
+      ASSERT_EQ(index && n > 0, m.has_index());
+      ASSERT_EQ(n, m.size());
+      ASSERT_TRUE(std::equal(expected.begin(), expected.end(), m.begin()));
+      for(int x = -1; x <= int(4*n + 1); x += (n > 1000 ? 7 : 1)) {
+        ASSERT_EQ(expected.count(x) == 1, m.find(x));
+        ASSERT_EQ(size_t(std::lower_bound(sorted.begin(), sorted.end(), x) - sorted.begin()), m.lower_bound(x));
+      }
+      size_t visited = m.visit_range(int(n), int(2*n), [&](int x) { ASSERT_TRUE(x >= int(n) && x < int(2*n)); });
+      ASSERT_EQ(m.lower_bound(2*n) - m.lower_bound(n), visited);
+      ASSERT_EQ(visited, m.count_range(n, 2*n));
+    }
+    mqs::order_statistic_tree<int> loaded;
+    loaded.insert(-5);
+    mqs::load(path, loaded);
+    ASSERT_TRUE(loaded.validate());
+    ASSERT_TRUE(std::equal(expected.begin(), expected.end(), loaded.begin()));
+    ASSERT_EQ(n, loaded.size());
+  }
+  // A damaged file fails its checksum and leaves the container alone; a cut short one doesn't even open.
+  {
+    FILE* f = std::fopen(path.c_str(), "r+b");
+    std::fseek(f, 64 + 100, SEEK_SET);
+    std::fputc(0x55, f);
+    std::fclose(f);
+  }
+  ASSERT_FALSE(mqs::mapped_set<int>(path).verify());
+  mqs::red_black_tree<int> kept;
+  kept.insert(1);
+  ASSERT_THROW(mqs::load(path, kept), std::runtime_error);
+  ASSERT_EQ(1, kept.size());
+  // A header whose index doesn't fit its count is rejected on opening, and any other changed header byte fails
+  // the checksum.
+  auto patch_header = [&](long offset, std::uint64_t value) {
+    FILE* f = std::fopen(path.c_str(), "r+b");
+    std::fseek(f, offset, SEEK_SET);
+    std::fwrite(&value, sizeof(value), 1, f);
+    std::fclose(f);
+  };
+  mqs::red_black_tree<int> small;
+  for(int i = 0; i < 1000; i++) {
+    small.insert(2*i);
+  }
+  mqs::save(small, path);
+  patch_header(offsetof(mqs::detail::flat_header, block), 1000000);
+  ASSERT_THROW(mqs::mapped_set<int> wrong_block(path), std::runtime_error);
+  mqs::save(small, path);
+  patch_header(offsetof(mqs::detail::flat_header, levels), 3);
+  ASSERT_THROW(mqs::mapped_set<int> wrong_levels(path), std::runtime_error);
+  mqs::save(small, path);
+  patch_header(offsetof(mqs::detail::flat_header, reserved), 1);
+  ASSERT_FALSE(mqs::mapped_set<int>(path).verify());
+  ASSERT_EQ(0, ::truncate(path.c_str(), 64 + 40));
+  ASSERT_THROW(mqs::mapped_set<int> cut(path), std::runtime_error);
+  std::remove(path.c_str());
+  ASSERT_THROW(mqs::mapped_set<int> missing(path), std::system_error);
+}
+
+TEST(FrozenSetTest, FrozenMatchesSet) {
+  // Sizes around whole leaves of 16 ints and whole layers of 17 nodes, and strings, which don't vectorize.
+  std::mt19937 gen(24);
+  for(size_t n : {0, 1, 15, 16, 17, 271, 272, 273, 4624, 4625, 60000}) {
+    std::set<int> expected;
+    mqs::red_black_tree<int> tree;
+    mqs::red_black_tree<std::string> strings;
+    while(expected.size() < n) {
+      int x = gen() % (3*n + 3);
+      expected.insert(x);
+      tree.insert(x);
+      strings.insert(std::to_string(x));
+    }
+    mqs::frozen_set<int> frozen = mqs::freeze(tree);
+    mqs::frozen_set<std::string> frozen_strings = mqs::freeze(strings.dump());
+    ASSERT_EQ(n, frozen.size());
+    ASSERT_TRUE(std::equal(expected.begin(), expected.end(), frozen.begin()));
+    ASSERT_TRUE(std::equal(strings.begin(), strings.end(), frozen_strings.begin()));
+    const std::vector<int> sorted(expected.begin(), expected.end());
+    std::vector<int> keys;
+    for(int x = -2; x <= int(3*n + 4); x += (n > 5000 ? 3 : 1)) {
+      keys.push_back(x);
+    }
+    std::shuffle(keys.begin(), keys.end(), gen);
+    std::vector<const int*> bounds(keys.size());
+    std::vector<bool> found(keys.size());
+    frozen.lower_bound_batch(keys.begin(), keys.end(), bounds.begin());
+    frozen.find_batch(keys.begin(), keys.end(), found.begin());
+    for(size_t i = 0; i < keys.size(); i++) {
+      int x = keys[i];
+      const int* bound = frozen.lower_bound(x);
+      ASSERT_EQ(std::lower_bound(sorted.begin(), sorted.end(), x) - sorted.begin(), bound - frozen.begin());
+      ASSERT_EQ(bound, bounds[i]);
+      ASSERT_EQ(expected.count(x) == 1, frozen.find(x));
+      ASSERT_EQ(expected.count(x) == 1, found[i]);
+      ASSERT_EQ(strings.find(std::to_string(x)), frozen_strings.find(std::to_string(x)));
+    }
+  }
+}
+
+TEST(SimdTest, SimdCountLessLongArrays) {
+  // Long enough that 16-bit lane counters would wrap if they were never flushed.
+  std::vector<int16_t> zeros(2000000, 0);
+  ASSERT_EQ(zeros.size(), mqs::simd::count_less(zeros.data(), zeros.size(), int16_t(1)));
+  ASSERT_EQ(0u, mqs::simd::count_less(zeros.data(), zeros.size(), int16_t(0)));
+  std::vector<int8_t> bytes(100003, -1);
+  ASSERT_EQ(bytes.size(), mqs::simd::count_less(bytes.data(), bytes.size(), int8_t(0)));
+  ASSERT_EQ(bytes.size(), mqs::simd::count(bytes.data(), bytes.size(), int8_t(-1)));
+}
+
+TEST(BTreeTest, BTreeMatchesSet) {
+  // Small nodes give a tree several levels deep from a few thousand keys, so every split and merge path runs.
+  typedef mqs::b_tree<int, mqs::heap_allocator<int>, 64> small_tree;
+  ASSERT_EQ(9, small_tree::leaf_capacity);
+  ASSERT_EQ(3, small_tree::inner_capacity);
+  small_tree tree;
+  ASSERT_EQ(-1, tree.height());
+  ASSERT_FALSE(tree.find(0));
+  ASSERT_FALSE(tree.remove(0));
+  std::set<int> reference;
+  std::mt19937 gen(7);
+  for(int i = 0; i < 20000; i++) {
+    int x = gen() % 5000;
+    if(gen() % 3 != 0) {
+      ASSERT_EQ(reference.insert(x).second, tree.insert(x));
+    } else {
+      ASSERT_EQ(reference.erase(x) == 1, tree.remove(x));
+    }
+  }
+  ASSERT_EQ(reference.size(), tree.size());
+  ASSERT_TRUE(std::equal(reference.begin(), reference.end(), tree.begin()));
+  ASSERT_TRUE(std::equal(reference.rbegin(), reference.rend(), tree.rbegin()));
+  ASSERT_EQ(reference.size(), std::distance(tree.begin(), tree.end()));
+  for(int x = -1; x <= 5000; x++) {
+    ASSERT_EQ(reference.count(x) == 1, tree.find(x));
+    std::set<int>::iterator lo = reference.lower_bound(x), hi = reference.upper_bound(x);
+    ASSERT_EQ(lo == reference.end(), tree.lower_bound(x) == tree.end());
+    if(lo != reference.end()) {
+      ASSERT_EQ(*lo, *tree.lower_bound(x));
+    }
+    if(hi != reference.end()) {
+      ASSERT_EQ(*hi, *tree.upper_bound(x));
+    }
+  }
+  std::vector<int> visited;
+  ASSERT_EQ(std::distance(reference.lower_bound(100), reference.lower_bound(900)),
+            tree.visit_range(100, 900, [&](int x) { visited.push_back(x); }));
+  ASSERT_TRUE(std::equal(visited.begin(), visited.end(), reference.lower_bound(100)));
+
+  // Every leaf is at the same depth, and the leaves hold the elements in order.
+  std::vector<std::pair<int,int>> dump = tree.dump();
+  ASSERT_EQ(0, dump.front().second);
+  std::vector<int> leaves;
+  for(const std::pair<int,int>& p : dump) {
+    ASSERT_LE(p.second, tree.height());
+    if(p.second == tree.height()) {
+      leaves.push_back(p.first);
+    }
+  }
+  ASSERT_TRUE(std::equal(reference.begin(), reference.end(), leaves.begin()));
+  ASSERT_EQ(reference.size(), leaves.size());
+
+  small_tree copy(tree);
+  ASSERT_TRUE(std::equal(reference.begin(), reference.end(), copy.begin()));
+  for(int x : reference) {
+    ASSERT_TRUE(tree.remove(x));
+  }
+  ASSERT_EQ(0, tree.size());
+  ASSERT_EQ(-1, tree.height());
+  ASSERT_TRUE(tree.begin() == tree.end());
+  tree = copy;
+  ASSERT_EQ(reference.size(), tree.size());
+  ASSERT_EQ(copy.height(), tree.height());
+
+  // Moves and swaps hand over the nodes themselves and leave the source empty.
+  const int* first = &*copy.begin();
+  small_tree moved(std::move(copy));
+  ASSERT_EQ(0, copy.size());
+  ASSERT_TRUE(copy.begin() == copy.end());
+  ASSERT_EQ(first, &*moved.begin());
+  ASSERT_EQ(reference.size(), moved.size());
+  tree = std::move(moved);
+  ASSERT_EQ(0, moved.size());
+  ASSERT_EQ(first, &*tree.begin());
+  tree.swap(moved);
+  ASSERT_EQ(0, tree.size());
+  ASSERT_EQ(first, &*moved.begin());
+  ASSERT_TRUE(tree.insert(1) && moved.find(*reference.begin()));
+
+  // Keys without a vectorized search, which the nodes construct and destroy one at a time.
+  mqs::b_tree<std::string> words;
+  std::set<std::string> word_set;
+  for(int i = 0; i < 3000; i++) {
+    std::string w = std::to_string(gen() % 2000);
+    ASSERT_EQ(word_set.insert(w).second, words.insert(w));
+  }
+  for(int i = 0; i < 1000; i++) {
+    std::string w = std::to_string(gen() % 2000);
+    ASSERT_EQ(word_set.erase(w) == 1, words.remove(w));
+  }
+  ASSERT_TRUE(std::equal(word_set.begin(), word_set.end(), words.begin()));
+  ASSERT_EQ(word_set.size(), words.size());
+}
+
 TEST(RBTRandomTest, RBTRandomSuccess) {
   srand(time(NULL));
   mqs::red_black_tree<int> tree;
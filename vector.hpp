@@ -11,15 +11,112 @@
 #include <cstddef> //for std::size_t
 #include <stdexcept> // for STL exceptions
 #include <initializer_list>
+#include <algorithm> // for std::move_backward
+#include <cstring> // for std::memmove
+#include <functional> // for std::less
+#include <iterator> // for std::reverse_iterator, std::iterator_traits
 #include <limits> // for std::numeric_limits<size_t>
+#include <new> // for placement new and ::operator new
+#include <string> // for std::to_string
+#include <type_traits> // for std::is_trivially_copyable, std::enable_if
+#include <utility> // for std::move, std::forward, std::move_if_noexcept
+#include "allocator.hpp"
+#include "memory.hpp"
+#include "simd.hpp"
 
 namespace mqs
 {
 
-  template <typename T>
-  class Vector
+  /**
+   *  Describes how a Vector resizes its storage. A Vector multiplies its capacity by
+   *  GrowthNumerator/GrowthDenominator whenever it fills up, and, if Shrink is true, halves it once removals bring
+   *  the size down to capacity/ShrinkThreshold. The gap between the two thresholds is the hysteresis: a larger
+   *  ShrinkThreshold means a Vector whose size oscillates has to shed more elements before it reallocates.
+   *  A Vector without storage allocates InitialCapacity slots on its first insertion.
+   */
+  template <size_t GrowthNumerator = 2, size_t GrowthDenominator = 1, bool Shrink = true, size_t ShrinkThreshold = 4,
+            size_t InitialCapacity = 16>
+  struct growth_policy
   {
+    static_assert(GrowthDenominator > 0 && GrowthNumerator > GrowthDenominator, "mqs::growth_policy: growth factor must be greater than 1.");
+    static_assert(ShrinkThreshold > 2, "mqs::growth_policy: halving at or above half full would leave no room to grow.");
+    static_assert(InitialCapacity > 1, "mqs::growth_policy: initial capacity must leave room for a free slot.");
+
+    static constexpr size_t growth_numerator = GrowthNumerator;
+    static constexpr size_t growth_denominator = GrowthDenominator;
+    static constexpr bool shrink = Shrink;
+    static constexpr size_t shrink_threshold = ShrinkThreshold;
+    static constexpr size_t initial_capacity = InitialCapacity;
+  };
+
+  // Doubles when full and halves when a quarter full.
+  typedef growth_policy<> default_growth_policy;
+
+  // Doubles when full and never gives memory back on its own; use shrink_to_fit() to release it.
+  typedef growth_policy<2, 1, false> no_shrink_policy;
+
+  namespace detail
+  {
+    // Room for N elements inside the Vector object itself. The N = 0 specialization is empty, so a plain Vector
+    // pays nothing for it.
+    template <typename T, size_t N>
+    class inline_storage
+    {
+    private:
+      typename std::aligned_storage<sizeof(T), alignof(T)>::type buffer[N];
+
+    protected:
+      T* inline_data()
+      {
+        return reinterpret_cast<T*>(buffer);
+      }
+
+      const T* inline_data() const
+      {
+        return reinterpret_cast<const T*>(buffer);
+      }
+    };
+
+    template <typename T>
+    class inline_storage<T, 0>
+    {
+    protected:
+      T* inline_data() const
+      {
+        return nullptr;
+      }
+    };
+  }
+
+  /**
+   *  A Vector keeps its first InlineCapacity elements in a buffer inside the object and only allocates once it
+   *  grows past them. InlineCapacity is 0 for a plain Vector; see SmallVector.
+   *  Storage comes from Allocator, heap_allocator by default. Like the standard containers, a Vector only takes
+   *  another's allocator on copy assignment, move assignment or swap if the allocator's propagate_on_container_*
+   *  traits say so, and move assignment between Vectors with unequal allocators moves the elements one by one.
+   */
+  template <typename T, typename GrowthPolicy = default_growth_policy, size_t InlineCapacity = 0,
+            typename Allocator = heap_allocator<T>>
+  class Vector : private detail::inline_storage<T, InlineCapacity>, private detail::allocator_holder<Allocator>
+  {
+  public:
+    typedef T value_type;
+    typedef Allocator allocator_type;
+    typedef size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    // Elements are stored contiguously, so plain pointers serve as random-access iterators.
+    typedef T* iterator;
+    typedef const T* const_iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
   private:
+    typedef std::allocator_traits<Allocator> alloc_traits;
+
     T* arr;
     size_t _size;
     size_t _capacity;
@@ -31,88 +128,600 @@ namespace mqs
       }
     }
 
-    void grow_vector() {
-      if(_capacity != std::numeric_limits<size_t>::max() && _size == _capacity) {
-        _capacity = 2*_capacity;
-        _capacity = (_capacity < _size ? std::numeric_limits<size_t>::max() : _capacity);
-        T* new_arr = new T[_capacity];
-        std::copy(arr, arr+_size, new_arr);
-        delete []arr;
-        arr = new_arr;
+    // Raw, uninitialized storage for n elements. Nothing is constructed until an element is added.
+    // Requests that fit in the inline buffer get it, unless it is the buffer being replaced, in which case n is
+    // raised to the inline capacity.
+    T* allocate(size_t& n)
+    {
+      if(n <= InlineCapacity && !is_inline()) {
+        n = InlineCapacity;
+        return this->inline_data();
+      }
+      if(n == 0) {
+        return nullptr;
+      }
+      return alloc_traits::allocate(this->allocator(), n);
+    }
+
+    // Frees p, which holds storage for n elements.
+    void deallocate(T* p, size_t n)
+    {
+      if(p && p != this->inline_data()) {
+        alloc_traits::deallocate(this->allocator(), p, n);
+      }
+    }
+
+    // True if the buffer can be resized to new_capacity in place with the allocator's reallocate(). That needs an
+    // allocator that has one, elements that can be moved as bytes, and an allocated buffer on both sides.
+    bool can_reallocate_to(size_t new_capacity) const
+    {
+      return detail::has_reallocate<Allocator>::value && is_trivially_relocatable<T>::value && arr && !is_inline() &&
+             new_capacity > InlineCapacity;
+    }
+
+    bool is_inline() const
+    {
+      return InlineCapacity != 0 && arr == this->inline_data();
+    }
+
+    // Points the Vector back at its inline buffer, which is empty storage when there isn't one.
+    void reset_storage()
+    {
+      arr = this->inline_data();
+      _size = 0;
+      _capacity = InlineCapacity;
+    }
+
+    // Frees everything this Vector holds and takes v's elements and allocator. Used where v's allocator is known
+    // to be the right one to keep, whatever the propagation traits say.
+    void move_from(Vector& v)
+    {
+      destroy(arr, arr+_size);
+      deallocate(arr, _capacity);
+      reset_storage();
+      this->allocator() = std::move(v.allocator());
+      take(v);
+    }
+
+    // Takes v's elements, stealing its heap buffer or moving them one by one out of its inline buffer. This Vector
+    // must hold no elements or storage of its own.
+    void take(Vector& v)
+    {
+      if(v.is_inline()) {
+        arr = this->inline_data();
+        _capacity = InlineCapacity;
+        relocate(v.arr, v._size, arr);
+        _size = v._size;
+      } else {
+        arr = v.arr;
+        _size = v._size;
+        _capacity = v._capacity;
       }
+      v.reset_storage();
     }
 
+    static void destroy(T* first, T* last)
+    {
+      for(; first != last; ++first) {
+        first->~T();
+      }
+    }
+
+    // Moves (or copies, if T's move constructor may throw) n elements from src into the uninitialized
+    // storage at dest, leaving the originals alive. If a copy throws, everything built so far is destroyed.
+    static void move_construct(T* src, size_t n, T* dest)
+    {
+      size_t i = 0;
+      try {
+        for(; i < n; i++) {
+          ::new(static_cast<void*>(dest+i)) T(std::move_if_noexcept(src[i]));
+        }
+      } catch(...) {
+        destroy(dest, dest+i);
+        throw;
+      }
+    }
+
+    // Moves n elements from src into the uninitialized storage at dest and destroys the originals.
+    // If a copy throws, src is left untouched. Trivially relocatable elements are copied as bytes.
+    static void relocate(T* src, size_t n, T* dest)
+    {
+      if(is_trivially_relocatable<T>::value) {
+        if(n != 0) {
+          std::memcpy(static_cast<void*>(dest), static_cast<const void*>(src), n*sizeof(T));
+        }
+        return;
+      }
+      move_construct(src, n, dest);
+      destroy(src, src+n);
+    }
+
+    // Moves the n live elements at src down to dest, which lies before src. Trivially copyable elements are
+    // moved with a single memmove.
+    static void shift_down(T* src, size_t n, T* dest)
+    {
+      if(std::is_trivially_copyable<T>::value) {
+        if(n != 0) {
+          std::memmove(static_cast<void*>(dest), static_cast<const void*>(src), n*sizeof(T));
+        }
+      } else {
+        for(size_t i = 0; i < n; i++) {
+          dest[i] = std::move(src[i]);
+        }
+      }
+    }
+
+    // Moves the n live elements at src up by k slots, where everything past src+n is uninitialized. Afterwards
+    // [src, src+min(k, n)) holds moved-from elements and the rest of [src, src+k) is uninitialized.
+    static void shift_up(T* src, size_t n, size_t k)
+    {
+      if(std::is_trivially_copyable<T>::value) {
+        if(n != 0) {
+          std::memmove(static_cast<void*>(src+k), static_cast<const void*>(src), n*sizeof(T));
+        }
+      } else if(k < n) {
+        for(size_t i = 0; i < k; i++) {
+          ::new(static_cast<void*>(src+n+i)) T(std::move(src[n-k+i]));
+        }
+        std::move_backward(src, src+n-k, src+n);
+      } else {
+        for(size_t i = 0; i < n; i++) {
+          ::new(static_cast<void*>(src+k+i)) T(std::move(src[i]));
+        }
+      }
+    }
+
+    // Element scans: arithmetic types go through the vectorized kernels in simd.hpp, everything else loops.
+    size_t find_index(const T& t, std::true_type) const
+    {
+      return simd::find(arr, _size, t);
+    }
+
+    size_t find_index(const T& t, std::false_type) const
+    {
+      for(size_t i = 0; i < _size; i++) {
+        if(arr[i] == t) {
+          return i;
+        }
+      }
+      return _size;
+    }
+
+    size_t count_of(const T& t, std::true_type) const
+    {
+      return simd::count(arr, _size, t);
+    }
+
+    size_t count_of(const T& t, std::false_type) const
+    {
+      size_t found = 0;
+      for(size_t i = 0; i < _size; i++) {
+        if(arr[i] == t) {
+          found++;
+        }
+      }
+      return found;
+    }
+
+    T min_of(std::true_type) const
+    {
+      return simd::min(arr, _size);
+    }
+
+    T min_of(std::false_type) const
+    {
+      const T* best = arr;
+      for(size_t i = 1; i < _size; i++) {
+        if(arr[i] < *best) {
+          best = arr+i;
+        }
+      }
+      return *best;
+    }
+
+    T max_of(std::true_type) const
+    {
+      return simd::max(arr, _size);
+    }
+
+    T max_of(std::false_type) const
+    {
+      const T* best = arr;
+      for(size_t i = 1; i < _size; i++) {
+        if(*best < arr[i]) {
+          best = arr+i;
+        }
+      }
+      return *best;
+    }
+
+    T sum_of(std::true_type) const
+    {
+      return simd::sum(arr, _size);
+    }
+
+    T sum_of(std::false_type) const
+    {
+      T total = T();
+      for(size_t i = 0; i < _size; i++) {
+        total += arr[i];
+      }
+      return total;
+    }
+
+    // True if p points at one of this Vector's elements.
+    bool owns(const T* p) const
+    {
+      std::less<const T*> before;
+      return !before(p, arr) && before(p, arr+_size);
+    }
+
+    template <typename It>
+    typename std::enable_if<!std::is_convertible<It, const T*>::value, bool>::type owns(const It&) const
+    {
+      return false;
+    }
+
+    // Returns 2n, or the largest capacity a Vector can hold if 2n would overflow it.
+    static size_t doubled(size_t n)
+    {
+      return (n > max_size()/2 ? max_size() : 2*n);
+    }
+
+    // Returns n scaled by the policy's growth factor, or the largest capacity a Vector can hold if that would overflow.
+    static size_t scaled(size_t n)
+    {
+      if(n > max_size()/GrowthPolicy::growth_numerator) {
+        return max_size();
+      }
+      return n*GrowthPolicy::growth_numerator/GrowthPolicy::growth_denominator;
+    }
+
+    void reallocate(size_t new_capacity)
+    {
+      if(is_inline() && new_capacity <= InlineCapacity) {
+        return; // Already as small as it gets.
+      }
+      if(can_reallocate_to(new_capacity)) {
+        arr = detail::reallocate(this->allocator(), arr, _capacity, new_capacity, detail::has_reallocate<Allocator>());
+        _capacity = new_capacity;
+        return;
+      }
+      T* new_arr = allocate(new_capacity);
+      try {
+        relocate(arr, _size, new_arr);
+      } catch(...) {
+        deallocate(new_arr, new_capacity);
+        throw;
+      }
+      deallocate(arr, _capacity);
+      arr = new_arr;
+      _capacity = new_capacity;
+    }
+
+    // True if n elements fit without reallocating. A heap buffer always keeps at least one free slot after an
+    // insertion, so it grows as soon as adding one more element would fill it; the inline buffer can be filled.
+    bool fits(size_t n) const
+    {
+      return n + (is_inline() ? 0 : 1) <= _capacity;
+    }
+
+    bool needs_growth() const
+    {
+      return !fits(_size + 1);
+    }
+
+    // The capacity to grow to so that n more elements fit, leaving the free slot.
+    size_t grown_capacity(const char* caller, size_t n = 1) const
+    {
+      if(n >= max_size() - _size - 1) {
+        throw std::length_error(std::string("mqs::Vector::") + caller + ": Vector exceeded max capacity.");
+      }
+      size_t new_capacity = (_capacity == 0 ? GrowthPolicy::initial_capacity : scaled(_capacity));
+      return (new_capacity < _size + n + 1 ? _size + n + 1 : new_capacity);
+    }
+
+    void grow_vector(const char* caller)
+    {
+      if(needs_growth()) {
+        reallocate(grown_capacity(caller));
+      }
+    }
+
+    // Halves the capacity until it is above the shrink threshold again, reallocating at most once no matter how
+    // many elements were just removed. It never goes below the initial capacity, or the inline capacity if that is
+    // larger, so a Vector that is filled and emptied over and over keeps its buffer instead of freeing it and
+    // growing it back each time.
     void shrink_vector()
     {
-      if(_size <= _capacity/4) {
-        _capacity /= 2;
-        T* new_arr = new T[_capacity];
-        for(size_t i = 0; i < _size; i++) {
-          new_arr[i] = arr[i];
+      if(!GrowthPolicy::shrink) {
+        return;
+      }
+      const size_t floor = (InlineCapacity > GrowthPolicy::initial_capacity ? InlineCapacity
+                                                                            : GrowthPolicy::initial_capacity);
+      size_t new_capacity = _capacity;
+      while(new_capacity/2 >= floor && _size <= new_capacity/GrowthPolicy::shrink_threshold) {
+        new_capacity /= 2;
+      }
+      if(new_capacity != _capacity) {
+        reallocate(new_capacity);
+      }
+    }
+
+    // Removes the elements in [first, last) by shifting the tail down once.
+    void erase_indices(size_t first, size_t last)
+    {
+      if(first == last) {
+        return;
+      }
+      shift_down(arr+last, _size-last, arr+first);
+      destroy(arr+_size-(last-first), arr+_size);
+      _size -= (last-first);
+      shrink_vector();
+    }
+
+    // Inserts the n elements starting at first before index i by building a new buffer of new_capacity around them.
+    template <typename ForwardIt>
+    void insert_into_new_buffer(const size_t i, ForwardIt first, const size_t n, size_t new_capacity)
+    {
+      T* new_arr = allocate(new_capacity);
+      // Copy the new elements first, since the range may come from the old buffer.
+      size_t built = 0;
+      try {
+        for(; built < n; ++built, ++first) {
+          ::new(static_cast<void*>(new_arr+i+built)) T(*first);
         }
-        delete[] arr;
-        arr = new_arr;
+        move_construct(arr, i, new_arr);
+      } catch(...) {
+        destroy(new_arr+i, new_arr+i+built);
+        deallocate(new_arr, new_capacity);
+        throw;
+      }
+      try {
+        move_construct(arr+i, _size-i, new_arr+i+n);
+      } catch(...) {
+        destroy(new_arr, new_arr+i+n);
+        deallocate(new_arr, new_capacity);
+        throw;
+      }
+      destroy(arr, arr+_size);
+      deallocate(arr, _capacity);
+      arr = new_arr;
+      _capacity = new_capacity;
+      _size += n;
+    }
+
+    // Inserts the n elements starting at first before index i, moving the tail and reallocating at most once.
+    template <typename ForwardIt>
+    void insert_n(const size_t i, ForwardIt first, const size_t n)
+    {
+      if(n == 0) {
+        return;
+      }
+      if(!fits(_size + n)) {
+        size_t new_capacity = grown_capacity("insert()", n);
+        if(can_reallocate_to(new_capacity) && !owns(first)) {
+          reallocate(new_capacity); // Resize in place, then insert below.
+        } else {
+          insert_into_new_buffer(i, first, n, new_capacity);
+          return;
+        }
+      }
+      if(owns(first)) {
+        // The range is about to be shifted out from under us, so take a copy of it first.
+        Vector copy;
+        copy.reserve(n);
+        for(size_t j = 0; j < n; ++j, ++first) {
+          copy.emplace_back(*first);
+        }
+        insert_n(i, std::make_move_iterator(copy.begin()), n);
+        return;
+      }
+      const size_t tail = _size - i;
+      shift_up(arr+i, tail, n);
+      // The first min(n, tail) slots of the gap hold moved-from elements, the rest are uninitialized.
+      size_t j = 0;
+      for(; j < n && (j < tail || std::is_trivially_copyable<T>::value); ++j, ++first) {
+        arr[i+j] = *first;
+      }
+      for(; j < n; ++j, ++first) {
+        ::new(static_cast<void*>(arr+i+j)) T(*first);
+      }
+      _size += n;
+    }
+
+    template <typename InputIt>
+    void insert_range(const size_t i, InputIt first, InputIt last, std::input_iterator_tag)
+    {
+      // Single-pass iterators can't be counted up front, so buffer them first.
+      Vector buffer;
+      for(; first != last; ++first) {
+        buffer.emplace_back(*first);
+      }
+      insert_n(i, std::make_move_iterator(buffer.begin()), buffer.size());
+    }
+
+    template <typename ForwardIt>
+    void insert_range(const size_t i, ForwardIt first, ForwardIt last, std::forward_iterator_tag)
+    {
+      insert_n(i, first, static_cast<size_t>(std::distance(first, last)));
+    }
+
+    void length_check(size_t n, const char* caller) const
+    {
+      if(n >= max_size()) {
+        throw std::length_error(std::string("mqs::Vector::") + caller + ": Vector exceeded max capacity.");
       }
     }
 
   public:
     /**
-     * Default constructor. Creates an empty vector with max size of 1
+     * Default constructor. Creates an empty vector without allocating; storage for the growth policy's initial
+     * capacity (16 by default) is allocated by the first insertion.
      */
-    explicit Vector() {arr = new T[16]; _size = 0; _capacity = 16;}
+    explicit Vector(const Allocator& alloc = Allocator()) : detail::allocator_holder<Allocator>(alloc),
+      arr(this->inline_data()), _size(0), _capacity(InlineCapacity) {}
 
     /**
-     * Creates a vector of size n and max size of 2n or maximum value for size_t if 2n overflows.
+     * Creates a vector of n value-initialized elements and max size of 2n or maximum value for size_t if 2n overflows.
      */
-    explicit Vector(const size_t n)
+    explicit Vector(const size_t n, const Allocator& alloc = Allocator()) : detail::allocator_holder<Allocator>(alloc),
+      arr(nullptr), _size(0), _capacity(doubled(n))
     {
-      _size = n;
-      _capacity = 2*_size;
-      arr = new T[_capacity];
-      _capacity = (_capacity <= _size ? std::numeric_limits<size_t>::max() : _capacity);
+      arr = allocate(_capacity);
+      try {
+        for(; _size < n; _size++) {
+          ::new(static_cast<void*>(arr+_size)) T();
+        }
+      } catch(...) {
+        destroy(arr, arr+_size);
+        deallocate(arr, _capacity);
+        throw;
+      }
     }
 
     /**
      *  Creates a vector of size n, each element is initialized to value t.
      */
-    explicit Vector(const size_t n, const T& t)
+    explicit Vector(const size_t n, const T& t, const Allocator& alloc = Allocator()) :
+      detail::allocator_holder<Allocator>(alloc), arr(nullptr), _size(0), _capacity(doubled(n))
     {
-      _size = n;
-      _capacity = 2*_size;
-      arr = new T[_capacity];
-      _capacity = (_capacity <= _size ? std::numeric_limits<size_t>::max() : _capacity);
-      for(size_t i = 0; i < _size; i++) {
-        arr[i] = t;
+      arr = allocate(_capacity);
+      try {
+        for(; _size < n; _size++) {
+          ::new(static_cast<void*>(arr+_size)) T(t);
+        }
+      } catch(...) {
+        destroy(arr, arr+_size);
+        deallocate(arr, _capacity);
+        throw;
       }
     }
 
     /**
-     * Copy constructor. Creates a duplicate of the input Vector v.
+     * Copy constructor. Creates a duplicate of the input Vector v, with the allocator
+     * select_on_container_copy_construction() gives for v's.
     */
-    Vector(const Vector& v)
+    Vector(const Vector& v) : Vector(v, alloc_traits::select_on_container_copy_construction(v.allocator())) {}
+
+    /**
+     * Creates a duplicate of the input Vector v that allocates from alloc.
+    */
+    Vector(const Vector& v, const Allocator& alloc) : detail::inline_storage<T, InlineCapacity>(),
+      detail::allocator_holder<Allocator>(alloc), arr(nullptr), _size(0), _capacity(v._capacity)
     {
-      _size = v.size();
-      _capacity = v.capacity();
-      arr = new T[_capacity];
-      for(size_t i = 0; i < _size; i++) {
-        arr[i] = v.arr[i];
+      arr = allocate(_capacity);
+      try {
+        for(; _size < v._size; _size++) {
+          ::new(static_cast<void*>(arr+_size)) T(v.arr[_size]);
+        }
+      } catch(...) {
+        destroy(arr, arr+_size);
+        deallocate(arr, _capacity);
+        throw;
       }
     }
 
+    /**
+     * Move constructor. Takes ownership of v's elements without copying them, leaving v empty. Elements held in an
+     * inline buffer are moved one by one.
+     */
+    Vector(Vector&& v) noexcept(InlineCapacity == 0 || std::is_nothrow_move_constructible<T>::value) :
+      detail::allocator_holder<Allocator>(std::move(v.allocator()))
+    {
+      take(v);
+    }
+
     /**
      *  Initializer list constructor. Creates a vector with the values of initializer list l.
      */
-    Vector(const std::initializer_list<T>& l)
+    Vector(const std::initializer_list<T>& l, const Allocator& alloc = Allocator()) :
+      detail::allocator_holder<Allocator>(alloc), arr(nullptr), _size(0), _capacity(doubled(l.size()))
     {
-      _size = l.size();
-      _capacity = 2*_size;
-      arr = new T[_capacity];
-      _capacity = (_capacity <= _size ? std::numeric_limits<size_t>::max() : _capacity);
-      for(auto it = l.begin(); it < l.end(); it++) {
-        arr[(it-l.begin())] = *it;
+      arr = allocate(_capacity);
+      try {
+        for(auto it = l.begin(); it < l.end(); it++, _size++) {
+          ::new(static_cast<void*>(arr+_size)) T(*it);
+        }
+      } catch(...) {
+        destroy(arr, arr+_size);
+        deallocate(arr, _capacity);
+        throw;
       }
     }
 
+    /**
+     * Copy assignment. Replaces the contents of this Vector with a copy of v. If copying throws, this
+     * Vector is left unchanged.
+     */
+    Vector& operator=(const Vector& v)
+    {
+      if(this != &v) {
+        Vector copy(v, alloc_traits::propagate_on_container_copy_assignment::value ? v.allocator() : this->allocator());
+        swap(copy);
+      }
+      return *this;
+    }
+
+    /**
+     * Move assignment. Takes ownership of v's elements, leaving v empty. If the allocators differ and v's doesn't
+     * propagate, v's buffer can't be freed through this Vector's allocator, so the elements are moved one by one.
+     */
+    Vector& operator=(Vector&& v) noexcept((InlineCapacity == 0 || std::is_nothrow_move_constructible<T>::value) &&
+                                           (alloc_traits::propagate_on_container_move_assignment::value ||
+                                            std::is_empty<Allocator>::value))
+    {
+      if(this == &v) {
+        return *this;
+      }
+      if(alloc_traits::propagate_on_container_move_assignment::value || this->allocator() == v.allocator()) {
+        destroy(arr, arr+_size);
+        deallocate(arr, _capacity);
+        reset_storage();
+        if(alloc_traits::propagate_on_container_move_assignment::value) {
+          this->allocator() = std::move(v.allocator());
+        }
+        take(v);
+        return *this;
+      }
+      clear();
+      if(!fits(v._size)) {
+        reallocate(v._size + 1);
+      }
+      move_construct(v.arr, v._size, arr);
+      _size = v._size;
+      v.clear();
+      return *this;
+    }
+
+    /**
+     * Exchanges the contents and allocators of this Vector and v. Heap buffers are swapped without copying or moving
+     * any elements; elements held in an inline buffer are moved. As with the standard containers, the allocators
+     * must compare equal unless they propagate on swap.
+     */
+    void swap(Vector& v) noexcept(InlineCapacity == 0 || std::is_nothrow_move_constructible<T>::value)
+    {
+      if(is_inline() || v.is_inline()) {
+        Vector tmp(std::move(v));
+        v.move_from(*this);
+        move_from(tmp);
+        return;
+      }
+      using std::swap;
+      swap(this->allocator(), v.allocator());
+      swap(arr, v.arr);
+      swap(_size, v._size);
+      swap(_capacity, v._capacity);
+    }
+
+    /**
+     *  @return a copy of the allocator the Vector was constructed with.
+     */
+    Allocator get_allocator() const
+    {
+      return this->allocator();
+    }
+
     /**
      *  Returns the number of elements in the vector.
      *  @return the number of elements in the Vector.
@@ -131,6 +740,92 @@ namespace mqs
       return _capacity;
     }
 
+    /**
+     *  Returns the largest number of elements a Vector can hold.
+     *  @return the largest number of elements a Vector can hold.
+     */
+    static constexpr size_t max_size()
+    {
+      return std::numeric_limits<size_t>::max()/sizeof(T);
+    }
+
+    /**
+     *  Makes sure n elements fit in the Vector without it reallocating. Since a Vector keeps a free slot after its
+     *  last element, this allocates room for n+1 elements if the current capacity isn't already larger than n.
+     *  @param the number of elements the Vector should be able to hold without reallocating.
+     */
+    void reserve(const size_t n)
+    {
+      length_check(n, "reserve()");
+      if(!fits(n)) {
+        reallocate(n+1);
+      }
+    }
+
+    /**
+     *  Changes the number of elements to n. New elements are value-initialized, and surplus elements are destroyed
+     *  without giving up capacity.
+     *  @param the new number of elements.
+     */
+    void resize(const size_t n)
+    {
+      if(n < _size) {
+        destroy(arr+n, arr+_size);
+        _size = n;
+        return;
+      }
+      reserve(n);
+      for(; _size < n; _size++) {
+        ::new(static_cast<void*>(arr+_size)) T();
+      }
+    }
+
+    /**
+     *  Changes the number of elements to n. New elements are copies of t, and surplus elements are destroyed
+     *  without giving up capacity.
+     *  @param the new number of elements, and the value to fill new elements with.
+     */
+    void resize(const size_t n, const T& t)
+    {
+      if(n < _size) {
+        destroy(arr+n, arr+_size);
+        _size = n;
+        return;
+      }
+      if(!fits(n)) {
+        // Copy t first, since it may refer to an element that the reallocation is about to move.
+        T fill(t);
+        reserve(n);
+        for(; _size < n; _size++) {
+          ::new(static_cast<void*>(arr+_size)) T(fill);
+        }
+        return;
+      }
+      for(; _size < n; _size++) {
+        ::new(static_cast<void*>(arr+_size)) T(t);
+      }
+    }
+
+    /**
+     *  Releases unused capacity so that capacity() == size(), or moves the elements back into the inline buffer if
+     *  they fit there.
+     */
+    void shrink_to_fit()
+    {
+      if(_capacity != _size) {
+        reallocate(_size);
+      }
+    }
+
+    /**
+     *  Destroys every element. The capacity is kept so the Vector can be refilled without reallocating.
+     */
+    void clear()
+    {
+      destroy(arr, arr+_size);
+      _size = 0;
+    }
+
     /**
      *  Returns true if the Vector is empty, false otherwise.
      *  @return true if the Vector is empty, false otherwise.
@@ -141,39 +836,175 @@ namespace mqs
     }
 
     /**
-     * Returns the element at index i, even if it is out of bounds of the Vector.
+     * Returns a reference to the element at index i, without checking that it is in bounds of the Vector.
      * @param the index of the wanted element
      * @return the element at that index
      */
-    T operator[](const size_t i) const
+    T& operator[](const size_t i)
     {
       return arr[i];
     }
 
+    const T& operator[](const size_t i) const
+    {
+      return arr[i];
+    }
 
     /**
-     *  Attempts to return the element at the given index. Throws an out_of_range exception if the index is greater
-     *  than or equal to the number of elements in the array.
+     *  Attempts to return a reference to the element at the given index. Throws an out_of_range exception if the index
+     *  is greater than or equal to the number of elements in the array.
      *  @param the index of the wanted element
      *  @return the element held at index i in the Vector.
      */
-    T at(const size_t i) const
+    T& at(const size_t i)
+    {
+      range_check(i);
+      return arr[i];
+    }
+
+    const T& at(const size_t i) const
     {
       range_check(i);
       return arr[i];
     }
 
+    /**
+     *  Returns a reference to the first element. The Vector must not be empty.
+     *  @return the first element in the Vector.
+     */
+    T& front()
+    {
+      return arr[0];
+    }
+
+    const T& front() const
+    {
+      return arr[0];
+    }
+
+    /**
+     *  Returns a reference to the last element. The Vector must not be empty.
+     *  @return the last element in the Vector.
+     */
+    T& back()
+    {
+      return arr[_size-1];
+    }
+
+    const T& back() const
+    {
+      return arr[_size-1];
+    }
+
+    /**
+     *  Returns a pointer to the underlying array. The elements occupy [data(), data()+size()) and the pointer
+     *  stays valid until the Vector reallocates.
+     *  @return a pointer to the first element, or nullptr if no storage has been allocated.
+     */
+    T* data()
+    {
+      return arr;
+    }
+
+    const T* data() const
+    {
+      return arr;
+    }
+
+    iterator begin() { return arr; }
+    const_iterator begin() const { return arr; }
+    const_iterator cbegin() const { return arr; }
+    iterator end() { return arr+_size; }
+    const_iterator end() const { return arr+_size; }
+    const_iterator cend() const { return arr+_size; }
+    reverse_iterator rbegin() { return reverse_iterator(end()); }
+    const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+    reverse_iterator rend() { return reverse_iterator(begin()); }
+    const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+    /**
+     *  Constructs an element in place at the end of the array from args, increasing its size by 1.
+     *  The arguments may refer to elements of this Vector.
+     *  @param the arguments forwarded to T's constructor
+     *  @return a reference to the new element
+     */
+    template <typename... Args>
+    T& emplace_back(Args&&... args)
+    {
+      if(needs_growth()) {
+        size_t new_capacity = grown_capacity("emplace_back()");
+        if(can_reallocate_to(new_capacity)) {
+          // args may point into the buffer that is about to move, so build the element before resizing it.
+          T t(std::forward<Args>(args)...);
+          reallocate(new_capacity);
+          ::new(static_cast<void*>(arr+_size)) T(std::move(t));
+          return arr[_size++];
+        }
+        // Build the new element in the new buffer before relocating, since args may point into the old one.
+        T* new_arr = allocate(new_capacity);
+        try {
+          ::new(static_cast<void*>(new_arr+_size)) T(std::forward<Args>(args)...);
+        } catch(...) {
+          deallocate(new_arr, new_capacity);
+          throw;
+        }
+        try {
+          relocate(arr, _size, new_arr);
+        } catch(...) {
+          new_arr[_size].~T();
+          deallocate(new_arr, new_capacity);
+          throw;
+        }
+        deallocate(arr, _capacity);
+        arr = new_arr;
+        _capacity = new_capacity;
+      } else {
+        ::new(static_cast<void*>(arr+_size)) T(std::forward<Args>(args)...);
+      }
+      return arr[_size++];
+    }
+
     /**
      *  Adds an element on to the end of the array, increasing its size by 1.
      *  @param the element to be inserted
      */
     void push_back(const T& t)
     {
-      if(_size == 0 && _capacity == std::numeric_limits<size_t>::max()) {
-        throw std::length_error("mqs::Vector::push_back(): Vector exceeded max capacity.");
+      emplace_back(t);
+    }
+
+    /**
+     *  Moves an element on to the end of the array, increasing its size by 1.
+     *  @param the element to be inserted
+     */
+    void push_back(T&& t)
+    {
+      emplace_back(std::move(t));
+    }
+
+    /**
+     * Constructs an element in place at the given index, shifting elements forward, and increasing the
+     * size of the vector by 1. Throws an out_of_range exception if the index is greater than the size of the vector.
+     * @param the desired index and the arguments forwarded to T's constructor.
+     * @return a reference to the new element
+     */
+    template <typename... Args>
+    T& emplace(const size_t i, Args&&... args)
+    {
+      if(i == _size) {
+        return emplace_back(std::forward<Args>(args)...);
       }
-      arr[_size++] = t;
-      grow_vector();
+      range_check(i);
+      // Build the element first, since args may refer to an element that is about to be shifted.
+      T t(std::forward<Args>(args)...);
+      grow_vector("emplace()");
+      ::new(static_cast<void*>(arr+_size)) T(std::move(arr[_size-1]));
+      for(size_t j = _size-1; j > i; j--) {
+        arr[j] = std::move(arr[j-1]);
+      }
+      arr[i] = std::move(t);
+      _size++;
+      return arr[i];
     }
 
     /**
@@ -183,18 +1014,17 @@ namespace mqs
      */
     void insert(const size_t i, const T& t)
     {
-      if(i == _size) {
-        push_back(t);
-      } else if(_size == 0 && _capacity == std::numeric_limits<size_t>::max()) {
-        throw std::length_error("mqs::Vector::insert(): Vector exceeded max capacity.");
-      } else {
-        for(size_t j = _size-1; j >= i; j--) {
-          arr[j+1] = arr[j];
-        }
-        arr[i] = t;
-        _size++;
-        grow_vector();
-      }
+      emplace(i, t);
+    }
+
+    /**
+     * Moves an element in at the given index, shifting elements forward, and increasing the
+     * size of the vector by 1.
+     * @param the desired index and the element to be inserted there.
+     */
+    void insert(const size_t i, T&& t)
+    {
+      emplace(i, std::move(t));
     }
 
     /**
@@ -207,6 +1037,16 @@ namespace mqs
       insert(0, t);
     }
 
+    /**
+     * Moves an element in at the beginning of the Vector, shifting already existing elements
+     * forward.
+     * @param the element to be inserted.
+     */
+    void prepend(T&& t)
+    {
+      insert(0, std::move(t));
+    }
+
     /**
      * Removes the last element in the array and returns it.
      * @return the last element in the array
@@ -216,7 +1056,8 @@ namespace mqs
       if(_size == 0) {
         throw std::out_of_range("mqs::Vector::pop(): Can't pop() on an empty Vector.");
       }
-      T top = arr[--_size];
+      T top(std::move(arr[_size-1]));
+      arr[--_size].~T();
       shrink_vector();
       return top;
     }
@@ -228,14 +1069,62 @@ namespace mqs
      * @param the element to be found.
      * @return the index of the found element, or the size of the array if it wasn't found.
      */
-    size_t find(const T& t)
+    size_t find(const T& t) const
     {
-      for(size_t i = 0; i < _size; i++) {
-        if(arr[i] == t) {
-          return i;
-        }
+      return find_index(t, simd::is_vectorizable<T>());
+    }
+
+    /**
+     * Counts the elements equal to t.
+     * @param the element to be counted.
+     * @return the number of elements equal to t.
+     */
+    size_t count(const T& t) const
+    {
+      return count_of(t, simd::is_vectorizable<T>());
+    }
+
+    /**
+     * Returns true if an element equal to t is in the Vector, false otherwise.
+     * @param the element to be found.
+     * @return true if t is in the Vector, false otherwise.
+     */
+    bool contains(const T& t) const
+    {
+      return find(t) != _size;
+    }
+
+    /**
+     * Returns the smallest element, as ordered by operator<. Throws an out_of_range exception if the Vector is empty.
+     * @return a copy of the first smallest element.
+     */
+    T min() const
+    {
+      if(_size == 0) {
+        throw std::out_of_range("mqs::Vector::min(): Can't min() on an empty Vector.");
       }
-      return _size;
+      return min_of(simd::is_vectorizable<T>());
+    }
+
+    /**
+     * Returns the largest element, as ordered by operator<. Throws an out_of_range exception if the Vector is empty.
+     * @return a copy of the first largest element.
+     */
+    T max() const
+    {
+      if(_size == 0) {
+        throw std::out_of_range("mqs::Vector::max(): Can't max() on an empty Vector.");
+      }
+      return max_of(simd::is_vectorizable<T>());
+    }
+
+    /**
+     * Adds up the elements, starting from T(). Integer sums wrap around instead of overflowing.
+     * @return the sum of the elements, or T() if the Vector is empty.
+     */
+    T sum() const
+    {
+      return sum_of(simd::is_vectorizable<T>());
     }
 
     /**
@@ -246,15 +1135,7 @@ namespace mqs
     void remove(const size_t i)
     {
       range_check(i);
-      if(i == _size-1) {
-        pop();
-      } else {
-        _size--;
-        for(size_t j = i; j < _size; j++) {
-          arr[j] = arr[j+1];
-        }
-      }
-      shrink_vector();
+      erase_indices(i, i+1);
     }
 
     /**
@@ -264,24 +1145,115 @@ namespace mqs
      */
     size_t remove(const T& t)
     {
-      size_t found = 0;
-      for(size_t i = 0; i < _size; i++) {
-        if(arr[i] == t) {
-          remove(i);
-          found++;
-          i--;
+      if(owns(&t)) {
+        // Compacting would overwrite t, so compare against a copy.
+        T value(t);
+        return erase_if([&value](const T& x) { return x == value; });
+      }
+      return erase_if([&t](const T& x) { return x == t; });
+    }
+
+    /**
+     * Removes every element for which pred returns true, in a single pass that keeps the order of the remaining
+     * elements. The buffer is shrunk at most once afterwards.
+     * @param a predicate taking a const T&.
+     * @return the number of elements removed from the Vector.
+     */
+    template <typename Predicate>
+    size_t erase_if(Predicate pred)
+    {
+      size_t kept = 0;
+      while(kept < _size && !pred(arr[kept])) {
+        kept++;
+      }
+      for(size_t i = kept+1; i < _size; i++) {
+        if(!pred(arr[i])) {
+          arr[kept++] = std::move(arr[i]);
         }
       }
-      return found;
+      if(kept >= _size) {
+        return 0;
+      }
+      size_t removed = _size - kept;
+      destroy(arr+kept, arr+_size);
+      _size = kept;
+      shrink_vector();
+      return removed;
+    }
+
+    /**
+     * Removes the elements in [first, last), shifting the elements after them back once.
+     * @param the range of elements to remove.
+     * @return an iterator to the element that followed the removed range.
+     */
+    iterator erase(const_iterator first, const_iterator last)
+    {
+      const size_t i = static_cast<size_t>(first - arr);
+      erase_indices(i, static_cast<size_t>(last - arr));
+      return arr+i;
+    }
+
+    /**
+     * Removes the element at pos, shifting the elements after it back once.
+     * @param an iterator to the element to remove.
+     * @return an iterator to the element that followed it.
+     */
+    iterator erase(const_iterator pos)
+    {
+      return erase(pos, pos+1);
+    }
+
+    /**
+     * Inserts copies of the elements in [first, last) before index i, shifting the existing elements forward once.
+     * Throws an out_of_range exception if the index is greater than the size of the vector.
+     * @param the desired index and the range of elements to insert there.
+     */
+    template <typename InputIt, typename = typename std::enable_if<!std::is_integral<InputIt>::value>::type>
+    void insert(const size_t i, InputIt first, InputIt last)
+    {
+      if(i != _size) {
+        range_check(i);
+      }
+      insert_range(i, first, last, typename std::iterator_traits<InputIt>::iterator_category());
+    }
+
+    void insert(const size_t i, std::initializer_list<T> l)
+    {
+      insert(i, l.begin(), l.end());
+    }
+
+    /**
+     * Adds copies of the elements in [first, last) on to the end of the array, reallocating at most once.
+     * @param the range of elements to add.
+     */
+    template <typename InputIt, typename = typename std::enable_if<!std::is_integral<InputIt>::value>::type>
+    void append(InputIt first, InputIt last)
+    {
+      insert_range(_size, first, last, typename std::iterator_traits<InputIt>::iterator_category());
+    }
+
+    void append(std::initializer_list<T> l)
+    {
+      append(l.begin(), l.end());
     }
 
     ~Vector()
     {
-      delete []arr;
+      destroy(arr, arr+_size);
+      deallocate(arr, _capacity);
     }
 
   };
 
+  /**
+   *  A Vector that keeps up to N elements inside the object and only allocates once it grows past them, for the
+   *  many vectors that stay small. It has the same interface as Vector. Moving or swapping one whose elements are
+   *  inline moves the elements instead of a pointer.
+   */
+  template <typename T, size_t N, typename GrowthPolicy = default_growth_policy,
+            typename Allocator = heap_allocator<T>>
+  using SmallVector = Vector<T, GrowthPolicy, N, Allocator>;
+
 }
 
 #endif